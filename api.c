@@ -23,79 +23,157 @@
 #include <errno.h>
 #include <assert.h>
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
 #include "libtcmu_priv.h"
 #include "be_byteshift.h"
+#include "scsi_defs.h"
 
-int tcmu_cdb_get_length(uint8_t *cdb)
+/*
+ * Location of the LBA and TRANSFER LENGTH fields for each CDB group code,
+ * see spc-4 4.2.5.1 operation code. Group 3 is reserved except for the
+ * variable length CDB, and groups 6 and 7 are vendor specific.
+ */
+struct cdb_layout {
+	uint8_t len;
+	uint8_t lba_off;
+	uint8_t lba_bytes;
+	uint8_t xfer_off;
+	uint8_t xfer_bytes;
+};
+
+static const struct cdb_layout cdb_layouts[8] = {
+	[0] = {  6, 1, 3,  4, 1 },
+	[1] = { 10, 2, 4,  7, 2 },
+	[2] = { 10, 2, 4,  7, 2 },
+	[4] = { 16, 2, 8, 10, 4 },
+	[5] = { 12, 2, 4,  6, 4 },
+};
+
+static const uint8_t cdb_op_classes[256] = {
+	[READ_6]		= TCMU_OP_CLASS_READ,
+	[READ_10]		= TCMU_OP_CLASS_READ,
+	[READ_12]		= TCMU_OP_CLASS_READ,
+	[READ_16]		= TCMU_OP_CLASS_READ,
+	[WRITE_6]		= TCMU_OP_CLASS_WRITE,
+	[WRITE_10]		= TCMU_OP_CLASS_WRITE,
+	[WRITE_12]		= TCMU_OP_CLASS_WRITE,
+	[WRITE_16]		= TCMU_OP_CLASS_WRITE,
+	[WRITE_VERIFY]		= TCMU_OP_CLASS_WRITE,
+	[WRITE_VERIFY_12]	= TCMU_OP_CLASS_WRITE,
+	[WRITE_VERIFY_16]	= TCMU_OP_CLASS_WRITE,
+	[WRITE_SAME]		= TCMU_OP_CLASS_WRITE,
+	[WRITE_SAME_16]		= TCMU_OP_CLASS_WRITE,
+	[COMPARE_AND_WRITE]	= TCMU_OP_CLASS_WRITE,
+	[SYNCHRONIZE_CACHE]	= TCMU_OP_CLASS_SYNC,
+	[SYNCHRONIZE_CACHE_16]	= TCMU_OP_CLASS_SYNC,
+};
+
+static int cdb_layout_length(const struct cdb_layout *layout, uint8_t *cdb)
 {
-	uint8_t group_code = cdb[0] >> 5;
-
-	/* See spc-4 4.2.5.1 operation code */
-	switch (group_code) {
-	case 0: /*000b for 6 bytes commands */
-		return 6;
-	case 1: /*001b for 10 bytes commands */
-	case 2: /*010b for 10 bytes commands */
-		return 10;
-	case 3: /*011b Reserved ? */
-		if (cdb[0] == 0x7f)
-			return 8 + cdb[7];
-		goto cdb_not_supp;
-	case 4: /*100b for 16 bytes commands */
-		return 16;
-	case 5: /*101b for 12 bytes commands */
-		return 12;
-	case 6: /*110b Vendor Specific */
-	case 7: /*111b Vendor Specific */
-	default:
-		/* TODO: */
-		goto cdb_not_supp;
-	}
+	if (layout->len)
+		return layout->len;
+	if (cdb[0] == 0x7f)
+		return 8 + cdb[7];
 
-cdb_not_supp:
 	tcmu_err("CDB %x0x not supported.\n", cdb[0]);
 	return -EINVAL;
 }
 
-uint64_t tcmu_cdb_get_lba(uint8_t *cdb)
+static uint64_t cdb_layout_lba(const struct cdb_layout *layout, uint8_t *cdb)
 {
-	uint16_t val;
-
-	switch (tcmu_cdb_get_length(cdb)) {
-	case 6:
-		val = be16toh(*((uint16_t *)&cdb[2]));
-		return ((cdb[1] & 0x1f) << 16) | val;
-	case 10:
-		return be32toh(*((u_int32_t *)&cdb[2]));
-	case 12:
-		return be32toh(*((u_int32_t *)&cdb[2]));
-	case 16:
-		return be64toh(*((u_int64_t *)&cdb[2]));
+	switch (layout->lba_bytes) {
+	case 3:
+		/* 21 bits, the top of byte 1 is reserved */
+		return ((cdb[1] & 0x1f) << 16) |
+			be16toh(*((uint16_t *)&cdb[2]));
+	case 4:
+		return be32toh(*((u_int32_t *)&cdb[layout->lba_off]));
+	case 8:
+		return be64toh(*((u_int64_t *)&cdb[layout->lba_off]));
 	default:
 		assert_perror(EINVAL);
 		return 0;	/* not reached */
 	}
 }
 
-uint32_t tcmu_cdb_get_xfer_length(uint8_t *cdb)
+static uint32_t cdb_layout_xfer_length(const struct cdb_layout *layout,
+				       uint8_t *cdb)
 {
-	switch (tcmu_cdb_get_length(cdb)) {
-	case 6:
-		return cdb[4];
-	case 10:
-		return be16toh(*((uint16_t *)&cdb[7]));
-	case 12:
-		return be32toh(*((u_int32_t *)&cdb[6]));
-	case 16:
-		return be32toh(*((u_int32_t *)&cdb[10]));
+	switch (layout->xfer_bytes) {
+	case 1:
+		return cdb[layout->xfer_off];
+	case 2:
+		return be16toh(*((uint16_t *)&cdb[layout->xfer_off]));
+	case 4:
+		return be32toh(*((u_int32_t *)&cdb[layout->xfer_off]));
 	default:
 		assert_perror(EINVAL);
 		return 0;	/* not reached */
 	}
 }
 
+int tcmu_cdb_get_length(uint8_t *cdb)
+{
+	return cdb_layout_length(&cdb_layouts[cdb[0] >> 5], cdb);
+}
+
+uint64_t tcmu_cdb_get_lba(uint8_t *cdb)
+{
+	return cdb_layout_lba(&cdb_layouts[cdb[0] >> 5], cdb);
+}
+
+uint32_t tcmu_cdb_get_xfer_length(uint8_t *cdb)
+{
+	return cdb_layout_xfer_length(&cdb_layouts[cdb[0] >> 5], cdb);
+}
+
+/*
+ * Fill in the decoded cdb fields of cmd, so the runner and handlers do
+ * not have to parse the cdb again. Returns the cdb length or -EINVAL.
+ */
+int tcmu_cdb_decode(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+	const struct cdb_layout *layout = &cdb_layouts[cdb[0] >> 5];
+	int len;
+
+	len = cdb_layout_length(layout, cdb);
+	if (len < 0)
+		return len;
+
+	cmd->cdb_len = len;
+	cmd->op_class = cdb_op_classes[cdb[0]];
+	cmd->cdb_flags = 0;
+
+	if (!layout->len) {
+		/* variable length cdbs have no common lba field */
+		cmd->lba = 0;
+		cmd->xfer_len = 0;
+	} else {
+		cmd->lba = cdb_layout_lba(layout, cdb);
+		cmd->xfer_len = cdb_layout_xfer_length(layout, cdb);
+
+		/* READ_6 and WRITE_6 have no flags */
+		if (layout->len > 6 &&
+		    (cmd->op_class == TCMU_OP_CLASS_READ ||
+		     cmd->op_class == TCMU_OP_CLASS_WRITE)) {
+			if (cdb[1] & 0x08)
+				cmd->cdb_flags |= TCMU_CDB_FUA;
+			if (cdb[1] & 0x10)
+				cmd->cdb_flags |= TCMU_CDB_DPO;
+		}
+	}
+
+	cmd->off = tcmu_lba_to_byte(dev, cmd->lba);
+	cmd->len = tcmu_lba_to_byte(dev, cmd->xfer_len);
+	return len;
+}
+
 /*
  * Returns location of first mismatch between bytes in mem and the iovec.
  * If they are the same, return -1.
@@ -284,6 +362,80 @@ size_t tcmu_memcpy_into_iovec(
 	return copied;
 }
 
+#if defined(__x86_64__)
+static void tcmu_memcpy_nt(void *dst, const void *src, size_t len)
+{
+	size_t head = -(uintptr_t)dst & 15;
+	char *d = dst;
+	const char *s = src;
+
+	if (len < head + 64) {
+		memcpy(d, s, len);
+		return;
+	}
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)d, x0);
+		_mm_stream_si128((__m128i *)(d + 16), x1);
+		_mm_stream_si128((__m128i *)(d + 32), x2);
+		_mm_stream_si128((__m128i *)(d + 48), x3);
+	}
+
+	memcpy(d, s, len);
+}
+#endif
+
+/*
+ * Like tcmu_memcpy_into_iovec, but with non-temporal stores that do not
+ * go through the cache where the CPU supports it.
+ *
+ * The data area is read next by the kernel, so this only pays off for
+ * transfers larger than the cache: small ones are better left hot for
+ * the kernel's copy.
+ */
+size_t tcmu_memcpy_into_iovec_nt(
+	struct iovec *iovec,
+	size_t iov_cnt,
+	void *src,
+	size_t len)
+{
+#if defined(__x86_64__)
+	size_t copied = 0;
+
+	while (len && iov_cnt) {
+		size_t to_copy = min(iovec->iov_len, len);
+
+		if (to_copy) {
+			tcmu_memcpy_nt(iovec->iov_base, src + copied, to_copy);
+
+			len -= to_copy;
+			copied += to_copy;
+			iovec->iov_base += to_copy;
+			iovec->iov_len -= to_copy;
+		}
+
+		iovec++;
+		iov_cnt--;
+	}
+
+	/* order the streaming stores before the completion */
+	_mm_sfence();
+	return copied;
+#else
+	return tcmu_memcpy_into_iovec(iovec, iov_cnt, src, len);
+#endif
+}
+
 /*
  * Copy data from an iovec, and consume the space in the iovec.
  */
@@ -326,9 +478,7 @@ void tcmu_cdb_print_info(struct tcmu_device *dev,
 
 	buf = fix;
 
-	bytes = tcmu_cdb_get_length(cmd->cdb);
-	if (bytes < 0)
-		return;
+	bytes = cmd->cdb_len;
 
 	if (bytes > CDB_FIX_SIZE) {
 		buf = malloc(CDB_TO_BUF_SIZE(bytes));
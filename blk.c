@@ -0,0 +1,775 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Block device handler
+ *
+ * Exports a local block device (NVMe, SAS, ...) through the runner:
+ *
+ *   blk//dev/nvme0n1[;qd=N]
+ *
+ * The device is opened with O_DIRECT and READs and WRITEs are
+ * submitted with Linux native AIO, up to qd (128 by default) at a
+ * time, and completed from a reaper thread. Those the runner takes
+ * from the ring in one pass are submitted with a single io_submit.
+ * Buffers that are not aligned to the device's logical block size are
+ * bounced.
+ *
+ * The transfer, unmap and write cache settings of the LUN are taken
+ * from the device's queue limits in sysfs. UNMAP is passed down as
+ * BLKDISCARD and WRITE SAME of zeros as BLKZEROOUT. Those and
+ * SYNCHRONIZE CACHE run on a separate thread since they block.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <scsi/scsi.h>
+#include <linux/fs.h>
+#include <linux/aio_abi.h>
+
+#include "ccan/list/list.h"
+
+#include "scsi_defs.h"
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_cmd_handler.h"
+
+#define BLK_DEF_QD		128
+#define BLK_MAX_QD		4096
+#define BLK_REAP_BATCH		64
+
+enum {
+	BLK_OP_READ,
+	BLK_OP_WRITE,
+	BLK_OP_FLUSH,
+	BLK_OP_DISCARD,
+	BLK_OP_ZEROOUT,
+};
+
+struct blk_io {
+	struct iocb iocb;
+	struct list_node entry;
+
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+	int op;
+	struct iovec *iov;
+	size_t iov_cnt;
+	/* aligned copy of the data for unaligned iovecs */
+	void *bounce;
+	uint64_t off;
+	uint64_t len;
+};
+
+struct blk_state {
+	char *path;
+	int fd;
+	dev_t rdev;
+	uint32_t lbs;
+	int qd;
+
+	aio_context_t ctx;
+	pthread_t reaper;
+	bool stop;
+
+	/* blocking ioctls and flushes */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head queue;
+	pthread_t worker;
+};
+
+static inline int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/*
+ * Read a queue limit of the device. Partitions use the queue of the
+ * whole disk, which is their parent in sysfs.
+ */
+static int blk_sysfs_read(struct blk_state *state, const char *name,
+			  char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	char *ret;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+		 major(state->rdev), minor(state->rdev), name);
+	fp = fopen(path, "r");
+	if (!fp) {
+		snprintf(path, sizeof(path),
+			 "/sys/dev/block/%u:%u/../queue/%s",
+			 major(state->rdev), minor(state->rdev), name);
+		fp = fopen(path, "r");
+		if (!fp)
+			return -errno;
+	}
+
+	ret = fgets(buf, len, fp);
+	fclose(fp);
+	if (!ret)
+		return -EIO;
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int blk_sysfs_read_u64(struct blk_state *state, const char *name,
+			      uint64_t *val)
+{
+	char buf[64];
+	int ret;
+
+	ret = blk_sysfs_read(state, name, buf, sizeof(buf));
+	if (ret)
+		return ret;
+	*val = strtoull(buf, NULL, 0);
+	return 0;
+}
+
+/* Set up the LUN from the queue limits of the device */
+static void blk_apply_limits(struct tcmu_device *dev, struct blk_state *state)
+{
+	uint32_t block_size = tcmu_dev_get_block_size(dev);
+	uint64_t val;
+	char buf[64];
+
+	if (!blk_sysfs_read_u64(state, "max_sectors_kb", &val) && val)
+		tcmu_dev_set_max_xfer_len(dev,
+				min(tcmu_dev_get_max_xfer_len(dev),
+				    (uint32_t)(val * 1024 / block_size)));
+
+	if (!blk_sysfs_read_u64(state, "discard_max_bytes", &val) && val) {
+		tcmu_dev_set_max_unmap_len(dev,
+				min(tcmu_dev_get_max_unmap_len(dev),
+				    (uint32_t)min(val / block_size,
+						  (uint64_t)UINT32_MAX)));
+		if (!blk_sysfs_read_u64(state, "discard_granularity", &val))
+			tcmu_dev_set_opt_unmap_gran(dev,
+					max(val / block_size, (uint64_t)1),
+					false);
+	} else {
+		tcmu_dev_set_unmap_enabled(dev, false);
+	}
+
+	if (!blk_sysfs_read_u64(state, "rotational", &val))
+		tcmu_dev_set_solid_state_media(dev, !val);
+
+	if (!blk_sysfs_read(state, "write_cache", buf, sizeof(buf)))
+		tcmu_dev_set_write_cache_enabled(dev,
+					!strcmp(buf, "write back"));
+	else
+		tcmu_dev_set_write_cache_enabled(dev, 1);
+
+	if (!blk_sysfs_read_u64(state, "physical_block_size", &val) &&
+	    block_size < val)
+		tcmu_dev_warn(dev, "Block size %u is smaller than the %"PRIu64" byte physical block size of %s, small writes will be slow\n",
+			      block_size, val, state->path);
+
+	tcmu_dev_dbg(dev, "max xfer %u, max unmap %u, unmap gran %u, unmap %s, write cache %s\n",
+		     tcmu_dev_get_max_xfer_len(dev),
+		     tcmu_dev_get_max_unmap_len(dev),
+		     tcmu_dev_get_opt_unmap_gran(dev),
+		     tcmu_dev_get_unmap_enabled(dev) ? "on" : "off",
+		     tcmu_dev_get_write_cache_enabled(dev) ? "on" : "off");
+}
+
+static void blk_io_free(struct blk_io *io)
+{
+	free(io->bounce);
+	free(io);
+}
+
+static void blk_io_done(struct blk_io *io, int ret)
+{
+	int sts = TCMU_STS_OK;
+
+	if (ret) {
+		tcmu_dev_err(io->dev, "IO at %"PRIu64" len %"PRIu64" failed: %d\n",
+			     io->off, io->len, ret);
+		sts = io->op == BLK_OP_READ ? TCMU_STS_RD_ERR :
+					      TCMU_STS_WR_ERR;
+	} else if (io->op == BLK_OP_READ && io->bounce) {
+		tcmu_memcpy_into_iovec(io->iov, io->iov_cnt, io->bounce,
+				       io->len);
+	}
+
+	tcmur_cmd_complete(io->dev, io->tcmur_cmd, sts);
+	blk_io_free(io);
+}
+
+static void *blk_reaper(void *arg)
+{
+	struct blk_state *state = arg;
+	struct io_event events[BLK_REAP_BATCH];
+	struct timespec timeout;
+	struct blk_io *io;
+	int i, nr;
+
+	while (!__atomic_load_n(&state->stop, __ATOMIC_ACQUIRE)) {
+		/* wake up now and then to notice stop */
+		timeout.tv_sec = 1;
+		timeout.tv_nsec = 0;
+		nr = io_getevents(state->ctx, 1, BLK_REAP_BATCH, events,
+				  &timeout);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			tcmu_err("io_getevents failed for %s: %m\n",
+				 state->path);
+			break;
+		}
+
+		for (i = 0; i < nr; i++) {
+			io = (struct blk_io *)(uintptr_t)events[i].data;
+			if ((int64_t)events[i].res < 0)
+				blk_io_done(io, events[i].res);
+			else if (events[i].res != io->len)
+				blk_io_done(io, -EIO);
+			else
+				blk_io_done(io, 0);
+		}
+	}
+
+	return NULL;
+}
+
+static void *blk_worker(void *arg)
+{
+	struct blk_state *state = arg;
+	uint64_t range[2];
+	struct blk_io *io;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->stop && list_empty(&state->queue))
+			pthread_cond_wait(&state->cond, &state->lock);
+		io = list_pop(&state->queue, struct blk_io, entry);
+		pthread_mutex_unlock(&state->lock);
+		if (!io)
+			break;
+
+		range[0] = io->off;
+		range[1] = io->len;
+		ret = 0;
+		switch (io->op) {
+		case BLK_OP_FLUSH:
+			if (fdatasync(state->fd))
+				ret = -errno;
+			break;
+		case BLK_OP_DISCARD:
+			/* UNMAP is a hint, ignore devices that cannot */
+			if (ioctl(state->fd, BLKDISCARD, range) &&
+			    errno != EOPNOTSUPP)
+				ret = -errno;
+			break;
+		case BLK_OP_ZEROOUT:
+			if (ioctl(state->fd, BLKZEROOUT, range))
+				ret = -errno;
+			break;
+		}
+		blk_io_done(io, ret);
+	}
+
+	return NULL;
+}
+
+static struct blk_io *blk_io_alloc(struct tcmu_device *dev,
+				   struct tcmur_cmd *tcmur_cmd, int op,
+				   uint64_t off, uint64_t len)
+{
+	struct blk_io *io;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return NULL;
+	io->dev = dev;
+	io->tcmur_cmd = tcmur_cmd;
+	io->op = op;
+	io->off = off;
+	io->len = len;
+	return io;
+}
+
+static int blk_queue_op(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			int op, uint64_t off, uint64_t len)
+{
+	struct blk_state *state = tcmur_dev_get_private(dev);
+	struct blk_io *io;
+
+	io = blk_io_alloc(dev, tcmur_cmd, op, off, len);
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+
+	pthread_mutex_lock(&state->lock);
+	list_add_tail(&state->queue, &io->entry);
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+	return TCMU_STS_OK;
+}
+
+/* Can the iovec be used for O_DIRECT I/O as is */
+static bool blk_iov_aligned(struct blk_state *state, struct iovec *iov,
+			    size_t iov_cnt)
+{
+	size_t i;
+
+	if (iov_cnt > IOV_MAX)
+		return false;
+
+	for (i = 0; i < iov_cnt; i++) {
+		if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+		    (state->lbs - 1))
+			return false;
+	}
+	return true;
+}
+
+/* Set up the iocb of a READ or WRITE, bouncing unaligned iovecs */
+static struct blk_io *blk_prep_rw(struct tcmu_device *dev,
+				  struct tcmur_cmd *tcmur_cmd, int op,
+				  struct iovec *iov, size_t iov_cnt,
+				  size_t length, off_t offset)
+{
+	struct blk_state *state = tcmur_dev_get_private(dev);
+	struct blk_io *io;
+
+	io = blk_io_alloc(dev, tcmur_cmd, op, offset, length);
+	if (!io)
+		return NULL;
+	io->iov = iov;
+	io->iov_cnt = iov_cnt;
+
+	io->iocb.aio_data = (uintptr_t)io;
+	io->iocb.aio_fildes = state->fd;
+	io->iocb.aio_offset = offset;
+
+	if (blk_iov_aligned(state, iov, iov_cnt)) {
+		io->iocb.aio_lio_opcode = op == BLK_OP_READ ?
+					  IOCB_CMD_PREADV : IOCB_CMD_PWRITEV;
+		io->iocb.aio_buf = (uintptr_t)iov;
+		io->iocb.aio_nbytes = iov_cnt;
+	} else {
+		if (posix_memalign(&io->bounce, state->lbs, length)) {
+			free(io);
+			return NULL;
+		}
+		if (op == BLK_OP_WRITE)
+			tcmu_memcpy_from_iovec(io->bounce, length, iov,
+					       iov_cnt);
+		io->iocb.aio_lio_opcode = op == BLK_OP_READ ?
+					  IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+		io->iocb.aio_buf = (uintptr_t)io->bounce;
+		io->iocb.aio_nbytes = length;
+	}
+
+	return io;
+}
+
+/*
+ * Submit nr iocbs and free the ones the kernel did not take. Returns
+ * how many it took or -errno if none.
+ */
+static int blk_submit_iocbs(struct blk_state *state, struct iocb **iocbs,
+			    int nr)
+{
+	int ret, i;
+
+	do {
+		ret = io_submit(state->ctx, nr, iocbs);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		ret = -errno;
+
+	for (i = ret < 0 ? 0 : ret; i < nr; i++)
+		blk_io_free(container_of(iocbs[i], struct blk_io, iocb));
+	return ret;
+}
+
+static int blk_submit_rw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int op, struct iovec *iov, size_t iov_cnt,
+			 size_t length, off_t offset)
+{
+	struct blk_state *state = tcmur_dev_get_private(dev);
+	struct iocb *iocbp;
+	struct blk_io *io;
+	int ret;
+
+	io = blk_prep_rw(dev, tcmur_cmd, op, iov, iov_cnt, length, offset);
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+
+	iocbp = &io->iocb;
+	ret = blk_submit_iocbs(state, &iocbp, 1);
+	if (ret == 1)
+		return TCMU_STS_OK;
+	if (ret != -EAGAIN) {
+		tcmu_dev_err(dev, "io_submit failed: %d\n", ret);
+		return op == BLK_OP_READ ? TCMU_STS_RD_ERR : TCMU_STS_WR_ERR;
+	}
+
+	/* qd commands are already in flight */
+	return TCMU_STS_NO_RESOURCE;
+}
+
+/*
+ * Submit the READs and WRITEs of a batch with one io_submit. A flush
+ * is queued once the commands before it are submitted, as it would be
+ * if they came one at a time.
+ */
+static int blk_submit_batch(struct tcmu_device *dev, struct tcmur_cmd **cmds,
+			    int nr_cmds)
+{
+	struct blk_state *state = tcmur_dev_get_private(dev);
+	struct iocb *iocbs[TCMUR_MAX_BATCH];
+	struct tcmulib_cmd *cmd;
+	struct blk_io *io;
+	int i, ret, nr_iocbs = 0, taken = 0;
+
+	nr_cmds = min(nr_cmds, TCMUR_MAX_BATCH);
+	for (i = 0; i < nr_cmds; i++) {
+		cmd = cmds[i]->lib_cmd;
+
+		if (cmd->op_class == TCMU_OP_CLASS_SYNC) {
+			if (nr_iocbs) {
+				ret = blk_submit_iocbs(state, iocbs, nr_iocbs);
+				if (ret > 0)
+					taken += ret;
+				if (ret != nr_iocbs)
+					return taken;
+				nr_iocbs = 0;
+			}
+			if (blk_queue_op(dev, cmds[i], BLK_OP_FLUSH, 0, 0))
+				return taken;
+			taken++;
+			continue;
+		}
+
+		io = blk_prep_rw(dev, cmds[i],
+				 cmd->op_class == TCMU_OP_CLASS_READ ?
+				 BLK_OP_READ : BLK_OP_WRITE,
+				 cmd->iovec, cmd->iov_cnt,
+				 tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+				 cmd->off);
+		if (!io)
+			break;
+		iocbs[nr_iocbs++] = &io->iocb;
+	}
+
+	if (nr_iocbs) {
+		ret = blk_submit_iocbs(state, iocbs, nr_iocbs);
+		if (ret > 0)
+			taken += ret;
+	}
+	return taken;
+}
+
+static int blk_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		    struct iovec *iov, size_t iov_cnt, size_t length,
+		    off_t offset)
+{
+	return blk_submit_rw(dev, tcmur_cmd, BLK_OP_READ, iov, iov_cnt,
+			     length, offset);
+}
+
+static int blk_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	return blk_submit_rw(dev, tcmur_cmd, BLK_OP_WRITE, iov, iov_cnt,
+			     length, offset);
+}
+
+static int blk_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	return blk_queue_op(dev, tcmur_cmd, BLK_OP_FLUSH, 0, 0);
+}
+
+static int blk_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		     uint64_t off, uint64_t len)
+{
+	return blk_queue_op(dev, tcmur_cmd, BLK_OP_DISCARD, off, len);
+}
+
+static int blk_writesame(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 uint64_t off, uint64_t len, struct iovec *iov,
+			 size_t iov_cnt)
+{
+	return blk_queue_op(dev, tcmur_cmd, BLK_OP_ZEROOUT, off, len);
+}
+
+/*
+ * Return scsi status or TCMU_STS_NOT_HANDLED
+ */
+static int blk_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	switch (cmd->cdb[0]) {
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		/* the runner emulates WRITE SAME of anything else */
+		if (!tcmu_iovec_zeroed(cmd->iovec, cmd->iov_cnt))
+			return TCMU_STS_NOT_HANDLED;
+		return tcmur_handle_writesame(dev, tcmur_cmd, blk_writesame);
+	default:
+		return TCMU_STS_NOT_HANDLED;
+	}
+}
+
+static int blk_check_size(struct tcmu_device *dev, struct blk_state *state,
+			  uint64_t size)
+{
+	uint64_t dev_size;
+
+	if (ioctl(state->fd, BLKGETSIZE64, &dev_size))
+		return -errno;
+
+	if (size > dev_size) {
+		tcmu_dev_err(dev, "Size %"PRIu64" is larger than %s (%"PRIu64" bytes)\n",
+			     size, state->path, dev_size);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+static int blk_parse_config(struct tcmu_device *dev, struct blk_state *state)
+{
+	char *config, *opt;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	state->qd = BLK_DEF_QD;
+
+	state->path = strdup(strtok(config, ";") ? : "");
+	if (!state->path || !strlen(state->path)) {
+		tcmu_dev_err(dev, "Could not get device path\n");
+		free(config);
+		return -EINVAL;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "qd=", 3))
+			state->qd = atoi(opt + 3);
+		else
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+	}
+	free(config);
+
+	if (state->qd < 1 || state->qd > BLK_MAX_QD) {
+		tcmu_dev_err(dev, "qd must be from 1 to %d\n", BLK_MAX_QD);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int blk_open(struct tcmu_device *dev, bool reopen)
+{
+	uint32_t block_size = tcmu_dev_get_block_size(dev);
+	struct blk_state *state;
+	struct stat st;
+	int lbs, ret;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	state->fd = -1;
+	list_head_init(&state->queue);
+	tcmur_dev_set_private(dev, state);
+
+	ret = blk_parse_config(dev, state);
+	if (ret)
+		goto free_state;
+
+	state->fd = open(state->path, O_RDWR | O_DIRECT | O_CLOEXEC);
+	if (state->fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s: %m\n", state->path);
+		goto free_state;
+	}
+
+	if (fstat(state->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+	if (!S_ISBLK(st.st_mode)) {
+		tcmu_dev_err(dev, "%s is not a block device, use the file handler\n",
+			     state->path);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+	state->rdev = st.st_rdev;
+
+	if (ioctl(state->fd, BLKSSZGET, &lbs)) {
+		ret = -errno;
+		goto close_fd;
+	}
+	state->lbs = lbs;
+	if (block_size % state->lbs) {
+		tcmu_dev_err(dev, "Block size %u is not a multiple of the %u byte logical block size of %s\n",
+			     block_size, state->lbs, state->path);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	ret = blk_check_size(dev, state, tcmu_dev_get_num_lbas(dev) *
+			     block_size);
+	if (ret)
+		goto close_fd;
+
+	blk_apply_limits(dev, state);
+
+	if (io_setup(state->qd, &state->ctx)) {
+		ret = -errno;
+		tcmu_dev_err(dev, "io_setup failed: %m\n");
+		goto close_fd;
+	}
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->cond, NULL);
+
+	ret = pthread_create(&state->reaper, NULL, blk_reaper, state);
+	if (ret) {
+		ret = -ret;
+		goto destroy_ctx;
+	}
+
+	ret = pthread_create(&state->worker, NULL, blk_worker, state);
+	if (ret) {
+		ret = -ret;
+		goto stop_reaper;
+	}
+
+	tcmu_dev_dbg(dev, "config %s, logical block size %u, qd %d\n",
+		     tcmu_dev_get_cfgstring(dev), state->lbs, state->qd);
+	return 0;
+
+stop_reaper:
+	__atomic_store_n(&state->stop, true, __ATOMIC_RELEASE);
+	pthread_join(state->reaper, NULL);
+destroy_ctx:
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	io_destroy(state->ctx);
+close_fd:
+	close(state->fd);
+free_state:
+	free(state->path);
+	free(state);
+	return ret;
+}
+
+static void blk_close(struct tcmu_device *dev)
+{
+	struct blk_state *state = tcmur_dev_get_private(dev);
+
+	pthread_mutex_lock(&state->lock);
+	__atomic_store_n(&state->stop, true, __ATOMIC_RELEASE);
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+
+	pthread_join(state->worker, NULL);
+	pthread_join(state->reaper, NULL);
+
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	io_destroy(state->ctx);
+	close(state->fd);
+	free(state->path);
+	free(state);
+}
+
+static int blk_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
+{
+	struct blk_state *state = tcmur_dev_get_private(dev);
+
+	switch (cfg->type) {
+	case TCMULIB_CFG_DEV_SIZE:
+		return blk_check_size(dev, state, cfg->data.dev_size);
+	case TCMULIB_CFG_DEV_CFGSTR:
+	case TCMULIB_CFG_WRITE_CACHE:
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char blk_cfg_desc[] =
+	"The path to the block device to export, with an optional "
+	";qd=N setting for the number of I/Os in flight.";
+
+static struct tcmur_handler blk_handler = {
+	.cfg_desc = blk_cfg_desc,
+
+	.reconfig = blk_reconfig,
+
+	.open = blk_open,
+	.close = blk_close,
+	.read = blk_read,
+	.write = blk_write,
+	.flush = blk_flush,
+	.unmap = blk_unmap,
+	.handle_cmd = blk_handle_cmd,
+	.submit_batch = blk_submit_batch,
+	.name = "Block Device Handler",
+	.subtype = "blk",
+	.nr_threads = 0,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&blk_handler);
+}
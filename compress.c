@@ -0,0 +1,1123 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Compressing handler
+ *
+ * Stores the device compressed with zlib. The cfgstring is a directory
+ * plus optional settings:
+ *
+ *   compress//path/to/dir[;chunk_size=N][;level=N][;threads=N]
+ *
+ * The device is split into chunk_size (64K by default) logical chunks.
+ * Every chunk written is compressed and stored as a variable sized
+ * extent of COMP_SECTOR units in the data file, and an extent map
+ * records where each chunk lives. Chunks that do not compress into
+ * fewer sectors are stored raw, and after a run of incompressible
+ * chunks compression is only attempted on a sample of them until one
+ * compresses again. All zero chunks are not stored at all.
+ *
+ * The directory holds:
+ *   map   header and the mmapped extent map
+ *   data  the extents
+ *
+ * Extents are written out of place. The one a chunk used before is
+ * only reused after the next SYNCHRONIZE CACHE, so a synced chunk is
+ * never overwritten in place. The allocation bitmap is rebuilt from
+ * the extent map on open.
+ *
+ * Chunks are compressed and decompressed by a pool of worker threads
+ * (one per CPU by default), so the chunks of a large command are
+ * processed in parallel. Compression statistics are logged every
+ * COMP_STATS_SECS while the device is written to, and on close.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <zlib.h>
+
+#include "ccan/list/list.h"
+
+#include "darray.h"
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#define COMP_MAGIC		0x504d4354	/* "TCMP" */
+#define COMP_VERSION		1
+#define COMP_HDR_LEN		4096
+#define COMP_SECTOR		4096
+#define COMP_MIN_CHUNK		(8 * 1024)
+#define COMP_MAX_CHUNK		(256 * 1024)
+#define COMP_DEF_CHUNK		(64 * 1024)
+#define COMP_DEF_LEVEL		1
+#define COMP_MAX_THREADS	16
+/* sync to release old extents once this many are waiting */
+#define COMP_PENDING_MAX	1024
+#define COMP_NR_CHUNK_LOCKS	256
+/* incompressible chunks in a row before sampling, and the sample rate */
+#define COMP_BYPASS_STREAK	16
+#define COMP_BYPASS_SAMPLE	8
+#define COMP_STATS_SECS		60
+
+#define COMP_EXT_RAW		(1 << 0)
+
+enum {
+	COMP_OP_READ,
+	COMP_OP_WRITE,
+	COMP_OP_FLUSH,
+	COMP_OP_UNMAP,
+};
+
+struct comp_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chunk_size;
+	uint32_t pad;
+	uint64_t nr_chunks;
+	uint64_t nr_sectors;
+};
+
+struct comp_extent {
+	uint64_t sector;	/* + 1, 0 is an unmapped chunk */
+	uint32_t len;		/* bytes stored */
+	uint32_t flags;
+};
+
+/* State of a command that has been split into chunk jobs */
+struct comp_cmd {
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+	int op;
+	struct iovec *iov;
+	size_t iov_cnt;
+	void *buf;
+	uint64_t off;
+	uint64_t len;
+	int remaining;
+	int ret;
+};
+
+struct comp_job {
+	struct comp_cmd *ccmd;
+	struct list_node entry;
+	uint64_t chunk;
+	uint32_t coff;
+	uint32_t len;
+	uint64_t buf_off;
+};
+
+struct comp_worker {
+	struct comp_state *state;
+	pthread_t thread;
+	/* a chunk and its worst case compressed size */
+	void *buf;
+	void *cbuf;
+	uLong cbuf_len;
+};
+
+struct comp_state {
+	struct tcmu_device *dev;
+	char *dir;
+	int dir_fd;
+	int data_fd;
+	uint32_t chunk_size;
+	uint32_t chunk_shift;
+	uint32_t chunk_sectors;
+	int level;
+
+	struct comp_hdr *hdr;
+	size_t map_len;
+	struct comp_extent *map;
+
+	/* map, allocation bitmap, pending frees and stats */
+	pthread_mutex_t lock;
+	uint64_t *bitmap;
+	uint64_t alloc_hint;
+	darray(struct comp_extent) pending;
+
+	/* serialize read-modify-write of a chunk */
+	pthread_mutex_t chunk_locks[COMP_NR_CHUNK_LOCKS];
+
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	struct list_head queue;
+	bool stop;
+	struct comp_worker *workers;
+	int nr_workers;
+
+	/* incompressible chunks in a row, and sampling counter */
+	int streak;
+	int sample;
+
+	/* statistics, under lock */
+	uint64_t nr_mapped;
+	uint64_t used_sectors;
+	uint64_t nr_compressed;
+	uint64_t nr_raw;
+	uint64_t nr_bypassed;
+	uint64_t nr_zero;
+	uint64_t compress_ns;
+	time_t stats_time;
+};
+
+static inline uint32_t comp_sectors(uint32_t len)
+{
+	return (len + COMP_SECTOR - 1) / COMP_SECTOR;
+}
+
+static inline bool comp_bit_test(struct comp_state *state, uint64_t bit)
+{
+	return state->bitmap[bit / 64] & (1ULL << (bit % 64));
+}
+
+static void comp_bits_set(struct comp_state *state, uint64_t start,
+			  uint32_t n, bool set)
+{
+	uint64_t bit;
+
+	for (bit = start; bit < start + n; bit++) {
+		if (set)
+			state->bitmap[bit / 64] |= 1ULL << (bit % 64);
+		else
+			state->bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+	}
+}
+
+/*
+ * First fit allocation of n contiguous sectors from the lowest free
+ * one, keeping the data file compact. Caller holds state->lock.
+ */
+static int comp_alloc(struct comp_state *state, uint32_t n, uint64_t *start)
+{
+	uint64_t bit = state->alloc_hint, run = 0;
+	uint64_t nr_sectors = state->hdr->nr_sectors;
+	bool lowest = true;
+
+	while (bit < nr_sectors) {
+		/* skip full words */
+		if (!(bit % 64) && state->bitmap[bit / 64] == ~0ULL) {
+			bit += 64;
+			run = 0;
+			continue;
+		}
+
+		if (comp_bit_test(state, bit)) {
+			run = 0;
+		} else {
+			if (lowest) {
+				state->alloc_hint = bit;
+				lowest = false;
+			}
+			if (++run == n) {
+				*start = bit + 1 - n;
+				comp_bits_set(state, *start, n, true);
+				return 0;
+			}
+		}
+		bit++;
+	}
+	return -ENOSPC;
+}
+
+/* Caller holds state->lock */
+static void comp_set_map(struct comp_state *state, uint64_t chunk,
+			 struct comp_extent *ext)
+{
+	struct comp_extent old = state->map[chunk];
+
+	state->map[chunk] = *ext;
+	if (old.sector) {
+		state->nr_mapped--;
+		state->used_sectors -= comp_sectors(old.len);
+		/* reused only after the new mapping is stable */
+		darray_append(state->pending, old);
+	}
+	if (ext->sector) {
+		state->nr_mapped++;
+		state->used_sectors += comp_sectors(ext->len);
+	}
+}
+
+/*
+ * Make the data and map stable, then allow the extents replaced
+ * before it to be reused.
+ */
+static int comp_sync(struct comp_state *state)
+{
+	struct comp_extent *released;
+	size_t nr, i;
+	int ret = 0;
+
+	pthread_mutex_lock(&state->lock);
+	nr = darray_size(state->pending);
+	released = state->pending.item;
+	darray_init(state->pending);
+	pthread_mutex_unlock(&state->lock);
+
+	if (fdatasync(state->data_fd) ||
+	    msync(state->hdr, state->map_len, MS_SYNC)) {
+		ret = -errno;
+		tcmu_dev_err(state->dev, "Could not sync %s: %m\n",
+			     state->dir);
+	}
+
+	pthread_mutex_lock(&state->lock);
+	for (i = 0; i < nr; i++) {
+		/* on failure keep them pending for the next try */
+		if (ret) {
+			darray_append(state->pending, released[i]);
+			continue;
+		}
+		comp_bits_set(state, released[i].sector - 1,
+			      comp_sectors(released[i].len), false);
+		state->alloc_hint = min(state->alloc_hint,
+					released[i].sector - 1);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	free(released);
+	return ret;
+}
+
+static int comp_pio(struct comp_state *state, bool write, void *buf,
+		    size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		if (write)
+			ret = pwrite(state->data_fd, buf + done, len - done,
+				     off + done);
+		else
+			ret = pread(state->data_fd, buf + done, len - done,
+				    off + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+		done += ret;
+	}
+	return 0;
+}
+
+/* Read a chunk into buf. Caller holds the chunk lock. */
+static int comp_read_chunk(struct comp_worker *w, uint64_t chunk, void *buf)
+{
+	struct comp_state *state = w->state;
+	struct comp_extent ext;
+	uLongf out_len = state->chunk_size;
+	int ret;
+
+	pthread_mutex_lock(&state->lock);
+	ext = state->map[chunk];
+	pthread_mutex_unlock(&state->lock);
+
+	if (!ext.sector) {
+		memset(buf, 0, state->chunk_size);
+		return 0;
+	}
+
+	if (ext.flags & COMP_EXT_RAW)
+		return comp_pio(state, false, buf, state->chunk_size,
+				(ext.sector - 1) * COMP_SECTOR);
+
+	if (ext.len > w->cbuf_len)
+		return -EIO;
+	ret = comp_pio(state, false, w->cbuf, ext.len,
+		       (ext.sector - 1) * COMP_SECTOR);
+	if (ret)
+		return ret;
+
+	ret = uncompress(buf, &out_len, w->cbuf, ext.len);
+	if (ret != Z_OK || out_len != state->chunk_size) {
+		tcmu_dev_err(state->dev, "Chunk %"PRIu64" is corrupt (%d)\n",
+			     chunk, ret);
+		return -EIO;
+	}
+	return 0;
+}
+
+static bool comp_is_zero(const void *buf, size_t len)
+{
+	const uint64_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++) {
+		if (p[i])
+			return false;
+	}
+	return true;
+}
+
+static uint64_t comp_elapsed_ns(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Decide whether to try compressing the next chunk. Once
+ * COMP_BYPASS_STREAK chunks in a row did not compress, only one in
+ * COMP_BYPASS_SAMPLE is tried.
+ */
+static bool comp_should_try(struct comp_state *state)
+{
+	if (__atomic_load_n(&state->streak, __ATOMIC_RELAXED) <
+	    COMP_BYPASS_STREAK)
+		return true;
+	return !(__atomic_add_fetch(&state->sample, 1, __ATOMIC_RELAXED) %
+		 COMP_BYPASS_SAMPLE);
+}
+
+/* Store the new contents of a chunk. Caller holds the chunk lock. */
+static int comp_store(struct comp_worker *w, uint64_t chunk, void *data)
+{
+	struct comp_state *state = w->state;
+	struct comp_extent ext = { 0 };
+	struct timespec start;
+	uint64_t sector, ns = 0;
+	uLongf clen = w->cbuf_len;
+	bool tried = false, need_sync;
+	void *out = data;
+	int ret;
+
+	if (comp_is_zero(data, state->chunk_size)) {
+		pthread_mutex_lock(&state->lock);
+		comp_set_map(state, chunk, &ext);
+		state->nr_zero++;
+		pthread_mutex_unlock(&state->lock);
+		return 0;
+	}
+
+	ext.len = state->chunk_size;
+	ext.flags = COMP_EXT_RAW;
+	if (comp_should_try(state)) {
+		tried = true;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = compress2(w->cbuf, &clen, data, state->chunk_size,
+				state->level);
+		ns = comp_elapsed_ns(&start);
+		if (ret == Z_OK &&
+		    comp_sectors(clen) < state->chunk_sectors) {
+			ext.len = clen;
+			ext.flags = 0;
+			out = w->cbuf;
+			__atomic_store_n(&state->streak, 0, __ATOMIC_RELAXED);
+		} else {
+			__atomic_add_fetch(&state->streak, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_lock(&state->lock);
+	ret = comp_alloc(state, comp_sectors(ext.len), &sector);
+	pthread_mutex_unlock(&state->lock);
+	if (ret == -ENOSPC) {
+		/* free space may be waiting for a sync */
+		ret = comp_sync(state);
+		if (ret)
+			return ret;
+
+		pthread_mutex_lock(&state->lock);
+		ret = comp_alloc(state, comp_sectors(ext.len), &sector);
+		pthread_mutex_unlock(&state->lock);
+		if (ret) {
+			tcmu_dev_err(state->dev, "No space for chunk %"PRIu64"\n",
+				     chunk);
+			return ret;
+		}
+	}
+	ext.sector = sector + 1;
+
+	ret = comp_pio(state, true, out, ext.len, sector * COMP_SECTOR);
+
+	pthread_mutex_lock(&state->lock);
+	if (ret) {
+		comp_bits_set(state, sector, comp_sectors(ext.len), false);
+		state->alloc_hint = min(state->alloc_hint, sector);
+	} else {
+		comp_set_map(state, chunk, &ext);
+		if (ext.flags & COMP_EXT_RAW) {
+			if (tried)
+				state->nr_raw++;
+			else
+				state->nr_bypassed++;
+		} else {
+			state->nr_compressed++;
+		}
+		state->compress_ns += ns;
+	}
+	need_sync = darray_size(state->pending) >= COMP_PENDING_MAX;
+	pthread_mutex_unlock(&state->lock);
+
+	if (need_sync)
+		comp_sync(state);
+	return ret;
+}
+
+static int comp_do_write(struct comp_worker *w, struct comp_job *job)
+{
+	struct comp_state *state = w->state;
+	void *data = job->ccmd->buf + job->buf_off;
+	int ret;
+
+	if (job->len != state->chunk_size) {
+		ret = comp_read_chunk(w, job->chunk, w->buf);
+		if (ret)
+			return ret;
+		memcpy(w->buf + job->coff, data, job->len);
+		data = w->buf;
+	}
+	return comp_store(w, job->chunk, data);
+}
+
+static int comp_do_read(struct comp_worker *w, struct comp_job *job)
+{
+	struct comp_state *state = w->state;
+	void *data = job->ccmd->buf + job->buf_off;
+	int ret;
+
+	if (job->len == state->chunk_size)
+		return comp_read_chunk(w, job->chunk, data);
+
+	ret = comp_read_chunk(w, job->chunk, w->buf);
+	if (!ret)
+		memcpy(data, w->buf + job->coff, job->len);
+	return ret;
+}
+
+/* Release the whole chunks of the range, UNMAP is a hint */
+static void comp_do_unmap(struct comp_state *state, uint64_t off,
+			  uint64_t len)
+{
+	struct comp_extent ext = { 0 };
+	uint64_t chunk, end;
+	pthread_mutex_t *chunk_lock;
+
+	chunk = round_up(off, (uint64_t)state->chunk_size) >>
+			state->chunk_shift;
+	end = (off + len) >> state->chunk_shift;
+
+	for (; chunk < end; chunk++) {
+		chunk_lock = &state->chunk_locks[chunk % COMP_NR_CHUNK_LOCKS];
+
+		pthread_mutex_lock(chunk_lock);
+		pthread_mutex_lock(&state->lock);
+		comp_set_map(state, chunk, &ext);
+		pthread_mutex_unlock(&state->lock);
+		pthread_mutex_unlock(chunk_lock);
+	}
+}
+
+static void comp_log_stats(struct comp_state *state)
+{
+	uint64_t stored = state->used_sectors * COMP_SECTOR;
+	uint64_t nr_tried = state->nr_compressed + state->nr_raw;
+
+	tcmu_dev_info(state->dev, "compression ratio %.2f (%"PRIu64" chunks in %"PRIu64" bytes), %"PRIu64" compressed, %"PRIu64" incompressible, %"PRIu64" bypassed, %"PRIu64" zero, avg compress %"PRIu64" us\n",
+		      stored ? (double)state->nr_mapped * state->chunk_size /
+			       stored : 1.0,
+		      state->nr_mapped, stored, state->nr_compressed,
+		      state->nr_raw, state->nr_bypassed, state->nr_zero,
+		      nr_tried ? state->compress_ns / nr_tried / 1000 : 0);
+}
+
+static void comp_cmd_done(struct comp_cmd *ccmd)
+{
+	if (__atomic_sub_fetch(&ccmd->remaining, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (ccmd->op == COMP_OP_READ && ccmd->ret == TCMU_STS_OK)
+		tcmu_memcpy_into_iovec(ccmd->iov, ccmd->iov_cnt, ccmd->buf,
+				       ccmd->len);
+	tcmur_cmd_complete(ccmd->dev, ccmd->tcmur_cmd, ccmd->ret);
+	free(ccmd->buf);
+	free(ccmd);
+}
+
+static void comp_run_job(struct comp_worker *w, struct comp_job *job)
+{
+	struct comp_state *state = w->state;
+	struct comp_cmd *ccmd = job->ccmd;
+	pthread_mutex_t *chunk_lock;
+	int ret, sts = TCMU_STS_OK;
+
+	switch (ccmd->op) {
+	case COMP_OP_READ:
+	case COMP_OP_WRITE:
+		chunk_lock = &state->chunk_locks[job->chunk %
+						 COMP_NR_CHUNK_LOCKS];
+		pthread_mutex_lock(chunk_lock);
+		if (ccmd->op == COMP_OP_READ)
+			ret = comp_do_read(w, job);
+		else
+			ret = comp_do_write(w, job);
+		pthread_mutex_unlock(chunk_lock);
+
+		if (ret) {
+			tcmu_dev_err(state->dev, "%s of chunk %"PRIu64" failed: %d\n",
+				     ccmd->op == COMP_OP_READ ? "Read" : "Write",
+				     job->chunk, ret);
+			sts = ccmd->op == COMP_OP_READ ? TCMU_STS_RD_ERR :
+							 TCMU_STS_WR_ERR;
+		}
+		break;
+	case COMP_OP_FLUSH:
+		if (comp_sync(state))
+			sts = TCMU_STS_WR_ERR;
+		break;
+	case COMP_OP_UNMAP:
+		comp_do_unmap(state, ccmd->off, ccmd->len);
+		break;
+	}
+
+	if (sts != TCMU_STS_OK)
+		__atomic_store_n(&ccmd->ret, sts, __ATOMIC_RELAXED);
+	free(job);
+	comp_cmd_done(ccmd);
+}
+
+static void *comp_worker(void *arg)
+{
+	struct comp_worker *w = arg;
+	struct comp_state *state = w->state;
+	struct comp_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&state->queue_lock);
+		while (!state->stop && list_empty(&state->queue))
+			pthread_cond_wait(&state->queue_cond,
+					  &state->queue_lock);
+		job = list_pop(&state->queue, struct comp_job, entry);
+		pthread_mutex_unlock(&state->queue_lock);
+		if (!job)
+			break;
+
+		comp_run_job(w, job);
+	}
+
+	return NULL;
+}
+
+static struct comp_cmd *comp_alloc_cmd(struct tcmu_device *dev,
+				       struct tcmur_cmd *tcmur_cmd, int op,
+				       uint64_t off, uint64_t len)
+{
+	struct comp_cmd *ccmd;
+
+	ccmd = calloc(1, sizeof(*ccmd));
+	if (!ccmd)
+		return NULL;
+	ccmd->dev = dev;
+	ccmd->tcmur_cmd = tcmur_cmd;
+	ccmd->op = op;
+	ccmd->off = off;
+	ccmd->len = len;
+	ccmd->ret = TCMU_STS_OK;
+	/* held by the submitter until every job is queued */
+	ccmd->remaining = 1;
+	return ccmd;
+}
+
+/* Queue the jobs and drop the submitter's reference */
+static void comp_submit(struct comp_state *state, struct comp_cmd *ccmd,
+			struct list_head *jobs)
+{
+	struct comp_job *job;
+
+	list_for_each(jobs, job, entry)
+		ccmd->remaining++;
+
+	pthread_mutex_lock(&state->queue_lock);
+	list_append_list(&state->queue, jobs);
+	pthread_cond_broadcast(&state->queue_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+
+	comp_cmd_done(ccmd);
+}
+
+static int comp_rw_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		       int op, struct iovec *iov, size_t iov_cnt,
+		       size_t length, off_t offset)
+{
+	struct comp_state *state = tcmur_dev_get_private(dev);
+	struct comp_cmd *ccmd;
+	struct comp_job *job;
+	LIST_HEAD(jobs);
+	uint64_t off = offset, left = length, coff, n;
+
+	ccmd = comp_alloc_cmd(dev, tcmur_cmd, op, offset, length);
+	if (!ccmd)
+		return TCMU_STS_NO_RESOURCE;
+	ccmd->iov = iov;
+	ccmd->iov_cnt = iov_cnt;
+
+	ccmd->buf = malloc(length);
+	if (!ccmd->buf)
+		goto free_cmd;
+	if (op == COMP_OP_WRITE)
+		tcmu_memcpy_from_iovec(ccmd->buf, length, iov, iov_cnt);
+
+	while (left) {
+		coff = off & (state->chunk_size - 1);
+		n = min(left, state->chunk_size - coff);
+
+		job = calloc(1, sizeof(*job));
+		if (!job)
+			goto free_jobs;
+		job->ccmd = ccmd;
+		job->chunk = off >> state->chunk_shift;
+		job->coff = coff;
+		job->len = n;
+		job->buf_off = off - offset;
+		list_add_tail(&jobs, &job->entry);
+
+		off += n;
+		left -= n;
+	}
+
+	comp_submit(state, ccmd, &jobs);
+	return TCMU_STS_OK;
+
+free_jobs:
+	while ((job = list_pop(&jobs, struct comp_job, entry)))
+		free(job);
+	free(ccmd->buf);
+free_cmd:
+	free(ccmd);
+	return TCMU_STS_NO_RESOURCE;
+}
+
+static int comp_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	return comp_rw_cmd(dev, tcmur_cmd, COMP_OP_READ, iov, iov_cnt,
+			   length, offset);
+}
+
+static int comp_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	struct comp_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	ret = comp_rw_cmd(dev, tcmur_cmd, COMP_OP_WRITE, iov, iov_cnt,
+			  length, offset);
+
+	pthread_mutex_lock(&state->lock);
+	if (time(NULL) - state->stats_time >= COMP_STATS_SECS) {
+		state->stats_time = time(NULL);
+		comp_log_stats(state);
+	}
+	pthread_mutex_unlock(&state->lock);
+	return ret;
+}
+
+/* Run a flush or unmap on a worker so the caller is not blocked */
+static int comp_queue_op(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int op, uint64_t off, uint64_t len)
+{
+	struct comp_state *state = tcmur_dev_get_private(dev);
+	struct comp_cmd *ccmd;
+	struct comp_job *job;
+	LIST_HEAD(jobs);
+
+	ccmd = comp_alloc_cmd(dev, tcmur_cmd, op, off, len);
+	if (!ccmd)
+		return TCMU_STS_NO_RESOURCE;
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		free(ccmd);
+		return TCMU_STS_NO_RESOURCE;
+	}
+	job->ccmd = ccmd;
+	list_add_tail(&jobs, &job->entry);
+
+	comp_submit(state, ccmd, &jobs);
+	return TCMU_STS_OK;
+}
+
+static int comp_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	return comp_queue_op(dev, tcmur_cmd, COMP_OP_FLUSH, 0, 0);
+}
+
+static int comp_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		      uint64_t off, uint64_t len)
+{
+	return comp_queue_op(dev, tcmur_cmd, COMP_OP_UNMAP, off, len);
+}
+
+/* Rebuild the allocation bitmap and statistics from the extent map */
+static int comp_load_map(struct comp_state *state)
+{
+	struct comp_extent *ext;
+	uint64_t i, start;
+	uint32_t n;
+
+	for (i = 0; i < state->hdr->nr_chunks; i++) {
+		ext = &state->map[i];
+		if (!ext->sector)
+			continue;
+
+		start = ext->sector - 1;
+		n = comp_sectors(ext->len);
+		if (!n || n > state->chunk_sectors ||
+		    start + n > state->hdr->nr_sectors) {
+			tcmu_dev_err(state->dev, "Chunk %"PRIu64" has an invalid extent %"PRIu64"+%u, unmapping it\n",
+				     i, start, ext->len);
+			memset(ext, 0, sizeof(*ext));
+			continue;
+		}
+
+		comp_bits_set(state, start, n, true);
+		state->nr_mapped++;
+		state->used_sectors += n;
+	}
+	return 0;
+}
+
+static int comp_map_file(struct comp_state *state, uint64_t nr_chunks)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	state->map_len = COMP_HDR_LEN + nr_chunks * sizeof(struct comp_extent);
+
+	fd = openat(state->dir_fd, "map", O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st) ||
+	    (st.st_size < state->map_len && ftruncate(fd, state->map_len))) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	state->hdr = mmap(NULL, state->map_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (state->hdr == MAP_FAILED) {
+		ret = -errno;
+		state->hdr = NULL;
+		goto close_fd;
+	}
+	state->map = (void *)state->hdr + COMP_HDR_LEN;
+
+close_fd:
+	close(fd);
+	return ret;
+}
+
+static int comp_parse_config(struct tcmu_device *dev,
+			     struct comp_state *state)
+{
+	char *config, *opt;
+	long cpus;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	state->nr_workers = min(max(cpus, 1L), (long)COMP_MAX_THREADS);
+	state->chunk_size = COMP_DEF_CHUNK;
+	state->level = COMP_DEF_LEVEL;
+
+	state->dir = strdup(strtok(config, ";") ? : "");
+	if (!state->dir || !strlen(state->dir)) {
+		tcmu_dev_err(dev, "Could not get directory\n");
+		free(config);
+		return -EINVAL;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "chunk_size=", 11))
+			state->chunk_size = strtoul(opt + 11, NULL, 0);
+		else if (!strncmp(opt, "level=", 6))
+			state->level = atoi(opt + 6);
+		else if (!strncmp(opt, "threads=", 8))
+			state->nr_workers = atoi(opt + 8);
+		else
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+	}
+	free(config);
+
+	if (state->chunk_size < COMP_MIN_CHUNK ||
+	    state->chunk_size > COMP_MAX_CHUNK ||
+	    (state->chunk_size & (state->chunk_size - 1)) ||
+	    state->chunk_size < tcmu_dev_get_block_size(dev)) {
+		tcmu_dev_err(dev, "chunk_size must be a power of 2 from %u to %u and at least the block size\n",
+			     COMP_MIN_CHUNK, COMP_MAX_CHUNK);
+		return -EINVAL;
+	}
+	if (state->level < 1 || state->level > 9) {
+		tcmu_dev_err(dev, "level must be from 1 to 9\n");
+		return -EINVAL;
+	}
+	if (state->nr_workers < 1 || state->nr_workers > COMP_MAX_THREADS) {
+		tcmu_dev_err(dev, "threads must be from 1 to %d\n",
+			     COMP_MAX_THREADS);
+		return -EINVAL;
+	}
+
+	state->chunk_shift = __builtin_ctz(state->chunk_size);
+	state->chunk_sectors = state->chunk_size / COMP_SECTOR;
+	return 0;
+}
+
+static void comp_stop_workers(struct comp_state *state)
+{
+	int i;
+
+	pthread_mutex_lock(&state->queue_lock);
+	state->stop = true;
+	pthread_cond_broadcast(&state->queue_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+
+	for (i = 0; i < state->nr_workers; i++) {
+		if (state->workers[i].thread)
+			pthread_join(state->workers[i].thread, NULL);
+		free(state->workers[i].buf);
+		free(state->workers[i].cbuf);
+	}
+	free(state->workers);
+}
+
+static int comp_start_workers(struct comp_state *state)
+{
+	struct comp_worker *w;
+	int i, ret;
+
+	state->workers = calloc(state->nr_workers, sizeof(*state->workers));
+	if (!state->workers)
+		return -ENOMEM;
+
+	for (i = 0; i < state->nr_workers; i++) {
+		w = &state->workers[i];
+		w->state = state;
+		w->cbuf_len = compressBound(state->chunk_size);
+		w->buf = malloc(state->chunk_size);
+		w->cbuf = malloc(w->cbuf_len);
+		if (!w->buf || !w->cbuf) {
+			ret = -ENOMEM;
+			goto stop_workers;
+		}
+
+		ret = pthread_create(&w->thread, NULL, comp_worker, w);
+		if (ret) {
+			ret = -ret;
+			goto stop_workers;
+		}
+	}
+	return 0;
+
+stop_workers:
+	comp_stop_workers(state);
+	return ret;
+}
+
+static int comp_open(struct tcmu_device *dev, bool reopen)
+{
+	uint64_t nr_chunks, nr_sectors;
+	struct comp_state *state;
+	int i, ret;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	state->dev = dev;
+	state->dir_fd = state->data_fd = -1;
+	darray_init(state->pending);
+	list_head_init(&state->queue);
+	tcmur_dev_set_private(dev, state);
+
+	ret = comp_parse_config(dev, state);
+	if (ret)
+		goto free_state;
+
+	nr_chunks = (tcmu_dev_get_num_lbas(dev) * tcmu_dev_get_block_size(dev) +
+		     state->chunk_size - 1) >> state->chunk_shift;
+	/* room for every chunk raw plus slack for fragmentation */
+	nr_sectors = nr_chunks * state->chunk_sectors;
+	nr_sectors += nr_sectors / 8 + COMP_PENDING_MAX * state->chunk_sectors;
+
+	if (mkdir(state->dir, 0700) && errno != EEXIST) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not create %s: %m\n", state->dir);
+		goto free_state;
+	}
+
+	state->dir_fd = open(state->dir, O_RDONLY | O_DIRECTORY);
+	if (state->dir_fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s: %m\n", state->dir);
+		goto free_state;
+	}
+
+	ret = comp_map_file(state, nr_chunks);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not map %s/map: %d\n", state->dir,
+			     ret);
+		goto close_dir;
+	}
+
+	if (!state->hdr->magic) {
+		state->hdr->magic = COMP_MAGIC;
+		state->hdr->version = COMP_VERSION;
+		state->hdr->chunk_size = state->chunk_size;
+		state->hdr->nr_chunks = nr_chunks;
+		state->hdr->nr_sectors = nr_sectors;
+	} else if (state->hdr->magic != COMP_MAGIC ||
+		   state->hdr->version != COMP_VERSION ||
+		   state->hdr->chunk_size != state->chunk_size ||
+		   state->hdr->nr_chunks != nr_chunks) {
+		tcmu_dev_err(dev, "%s does not match the device (chunk size %u, %"PRIu64" chunks)\n",
+			     state->dir, state->hdr->chunk_size,
+			     state->hdr->nr_chunks);
+		ret = -EINVAL;
+		goto unmap_file;
+	}
+
+	state->bitmap = calloc((state->hdr->nr_sectors + 63) / 64,
+			       sizeof(uint64_t));
+	if (!state->bitmap) {
+		ret = -ENOMEM;
+		goto unmap_file;
+	}
+
+	ret = comp_load_map(state);
+	if (ret)
+		goto free_bitmap;
+
+	state->data_fd = openat(state->dir_fd, "data", O_RDWR | O_CREAT, 0600);
+	if (state->data_fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s/data: %m\n", state->dir);
+		goto free_bitmap;
+	}
+
+	ret = pthread_mutex_init(&state->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto close_data;
+	}
+	for (i = 0; i < COMP_NR_CHUNK_LOCKS; i++)
+		pthread_mutex_init(&state->chunk_locks[i], NULL);
+	pthread_mutex_init(&state->queue_lock, NULL);
+	pthread_cond_init(&state->queue_cond, NULL);
+
+	ret = comp_start_workers(state);
+	if (ret)
+		goto destroy_locks;
+
+	state->stats_time = time(NULL);
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+	tcmu_dev_dbg(dev, "config %s, %"PRIu64" chunks of %u bytes, %d threads\n",
+		     tcmu_dev_get_cfgstring(dev), nr_chunks, state->chunk_size,
+		     state->nr_workers);
+	return 0;
+
+destroy_locks:
+	pthread_cond_destroy(&state->queue_cond);
+	pthread_mutex_destroy(&state->queue_lock);
+	for (i = 0; i < COMP_NR_CHUNK_LOCKS; i++)
+		pthread_mutex_destroy(&state->chunk_locks[i]);
+	pthread_mutex_destroy(&state->lock);
+close_data:
+	close(state->data_fd);
+free_bitmap:
+	free(state->bitmap);
+unmap_file:
+	munmap(state->hdr, state->map_len);
+close_dir:
+	close(state->dir_fd);
+free_state:
+	free(state->dir);
+	free(state);
+	return ret;
+}
+
+static void comp_close(struct tcmu_device *dev)
+{
+	struct comp_state *state = tcmur_dev_get_private(dev);
+	int i;
+
+	comp_stop_workers(state);
+	comp_log_stats(state);
+	comp_sync(state);
+
+	pthread_cond_destroy(&state->queue_cond);
+	pthread_mutex_destroy(&state->queue_lock);
+	for (i = 0; i < COMP_NR_CHUNK_LOCKS; i++)
+		pthread_mutex_destroy(&state->chunk_locks[i]);
+	pthread_mutex_destroy(&state->lock);
+	close(state->data_fd);
+	free(state->bitmap);
+	munmap(state->hdr, state->map_len);
+	close(state->dir_fd);
+	darray_free(state->pending);
+	free(state->dir);
+	free(state);
+}
+
+static const char comp_cfg_desc[] =
+	"Directory for the data and extent map files, with optional "
+	";chunk_size=bytes (8K to 256K), ;level=1-9 and ;threads=N settings.";
+
+static struct tcmur_handler comp_handler = {
+	.cfg_desc = comp_cfg_desc,
+
+	.open = comp_open,
+	.close = comp_close,
+	.read = comp_read,
+	.write = comp_write,
+	.flush = comp_flush,
+	.unmap = comp_unmap,
+	.name = "Compressing Handler",
+	.subtype = "compress",
+	.nr_threads = 0,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&comp_handler);
+}
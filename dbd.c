@@ -5,32 +5,121 @@
  *
  * This tcmu-runner backstore handler interfaces to a Distributed Block Device
  * which provides mirror redundancy across multiple host computers.
+ *
+ * I/O is submitted asynchronously through the interface in dbd.h, so each
+ * LUN can have many commands outstanding against the mirrors, and each LUN
+ * has its own instance of the distributed layer.  The cfgstring after the
+ * subtype is passed to the layer's open; "local:/path" uses the file backed
+ * stand-in in dbd_local.c instead.
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/uio.h>
 
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
+#include "dbd.h"
 
 #define BLOCK_SIZE (4*1024)
 
+#define DBD_LOCAL_PREFIX "local:"
+
 typedef struct tcmu_dbd {
     size_t		size;
-    void	      * private;
+    const struct dbd_ops * ops;
+    void	      * private;	/* instance handle from ops->open */
 } * tcmu_dbd;
 
+typedef struct tcmu_dbd_io {
+    struct tcmu_device * td;
+    struct tcmur_cmd  * cmd;
+    size_t		size;
+    int			err_sts;
+} * tcmu_dbd_io;
+
+/*
+ * Exported by the Go side of the distributed layer when it is linked into
+ * the process; weak so the handler still loads with only the stand-in.
+ * The Go side completes each I/O by calling tcmu_dbd_complete().
+ */
 // #include "_cgo_export.h"
-extern ssize_t go_dbd_probe(void *);
-extern ssize_t go_dbd_read(struct iovec *, size_t, size_t, off_t);
-extern ssize_t go_dbd_write(struct iovec *, size_t, size_t, off_t);
+extern void *go_dbd_open(char *config) __attribute__((weak));
+extern ssize_t go_dbd_probe(void *) __attribute__((weak));
+extern int go_dbd_submit_read(void *, struct iovec *, size_t, size_t, off_t,
+	  void *) __attribute__((weak));
+extern int go_dbd_submit_write(void *, struct iovec *, size_t, size_t, off_t,
+	  void *) __attribute__((weak));
+extern int go_dbd_submit_flush(void *, void *) __attribute__((weak));
+extern void go_dbd_close(void *) __attribute__((weak));
+
+void tcmu_dbd_complete(void *cookie, ssize_t ret)
+{
+    tcmu_dbd_io io = cookie;
+    int sts = TCMU_STS_OK;
+
+    if (ret < 0 || (size_t)ret != io->size) {
+	tcmu_dev_err(io->td, "I/O returned %ld, expected 0x%lx\n", ret, io->size);
+	sts = io->err_sts;
+    }
+
+    tcmur_cmd_complete(io->td, io->cmd, sts);
+    free(io);
+}
+
+static void *go_ops_open(const char *config, dbd_done_fn done, ssize_t *size)
+{
+    void *handle;
+
+    if (!go_dbd_open) {
+	tcmu_err("dbd: distributed layer is not linked in, use %s/path\n",
+		 DBD_LOCAL_PREFIX);
+	return NULL;
+    }
+
+    handle = go_dbd_open((char *)config);
+    if (!handle)
+	return NULL;
+
+    *size = go_dbd_probe(handle);
+    if (*size <= 0) {
+	go_dbd_close(handle);
+	return NULL;
+    }
+
+    return handle;
+}
+
+static const struct dbd_ops dbd_go_ops = {
+    .name	   = "dbd",
+    .open	   = go_ops_open,
+    .close	   = go_dbd_close,
+    .submit_read   = go_dbd_submit_read,
+    .submit_write  = go_dbd_submit_write,
+    .submit_flush  = go_dbd_submit_flush,
+};
+
+static tcmu_dbd_io tcmu_dbd_io_alloc(struct tcmu_device *td,
+	  struct tcmur_cmd *cmd, size_t size, int err_sts)
+{
+    tcmu_dbd_io io = calloc(1, sizeof(*io));
+
+    if (!io)
+	return NULL;
+    io->td = td;
+    io->cmd = cmd;
+    io->size = size;
+    io->err_sts = err_sts;
+    return io;
+}
 
 static int tcmu_dbd_read(struct tcmu_device *td, struct tcmur_cmd *cmd,
 	  struct iovec *iov, size_t niov, size_t size, off_t seekpos)
 {
-    ssize_t ret;
     tcmu_dbd dbd = tcmur_dev_get_private(td);
+    tcmu_dbd_io io;
+    int ret;
 
     if (seekpos >= dbd->size) {
 	tcmu_dev_err(td, "read seekpos out of range 0x%lx\n", seekpos);
@@ -40,10 +129,15 @@ static int tcmu_dbd_read(struct tcmu_device *td, struct tcmur_cmd *cmd,
     if (seekpos + size > dbd->size)
 	size = dbd->size - seekpos;
 
-    ret = go_dbd_read(iov, niov, size, seekpos);
-    if (ret != size) {
-	tcmu_dev_err(td, "read returned incorrect size 0x%lx/0x%lx\n", ret, size);
-	return TCMU_STS_RD_ERR;
+    io = tcmu_dbd_io_alloc(td, cmd, size, TCMU_STS_RD_ERR);
+    if (!io)
+	return TCMU_STS_NO_RESOURCE;
+
+    ret = dbd->ops->submit_read(dbd->private, iov, niov, size, seekpos, io);
+    if (ret < 0) {
+	tcmu_dev_err(td, "read submit failed %d\n", ret);
+	free(io);
+	return ret == -ENOMEM ? TCMU_STS_NO_RESOURCE : TCMU_STS_RD_ERR;
     }
 
     return TCMU_STS_OK;
@@ -52,8 +146,9 @@ static int tcmu_dbd_read(struct tcmu_device *td, struct tcmur_cmd *cmd,
 static int tcmu_dbd_write(struct tcmu_device *td, struct tcmur_cmd *cmd,
 	   struct iovec *iov, size_t niov, size_t size, off_t seekpos)
 {
-    ssize_t ret;
     tcmu_dbd dbd = tcmur_dev_get_private(td);
+    tcmu_dbd_io io;
+    int ret;
 
     if (seekpos >= dbd->size) {
 	tcmu_dev_err(td, "write seekpos out of range 0x%lx\n", seekpos);
@@ -63,10 +158,15 @@ static int tcmu_dbd_write(struct tcmu_device *td, struct tcmur_cmd *cmd,
     if (seekpos + size > dbd->size)
 	size = dbd->size - seekpos;
 
-    ret = go_dbd_write(iov, niov, size, seekpos);
-    if (ret != size) {
-	tcmu_dev_err(td, "write returned incorrect size 0x%lx/0x%lx\n", ret, size);
-	return TCMU_STS_WR_ERR;
+    io = tcmu_dbd_io_alloc(td, cmd, size, TCMU_STS_WR_ERR);
+    if (!io)
+	return TCMU_STS_NO_RESOURCE;
+
+    ret = dbd->ops->submit_write(dbd->private, iov, niov, size, seekpos, io);
+    if (ret < 0) {
+	tcmu_dev_err(td, "write submit failed %d\n", ret);
+	free(io);
+	return ret == -ENOMEM ? TCMU_STS_NO_RESOURCE : TCMU_STS_WR_ERR;
     }
 
     return TCMU_STS_OK;
@@ -74,12 +174,20 @@ static int tcmu_dbd_write(struct tcmu_device *td, struct tcmur_cmd *cmd,
 
 static int tcmu_dbd_flush(struct tcmu_device *td, struct tcmur_cmd *cmd)
 {
-    /*
     tcmu_dbd dbd = tcmur_dev_get_private(td);
+    tcmu_dbd_io io;
+    int ret;
+
+    io = tcmu_dbd_io_alloc(td, cmd, 0, TCMU_STS_WR_ERR);
+    if (!io)
+	return TCMU_STS_NO_RESOURCE;
 
-    if (dbd_sync(dbd->private) < 0)
-	return TCMU_STS_WR_ERR;
-    */
+    ret = dbd->ops->submit_flush(dbd->private, io);
+    if (ret < 0) {
+	tcmu_dev_err(td, "flush submit failed %d\n", ret);
+	free(io);
+	return ret == -ENOMEM ? TCMU_STS_NO_RESOURCE : TCMU_STS_WR_ERR;
+    }
 
     return TCMU_STS_OK;
 }
@@ -88,10 +196,8 @@ static void tcmu_dbd_close(struct tcmu_device *td)
 {
     tcmu_dbd dbd = tcmur_dev_get_private(td);
 
-    /*
-    if (dbd_close(dbd->private) < 0)
-	return
-    */
+    /* all commands have completed, the runner drains them before close */
+    dbd->ops->close(dbd->private);
 
     tcmur_dev_set_private(td, NULL);
 
@@ -101,7 +207,9 @@ static void tcmu_dbd_close(struct tcmu_device *td)
 static int tcmu_dbd_open(struct tcmu_device * td, bool reopen)
 {
     tcmu_dbd dbd;
+    ssize_t size = 0;
     char *config = tcmu_dev_get_cfgstring(td);
+    char *arg;
     tcmu_dev_dbg(td, "tcmu_dbd_open config %s\n", config);
 
     tcmu_dev_set_block_size(td, BLOCK_SIZE);
@@ -112,12 +220,24 @@ static int tcmu_dbd_open(struct tcmu_device * td, bool reopen)
 	return -ENOMEM;
     }
 
-    dbd->private = NULL;    //XXX
-    dbd->size = go_dbd_probe(dbd->private);
-    if (dbd->size <= 0) {
+    /* skip "dbd/" */
+    arg = strchr(config, '/');
+    arg = arg ? arg + 1 : config;
+
+    if (!strncmp(arg, DBD_LOCAL_PREFIX, strlen(DBD_LOCAL_PREFIX))) {
+	dbd->ops = &dbd_local_ops;
+	arg += strlen(DBD_LOCAL_PREFIX);
+    } else {
+	dbd->ops = &dbd_go_ops;
+    }
+
+    dbd->private = dbd->ops->open(arg, tcmu_dbd_complete, &size);
+    if (!dbd->private) {
+	tcmu_dev_err(td, "%s: %s open failed\n", config, dbd->ops->name);
 	free(dbd);
 	return -EIO;
     }
+    dbd->size = size;
 
     tcmu_dev_set_num_lbas(td, dbd->size / tcmu_dev_get_block_size(td));
     tcmu_dev_info(td, "%s: size determined as %lu\n", config, dbd->size);
@@ -129,7 +249,8 @@ static int tcmu_dbd_open(struct tcmu_device * td, bool reopen)
 }
 
 static const char tcmu_dbd_cfg_desc[] =
-    "YOUR MESSAGE HERE!\n";
+    "dbd/<config> to open the distributed layer with <config>, or\n"
+    "dbd/local:<path> to use the local file stand-in.\n";
 
 struct tcmur_handler tcmu_dbd_handler = {
     .name	   = "Distributed Block Device",
@@ -140,7 +261,7 @@ struct tcmur_handler tcmu_dbd_handler = {
     .read	   = tcmu_dbd_read,
     .write	   = tcmu_dbd_write,
     .flush	   = tcmu_dbd_flush,
-    .nr_threads    = 1, /* implies op completes before return from callout */
+    .nr_threads    = 0, /* ops complete through tcmu_dbd_complete */
 };
 
 int handler_init(void)
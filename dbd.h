@@ -0,0 +1,39 @@
+/* dbd.h -- interface between the dbd handler and the Distributed Block Device
+ *
+ * Copyright 2017-2021 David A. Butterfield
+ * MIT License [SPDX:MIT https://opensource.org/licenses/MIT]
+ *
+ * Each LUN opens its own instance of the distributed layer, identified by
+ * the opaque handle returned from open.  Reads, writes and flushes are
+ * submitted with a completion cookie and return immediately; the layer
+ * later calls the done function given to open with the cookie and the
+ * result, from any thread, exactly once per successful submission.
+ */
+#ifndef __TCMU_DBD_H
+#define __TCMU_DBD_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* ret is the number of bytes transferred (0 for flush), or -errno */
+typedef void (*dbd_done_fn)(void *cookie, ssize_t ret);
+
+struct dbd_ops {
+    const char	      * name;
+
+    /* Returns the instance handle and sets *size, or returns NULL */
+    void	      * (*open)(const char *config, dbd_done_fn done, ssize_t *size);
+    void		(*close)(void *handle);
+
+    /* Return 0 if the I/O was queued, or -errno if it never will complete */
+    int			(*submit_read)(void *handle, struct iovec *iov, size_t niov,
+				       size_t size, off_t seekpos, void *cookie);
+    int			(*submit_write)(void *handle, struct iovec *iov, size_t niov,
+					size_t size, off_t seekpos, void *cookie);
+    int			(*submit_flush)(void *handle, void *cookie);
+};
+
+/* File backed stand-in for the distributed layer, see dbd_local.c */
+extern const struct dbd_ops dbd_local_ops;
+
+#endif
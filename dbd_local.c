@@ -0,0 +1,231 @@
+/* dbd_local.c -- local stand-in for the Distributed Block Device
+ *
+ * Copyright 2017-2021 David A. Butterfield
+ * MIT License [SPDX:MIT https://opensource.org/licenses/MIT]
+ *
+ * Implements the asynchronous dbd interface on top of a local file, so the
+ * handler can be tested without the distributed layer:
+ *
+ *   dbd/local:/path/to/file
+ *
+ * Like the real layer, I/O is queued and completed from other threads
+ * (DBD_LOCAL_THREADS per instance) through the done function.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu_log.h"
+#include "dbd.h"
+
+#define DBD_LOCAL_THREADS 4
+
+enum { DBD_LOCAL_READ, DBD_LOCAL_WRITE, DBD_LOCAL_FLUSH };
+
+struct dbd_local_io {
+    struct list_node	entry;
+    int			op;
+    struct iovec      * iov;
+    size_t		niov;
+    size_t		size;
+    off_t		seekpos;
+    void	      * cookie;
+};
+
+struct dbd_local {
+    int			fd;
+    dbd_done_fn		done;
+
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+    struct list_head	queue;
+    bool		stop;
+    int			nr_threads;
+    pthread_t		threads[DBD_LOCAL_THREADS];
+};
+
+/* Transfer all of size, or fail; the iovec may be longer than size */
+static ssize_t dbd_local_rw(struct dbd_local *dl, struct dbd_local_io *io)
+{
+    size_t done = 0;
+    ssize_t ret;
+    struct iovec iov;
+    size_t i = 0, skip = 0;
+
+    while (done < io->size && i < io->niov) {
+	iov.iov_base = (char *)io->iov[i].iov_base + skip;
+	iov.iov_len = io->iov[i].iov_len - skip;
+	if (iov.iov_len > io->size - done)
+	    iov.iov_len = io->size - done;
+
+	if (io->op == DBD_LOCAL_READ)
+	    ret = preadv(dl->fd, &iov, 1, io->seekpos + done);
+	else
+	    ret = pwritev(dl->fd, &iov, 1, io->seekpos + done);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	if (ret == 0)
+	    break;
+
+	done += ret;
+	skip += ret;
+	if (skip == io->iov[i].iov_len) {
+	    i++;
+	    skip = 0;
+	}
+    }
+
+    return done;
+}
+
+static void *dbd_local_worker(void *arg)
+{
+    struct dbd_local *dl = arg;
+    struct dbd_local_io *io;
+    ssize_t ret;
+
+    for (;;) {
+	pthread_mutex_lock(&dl->lock);
+	while (!dl->stop && list_empty(&dl->queue))
+	    pthread_cond_wait(&dl->cond, &dl->lock);
+	io = list_pop(&dl->queue, struct dbd_local_io, entry);
+	pthread_mutex_unlock(&dl->lock);
+	if (!io)
+	    break;
+
+	if (io->op == DBD_LOCAL_FLUSH)
+	    ret = fdatasync(dl->fd) ? -errno : 0;
+	else
+	    ret = dbd_local_rw(dl, io);
+
+	dl->done(io->cookie, ret);
+	free(io);
+    }
+
+    return NULL;
+}
+
+static int dbd_local_queue(struct dbd_local *dl, int op, struct iovec *iov,
+	  size_t niov, size_t size, off_t seekpos, void *cookie)
+{
+    struct dbd_local_io *io = calloc(1, sizeof(*io));
+
+    if (!io)
+	return -ENOMEM;
+    io->op = op;
+    io->iov = iov;
+    io->niov = niov;
+    io->size = size;
+    io->seekpos = seekpos;
+    io->cookie = cookie;
+
+    pthread_mutex_lock(&dl->lock);
+    list_add_tail(&dl->queue, &io->entry);
+    pthread_cond_signal(&dl->cond);
+    pthread_mutex_unlock(&dl->lock);
+    return 0;
+}
+
+static int dbd_local_submit_read(void *handle, struct iovec *iov, size_t niov,
+	  size_t size, off_t seekpos, void *cookie)
+{
+    return dbd_local_queue(handle, DBD_LOCAL_READ, iov, niov, size, seekpos,
+			   cookie);
+}
+
+static int dbd_local_submit_write(void *handle, struct iovec *iov, size_t niov,
+	  size_t size, off_t seekpos, void *cookie)
+{
+    return dbd_local_queue(handle, DBD_LOCAL_WRITE, iov, niov, size, seekpos,
+			   cookie);
+}
+
+static int dbd_local_submit_flush(void *handle, void *cookie)
+{
+    return dbd_local_queue(handle, DBD_LOCAL_FLUSH, NULL, 0, 0, 0, cookie);
+}
+
+static void dbd_local_close(void *handle)
+{
+    struct dbd_local *dl = handle;
+    int i;
+
+    pthread_mutex_lock(&dl->lock);
+    dl->stop = true;
+    pthread_cond_broadcast(&dl->cond);
+    pthread_mutex_unlock(&dl->lock);
+
+    for (i = 0; i < dl->nr_threads; i++)
+	pthread_join(dl->threads[i], NULL);
+
+    pthread_cond_destroy(&dl->cond);
+    pthread_mutex_destroy(&dl->lock);
+    close(dl->fd);
+    free(dl);
+}
+
+static void *dbd_local_open(const char *config, dbd_done_fn done,
+	  ssize_t *size)
+{
+    struct dbd_local *dl;
+    struct stat st;
+
+    dl = calloc(1, sizeof(*dl));
+    if (!dl)
+	return NULL;
+
+    dl->fd = open(config, O_RDWR);
+    if (dl->fd < 0) {
+	tcmu_err("dbd local: could not open %s: %m\n", config);
+	free(dl);
+	return NULL;
+    }
+
+    if (fstat(dl->fd, &st) < 0 || !st.st_size) {
+	tcmu_err("dbd local: %s is empty or cannot be sized\n", config);
+	goto close_fd;
+    }
+    *size = st.st_size;
+
+    dl->done = done;
+    list_head_init(&dl->queue);
+    pthread_mutex_init(&dl->lock, NULL);
+    pthread_cond_init(&dl->cond, NULL);
+
+    for (; dl->nr_threads < DBD_LOCAL_THREADS; dl->nr_threads++) {
+	if (pthread_create(&dl->threads[dl->nr_threads], NULL,
+			   dbd_local_worker, dl)) {
+	    tcmu_err("dbd local: could not start worker threads\n");
+	    dbd_local_close(dl);
+	    return NULL;
+	}
+    }
+
+    return dl;
+
+close_fd:
+    close(dl->fd);
+    free(dl);
+    return NULL;
+}
+
+const struct dbd_ops dbd_local_ops = {
+    .name	   = "local",
+    .open	   = dbd_local_open,
+    .close	   = dbd_local_close,
+    .submit_read   = dbd_local_submit_read,
+    .submit_write  = dbd_local_submit_write,
+    .submit_flush  = dbd_local_submit_flush,
+};
@@ -0,0 +1,1020 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Deduplicating handler
+ *
+ * Stores each distinct chunk of data once. The cfgstring is a
+ * directory plus optional settings:
+ *
+ *   dedup//path/to/dir[;chunk_size=N][;verify=0|1]
+ *
+ * The device is split into chunk_size (4K to 64K, 4K by default)
+ * logical chunks. Each chunk written is fingerprinted with a 128 bit
+ * hash and looked up in a fingerprint index. If the content is
+ * already stored the logical chunk is pointed at the existing
+ * physical chunk, otherwise a new one is written. Unless verify=0 the
+ * contents are compared before a chunk is shared.
+ *
+ * WRITE AND VERIFY compares each chunk while it is stored: a shared
+ * chunk is compared before it is shared and a new one is read back
+ * right after it is written, so the runner does not read the whole
+ * transfer back afterwards.
+ *
+ * The directory holds mmapped metadata and the data file:
+ *   map     header and the physical chunk of each logical chunk
+ *   chunks  fingerprint and reference count of each physical chunk
+ *   index   open addressing hash table from fingerprint to chunk
+ *   data    the physical chunks
+ *
+ * A physical chunk whose last reference is dropped by an overwrite or
+ * UNMAP is only reused after the next SYNCHRONIZE CACHE, so a crash
+ * can never leave a synced logical chunk pointing at reused data.
+ * Reference counts and the index are rebuilt from the map on open if
+ * the device was not closed cleanly.
+ *
+ * The dedup ratio and fingerprint lookup latency are logged every
+ * DEDUP_STATS_SECS while the device is written to, and on close.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "darray.h"
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#define DEDUP_MAGIC		0x50444454	/* "TDDP" */
+#define DEDUP_VERSION		1
+#define DEDUP_HDR_LEN		4096
+#define DEDUP_MIN_CHUNK		4096
+#define DEDUP_MAX_CHUNK		(64 * 1024)
+/* physical chunks beyond the logical ones for frees waiting on a sync */
+#define DEDUP_PENDING_MAX	1024
+#define DEDUP_NR_CHUNK_LOCKS	256
+#define DEDUP_STATS_SECS	60
+
+#define DEDUP_CHUNK_INDEXED	(1 << 0)
+
+struct dedup_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chunk_size;
+	uint32_t clean;
+	uint64_t nr_lchunks;
+	uint64_t max_pchunks;
+	uint64_t index_size;
+	/* physical chunks below this have been used */
+	uint64_t next_pchunk;
+};
+
+struct dedup_chunk {
+	uint64_t fp[2];
+	uint32_t refs;
+	uint32_t flags;
+};
+
+struct dedup_index_ent {
+	uint64_t fp[2];
+	uint64_t pchunk;	/* + 1, 0 is an empty slot */
+};
+
+struct dedup_state {
+	char *dir;
+	int dir_fd;
+	int data_fd;
+	uint32_t chunk_size;
+	uint32_t chunk_shift;
+	bool verify;
+
+	struct dedup_hdr *hdr;
+	size_t map_len;
+	uint64_t *map;		/* physical chunk + 1, 0 is unmapped */
+	struct dedup_chunk *chunks;
+	size_t chunks_len;
+	struct dedup_index_ent *index;
+	size_t index_len;
+	uint64_t index_mask;
+
+	/* metadata and the free lists */
+	pthread_mutex_t lock;
+	darray(uint64_t) free;
+	darray(uint64_t) pending;
+
+	/* serialize read-modify-write of a logical chunk */
+	pthread_mutex_t chunk_locks[DEDUP_NR_CHUNK_LOCKS];
+
+	/* statistics, under lock */
+	uint64_t nr_mapped;
+	uint64_t nr_used;
+	uint64_t lookups;
+	uint64_t lookup_ns;
+	uint64_t hits;
+	uint64_t verify_fails;
+	time_t stats_time;
+};
+
+#define DEDUP_P1	0x9e3779b185ebca87ULL
+#define DEDUP_P2	0xc2b2ae3d27d4eb4fULL
+#define DEDUP_P3	0x165667b19e3779f9ULL
+
+static inline uint64_t dedup_rotl(uint64_t v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t dedup_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= DEDUP_P2;
+	h ^= h >> 29;
+	h *= DEDUP_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * 128 bit fingerprint of a chunk. The chunk is consumed 64 bytes at a
+ * time by 8 independent 64 bit lanes, which the compiler can keep in
+ * vector registers, and the lanes are folded into two halves at the
+ * end. len must be a multiple of 64.
+ */
+static void dedup_hash(const void *buf, size_t len, uint64_t fp[2])
+{
+	const uint64_t *p = buf;
+	uint64_t acc[8];
+	size_t i;
+	int j;
+
+	for (j = 0; j < 8; j++)
+		acc[j] = DEDUP_P3 * (j + 1) + len;
+
+	for (i = 0; i < len / sizeof(uint64_t); i += 8) {
+		for (j = 0; j < 8; j++)
+			acc[j] = dedup_rotl(acc[j] + p[i + j] * DEDUP_P2, 31) *
+				 DEDUP_P1;
+	}
+
+	fp[0] = fp[1] = len;
+	for (j = 0; j < 4; j++) {
+		fp[0] = dedup_rotl(fp[0] ^ acc[j], 27) * DEDUP_P1 + DEDUP_P3;
+		fp[1] = dedup_rotl(fp[1] ^ acc[j + 4], 27) * DEDUP_P1 +
+			DEDUP_P3;
+	}
+	fp[0] = dedup_avalanche(fp[0] ^ acc[7]);
+	fp[1] = dedup_avalanche(fp[1] ^ acc[0]);
+}
+
+static inline uint64_t dedup_slot(struct dedup_state *state,
+				  const uint64_t fp[2])
+{
+	return fp[0] & state->index_mask;
+}
+
+/* Caller holds state->lock */
+static struct dedup_index_ent *dedup_index_find(struct dedup_state *state,
+						const uint64_t fp[2])
+{
+	uint64_t slot = dedup_slot(state, fp);
+	struct dedup_index_ent *ent;
+
+	for (;;) {
+		ent = &state->index[slot];
+		if (!ent->pchunk)
+			return NULL;
+		if (ent->fp[0] == fp[0] && ent->fp[1] == fp[1])
+			return ent;
+		slot = (slot + 1) & state->index_mask;
+	}
+}
+
+/* Caller holds state->lock */
+static void dedup_index_insert(struct dedup_state *state, uint64_t pchunk)
+{
+	struct dedup_chunk *chunk = &state->chunks[pchunk];
+	uint64_t slot = dedup_slot(state, chunk->fp);
+	struct dedup_index_ent *ent;
+
+	for (;;) {
+		ent = &state->index[slot];
+		if (!ent->pchunk)
+			break;
+		/* keep the first copy of the content */
+		if (ent->fp[0] == chunk->fp[0] && ent->fp[1] == chunk->fp[1])
+			return;
+		slot = (slot + 1) & state->index_mask;
+	}
+
+	ent->fp[0] = chunk->fp[0];
+	ent->fp[1] = chunk->fp[1];
+	ent->pchunk = pchunk + 1;
+	chunk->flags |= DEDUP_CHUNK_INDEXED;
+}
+
+/*
+ * Remove the entry of a chunk, shifting later entries of the probe
+ * sequence back so lookups never stop at a hole. Caller holds
+ * state->lock.
+ */
+static void dedup_index_remove(struct dedup_state *state, uint64_t pchunk)
+{
+	struct dedup_chunk *chunk = &state->chunks[pchunk];
+	struct dedup_index_ent *ent;
+	uint64_t hole, slot, home;
+
+	ent = dedup_index_find(state, chunk->fp);
+	chunk->flags &= ~DEDUP_CHUNK_INDEXED;
+	if (!ent || ent->pchunk != pchunk + 1)
+		return;
+
+	hole = ent - state->index;
+	slot = hole;
+	for (;;) {
+		slot = (slot + 1) & state->index_mask;
+		ent = &state->index[slot];
+		if (!ent->pchunk)
+			break;
+
+		home = dedup_slot(state, ent->fp);
+		/* move it if its home is not between the hole and slot */
+		if (((slot - home) & state->index_mask) >=
+		    ((slot - hole) & state->index_mask)) {
+			state->index[hole] = *ent;
+			hole = slot;
+		}
+	}
+	memset(&state->index[hole], 0, sizeof(state->index[hole]));
+}
+
+/* Drop a reference to a physical chunk. Caller holds state->lock. */
+static void dedup_put(struct dedup_state *state, uint64_t pchunk)
+{
+	struct dedup_chunk *chunk = &state->chunks[pchunk];
+
+	if (--chunk->refs)
+		return;
+
+	if (chunk->flags & DEDUP_CHUNK_INDEXED)
+		dedup_index_remove(state, pchunk);
+	state->nr_used--;
+	darray_append(state->pending, pchunk);
+}
+
+/* Point a logical chunk at pchunk + 1, or 0. Caller holds state->lock. */
+static void dedup_set_map(struct dedup_state *state, uint64_t lchunk,
+			  uint64_t entry)
+{
+	uint64_t old = state->map[lchunk];
+
+	state->map[lchunk] = entry;
+	if (old) {
+		state->nr_mapped--;
+		dedup_put(state, old - 1);
+	}
+	if (entry)
+		state->nr_mapped++;
+}
+
+/*
+ * Make the data and metadata stable, then allow the chunks freed
+ * before it to be reused.
+ */
+static int dedup_sync(struct tcmu_device *dev)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+	uint64_t *released;
+	size_t nr, i;
+	int ret = 0;
+
+	pthread_mutex_lock(&state->lock);
+	nr = darray_size(state->pending);
+	released = state->pending.item;
+	darray_init(state->pending);
+	pthread_mutex_unlock(&state->lock);
+
+	if (fdatasync(state->data_fd) ||
+	    msync(state->hdr, state->map_len, MS_SYNC) ||
+	    msync(state->chunks, state->chunks_len, MS_SYNC) ||
+	    msync(state->index, state->index_len, MS_SYNC)) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not sync %s: %m\n", state->dir);
+	}
+
+	pthread_mutex_lock(&state->lock);
+	/* on failure keep them pending for the next try */
+	for (i = 0; i < nr; i++) {
+		if (ret)
+			darray_append(state->pending, released[i]);
+		else
+			darray_append(state->free, released[i]);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	free(released);
+	return ret;
+}
+
+/* Allocate a physical chunk, with a reference. Caller holds state->lock. */
+static int dedup_alloc(struct dedup_state *state, uint64_t *pchunk)
+{
+	if (!darray_empty(state->free)) {
+		*pchunk = darray_pop(state->free);
+	} else if (state->hdr->next_pchunk < state->hdr->max_pchunks) {
+		*pchunk = state->hdr->next_pchunk++;
+	} else {
+		return -ENOSPC;
+	}
+
+	state->chunks[*pchunk].refs = 1;
+	state->chunks[*pchunk].flags = 0;
+	state->nr_used++;
+	return 0;
+}
+
+static int dedup_read_pchunk(struct dedup_state *state, uint64_t pchunk,
+			     void *buf)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < state->chunk_size) {
+		ret = pread(state->data_fd, buf + done, state->chunk_size - done,
+			    ((off_t)pchunk << state->chunk_shift) + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret) {
+			/* never written past the end of the file */
+			memset(buf + done, 0, state->chunk_size - done);
+			break;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int dedup_write_pchunk(struct dedup_state *state, uint64_t pchunk,
+			      const void *buf)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < state->chunk_size) {
+		ret = pwrite(state->data_fd, buf + done,
+			     state->chunk_size - done,
+			     ((off_t)pchunk << state->chunk_shift) + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/* Read the current contents of a logical chunk */
+static int dedup_read_lchunk(struct dedup_state *state, uint64_t lchunk,
+			     void *buf)
+{
+	uint64_t entry;
+	int ret;
+
+	pthread_mutex_lock(&state->lock);
+	entry = state->map[lchunk];
+	/* hold a reference so the chunk is not reused while it is read */
+	if (entry)
+		state->chunks[entry - 1].refs++;
+	pthread_mutex_unlock(&state->lock);
+
+	if (!entry) {
+		memset(buf, 0, state->chunk_size);
+		return 0;
+	}
+
+	ret = dedup_read_pchunk(state, entry - 1, buf);
+
+	pthread_mutex_lock(&state->lock);
+	dedup_put(state, entry - 1);
+	pthread_mutex_unlock(&state->lock);
+	return ret;
+}
+
+static void dedup_log_stats(struct tcmu_device *dev)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+
+	tcmu_dev_info(dev, "dedup ratio %.2f (%"PRIu64" logical, %"PRIu64" physical chunks), %"PRIu64" lookups, %"PRIu64" hits, %"PRIu64" verify mismatches, avg lookup %"PRIu64" ns\n",
+		      state->nr_used ?
+		      (double)state->nr_mapped / state->nr_used : 1.0,
+		      state->nr_mapped, state->nr_used, state->lookups,
+		      state->hits, state->verify_fails,
+		      state->lookups ? state->lookup_ns / state->lookups : 0);
+}
+
+static uint64_t dedup_elapsed_ns(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Store the new contents of a logical chunk, sharing an existing
+ * physical chunk if one has the same contents. cmp is a chunk sized
+ * buffer for verifying.
+ *
+ * With verify_write set the contents are always compared before a chunk
+ * is shared, and a newly written chunk is read back into cmp. If it
+ * differs from buf -EILSEQ is returned.
+ */
+static int dedup_store(struct tcmu_device *dev, uint64_t lchunk,
+		       const void *buf, void *cmp, bool verify_write)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+	struct dedup_index_ent *ent;
+	struct timespec start;
+	uint64_t fp[2], pchunk;
+	bool shared = false, need_sync;
+	int ret;
+
+	dedup_hash(buf, state->chunk_size, fp);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&state->lock);
+	ent = dedup_index_find(state, fp);
+	if (ent) {
+		pchunk = ent->pchunk - 1;
+		/* the reference taken here becomes the map's */
+		state->chunks[pchunk].refs++;
+		shared = true;
+	}
+
+	if (shared && (state->verify || verify_write)) {
+		pthread_mutex_unlock(&state->lock);
+		ret = dedup_read_pchunk(state, pchunk, cmp);
+		pthread_mutex_lock(&state->lock);
+		if (ret || memcmp(buf, cmp, state->chunk_size)) {
+			if (!ret)
+				state->verify_fails++;
+			dedup_put(state, pchunk);
+			shared = false;
+		}
+	}
+	state->lookups++;
+	state->lookup_ns += dedup_elapsed_ns(&start);
+
+	if (shared) {
+		state->hits++;
+		dedup_set_map(state, lchunk, pchunk + 1);
+		pthread_mutex_unlock(&state->lock);
+		return 0;
+	}
+
+	ret = dedup_alloc(state, &pchunk);
+	pthread_mutex_unlock(&state->lock);
+	if (ret == -ENOSPC) {
+		/* everything free is waiting for a sync */
+		ret = dedup_sync(dev);
+		if (ret)
+			return ret;
+
+		pthread_mutex_lock(&state->lock);
+		ret = dedup_alloc(state, &pchunk);
+		pthread_mutex_unlock(&state->lock);
+	}
+	if (ret)
+		return ret;
+
+	ret = dedup_write_pchunk(state, pchunk, buf);
+	if (!ret && verify_write) {
+		ret = dedup_read_pchunk(state, pchunk, cmp);
+		if (!ret && memcmp(buf, cmp, state->chunk_size))
+			ret = -EILSEQ;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	if (ret) {
+		dedup_put(state, pchunk);
+	} else {
+		state->chunks[pchunk].fp[0] = fp[0];
+		state->chunks[pchunk].fp[1] = fp[1];
+		dedup_index_insert(state, pchunk);
+		dedup_set_map(state, lchunk, pchunk + 1);
+	}
+	need_sync = darray_size(state->pending) >= DEDUP_PENDING_MAX / 2;
+	pthread_mutex_unlock(&state->lock);
+
+	/* release frees before the spare chunks run out */
+	if (need_sync)
+		dedup_sync(dev);
+	return ret;
+}
+
+static int dedup_write_chunks(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			      struct iovec *iov, size_t iov_cnt,
+			      size_t length, off_t offset, bool verify_write)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+	uint64_t lchunk, coff, n, pos, done = 0;
+	pthread_mutex_t *chunk_lock;
+	void *buf, *cmp;
+	int ret = TCMU_STS_OK;
+
+	buf = malloc(state->chunk_size);
+	cmp = malloc(state->chunk_size);
+	if (!buf || !cmp) {
+		ret = TCMU_STS_NO_RESOURCE;
+		goto free_bufs;
+	}
+
+	while (length) {
+		lchunk = offset >> state->chunk_shift;
+		coff = offset & (state->chunk_size - 1);
+		n = min((uint64_t)length, state->chunk_size - coff);
+		chunk_lock = &state->chunk_locks[lchunk % DEDUP_NR_CHUNK_LOCKS];
+
+		pthread_mutex_lock(chunk_lock);
+		if (n != state->chunk_size &&
+		    dedup_read_lchunk(state, lchunk, buf)) {
+			pthread_mutex_unlock(chunk_lock);
+			tcmu_dev_err(dev, "Could not read chunk %"PRIu64": %m\n",
+				     lchunk);
+			ret = TCMU_STS_WR_ERR;
+			break;
+		}
+		tcmu_memcpy_from_iovec(buf + coff, n, iov, iov_cnt);
+
+		ret = dedup_store(dev, lchunk, buf, cmp, verify_write);
+		pthread_mutex_unlock(chunk_lock);
+		if (ret == -EILSEQ) {
+			for (pos = 0; pos < state->chunk_size - 1; pos++) {
+				if (((uint8_t *)buf)[pos] != ((uint8_t *)cmp)[pos])
+					break;
+			}
+			/* report it within the bytes of this command */
+			pos = pos > coff ? min(pos - coff, n - 1) : 0;
+
+			tcmu_dev_err(dev, "Verify of chunk %"PRIu64" failed\n",
+				     lchunk);
+			tcmu_sense_set_info(cmd->lib_cmd->sense_buf, done + pos);
+			ret = TCMU_STS_MISCOMPARE;
+			break;
+		} else if (ret) {
+			tcmu_dev_err(dev, "Could not write chunk %"PRIu64"\n",
+				     lchunk);
+			ret = TCMU_STS_WR_ERR;
+			break;
+		}
+
+		offset += n;
+		length -= n;
+		done += n;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	if (time(NULL) - state->stats_time >= DEDUP_STATS_SECS) {
+		state->stats_time = time(NULL);
+		dedup_log_stats(dev);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+free_bufs:
+	free(cmp);
+	free(buf);
+	return ret;
+}
+
+static int dedup_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		       struct iovec *iov, size_t iov_cnt, size_t length,
+		       off_t offset)
+{
+	return dedup_write_chunks(dev, cmd, iov, iov_cnt, length, offset,
+				  false);
+}
+
+static int dedup_write_verify(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			      struct iovec *iov, size_t iov_cnt, size_t length,
+			      off_t offset)
+{
+	return dedup_write_chunks(dev, cmd, iov, iov_cnt, length, offset,
+				  true);
+}
+
+static int dedup_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+	uint64_t lchunk, coff, n;
+	void *buf;
+	int ret = TCMU_STS_OK;
+
+	buf = malloc(state->chunk_size);
+	if (!buf)
+		return TCMU_STS_NO_RESOURCE;
+
+	while (length) {
+		lchunk = offset >> state->chunk_shift;
+		coff = offset & (state->chunk_size - 1);
+		n = min((uint64_t)length, state->chunk_size - coff);
+
+		if (dedup_read_lchunk(state, lchunk, buf)) {
+			tcmu_dev_err(dev, "Could not read chunk %"PRIu64": %m\n",
+				     lchunk);
+			ret = TCMU_STS_RD_ERR;
+			break;
+		}
+		tcmu_memcpy_into_iovec(iov, iov_cnt, buf + coff, n);
+
+		offset += n;
+		length -= n;
+	}
+
+	free(buf);
+	return ret;
+}
+
+static int dedup_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		       uint64_t off, uint64_t len)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+	uint64_t first, end, lchunk;
+	pthread_mutex_t *chunk_lock;
+
+	/* only whole chunks are released, UNMAP is a hint */
+	first = round_up(off, (uint64_t)state->chunk_size) >>
+			state->chunk_shift;
+	end = (off + len) >> state->chunk_shift;
+
+	for (lchunk = first; lchunk < end; lchunk++) {
+		chunk_lock = &state->chunk_locks[lchunk % DEDUP_NR_CHUNK_LOCKS];
+
+		pthread_mutex_lock(chunk_lock);
+		pthread_mutex_lock(&state->lock);
+		dedup_set_map(state, lchunk, 0);
+		pthread_mutex_unlock(&state->lock);
+		pthread_mutex_unlock(chunk_lock);
+	}
+
+	return TCMU_STS_OK;
+}
+
+static int dedup_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
+{
+	if (dedup_sync(dev))
+		return TCMU_STS_WR_ERR;
+	return TCMU_STS_OK;
+}
+
+static int dedup_map_file(struct tcmu_device *dev, struct dedup_state *state,
+			  const char *name, size_t len, void **addr)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = openat(state->dir_fd, name, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		ret = -errno;
+		goto err;
+	}
+
+	if (fstat(fd, &st) || (st.st_size < len && ftruncate(fd, len))) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	*addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*addr == MAP_FAILED) {
+		ret = -errno;
+		*addr = NULL;
+	}
+
+close_fd:
+	close(fd);
+	if (!ret)
+		return 0;
+err:
+	tcmu_dev_err(dev, "Could not map %s/%s: %d\n", state->dir, name, ret);
+	return ret;
+}
+
+/*
+ * Rebuild the reference counts and the index from the map after an
+ * unclean shutdown.
+ */
+static void dedup_rebuild(struct tcmu_device *dev, struct dedup_state *state)
+{
+	uint64_t i, entry;
+
+	tcmu_dev_warn(dev, "%s was not closed cleanly, rebuilding reference counts and index\n",
+		      state->dir);
+
+	for (i = 0; i < state->hdr->next_pchunk; i++)
+		state->chunks[i].refs = 0;
+	memset(state->index, 0, state->index_len);
+
+	for (i = 0; i < state->hdr->nr_lchunks; i++) {
+		entry = state->map[i];
+		if (!entry)
+			continue;
+		if (entry > state->hdr->next_pchunk) {
+			tcmu_dev_err(dev, "Chunk %"PRIu64" maps to invalid chunk %"PRIu64", unmapping it\n",
+				     i, entry - 1);
+			state->map[i] = 0;
+			continue;
+		}
+		state->chunks[entry - 1].refs++;
+	}
+
+	for (i = 0; i < state->hdr->next_pchunk; i++) {
+		if (state->chunks[i].refs &&
+		    state->chunks[i].flags & DEDUP_CHUNK_INDEXED)
+			dedup_index_insert(state, i);
+		else
+			state->chunks[i].flags &= ~DEDUP_CHUNK_INDEXED;
+	}
+}
+
+static int dedup_load(struct tcmu_device *dev, struct dedup_state *state)
+{
+	uint64_t i;
+
+	if (!state->hdr->clean)
+		dedup_rebuild(dev, state);
+
+	state->hdr->clean = 0;
+	if (msync(state->hdr, DEDUP_HDR_LEN, MS_SYNC))
+		return -errno;
+
+	for (i = 0; i < state->hdr->nr_lchunks; i++) {
+		if (state->map[i])
+			state->nr_mapped++;
+	}
+
+	for (i = 0; i < state->hdr->next_pchunk; i++) {
+		if (state->chunks[i].refs)
+			state->nr_used++;
+		else
+			darray_append(state->free, i);
+	}
+	return 0;
+}
+
+static int dedup_parse_config(struct tcmu_device *dev,
+			      struct dedup_state *state)
+{
+	char *config, *opt;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	state->chunk_size = DEDUP_MIN_CHUNK;
+	state->verify = true;
+
+	state->dir = strdup(strtok(config, ";") ? : "");
+	if (!state->dir || !strlen(state->dir)) {
+		tcmu_dev_err(dev, "Could not get directory\n");
+		free(config);
+		return -EINVAL;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "chunk_size=", 11))
+			state->chunk_size = strtoul(opt + 11, NULL, 0);
+		else if (!strncmp(opt, "verify=", 7))
+			state->verify = atoi(opt + 7);
+		else
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+	}
+	free(config);
+
+	if (state->chunk_size < DEDUP_MIN_CHUNK ||
+	    state->chunk_size > DEDUP_MAX_CHUNK ||
+	    (state->chunk_size & (state->chunk_size - 1)) ||
+	    state->chunk_size < tcmu_dev_get_block_size(dev)) {
+		tcmu_dev_err(dev, "chunk_size must be a power of 2 from %u to %u and at least the block size\n",
+			     DEDUP_MIN_CHUNK, DEDUP_MAX_CHUNK);
+		return -EINVAL;
+	}
+	state->chunk_shift = __builtin_ctz(state->chunk_size);
+	return 0;
+}
+
+static void dedup_unmap_files(struct dedup_state *state)
+{
+	if (state->index)
+		munmap(state->index, state->index_len);
+	if (state->chunks)
+		munmap(state->chunks, state->chunks_len);
+	if (state->hdr)
+		munmap(state->hdr, state->map_len);
+}
+
+static int dedup_open(struct tcmu_device *dev, bool reopen)
+{
+	uint64_t nr_lchunks, max_pchunks, index_size;
+	struct dedup_state *state;
+	bool new_dev;
+	int i, ret;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	state->dir_fd = state->data_fd = -1;
+	darray_init(state->free);
+	darray_init(state->pending);
+	tcmur_dev_set_private(dev, state);
+
+	ret = dedup_parse_config(dev, state);
+	if (ret)
+		goto free_state;
+
+	nr_lchunks = (tcmu_dev_get_num_lbas(dev) * tcmu_dev_get_block_size(dev) +
+		      state->chunk_size - 1) >> state->chunk_shift;
+	max_pchunks = nr_lchunks + DEDUP_PENDING_MAX;
+	/* keep the index at most half full */
+	for (index_size = 1; index_size < max_pchunks * 2; index_size <<= 1)
+		;
+	state->index_mask = index_size - 1;
+
+	if (mkdir(state->dir, 0700) && errno != EEXIST) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not create %s: %m\n", state->dir);
+		goto free_state;
+	}
+
+	state->dir_fd = open(state->dir, O_RDONLY | O_DIRECTORY);
+	if (state->dir_fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s: %m\n", state->dir);
+		goto free_state;
+	}
+
+	state->map_len = DEDUP_HDR_LEN + nr_lchunks * sizeof(uint64_t);
+	state->chunks_len = max_pchunks * sizeof(struct dedup_chunk);
+	state->index_len = index_size * sizeof(struct dedup_index_ent);
+
+	ret = dedup_map_file(dev, state, "map", state->map_len,
+			     (void **)&state->hdr);
+	if (ret)
+		goto close_dir;
+	state->map = (void *)state->hdr + DEDUP_HDR_LEN;
+
+	ret = dedup_map_file(dev, state, "chunks", state->chunks_len,
+			     (void **)&state->chunks);
+	if (ret)
+		goto unmap_files;
+
+	ret = dedup_map_file(dev, state, "index", state->index_len,
+			     (void **)&state->index);
+	if (ret)
+		goto unmap_files;
+
+	new_dev = !state->hdr->magic;
+	if (new_dev) {
+		state->hdr->magic = DEDUP_MAGIC;
+		state->hdr->version = DEDUP_VERSION;
+		state->hdr->chunk_size = state->chunk_size;
+		state->hdr->nr_lchunks = nr_lchunks;
+		state->hdr->max_pchunks = max_pchunks;
+		state->hdr->index_size = index_size;
+		state->hdr->next_pchunk = 0;
+		state->hdr->clean = 1;
+	} else if (state->hdr->magic != DEDUP_MAGIC ||
+		   state->hdr->version != DEDUP_VERSION ||
+		   state->hdr->chunk_size != state->chunk_size ||
+		   state->hdr->nr_lchunks != nr_lchunks ||
+		   state->hdr->index_size != index_size) {
+		tcmu_dev_err(dev, "%s does not match the device (chunk size %u, %"PRIu64" chunks)\n",
+			     state->dir, state->hdr->chunk_size,
+			     state->hdr->nr_lchunks);
+		ret = -EINVAL;
+		goto unmap_files;
+	}
+
+	state->data_fd = openat(state->dir_fd, "data", O_RDWR | O_CREAT, 0600);
+	if (state->data_fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s/data: %m\n", state->dir);
+		goto unmap_files;
+	}
+
+	ret = pthread_mutex_init(&state->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto close_data;
+	}
+	for (i = 0; i < DEDUP_NR_CHUNK_LOCKS; i++)
+		pthread_mutex_init(&state->chunk_locks[i], NULL);
+
+	ret = dedup_load(dev, state);
+	if (ret)
+		goto destroy_locks;
+
+	state->stats_time = time(NULL);
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+	tcmu_dev_dbg(dev, "config %s, %"PRIu64" chunks of %u bytes\n",
+		     tcmu_dev_get_cfgstring(dev), nr_lchunks, state->chunk_size);
+	return 0;
+
+destroy_locks:
+	for (i = 0; i < DEDUP_NR_CHUNK_LOCKS; i++)
+		pthread_mutex_destroy(&state->chunk_locks[i]);
+	pthread_mutex_destroy(&state->lock);
+close_data:
+	close(state->data_fd);
+unmap_files:
+	dedup_unmap_files(state);
+close_dir:
+	close(state->dir_fd);
+free_state:
+	darray_free(state->free);
+	free(state->dir);
+	free(state);
+	return ret;
+}
+
+static void dedup_close(struct tcmu_device *dev)
+{
+	struct dedup_state *state = tcmur_dev_get_private(dev);
+	int i;
+
+	dedup_log_stats(dev);
+
+	if (!dedup_sync(dev)) {
+		state->hdr->clean = 1;
+		if (msync(state->hdr, DEDUP_HDR_LEN, MS_SYNC))
+			tcmu_dev_warn(dev, "Could not mark %s clean: %m\n",
+				      state->dir);
+	}
+
+	for (i = 0; i < DEDUP_NR_CHUNK_LOCKS; i++)
+		pthread_mutex_destroy(&state->chunk_locks[i]);
+	pthread_mutex_destroy(&state->lock);
+	close(state->data_fd);
+	dedup_unmap_files(state);
+	close(state->dir_fd);
+	darray_free(state->pending);
+	darray_free(state->free);
+	free(state->dir);
+	free(state);
+}
+
+static const char dedup_cfg_desc[] =
+	"Directory for the data and metadata files, with optional "
+	";chunk_size=bytes (4K to 64K) and ;verify=0|1 settings.";
+
+static struct tcmur_handler dedup_handler = {
+	.cfg_desc = dedup_cfg_desc,
+
+	.open = dedup_open,
+	.close = dedup_close,
+	.read = dedup_read,
+	.write = dedup_write,
+	.write_verify = dedup_write_verify,
+	.flush = dedup_flush,
+	.unmap = dedup_unmap,
+	.name = "Deduplicating Handler",
+	.subtype = "dedup",
+	.nr_threads = 4,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&dedup_handler);
+}
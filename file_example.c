@@ -7,14 +7,30 @@
  */
 
 /*
- * Example code to demonstrate how a TCMU handler might work.
- *
- * Using the example of backing a device by a file to demonstrate:
+ * File-backed handler, also example code to demonstrate how a TCMU
+ * handler might work:
  *
  * 1) Registering with tcmu-runner
  * 2) Parsing the handler-specific config string as needed for setup
  * 3) Opening resources as needed
  * 4) Handling SCSI commands and using the handler API
+ *
+ * The cfgstring is the path of the backing file plus optional
+ * settings:
+ *
+ *   file//path/to/file[;direct=0|1][;prealloc=0|1]
+ *
+ * With direct=1 the file is opened with O_DIRECT. Buffers that are not
+ * aligned for it, e.g. those built by the runner for emulated
+ * commands, are bounced through an aligned buffer. UNMAP punches holes
+ * and WRITE SAME of zeros zeroes the range with fallocate, with
+ * fallbacks for filesystems that support neither. With prealloc=1, the
+ * default, space is allocated when the file is created or the device
+ * grows, so running out of space fails the resize rather than a
+ * WRITE. The number of I/O threads can be changed with the runner's
+ * tcmur_nr_threads argument. Reads, writes and flushes go through the
+ * tcmur_co_* calls, so unless the coroutines tunable is cleared the I/O
+ * callouts run in coroutines on a single thread per device instead.
  */
 
 #define _GNU_SOURCE
@@ -24,50 +40,154 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <endian.h>
 #include <errno.h>
 #include <scsi/scsi.h>
+#include <linux/fs.h>
 
 #include "scsi_defs.h"
 #include "libtcmu.h"
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
+#include "tcmur_cmd_handler.h"
+#include "tcmur_co.h"
+
+/* bounce buffer size for unaligned O_DIRECT I/O and zeroing by writes */
+#define FILE_BOUNCE_LEN		(1024 * 1024)
 
 struct file_state {
 	int fd;
+	bool is_blk;
+	bool direct;
+	bool prealloc;
+	/* O_DIRECT buffer, offset and length alignment */
+	size_t align;
+
+	/* cleared once the filesystem returned EOPNOTSUPP */
+	bool can_punch;
+	bool can_zero_range;
 };
 
+static int file_parse_config(struct tcmu_device *dev, struct file_state *state,
+			     char **path)
+{
+	char *config, *opt;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	state->prealloc = true;
+
+	*path = strdup(strtok(config, ";") ? : "");
+	if (!*path || !strlen(*path)) {
+		tcmu_dev_err(dev, "Could not get file path\n");
+		free(*path);
+		free(config);
+		return -EINVAL;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "direct=", 7))
+			state->direct = atoi(opt + 7);
+		else if (!strncmp(opt, "prealloc=", 9))
+			state->prealloc = atoi(opt + 9);
+		else
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+	}
+
+	free(config);
+	return 0;
+}
+
+/*
+ * Make the file at least size bytes, allocating the space if prealloc
+ * is set.
+ */
+static int file_grow(struct tcmu_device *dev, struct file_state *state,
+		     uint64_t size)
+{
+	struct stat st;
+
+	if (state->is_blk)
+		return 0;
+
+	if (fstat(state->fd, &st))
+		return -errno;
+	if (st.st_size >= size)
+		return 0;
+
+	if (state->prealloc) {
+		if (!fallocate(state->fd, 0, st.st_size, size - st.st_size))
+			return 0;
+		if (errno != EOPNOTSUPP) {
+			tcmu_dev_err(dev, "Could not allocate %"PRIu64" bytes: %m\n",
+				     size);
+			return -errno;
+		}
+		tcmu_dev_warn(dev, "Filesystem cannot preallocate, the file will be sparse\n");
+	}
+
+	if (ftruncate(state->fd, size)) {
+		tcmu_dev_err(dev, "Could not grow file to %"PRIu64" bytes: %m\n",
+			     size);
+		return -errno;
+	}
+	return 0;
+}
+
 static int file_open(struct tcmu_device *dev, bool reopen)
 {
 	struct file_state *state;
-	char *config;
+	char *path = NULL;
+	struct stat st;
 	off_t file_size;
 	size_t block_size;
+	int flags, ret;
 
 	state = calloc(1, sizeof(*state));
 	if (!state)
 		return -ENOMEM;
+	state->can_punch = state->can_zero_range = true;
 
 	tcmur_dev_set_private(dev, state);
 
-	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
-	if (!config) {
-		tcmu_err("no configuration found in cfgstring\n");
-		goto err;
-	}
-	config += 1; /* get past '/' */
+	ret = file_parse_config(dev, state, &path);
+	if (ret)
+		goto free_state;
 
 	tcmu_dev_set_write_cache_enabled(dev, 1);
 
-	state->fd = open(config, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	flags = O_CREAT | O_RDWR;
+	if (state->direct)
+		flags |= O_DIRECT;
+	state->fd = open(path, flags, S_IRUSR | S_IWUSR);
 	if (state->fd == -1) {
-		tcmu_err("could not open %s: %m\n", config);
-		goto err;
+		ret = -errno;
+		tcmu_dev_err(dev, "could not open %s: %m\n", path);
+		goto free_path;
+	}
+
+	if (fstat(state->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
 	}
+	state->is_blk = S_ISBLK(st.st_mode);
 
 	block_size = tcmu_dev_get_block_size(dev);
 	if (!block_size) {
@@ -75,17 +195,55 @@ static int file_open(struct tcmu_device *dev, bool reopen)
 	    tcmu_dev_set_block_size(dev, block_size);
 	}
 
-	file_size = round_down(lseek(state->fd, 0, SEEK_END), block_size);
-	if (file_size)
-	    tcmu_dev_set_num_lbas(dev, file_size / block_size);
+	if (state->direct) {
+		int sector_size;
+
+		if (state->is_blk && !ioctl(state->fd, BLKSSZGET, &sector_size))
+			state->align = sector_size;
+		else
+			state->align = st.st_blksize;
+
+		if (block_size % state->align) {
+			tcmu_dev_err(dev, "Block size %zu is not a multiple of the %zu byte O_DIRECT alignment of %s\n",
+				     block_size, state->align, path);
+			ret = -EINVAL;
+			goto close_fd;
+		}
+	}
 
-	tcmu_dbg("config %s\n", tcmu_dev_get_cfgstring(dev));
+	if (state->is_blk) {
+		uint64_t dev_size;
 
+		if (ioctl(state->fd, BLKGETSIZE64, &dev_size)) {
+			ret = -errno;
+			goto close_fd;
+		}
+		file_size = round_down(dev_size, block_size);
+	} else {
+		file_size = round_down(lseek(state->fd, 0, SEEK_END),
+				       block_size);
+	}
+
+	if (file_size) {
+	    tcmu_dev_set_num_lbas(dev, file_size / block_size);
+	} else {
+		ret = file_grow(dev, state, tcmu_dev_get_num_lbas(dev) *
+				block_size);
+		if (ret)
+			goto close_fd;
+	}
+
+	tcmu_dev_dbg(dev, "config %s\n", tcmu_dev_get_cfgstring(dev));
+	free(path);
 	return 0;
 
-err:
+close_fd:
+	close(state->fd);
+free_path:
+	free(path);
+free_state:
 	free(state);
-	return -EINVAL;
+	return ret;
 }
 
 static void file_close(struct tcmu_device *dev)
@@ -96,86 +254,266 @@ static void file_close(struct tcmu_device *dev)
 	free(state);
 }
 
-static int file_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
-		     struct iovec *iov, size_t iov_cnt, size_t length,
-		     off_t offset)
+/* Can the iovec be used for O_DIRECT I/O as is */
+static bool file_iov_aligned(struct file_state *state, struct iovec *iov,
+			     size_t iov_cnt)
 {
-	struct file_state *state = tcmur_dev_get_private(dev);
-	size_t remaining = length;
+	size_t i;
+
+	if (!state->direct)
+		return true;
+
+	for (i = 0; i < iov_cnt; i++) {
+		if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+		    (state->align - 1))
+			return false;
+	}
+	return true;
+}
+
+static int file_rw(struct file_state *state, bool write, struct iovec *iov,
+		   size_t iov_cnt, size_t length, off_t offset)
+{
+	size_t consumed;
 	ssize_t ret;
 
-	while (remaining) {
-		ret = preadv(state->fd, iov, iov_cnt, offset);
+	while (length) {
+		if (write)
+			ret = tcmur_co_pwritev(state->fd, iov, iov_cnt,
+					       offset);
+		else
+			ret = tcmur_co_preadv(state->fd, iov, iov_cnt,
+					      offset);
 		if (ret < 0) {
-			tcmu_err("read failed: %m\n");
-			ret = TCMU_STS_RD_ERR;
-			goto done;
+			if (errno == EINTR)
+				continue;
+			return -errno;
 		}
 
 		if (ret == 0) {
+			if (write)
+				return -EIO;
 			/* EOF, then zeros the iovecs left */
 			tcmu_iovec_zero(iov, iov_cnt);
 			break;
 		}
 
-		tcmu_iovec_seek(iov, ret);
+		consumed = tcmu_iovec_seek(iov, ret);
+		iov += consumed;
+		iov_cnt -= consumed;
 		offset += ret;
-		remaining -= ret;
+		length -= ret;
 	}
-	ret = TCMU_STS_OK;
-done:
+
+	return 0;
+}
+
+/* O_DIRECT I/O on an unaligned iovec through an aligned buffer */
+static int file_rw_bounce(struct file_state *state, bool write,
+			  struct iovec *iov, size_t iov_cnt, size_t length,
+			  off_t offset)
+{
+	struct iovec bounce;
+	void *buf;
+	size_t n;
+	int ret = 0;
+
+	if (posix_memalign(&buf, state->align, FILE_BOUNCE_LEN))
+		return -ENOMEM;
+
+	while (length) {
+		n = min(length, (size_t)FILE_BOUNCE_LEN);
+		bounce.iov_base = buf;
+		bounce.iov_len = n;
+
+		if (write)
+			tcmu_memcpy_from_iovec(buf, n, iov, iov_cnt);
+		ret = file_rw(state, write, &bounce, 1, n, offset);
+		if (ret)
+			break;
+		if (!write)
+			tcmu_memcpy_into_iovec(iov, iov_cnt, buf, n);
+
+		offset += n;
+		length -= n;
+	}
+
+	free(buf);
 	return ret;
 }
 
+static int file_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	if (file_iov_aligned(state, iov, iov_cnt))
+		ret = file_rw(state, false, iov, iov_cnt, length, offset);
+	else
+		ret = file_rw_bounce(state, false, iov, iov_cnt, length,
+				     offset);
+	if (ret) {
+		tcmu_dev_err(dev, "read failed: %d\n", ret);
+		return TCMU_STS_RD_ERR;
+	}
+	return TCMU_STS_OK;
+}
+
 static int file_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
 		      struct iovec *iov, size_t iov_cnt, size_t length,
 		      off_t offset)
 {
 	struct file_state *state = tcmur_dev_get_private(dev);
-	size_t remaining = length;
-	ssize_t ret;
+	int ret;
 
-	while (remaining) {
-		ret = pwritev(state->fd, iov, iov_cnt, offset);
-		if (ret < 0) {
-			tcmu_err("write failed: %m\n");
-			ret = TCMU_STS_WR_ERR;
-			goto done;
-		}
-		tcmu_iovec_seek(iov, ret);
-		offset += ret;
-		remaining -= ret;
+	if (file_iov_aligned(state, iov, iov_cnt))
+		ret = file_rw(state, true, iov, iov_cnt, length, offset);
+	else
+		ret = file_rw_bounce(state, true, iov, iov_cnt, length,
+				     offset);
+	if (ret) {
+		tcmu_dev_err(dev, "write failed: %d\n", ret);
+		return TCMU_STS_WR_ERR;
 	}
-	ret = TCMU_STS_OK;
-done:
-	return ret;
+	return TCMU_STS_OK;
 }
 
 static int file_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
 {
 	struct file_state *state = tcmur_dev_get_private(dev);
-	int ret;
 
-	if (fsync(state->fd)) {
-		tcmu_err("sync failed\n");
-		ret = TCMU_STS_WR_ERR;
-		goto done;
+	if (tcmur_co_fdatasync(state->fd)) {
+		tcmu_dev_err(dev, "sync failed: %m\n");
+		return TCMU_STS_WR_ERR;
 	}
-	ret = TCMU_STS_OK;
-done:
+	return TCMU_STS_OK;
+}
+
+/*
+ * Make a range read back as zeros. Deallocate it if punch is set and
+ * the filesystem can, otherwise zero it with ZERO_RANGE or, as a last
+ * resort, by writing zeros.
+ */
+static int file_zero(struct file_state *state, bool punch, uint64_t off,
+		     uint64_t len)
+{
+	struct iovec iov;
+	void *buf;
+	uint64_t n;
+	int ret = 0;
+
+	if (punch && __atomic_load_n(&state->can_punch, __ATOMIC_RELAXED)) {
+		if (!fallocate(state->fd,
+			       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       off, len))
+			return 0;
+		if (errno != EOPNOTSUPP)
+			return -errno;
+		__atomic_store_n(&state->can_punch, false, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_load_n(&state->can_zero_range, __ATOMIC_RELAXED)) {
+		if (!fallocate(state->fd,
+			       FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+			       off, len))
+			return 0;
+		if (errno != EOPNOTSUPP)
+			return -errno;
+		__atomic_store_n(&state->can_zero_range, false,
+				 __ATOMIC_RELAXED);
+	}
+
+	if (posix_memalign(&buf, state->align ? : sizeof(void *),
+			   FILE_BOUNCE_LEN))
+		return -ENOMEM;
+	memset(buf, 0, FILE_BOUNCE_LEN);
+
+	while (len) {
+		n = min(len, (uint64_t)FILE_BOUNCE_LEN);
+		iov.iov_base = buf;
+		iov.iov_len = n;
+		ret = file_rw(state, true, &iov, 1, n, off);
+		if (ret)
+			break;
+		off += n;
+		len -= n;
+	}
+
+	free(buf);
 	return ret;
 }
 
+static int file_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      uint64_t off, uint64_t len)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	ret = file_zero(state, true, off, len);
+	if (ret) {
+		tcmu_dev_err(dev, "unmap failed: %d\n", ret);
+		return TCMU_STS_WR_ERR;
+	}
+	return TCMU_STS_OK;
+}
+
+static int file_writesame(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			  uint64_t off, uint64_t len, struct iovec *iov,
+			  size_t iov_cnt)
+{
+	struct file_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	/* keep the range allocated like a WRITE would */
+	ret = file_zero(state, false, off, len);
+	if (ret) {
+		tcmu_dev_err(dev, "write same failed: %d\n", ret);
+		return TCMU_STS_WR_ERR;
+	}
+	return TCMU_STS_OK;
+}
+
+/*
+ * Return scsi status or TCMU_STS_NOT_HANDLED
+ */
+static int file_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	switch (cmd->cdb[0]) {
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		/* the runner emulates WRITE SAME of anything else */
+		if (!tcmu_iovec_zeroed(cmd->iovec, cmd->iov_cnt))
+			return TCMU_STS_NOT_HANDLED;
+		return tcmur_handle_writesame(dev, tcmur_cmd, file_writesame);
+	default:
+		return TCMU_STS_NOT_HANDLED;
+	}
+}
+
 static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
+	struct file_state *state = tcmur_dev_get_private(dev);
+
 	switch (cfg->type) {
 	case TCMULIB_CFG_DEV_SIZE:
 		/*
-		 * TODO - For open/reconfig we should make sure the FS the
-		 * file is on is large enough for the requested size. For
-		 * now assume we can grow the file and return 0.
+		 * Only grow the file, data past a shrunk device is kept
+		 * in case it is grown back.
 		 */
-		return 0;
+		if (state->is_blk) {
+			uint64_t dev_size;
+
+			if (ioctl(state->fd, BLKGETSIZE64, &dev_size))
+				return -errno;
+			if (cfg->data.dev_size > dev_size)
+				return -ENOSPC;
+			return 0;
+		}
+		return file_grow(dev, state, cfg->data.dev_size);
 	case TCMULIB_CFG_DEV_CFGSTR:
 	case TCMULIB_CFG_WRITE_CACHE:
 	default:
@@ -184,7 +522,8 @@ static int file_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 }
 
 static const char file_cfg_desc[] =
-	"The path to the file to use as a backstore.";
+	"The path to the file to use as a backstore, with optional "
+	";direct=0|1 and ;prealloc=0|1 settings.";
 
 static struct tcmur_handler file_handler = {
 	.cfg_desc = file_cfg_desc,
@@ -196,9 +535,12 @@ static struct tcmur_handler file_handler = {
 	.read = file_read,
 	.write = file_write,
 	.flush = file_flush,
-	.name = "File-backed Handler (example code)",
+	.unmap = file_unmap,
+	.handle_cmd = file_handle_cmd,
+	.name = "File-backed Handler",
 	.subtype = "file",
-	.nr_threads = 2,
+	.nr_threads = 4,
+	.coroutines = true,
 };
 
 /* Entry point must be named "handler_init". */
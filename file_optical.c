@@ -1042,14 +1042,12 @@ static int fbo_synchronize_cache(struct tcmu_device *dev, uint8_t *cdb,
 	return fbo_do_sync(state, sense);
 }
 
-static int fbo_check_lba_and_length(struct fbo_state *state, uint8_t *cdb,
-				    uint8_t *sense, uint64_t *plba, int *plen)
+static int fbo_check_lba_and_length(struct fbo_state *state,
+				    struct tcmulib_cmd *cmd,
+				    uint64_t *plba, int *plen)
 {
-	uint64_t lba;
-	uint32_t num_blocks;
-
-	lba = tcmu_cdb_get_lba(cdb);
-	num_blocks = tcmu_cdb_get_xfer_length(cdb);
+	uint64_t lba = cmd->lba;
+	uint32_t num_blocks = cmd->xfer_len;
 
 	if (lba >= state->num_lbas || lba + num_blocks > state->num_lbas)
 		return TCMU_STS_RANGE;
@@ -1060,9 +1058,11 @@ static int fbo_check_lba_and_length(struct fbo_state *state, uint8_t *cdb,
 	return TCMU_STS_OK;
 }
 
-static int fbo_read(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
-		    size_t iov_cnt, uint8_t *sense)
+static int fbo_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	uint8_t *cdb = cmd->cdb;
+	struct iovec *iovec = cmd->iovec;
+	size_t iov_cnt = cmd->iov_cnt;
 	struct fbo_state *state = tcmur_dev_get_private(dev);
 	uint8_t fua = cdb[1] & 0x08;
 	uint64_t cur_lba = 0;
@@ -1077,7 +1077,7 @@ static int fbo_read(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
 	if (cdb[0] != READ_6 && cdb[1] & 0x11)
 		return TCMU_STS_INVALID_CDB;
 
-	rc = fbo_check_lba_and_length(state, cdb, sense, &cur_lba, &length);
+	rc = fbo_check_lba_and_length(state, cmd, &cur_lba, &length);
 	if (rc)
 		return rc;
 
@@ -1176,9 +1176,13 @@ static int fbo_do_verify(struct fbo_state *state, struct iovec *iovec,
 	return rc;
 }
 
-static int fbo_write(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
-		     size_t iov_cnt, uint8_t *sense, bool do_verify)
+static int fbo_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		     bool do_verify)
 {
+	uint8_t *cdb = cmd->cdb;
+	struct iovec *iovec = cmd->iovec;
+	size_t iov_cnt = cmd->iov_cnt;
+	uint8_t *sense = cmd->sense_buf;
 	struct fbo_state *state = tcmur_dev_get_private(dev);
 	struct iovec write_iovec[iov_cnt];
 	uint8_t fua = cdb[1] & 0x08;
@@ -1194,7 +1198,7 @@ static int fbo_write(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
 	if (state->flags & FBO_READ_ONLY)
 		return TCMU_STS_WR_ERR_INCOMPAT_FRMT;
 
-	rc = fbo_check_lba_and_length(state, cdb, sense, &cur_lba, &length);
+	rc = fbo_check_lba_and_length(state, cmd, &cur_lba, &length);
 	if (rc != TCMU_STS_OK)
 		return rc;
 
@@ -1240,9 +1244,12 @@ static int fbo_write(struct tcmu_device *dev, uint8_t *cdb, struct iovec *iovec,
 	return fbo_do_verify(state, iovec, iov_cnt, offset, length, sense);
 }
 
-static int fbo_verify(struct tcmu_device *dev, uint8_t *cdb,
-		      struct iovec *iovec, size_t iov_cnt, uint8_t *sense)
+static int fbo_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
+	uint8_t *cdb = cmd->cdb;
+	struct iovec *iovec = cmd->iovec;
+	size_t iov_cnt = cmd->iov_cnt;
+	uint8_t *sense = cmd->sense_buf;
 	struct fbo_state *state = tcmur_dev_get_private(dev);
 	uint64_t cur_lba = 0;
 	uint64_t offset;
@@ -1257,7 +1264,7 @@ static int fbo_verify(struct tcmu_device *dev, uint8_t *cdb,
 	if (cdb[1] & 0x13)
 		return TCMU_STS_INVALID_CDB;
 
-	rc = fbo_check_lba_and_length(state, cdb, sense, &cur_lba, &length);
+	rc = fbo_check_lba_and_length(state, cmd, &cur_lba, &length);
 	if (rc)
 		return rc;
 
@@ -1470,14 +1477,14 @@ static int fbo_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 	case READ_6:
 	case READ_10:
 	case READ_12:
-		ret = fbo_read(dev, cdb, iovec, iov_cnt, sense);
+		ret = fbo_read(dev, cmd);
 		break;
 	case WRITE_VERIFY:
 		do_verify = true;
 	case WRITE_6:
 	case WRITE_10:
 	case WRITE_12:
-		ret = fbo_write(dev, cdb, iovec, iov_cnt, sense, do_verify);
+		ret = fbo_write(dev, cmd, do_verify);
 		break;
 	case INQUIRY:
 		ret = fbo_emulate_inquiry(cdb, iovec, iov_cnt, sense);
@@ -1511,7 +1518,7 @@ static int fbo_handle_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 							    iov_cnt);
 		break;
 	case VERIFY:
-		ret = fbo_verify(dev, cdb, iovec, iov_cnt, sense);
+		ret = fbo_verify(dev, cmd);
 		break;
 	case SYNCHRONIZE_CACHE:
 		ret = fbo_synchronize_cache(dev, cdb, sense);
@@ -1882,9 +1882,8 @@ static int zbc_mode_sense(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 static int zbc_check_rdwr(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
-	uint8_t *cdb = cmd->cdb;
-	uint64_t lba = tcmu_cdb_get_lba(cdb);
-	size_t nr_lbas = tcmu_cdb_get_xfer_length(cdb);
+	uint64_t lba = cmd->lba;
+	size_t nr_lbas = cmd->xfer_len;
 	size_t iov_length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
 
 	if (iov_length != nr_lbas * zdev->lba_size) {
@@ -1974,8 +1973,7 @@ static ssize_t __zbc_read(struct zbc_dev *zdev, void *buf,
 static int zbc_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
-	uint8_t *cdb = cmd->cdb;
-	uint64_t lba = tcmu_cdb_get_lba(cdb);
+	uint64_t lba = cmd->lba;
 	struct iovec *iovec = cmd->iovec;
 	size_t iov_cnt = cmd->iov_cnt;
 	int zone_type = 0;
@@ -1984,7 +1982,7 @@ static int zbc_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	tcmu_dev_dbg(dev, "Read LBA %llu+%u, %zu vectors\n",
 		     (unsigned long long)lba,
-		     tcmu_cdb_get_xfer_length(cdb), iov_cnt);
+		     cmd->xfer_len, iov_cnt);
 
 	/* Check LBA and length */
 	ret = zbc_check_rdwr(dev, cmd);
@@ -2101,9 +2099,8 @@ static int zbc_write_check_zones(struct tcmu_device *dev,
 static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct zbc_dev *zdev = tcmur_dev_get_private(dev);
-	uint8_t *cdb = cmd->cdb;
-	uint64_t lba = tcmu_cdb_get_lba(cdb);
-	size_t nr_lbas = tcmu_cdb_get_xfer_length(cdb);
+	uint64_t lba = cmd->lba;
+	size_t nr_lbas = cmd->xfer_len;
 	size_t count, lba_count;
 	struct iovec *iovec = cmd->iovec;
 	struct zbc_zone *zone;
@@ -2111,7 +2108,7 @@ static int zbc_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	tcmu_dev_dbg(dev, "Write LBA %llu+%u, %zu vectors\n",
 		     (unsigned long long)lba,
-		     tcmu_cdb_get_xfer_length(cdb), cmd->iov_cnt);
+		     cmd->xfer_len, cmd->iov_cnt);
 
 	/* Check LBA and length */
 	ret = zbc_check_rdwr(dev, cmd);
@@ -795,6 +795,7 @@ uint64_t tcmu_byte_to_lba(struct tcmu_device *dev, uint64_t byte)
 	return byte >> dev->block_size_shift;
 }
 
+/* Commands fetched by tcmulib_get_next_command have this in cmd->off */
 uint64_t tcmu_cdb_to_byte(struct tcmu_device *dev, uint8_t *cdb)
 {
 	return tcmu_lba_to_byte(dev, tcmu_cdb_get_lba(cdb));
@@ -970,10 +971,12 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
 			break;
 		case TCMU_OP_CMD: {
 			int i;
-			struct tcmulib_cmd *cmd;
-			uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
-			int cdb_len = tcmu_cdb_get_length(cdb);
+			struct tcmulib_cmd *cmd, decoded;
+			int cdb_len;
 
+			/* Decode the cdb off the command ring */
+			decoded.cdb = (uint8_t *) mb + ent->req.cdb_off;
+			cdb_len = tcmu_cdb_decode(dev, &decoded);
 			if (cdb_len < 0) {
 				/*
 				 * This should never happen so just drop cmd
@@ -1001,7 +1004,14 @@ struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev,
 
 			/* Copy cdb that currently points to the command ring */
 			cmd->cdb = (uint8_t *) (cmd->iovec + cmd->iov_cnt);
-			memcpy(cmd->cdb, (void *) mb + ent->req.cdb_off, cdb_len);
+			memcpy(cmd->cdb, decoded.cdb, cdb_len);
+			cmd->cdb_len = decoded.cdb_len;
+			cmd->op_class = decoded.op_class;
+			cmd->cdb_flags = decoded.cdb_flags;
+			cmd->xfer_len = decoded.xfer_len;
+			cmd->lba = decoded.lba;
+			cmd->off = decoded.off;
+			cmd->len = decoded.len;
 
 			/* Setup handler memory area after iovecs and cdb */
 			if (hm_cmd_size)
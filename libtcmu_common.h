@@ -94,6 +94,19 @@ enum {
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+/* tcmulib_cmd op_class */
+enum {
+	TCMU_OP_CLASS_OTHER,
+	TCMU_OP_CLASS_READ,
+	/* modifies the LBAs from lba for xfer_len blocks */
+	TCMU_OP_CLASS_WRITE,
+	TCMU_OP_CLASS_SYNC,
+};
+
+/* tcmulib_cmd cdb_flags */
+#define TCMU_CDB_FUA	0x01
+#define TCMU_CDB_DPO	0x02
+
 struct tcmulib_cmd {
 	uint16_t cmd_id;
 	uint8_t *cdb;
@@ -101,6 +114,21 @@ struct tcmulib_cmd {
 	size_t iov_cnt;
 	uint8_t sense_buf[SENSE_BUFFERSIZE];
 	void *hm_private;
+
+	/*
+	 * Decoded from the cdb by tcmu_cdb_decode when the command is
+	 * fetched. lba and xfer_len are the fields tcmu_cdb_get_lba and
+	 * tcmu_cdb_get_xfer_length return, so xfer_len is the allocation
+	 * or parameter list length for non-I/O commands, and 0 for a
+	 * 256 block READ_6/WRITE_6.
+	 */
+	uint16_t cdb_len;
+	uint8_t op_class;
+	uint8_t cdb_flags;
+	uint32_t xfer_len;
+	uint64_t lba;
+	uint64_t off;	/* lba in bytes */
+	uint64_t len;	/* xfer_len blocks in bytes */
 };
 
 /* Set/Get methods for the opaque tcmu_device */
@@ -158,6 +186,7 @@ int tcmu_cfgfs_mod_param_set_u32(const char *name, uint32_t val);
 int tcmu_cdb_get_length(uint8_t *cdb);
 uint64_t tcmu_cdb_get_lba(uint8_t *cdb);
 uint32_t tcmu_cdb_get_xfer_length(uint8_t *cdb);
+int tcmu_cdb_decode(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
 void tcmu_cdb_print_info(struct tcmu_device *dev, const struct tcmulib_cmd *cmd,
 			 const char *info);
 uint64_t tcmu_cdb_to_byte(struct tcmu_device *dev, uint8_t *cdb);
@@ -172,6 +201,8 @@ size_t tcmu_iovec_length(struct iovec *iovec, size_t iov_cnt);
 /* memory mangement */
 size_t tcmu_memcpy_into_iovec(struct iovec *iovec, size_t iov_cnt, void *src,
 			      size_t len);
+size_t tcmu_memcpy_into_iovec_nt(struct iovec *iovec, size_t iov_cnt,
+				 void *src, size_t len);
 size_t tcmu_memcpy_from_iovec(void *dest, size_t len, struct iovec *iovec,
 			      size_t iov_cnt);
 
@@ -18,6 +18,10 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <pthread.h>
 
 #include "darray.h"
 #include "libtcmu_config.h"
@@ -98,6 +102,10 @@ struct tcmu_conf_option {
  */
 
 static LIST_HEAD(tcmu_options);
+static LIST_HEAD(tcmu_tunables);
+static int tcmu_nr_tunables;
+/* protects tcmu_options and tcmu_tunables */
+static pthread_mutex_t tcmu_options_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static struct tcmu_conf_option * tcmu_get_option(const char *key)
 {
@@ -112,7 +120,7 @@ static struct tcmu_conf_option * tcmu_get_option(const char *key)
 }
 
 static struct tcmu_conf_option *
-tcmu_register_option(char *key, tcmu_option_type type)
+tcmu_register_option(const char *key, tcmu_option_type type)
 {
 	struct tcmu_conf_option *option;
 
@@ -181,8 +189,240 @@ do { \
 	option->opt_str = strdup(cfg->def_##key); \
 } while (0);
 
+static struct tcmu_tunable *__tcmu_find_tunable(const char *name)
+{
+	struct tcmu_tunable *tun;
+
+	list_for_each(&tcmu_tunables, tun, list) {
+		if (!strcmp(tun->name, name))
+			return tun;
+	}
+
+	return NULL;
+}
+
+struct tcmu_tunable *tcmu_find_tunable(const char *name)
+{
+	struct tcmu_tunable *tun;
+
+	pthread_mutex_lock(&tcmu_options_lock);
+	tun = __tcmu_find_tunable(name);
+	pthread_mutex_unlock(&tcmu_options_lock);
+
+	return tun;
+}
+
+int tcmu_parse_tunable(struct tcmu_tunable *tun, const char *str, int64_t *val)
+{
+	long long v;
+	int shift = 0;
+	char *end;
+
+	while (isblank(*str))
+		str++;
+
+	if (tun->type == TCMU_TUNABLE_BOOL) {
+		if (!strcasecmp(str, "true") || !strcasecmp(str, "yes") ||
+		    !strcasecmp(str, "on")) {
+			*val = 1;
+			return 0;
+		}
+		if (!strcasecmp(str, "false") || !strcasecmp(str, "no") ||
+		    !strcasecmp(str, "off")) {
+			*val = 0;
+			return 0;
+		}
+	}
+
+	errno = 0;
+	v = strtoll(str, &end, 0);
+	if (errno || end == str)
+		return -EINVAL;
+
+	if (tun->type == TCMU_TUNABLE_SIZE) {
+		switch (tolower(*end)) {
+		case 't':
+			shift = 40;
+			break;
+		case 'g':
+			shift = 30;
+			break;
+		case 'm':
+			shift = 20;
+			break;
+		case 'k':
+			shift = 10;
+			break;
+		}
+		if (shift) {
+			end++;
+			if (v > (INT64_MAX >> shift) || v < (INT64_MIN >> shift))
+				return -ERANGE;
+			v *= 1LL << shift;
+		}
+	}
+
+	while (isblank(*end))
+		end++;
+	if (*end)
+		return -EINVAL;
+
+	if (v < tun->min || v > tun->max)
+		return -ERANGE;
+
+	*val = v;
+	return 0;
+}
+
+static void tcmu_update_tunable(struct tcmu_tunable *tun, int64_t val)
+{
+	if (tun->value == val)
+		return;
+
+	__atomic_store_n(&tun->value, val, __ATOMIC_RELAXED);
+	tcmu_info("Tunable %s set to %"PRId64"\n", tun->name, val);
+
+	if (tun->apply)
+		tun->apply(tun);
+}
+
+/*
+ * Tunable keys are kept as string options, so values like "4M" are not
+ * truncated by tcmu_parse_option, and opt_str is reset to NULL once it
+ * has been consumed, so a key that is commented out falls back to the
+ * default. A value set at runtime is only replaced when the key's value
+ * in the config file changes.
+ */
+static void tcmu_conf_set_tunable(struct tcmu_tunable *tun)
+{
+	struct tcmu_conf_option *option;
+	char buf[32], *str = NULL;
+	int64_t val;
+	int ret;
+
+	option = tcmu_get_option(tun->name);
+	if (!option) {
+		tcmu_register_option(tun->name, TCMU_OPT_STR);
+		goto unset;
+	}
+
+	switch (option->type) {
+	case TCMU_OPT_INT:
+		/* parsed before the tunable was registered */
+		snprintf(buf, sizeof(buf), "%d", option->opt_int);
+		str = buf;
+		break;
+	case TCMU_OPT_BOOL:
+		if (option->opt_bool) {
+			snprintf(buf, sizeof(buf), "1");
+			str = buf;
+		}
+		break;
+	case TCMU_OPT_STR:
+		if (option->opt_str) {
+			snprintf(buf, sizeof(buf), "%s", option->opt_str);
+			free(option->opt_str);
+			str = buf;
+		}
+		break;
+	default:
+		break;
+	}
+	option->type = TCMU_OPT_STR;
+	option->opt_str = NULL;
+
+	if (!str)
+		goto unset;
+
+	ret = tcmu_parse_tunable(tun, str, &val);
+	if (ret) {
+		tcmu_err("Invalid value \"%s\" for %s, valid range [%"PRId64", %"PRId64"]\n",
+			 str, tun->name, tun->min, tun->max);
+		return;
+	}
+
+	if (!tun->conf_set || tun->conf_value != val) {
+		tun->conf_set = true;
+		tun->conf_value = val;
+		tcmu_update_tunable(tun, val);
+	}
+	return;
+
+unset:
+	if (tun->conf_set) {
+		tun->conf_set = false;
+		tcmu_update_tunable(tun, tun->def);
+	}
+}
+
+int tcmu_register_tunable(struct tcmu_tunable *tun)
+{
+	int ret = 0;
+
+	if (tun->def < tun->min || tun->def > tun->max) {
+		tcmu_err("Tunable %s default %"PRId64" is out of range\n",
+			 tun->name, tun->def);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&tcmu_options_lock);
+	if (__tcmu_find_tunable(tun->name)) {
+		tcmu_err("Tunable %s is already registered\n", tun->name);
+		ret = -EEXIST;
+		goto unlock;
+	}
+
+	if (tcmu_nr_tunables == TCMU_MAX_TUNABLES) {
+		tcmu_err("Cannot register tunable %s, max %d reached\n",
+			 tun->name, TCMU_MAX_TUNABLES);
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	tun->id = tcmu_nr_tunables++;
+	tun->value = tun->def;
+	tun->conf_set = false;
+	list_node_init(&tun->list);
+	list_add_tail(&tcmu_tunables, &tun->list);
+
+	/* pick up the value if the config file was loaded before us */
+	tcmu_conf_set_tunable(tun);
+unlock:
+	pthread_mutex_unlock(&tcmu_options_lock);
+	return ret;
+}
+
+int tcmu_set_tunable(struct tcmu_tunable *tun, int64_t val)
+{
+	if (val < tun->min || val > tun->max)
+		return -ERANGE;
+
+	pthread_mutex_lock(&tcmu_options_lock);
+	tcmu_update_tunable(tun, val);
+	pthread_mutex_unlock(&tcmu_options_lock);
+	return 0;
+}
+
+int64_t tcmu_get_tunable(struct tcmu_tunable *tun)
+{
+	return __atomic_load_n(&tun->value, __ATOMIC_RELAXED);
+}
+
+void tcmu_for_each_tunable(void (*fn)(struct tcmu_tunable *tun, void *data),
+			   void *data)
+{
+	struct tcmu_tunable *tun;
+
+	pthread_mutex_lock(&tcmu_options_lock);
+	list_for_each(&tcmu_tunables, tun, list)
+		fn(tun, data);
+	pthread_mutex_unlock(&tcmu_options_lock);
+}
+
 static void tcmu_conf_set_options(struct tcmu_config *cfg)
 {
+	struct tcmu_tunable *tun;
+
 	/* set log_level option */
 	TCMU_PARSE_CFG_INT(cfg, log_level);
 	tcmu_set_log_level(cfg->log_level);
@@ -192,6 +432,10 @@ static void tcmu_conf_set_options(struct tcmu_config *cfg)
 	tcmu_resetup_log_file(cfg, cfg->log_dir);
 
 	/* add your new config options */
+
+	/* and the registered tunables */
+	list_for_each(&tcmu_tunables, tun, list)
+		tcmu_conf_set_tunable(tun);
 }
 
 #define TCMU_MAX_CFG_FILE_SIZE (2 * 1024 * 1024)
@@ -260,8 +504,13 @@ static void tcmu_parse_option(char **cur, const char *end)
 		if (!option)
 			option = tcmu_register_option(p, TCMU_OPT_BOOL);
 
-		if (option)
+		if (option && option->type == TCMU_OPT_STR) {
+			/* a boolean tunable, see tcmu_conf_set_tunable() */
+			free(option->opt_str);
+			option->opt_str = strdup("1");
+		} else if (option) {
 			option->opt_bool = true;
+		}
 
 		return;
 	}
@@ -279,10 +528,16 @@ static void tcmu_parse_option(char **cur, const char *end)
 		while (isblank(*r))
 			r++;
 
-		if (isdigit(*r))
-			type = TCMU_OPT_INT;
-		else
-			type = TCMU_OPT_STR;
+		/* values like "4M" are strings */
+		type = TCMU_OPT_STR;
+		if (isdigit(*r)) {
+			while (isdigit(*r))
+				r++;
+			while (isblank(*r))
+				r++;
+			if (!*r || *r == '#')
+				type = TCMU_OPT_INT;
+		}
 
 		option = tcmu_register_option(p, type);
 		if (!option)
@@ -385,7 +640,9 @@ int tcmu_load_config(struct tcmu_config *cfg)
 
 	buf[len] = '\0';
 
+	pthread_mutex_lock(&tcmu_options_lock);
 	tcmu_parse_options(cfg, buf, len);
+	pthread_mutex_unlock(&tcmu_options_lock);
 
 	ret = 0;
 free_buf:
@@ -491,10 +748,15 @@ struct tcmu_config* tcmu_initialize_config(void)
 void tcmu_free_config(struct tcmu_config *cfg)
 {
 	struct tcmu_conf_option *option, *next;
+	struct tcmu_tunable *tun, *tun_next;
 
 	if (!cfg)
 		return;
 
+	list_for_each_safe(&tcmu_tunables, tun, tun_next, list)
+		list_del(&tun->list);
+	tcmu_nr_tunables = 0;
+
 	list_for_each_safe(&tcmu_options, option, next, list) {
 		list_del(&option->list);
 
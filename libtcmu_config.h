@@ -10,6 +10,7 @@
 # define __TCMU_CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "ccan/list/list.h"
@@ -55,6 +56,50 @@ static const char *const log_level_lookup[] = {
 	[TCMU_CONF_LOG_DEBUG_SCSI_CMD]	= "DEBUG SCSI CMD",
 };
 
+/*
+ * Tunables are typed knobs that core modules and handlers register at
+ * init time. The global value can be set in tcmu.conf using the tunable
+ * name as the key and is re-applied by the config watcher thread when the
+ * file changes. tcmu-runner also lets it be overridden per device.
+ */
+typedef enum {
+	TCMU_TUNABLE_INT,	/* plain integer */
+	TCMU_TUNABLE_BOOL,	/* 0/1, true/false, yes/no or on/off */
+	TCMU_TUNABLE_SIZE,	/* byte count with optional K, M, G or T suffix */
+} tcmu_tunable_type;
+
+#define TCMU_MAX_TUNABLES 32
+
+struct tcmu_tunable {
+	const char *name;
+	const char *desc;
+	tcmu_tunable_type type;
+	int64_t def;
+	int64_t min;
+	int64_t max;
+	/*
+	 * Optional, called with the registry lock held after the global
+	 * value has changed. It must not call into the registry other than
+	 * tcmu_get_tunable.
+	 */
+	void (*apply)(struct tcmu_tunable *tun);
+
+	/* private to libtcmu_config.c */
+	struct list_node list;
+	int id;
+	int64_t value;
+	bool conf_set;
+	int64_t conf_value;
+};
+
+int tcmu_register_tunable(struct tcmu_tunable *tun);
+struct tcmu_tunable *tcmu_find_tunable(const char *name);
+int tcmu_parse_tunable(struct tcmu_tunable *tun, const char *str, int64_t *val);
+int tcmu_set_tunable(struct tcmu_tunable *tun, int64_t val);
+int64_t tcmu_get_tunable(struct tcmu_tunable *tun);
+void tcmu_for_each_tunable(void (*fn)(struct tcmu_tunable *tun, void *data),
+			   void *data);
+
 struct tcmu_config* tcmu_initialize_config(void);
 void tcmu_free_config(struct tcmu_config *cfg);
 int tcmu_load_config(struct tcmu_config *cfg);
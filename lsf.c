@@ -0,0 +1,1651 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Log-structured file handler
+ *
+ * Random writes are turned into sequential appends, which is what
+ * HDD and SMR media are good at. The cfgstring is a directory plus
+ * optional settings:
+ *
+ *   lsf//path/to/dir[;seg_size=N][;overprov=P][;ckpt_interval=N]
+ *
+ * The directory holds segment files of seg_size bytes (64M by
+ * default) and a checkpoint. A segment is a header, a summary with
+ * one struct lsf_summary per block and then the data blocks. A write
+ * takes the next free blocks of the open "hot" segment and records
+ * the LBA, a sequence number and a checksum of each block in the
+ * summary. UNMAP is logged as a summary entry without data.
+ *
+ * The LBA to log location index is a radix tree kept in memory. It is
+ * written to the checkpoint file every ckpt_interval bytes of writes
+ * (1G by default). On open the checkpoint is loaded and the summary
+ * entries newer than it are replayed, so recovery only reads what
+ * was written since the last checkpoint.
+ *
+ * A cleaner thread keeps overprov percent (20 by default) of extra
+ * segments free. It picks victims by cost-benefit (free space times
+ * age), and copies their live blocks to a separate "cold" segment so
+ * long lived data does not get mixed with fresh writes again. Copies
+ * keep the sequence number of the original write. A cleaned segment
+ * is only reused once a checkpoint no longer references it.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#define LSF_SEG_MAGIC		0x4753464c	/* "LFSG" */
+#define LSF_CKPT_MAGIC		0x4b43464c	/* "LFCK" */
+#define LSF_VERSION		1
+#define LSF_SEG_HDR_LEN		4096
+
+#define LSF_DEF_SEG_SIZE	(64 * 1024 * 1024ULL)
+#define LSF_MIN_SEG_SIZE	(1024 * 1024ULL)
+#define LSF_DEF_OVERPROV	20
+#define LSF_DEF_CKPT_INTERVAL	(1024 * 1024 * 1024ULL)
+/* segments only the cleaner may use, so it can always make progress */
+#define LSF_RESERVED_SEGS	2
+/* how long a write waits for the cleaner before failing */
+#define LSF_SPACE_WAIT_SECS	30
+/* blocks copied per batch while cleaning */
+#define LSF_GC_BATCH		256
+
+#define LSF_CKPT_NAME		"checkpoint"
+#define LSF_CKPT_TMP_NAME	"checkpoint.tmp"
+
+#define LSF_RADIX_BITS		9
+#define LSF_RADIX_SIZE		(1 << LSF_RADIX_BITS)
+#define LSF_RADIX_MASK		(LSF_RADIX_SIZE - 1)
+
+/* A location is (segment slot + 1) << 32 | block, 0 means unmapped */
+#define LSF_LOC(slot, blk)	((((uint64_t)(slot) + 1) << 32) | (blk))
+#define LSF_LOC_SLOT(loc)	((uint32_t)((loc) >> 32) - 1)
+#define LSF_LOC_BLOCK(loc)	((uint32_t)(loc))
+
+struct lsf_seg_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot;
+	uint32_t block_size;
+	uint64_t seg_size;
+};
+
+#define LSF_SUMMARY_TRIM	(1 << 0)
+#define LSF_SUMMARY_GC		(1 << 1)
+
+struct lsf_summary {
+	uint64_t lba;
+	uint64_t seq;		/* 0 if the block was never written */
+	uint32_t nr_blocks;	/* 1 for data, the range for TRIM */
+	uint32_t flags;
+	uint64_t csum;		/* of the data, seeded with lba and seq */
+};
+
+struct lsf_ckpt_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t reserved;
+	uint64_t seg_size;
+	uint64_t seq;		/* all entries up to seq are included */
+	uint64_t nr_runs;
+	uint64_t csum;		/* of the runs */
+};
+
+struct lsf_ckpt_run {
+	uint64_t lba;
+	uint64_t loc;
+	uint64_t count;
+};
+
+enum {
+	LSF_SEG_FREE,
+	LSF_SEG_OPEN,
+	LSF_SEG_FULL,
+	LSF_SEG_CLEANING,
+	/* no live blocks, reusable after the next checkpoint */
+	LSF_SEG_CLEANED,
+};
+
+struct lsf_seg {
+	int fd;
+	int state;
+	uint32_t next_blk;
+	uint32_t live;
+	time_t mtime;
+	/* written since the last SYNCHRONIZE CACHE / checkpoint */
+	bool flush_dirty;
+	bool ckpt_dirty;
+};
+
+struct lsf_radix {
+	void *root;
+	unsigned int levels;
+};
+
+struct lsf_state {
+	char *dir;
+	int dir_fd;
+
+	uint32_t block_size;
+	uint64_t seg_size;
+	uint32_t seg_blocks;
+	off_t data_off;
+	uint32_t overprov;
+	uint64_t ckpt_interval;
+
+	/*
+	 * Held for read across IO and for write while a checkpoint
+	 * snapshots the index or segments are freed or resized.
+	 */
+	pthread_rwlock_t io_lock;
+	/* index, segment table and allocation */
+	pthread_mutex_t lock;
+	pthread_cond_t gc_cond;
+	pthread_cond_t space_cond;
+
+	struct lsf_radix index;
+	struct lsf_seg *segs;
+	uint32_t nr_segs;
+	uint32_t nr_free;
+	int hot;
+	int cold;
+	uint64_t seq;
+	uint64_t ckpt_seq;
+	uint64_t written_since_ckpt;
+
+	pthread_t gc_thread;
+	bool stop;
+
+	/* statistics */
+	uint64_t user_blocks;
+	uint64_t gc_blocks;
+	uint64_t gc_segs;
+};
+
+static uint64_t lsf_csum(const void *buf, size_t len, uint64_t seed)
+{
+	const uint64_t *p = buf;
+	uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(uint64_t); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+/* Returns the slot of key, allocating the path to it if alloc is set. */
+static uint64_t *lsf_radix_slot(struct lsf_radix *r, uint64_t key, bool alloc)
+{
+	void **node = &r->root;
+	int level;
+
+	if (key >> (LSF_RADIX_BITS * r->levels))
+		return NULL;
+
+	for (level = r->levels - 1; level >= 0; level--) {
+		if (!*node) {
+			if (!alloc)
+				return NULL;
+			*node = calloc(LSF_RADIX_SIZE,
+				       level ? sizeof(void *) : sizeof(uint64_t));
+			if (!*node)
+				return NULL;
+		}
+
+		if (!level)
+			break;
+		node = &((void **)*node)[(key >> (LSF_RADIX_BITS * level)) &
+					 LSF_RADIX_MASK];
+	}
+
+	return &((uint64_t *)*node)[key & LSF_RADIX_MASK];
+}
+
+static uint64_t lsf_radix_get(struct lsf_radix *r, uint64_t key)
+{
+	uint64_t *slot = lsf_radix_slot(r, key, false);
+
+	return slot ? *slot : 0;
+}
+
+static int lsf_radix_set(struct lsf_radix *r, uint64_t key, uint64_t val)
+{
+	uint64_t *slot = lsf_radix_slot(r, key, !!val);
+
+	if (!slot)
+		return val ? -ENOMEM : 0;
+	*slot = val;
+	return 0;
+}
+
+/* Make room for keys below nr_keys */
+static int lsf_radix_grow(struct lsf_radix *r, uint64_t nr_keys)
+{
+	void **node;
+
+	if (!r->levels)
+		r->levels = 1;
+
+	while (nr_keys && ((nr_keys - 1) >> (LSF_RADIX_BITS * r->levels))) {
+		if (r->root) {
+			node = calloc(LSF_RADIX_SIZE, sizeof(void *));
+			if (!node)
+				return -ENOMEM;
+			node[0] = r->root;
+			r->root = node;
+		}
+		r->levels++;
+	}
+	return 0;
+}
+
+static void lsf_radix_free_node(void *node, int level)
+{
+	int i;
+
+	if (!node)
+		return;
+
+	if (level) {
+		for (i = 0; i < LSF_RADIX_SIZE; i++)
+			lsf_radix_free_node(((void **)node)[i], level - 1);
+	}
+	free(node);
+}
+
+static void lsf_radix_free(struct lsf_radix *r)
+{
+	lsf_radix_free_node(r->root, r->levels - 1);
+	r->root = NULL;
+}
+
+typedef int (*lsf_radix_fn_t)(uint64_t key, uint64_t val, void *data);
+
+static int lsf_radix_walk_node(void *node, int level, uint64_t base,
+			       lsf_radix_fn_t fn, void *data)
+{
+	uint64_t key;
+	int i, ret;
+
+	if (!node)
+		return 0;
+
+	for (i = 0; i < LSF_RADIX_SIZE; i++) {
+		key = base | ((uint64_t)i << (LSF_RADIX_BITS * level));
+
+		if (level) {
+			ret = lsf_radix_walk_node(((void **)node)[i], level - 1,
+						  key, fn, data);
+		} else {
+			if (!((uint64_t *)node)[i])
+				continue;
+			ret = fn(key, ((uint64_t *)node)[i], data);
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Call fn for every non zero value in key order */
+static int lsf_radix_walk(struct lsf_radix *r, lsf_radix_fn_t fn, void *data)
+{
+	return lsf_radix_walk_node(r->root, r->levels - 1, 0, fn, data);
+}
+
+static int lsf_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int lsf_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static inline off_t lsf_summary_off(uint32_t blk)
+{
+	return LSF_SEG_HDR_LEN + (off_t)blk * sizeof(struct lsf_summary);
+}
+
+static inline off_t lsf_data_off(struct lsf_state *state, uint32_t blk)
+{
+	return state->data_off + (off_t)blk * state->block_size;
+}
+
+static uint32_t lsf_nr_segs(struct lsf_state *state, uint64_t num_lbas)
+{
+	uint64_t nr;
+
+	nr = (num_lbas + state->seg_blocks - 1) / state->seg_blocks;
+	nr += nr * state->overprov / 100;
+	/* the open hot and cold segments are never completely full */
+	return nr + LSF_RESERVED_SEGS + 2;
+}
+
+static int lsf_grow_segs(struct lsf_state *state, uint32_t nr_segs)
+{
+	struct lsf_seg *segs;
+	uint32_t i;
+
+	if (nr_segs <= state->nr_segs)
+		return 0;
+
+	segs = realloc(state->segs, nr_segs * sizeof(*segs));
+	if (!segs)
+		return -ENOMEM;
+
+	for (i = state->nr_segs; i < nr_segs; i++) {
+		memset(&segs[i], 0, sizeof(segs[i]));
+		segs[i].fd = -1;
+		segs[i].state = LSF_SEG_FREE;
+	}
+	state->nr_free += nr_segs - state->nr_segs;
+	state->segs = segs;
+	state->nr_segs = nr_segs;
+	return 0;
+}
+
+/* Update the index and the live counts. Caller holds state->lock. */
+static int lsf_map(struct lsf_state *state, uint64_t lba, uint64_t loc)
+{
+	uint64_t old = lsf_radix_get(&state->index, lba);
+	int ret;
+
+	ret = lsf_radix_set(&state->index, lba, loc);
+	if (ret)
+		return ret;
+
+	if (old)
+		state->segs[LSF_LOC_SLOT(old)].live--;
+	if (loc)
+		state->segs[LSF_LOC_SLOT(loc)].live++;
+	return 0;
+}
+
+/* Caller holds state->lock */
+static int lsf_seg_create(struct lsf_state *state, uint32_t slot)
+{
+	struct lsf_seg *seg = &state->segs[slot];
+	struct lsf_seg_hdr hdr;
+	char name[32];
+	int fd, ret;
+
+	snprintf(name, sizeof(name), "seg-%06u", slot);
+	fd = openat(state->dir_fd, name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return -errno;
+
+	/* ask for contiguous space, the point of this handler */
+	if (posix_fallocate(fd, 0, state->seg_size) &&
+	    ftruncate(fd, state->seg_size)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LSF_SEG_MAGIC;
+	hdr.version = LSF_VERSION;
+	hdr.slot = slot;
+	hdr.block_size = state->block_size;
+	hdr.seg_size = state->seg_size;
+	ret = lsf_pwrite(fd, &hdr, sizeof(hdr), 0);
+	if (ret)
+		goto close_fd;
+
+	if (fdatasync(fd) || fsync(state->dir_fd)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	seg->fd = fd;
+	seg->state = LSF_SEG_OPEN;
+	seg->next_blk = 0;
+	seg->live = 0;
+	seg->mtime = time(NULL);
+	state->nr_free--;
+	return 0;
+
+close_fd:
+	close(fd);
+	unlinkat(state->dir_fd, name, 0);
+	return ret;
+}
+
+/*
+ * Allocate up to nr blocks from the hot or cold open segment. Returns
+ * the number of blocks allocated, -ENOSPC if a new segment is needed
+ * and none may be used, or another -errno.
+ *
+ * Caller holds state->lock.
+ */
+static int lsf_alloc(struct lsf_state *state, bool cold, uint32_t nr,
+		     uint32_t *slot, uint32_t *blk)
+{
+	int *open = cold ? &state->cold : &state->hot;
+	struct lsf_seg *seg;
+	uint32_t i;
+	int ret;
+
+	if (*open >= 0 &&
+	    state->segs[*open].next_blk == state->seg_blocks) {
+		state->segs[*open].state = LSF_SEG_FULL;
+		*open = -1;
+	}
+
+	if (*open < 0) {
+		if (state->nr_free <= (cold ? 0 : LSF_RESERVED_SEGS)) {
+			pthread_cond_signal(&state->gc_cond);
+			return -ENOSPC;
+		}
+
+		for (i = 0; i < state->nr_segs; i++) {
+			if (state->segs[i].state == LSF_SEG_FREE)
+				break;
+		}
+		if (i == state->nr_segs)
+			return -ENOSPC;
+
+		ret = lsf_seg_create(state, i);
+		if (ret)
+			return ret;
+		*open = i;
+
+		if (state->nr_free <= LSF_RESERVED_SEGS + 1)
+			pthread_cond_signal(&state->gc_cond);
+	}
+
+	seg = &state->segs[*open];
+	*slot = *open;
+	*blk = seg->next_blk;
+	nr = min(nr, state->seg_blocks - seg->next_blk);
+	seg->next_blk += nr;
+	seg->mtime = time(NULL);
+	return nr;
+}
+
+static int lsf_write_blocks(struct lsf_state *state, uint32_t slot,
+			    uint32_t blk, const void *buf, uint32_t nr,
+			    struct lsf_summary *sums)
+{
+	int fd = state->segs[slot].fd;
+	int ret;
+
+	if (buf) {
+		ret = lsf_pwrite(fd, buf, (size_t)nr * state->block_size,
+				 lsf_data_off(state, blk));
+		if (ret)
+			return ret;
+	}
+
+	return lsf_pwrite(fd, sums, nr * sizeof(*sums), lsf_summary_off(blk));
+}
+
+/*
+ * Allocate blocks for a write, waiting for the cleaner if the device
+ * is out of segments. On success io_lock is held for read.
+ */
+static int lsf_alloc_wait(struct lsf_state *state, uint32_t nr,
+			  uint32_t *slot, uint32_t *blk, uint64_t *seq)
+{
+	struct timespec ts;
+	int ret, tries = 0;
+
+	for (;;) {
+		pthread_rwlock_rdlock(&state->io_lock);
+		pthread_mutex_lock(&state->lock);
+		ret = lsf_alloc(state, false, nr, slot, blk);
+		if (ret > 0)
+			*seq = state->seq++;
+		pthread_mutex_unlock(&state->lock);
+
+		if (ret != -ENOSPC)
+			break;
+		pthread_rwlock_unlock(&state->io_lock);
+
+		if (++tries > LSF_SPACE_WAIT_SECS)
+			return ret;
+
+		pthread_mutex_lock(&state->lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&state->space_cond, &state->lock, &ts);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	if (ret < 0)
+		pthread_rwlock_unlock(&state->io_lock);
+	return ret;
+}
+
+static void lsf_wrote(struct lsf_state *state, uint32_t slot, uint32_t nr)
+{
+	struct lsf_seg *seg = &state->segs[slot];
+
+	seg->flush_dirty = true;
+	seg->ckpt_dirty = true;
+	state->written_since_ckpt += (uint64_t)nr * state->block_size;
+	if (state->written_since_ckpt >= state->ckpt_interval)
+		pthread_cond_signal(&state->gc_cond);
+}
+
+static int lsf_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	uint32_t bs = state->block_size;
+	uint64_t lba = offset / bs, seq;
+	uint32_t nr = length / bs, done = 0, slot, blk, i;
+	struct lsf_summary *sums;
+	void *buf;
+	int n, ret = TCMU_STS_OK;
+
+	buf = malloc(length);
+	sums = calloc(min(nr, state->seg_blocks), sizeof(*sums));
+	if (!buf || !sums) {
+		ret = TCMU_STS_NO_RESOURCE;
+		goto free_buf;
+	}
+	tcmu_memcpy_from_iovec(buf, length, iov, iov_cnt);
+
+	while (done < nr) {
+		n = lsf_alloc_wait(state, nr - done, &slot, &blk, &seq);
+		if (n < 0) {
+			tcmu_dev_err(dev, "Could not allocate log space: %d\n",
+				     n);
+			ret = n == -ENOSPC ? TCMU_STS_NO_RESOURCE :
+					     TCMU_STS_WR_ERR;
+			goto free_buf;
+		}
+
+		for (i = 0; i < n; i++) {
+			sums[i].lba = lba + done + i;
+			sums[i].seq = seq;
+			sums[i].nr_blocks = 1;
+			sums[i].flags = 0;
+			sums[i].csum = lsf_csum(buf + (size_t)(done + i) * bs,
+						bs, sums[i].lba ^ seq);
+		}
+
+		if (lsf_write_blocks(state, slot, blk,
+				     buf + (size_t)done * bs, n, sums)) {
+			tcmu_dev_err(dev, "Could not write to segment %u: %m\n",
+				     slot);
+			pthread_rwlock_unlock(&state->io_lock);
+			ret = TCMU_STS_WR_ERR;
+			goto free_buf;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		for (i = 0; i < n; i++) {
+			if (lsf_map(state, lba + done + i,
+				    LSF_LOC(slot, blk + i)))
+				ret = TCMU_STS_NO_RESOURCE;
+		}
+		lsf_wrote(state, slot, n);
+		state->user_blocks += n;
+		pthread_mutex_unlock(&state->lock);
+		pthread_rwlock_unlock(&state->io_lock);
+
+		if (ret)
+			goto free_buf;
+		done += n;
+	}
+
+free_buf:
+	free(sums);
+	free(buf);
+	return ret;
+}
+
+static int lsf_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		    struct iovec *iov, size_t iov_cnt, size_t length,
+		    off_t offset)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	uint32_t bs = state->block_size;
+	uint64_t lba = offset / bs, loc;
+	uint32_t nr = length / bs, i = 0, run;
+	void *buf;
+	int ret = TCMU_STS_OK;
+
+	buf = malloc(length);
+	if (!buf)
+		return TCMU_STS_NO_RESOURCE;
+
+	pthread_rwlock_rdlock(&state->io_lock);
+	while (i < nr) {
+		/* read runs of blocks that are next to each other in the log */
+		pthread_mutex_lock(&state->lock);
+		loc = lsf_radix_get(&state->index, lba + i);
+		for (run = 1; i + run < nr; run++) {
+			uint64_t next = lsf_radix_get(&state->index,
+						      lba + i + run);
+
+			if (loc ? next != loc + run : next != 0)
+				break;
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		if (!loc) {
+			memset(buf + (size_t)i * bs, 0, (size_t)run * bs);
+		} else if (lsf_pread(state->segs[LSF_LOC_SLOT(loc)].fd,
+				     buf + (size_t)i * bs, (size_t)run * bs,
+				     lsf_data_off(state, LSF_LOC_BLOCK(loc)))) {
+			tcmu_dev_err(dev, "Could not read from segment %u: %m\n",
+				     LSF_LOC_SLOT(loc));
+			ret = TCMU_STS_RD_ERR;
+			break;
+		}
+		i += run;
+	}
+	pthread_rwlock_unlock(&state->io_lock);
+
+	if (!ret)
+		tcmu_memcpy_into_iovec(iov, iov_cnt, buf, length);
+	free(buf);
+	return ret;
+}
+
+static int lsf_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     uint64_t off, uint64_t len)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	uint64_t lba = off / state->block_size, i, seq;
+	uint32_t nr = len / state->block_size, slot, blk;
+	struct lsf_summary sum;
+	int n;
+
+	/* the TRIM record takes a block, so there must be space for it */
+	n = lsf_alloc_wait(state, 1, &slot, &blk, &seq);
+	if (n < 0)
+		return n == -ENOSPC ? TCMU_STS_NO_RESOURCE : TCMU_STS_WR_ERR;
+
+	memset(&sum, 0, sizeof(sum));
+	sum.lba = lba;
+	sum.seq = seq;
+	sum.nr_blocks = nr;
+	sum.flags = LSF_SUMMARY_TRIM;
+	sum.csum = lsf_csum(NULL, 0, lba ^ seq);
+	if (lsf_write_blocks(state, slot, blk, NULL, 1, &sum)) {
+		tcmu_dev_err(dev, "Could not write to segment %u: %m\n", slot);
+		pthread_rwlock_unlock(&state->io_lock);
+		return TCMU_STS_WR_ERR;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	for (i = 0; i < nr; i++)
+		lsf_map(state, lba + i, 0);
+	lsf_wrote(state, slot, 1);
+	pthread_mutex_unlock(&state->lock);
+	pthread_rwlock_unlock(&state->io_lock);
+
+	return TCMU_STS_OK;
+}
+
+static int lsf_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	int ret = TCMU_STS_OK;
+	uint32_t i;
+	bool dirty;
+
+	pthread_rwlock_rdlock(&state->io_lock);
+	for (i = 0; i < state->nr_segs; i++) {
+		pthread_mutex_lock(&state->lock);
+		dirty = state->segs[i].flush_dirty;
+		state->segs[i].flush_dirty = false;
+		pthread_mutex_unlock(&state->lock);
+
+		if (!dirty)
+			continue;
+
+		if (fdatasync(state->segs[i].fd)) {
+			tcmu_dev_err(dev, "Could not sync segment %u: %m\n", i);
+			pthread_mutex_lock(&state->lock);
+			state->segs[i].flush_dirty = true;
+			pthread_mutex_unlock(&state->lock);
+			ret = TCMU_STS_WR_ERR;
+		}
+	}
+	pthread_rwlock_unlock(&state->io_lock);
+
+	return ret;
+}
+
+struct lsf_ckpt_dump {
+	struct lsf_ckpt_run *runs;
+	uint64_t nr_runs;
+	uint64_t max_runs;
+};
+
+static int lsf_ckpt_add(uint64_t lba, uint64_t loc, void *data)
+{
+	struct lsf_ckpt_dump *dump = data;
+	struct lsf_ckpt_run *run;
+
+	if (dump->nr_runs) {
+		run = &dump->runs[dump->nr_runs - 1];
+		if (run->lba + run->count == lba && run->loc + run->count == loc) {
+			run->count++;
+			return 0;
+		}
+	}
+
+	if (dump->nr_runs == dump->max_runs) {
+		uint64_t max = dump->max_runs ? dump->max_runs * 2 : 1024;
+
+		run = realloc(dump->runs, max * sizeof(*run));
+		if (!run)
+			return -ENOMEM;
+		dump->runs = run;
+		dump->max_runs = max;
+	}
+
+	run = &dump->runs[dump->nr_runs++];
+	run->lba = lba;
+	run->loc = loc;
+	run->count = 1;
+	return 0;
+}
+
+/*
+ * Write the index to the checkpoint file, then release the segments
+ * that were cleaned before it was taken.
+ */
+static int lsf_checkpoint(struct tcmu_device *dev)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	struct lsf_ckpt_dump dump = { 0 };
+	struct lsf_ckpt_hdr hdr;
+	uint32_t *sync_segs, *cleaned, nr_sync = 0, nr_cleaned = 0, i;
+	int fd, ret;
+
+	sync_segs = calloc(state->nr_segs, sizeof(*sync_segs));
+	cleaned = calloc(state->nr_segs, sizeof(*cleaned));
+	if (!sync_segs || !cleaned) {
+		ret = -ENOMEM;
+		goto free_lists;
+	}
+
+	/* no writes may be in flight, their blocks would be missed */
+	pthread_rwlock_wrlock(&state->io_lock);
+	pthread_mutex_lock(&state->lock);
+	ret = lsf_radix_walk(&state->index, lsf_ckpt_add, &dump);
+	if (ret) {
+		pthread_mutex_unlock(&state->lock);
+		pthread_rwlock_unlock(&state->io_lock);
+		goto free_lists;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LSF_CKPT_MAGIC;
+	hdr.version = LSF_VERSION;
+	hdr.block_size = state->block_size;
+	hdr.seg_size = state->seg_size;
+	hdr.seq = state->seq - 1;
+	hdr.nr_runs = dump.nr_runs;
+
+	for (i = 0; i < state->nr_segs; i++) {
+		if (state->segs[i].ckpt_dirty) {
+			state->segs[i].ckpt_dirty = false;
+			sync_segs[nr_sync++] = i;
+		}
+		if (state->segs[i].state == LSF_SEG_CLEANED)
+			cleaned[nr_cleaned++] = i;
+	}
+	state->written_since_ckpt = 0;
+	pthread_mutex_unlock(&state->lock);
+	pthread_rwlock_unlock(&state->io_lock);
+
+	/* everything the checkpoint points to must be stable first */
+	for (i = 0; i < nr_sync; i++) {
+		if (fdatasync(state->segs[sync_segs[i]].fd)) {
+			ret = -errno;
+			goto redirty;
+		}
+	}
+
+	hdr.csum = lsf_csum(dump.runs, dump.nr_runs * sizeof(*dump.runs),
+			    hdr.seq);
+
+	fd = openat(state->dir_fd, LSF_CKPT_TMP_NAME,
+		    O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		ret = -errno;
+		goto redirty;
+	}
+
+	ret = lsf_pwrite(fd, &hdr, sizeof(hdr), 0);
+	if (!ret)
+		ret = lsf_pwrite(fd, dump.runs,
+				 dump.nr_runs * sizeof(*dump.runs),
+				 sizeof(hdr));
+	if (!ret && fdatasync(fd))
+		ret = -errno;
+	close(fd);
+	if (ret)
+		goto redirty;
+
+	if (renameat(state->dir_fd, LSF_CKPT_TMP_NAME, state->dir_fd,
+		     LSF_CKPT_NAME) || fsync(state->dir_fd)) {
+		ret = -errno;
+		goto redirty;
+	}
+
+	pthread_rwlock_wrlock(&state->io_lock);
+	pthread_mutex_lock(&state->lock);
+	state->ckpt_seq = hdr.seq;
+	for (i = 0; i < nr_cleaned; i++) {
+		struct lsf_seg *seg = &state->segs[cleaned[i]];
+		char name[32];
+
+		snprintf(name, sizeof(name), "seg-%06u", cleaned[i]);
+		close(seg->fd);
+		unlinkat(state->dir_fd, name, 0);
+		seg->fd = -1;
+		seg->state = LSF_SEG_FREE;
+		state->nr_free++;
+	}
+	pthread_cond_broadcast(&state->space_cond);
+	pthread_mutex_unlock(&state->lock);
+	pthread_rwlock_unlock(&state->io_lock);
+
+	tcmu_dev_dbg(dev, "Checkpoint at seq %"PRIu64": %"PRIu64" runs, %u segments freed\n",
+		     hdr.seq, dump.nr_runs, nr_cleaned);
+	goto free_lists;
+
+redirty:
+	tcmu_dev_err(dev, "Could not write checkpoint: %d\n", ret);
+	pthread_mutex_lock(&state->lock);
+	for (i = 0; i < nr_sync; i++)
+		state->segs[sync_segs[i]].ckpt_dirty = true;
+	pthread_mutex_unlock(&state->lock);
+free_lists:
+	free(dump.runs);
+	free(cleaned);
+	free(sync_segs);
+	return ret;
+}
+
+/*
+ * Pick the full segment where cleaning frees the most space for the
+ * least copying, favoring segments that have not been written for a
+ * while since their data is unlikely to die on its own.
+ *
+ * Caller holds state->lock.
+ */
+static int lsf_gc_pick(struct lsf_state *state)
+{
+	time_t now = time(NULL);
+	double score, best_score = 0;
+	int best = -1;
+	uint32_t i;
+
+	for (i = 0; i < state->nr_segs; i++) {
+		struct lsf_seg *seg = &state->segs[i];
+		double u;
+
+		if (seg->state != LSF_SEG_FULL || seg->live >= state->seg_blocks)
+			continue;
+
+		u = (double)seg->live / state->seg_blocks;
+		score = (1 - u) * (now - seg->mtime + 1) / (1 + u);
+		if (score > best_score) {
+			best_score = score;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/* Copy a batch of live blocks of a victim to the cold segment. */
+static int lsf_gc_copy(struct lsf_state *state, uint32_t victim,
+		       struct lsf_summary *batch, uint32_t *blks, uint32_t nr,
+		       void *buf)
+{
+	uint32_t bs = state->block_size, done = 0, slot, blk, i;
+	int fd = state->segs[victim].fd;
+	int n, ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = lsf_pread(fd, buf + (size_t)i * bs, bs,
+				lsf_data_off(state, blks[i]));
+		if (ret)
+			return ret;
+		batch[i].flags |= LSF_SUMMARY_GC;
+	}
+
+	while (done < nr) {
+		pthread_rwlock_rdlock(&state->io_lock);
+		pthread_mutex_lock(&state->lock);
+		n = lsf_alloc(state, true, nr - done, &slot, &blk);
+		pthread_mutex_unlock(&state->lock);
+		if (n < 0) {
+			pthread_rwlock_unlock(&state->io_lock);
+			return n;
+		}
+
+		ret = lsf_write_blocks(state, slot, blk,
+				       buf + (size_t)done * bs, n,
+				       &batch[done]);
+		if (ret) {
+			pthread_rwlock_unlock(&state->io_lock);
+			return ret;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		for (i = 0; i < n; i++) {
+			/* skip blocks overwritten while they were copied */
+			if (lsf_radix_get(&state->index, batch[done + i].lba) !=
+			    LSF_LOC(victim, blks[done + i]))
+				continue;
+			lsf_map(state, batch[done + i].lba,
+				LSF_LOC(slot, blk + i));
+			state->gc_blocks++;
+		}
+		lsf_wrote(state, slot, n);
+		pthread_mutex_unlock(&state->lock);
+		pthread_rwlock_unlock(&state->io_lock);
+
+		done += n;
+	}
+
+	return 0;
+}
+
+static int lsf_gc_segment(struct tcmu_device *dev, uint32_t victim)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	struct lsf_seg *seg = &state->segs[victim];
+	struct lsf_summary *sums, *batch;
+	uint32_t *blks, i, nr = 0;
+	void *buf;
+	int ret;
+
+	sums = malloc(state->seg_blocks * sizeof(*sums));
+	batch = malloc(LSF_GC_BATCH * sizeof(*batch));
+	blks = malloc(LSF_GC_BATCH * sizeof(*blks));
+	buf = malloc((size_t)LSF_GC_BATCH * state->block_size);
+	if (!sums || !batch || !blks || !buf) {
+		ret = -ENOMEM;
+		goto free_bufs;
+	}
+
+	ret = lsf_pread(seg->fd, sums, seg->next_blk * sizeof(*sums),
+			lsf_summary_off(0));
+	if (ret)
+		goto free_bufs;
+
+	for (i = 0; i < seg->next_blk; i++) {
+		bool live;
+
+		if (!sums[i].seq || sums[i].flags & LSF_SUMMARY_TRIM)
+			continue;
+
+		pthread_mutex_lock(&state->lock);
+		live = lsf_radix_get(&state->index, sums[i].lba) ==
+			LSF_LOC(victim, i);
+		pthread_mutex_unlock(&state->lock);
+		if (!live)
+			continue;
+
+		batch[nr] = sums[i];
+		blks[nr++] = i;
+		if (nr == LSF_GC_BATCH) {
+			ret = lsf_gc_copy(state, victim, batch, blks, nr, buf);
+			if (ret)
+				goto free_bufs;
+			nr = 0;
+		}
+	}
+
+	if (nr) {
+		ret = lsf_gc_copy(state, victim, batch, blks, nr, buf);
+		if (ret)
+			goto free_bufs;
+	}
+
+free_bufs:
+	pthread_mutex_lock(&state->lock);
+	if (!ret && !seg->live) {
+		seg->state = LSF_SEG_CLEANED;
+		state->gc_segs++;
+	} else {
+		if (!ret)
+			tcmu_dev_warn(dev, "Segment %u still has %u live blocks after cleaning\n",
+				      victim, seg->live);
+		seg->state = LSF_SEG_FULL;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	free(buf);
+	free(blks);
+	free(batch);
+	free(sums);
+	return ret;
+}
+
+static void *lsf_gc_thread(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	uint32_t low = LSF_RESERVED_SEGS + 2, high, cleaned = 0;
+	struct timespec ts;
+	bool ckpt;
+	int victim;
+
+	/* clean in batches, the segments are only freed by a checkpoint */
+	high = max(low * 2, state->nr_segs / 16);
+
+	pthread_mutex_lock(&state->lock);
+	while (!state->stop) {
+		victim = -1;
+		if (state->nr_free + cleaned < high &&
+		    (state->nr_free < low || cleaned))
+			victim = lsf_gc_pick(state);
+
+		if (victim >= 0) {
+			state->segs[victim].state = LSF_SEG_CLEANING;
+			pthread_mutex_unlock(&state->lock);
+
+			if (lsf_gc_segment(dev, victim))
+				tcmu_dev_err(dev, "Could not clean segment %d\n",
+					     victim);
+			else
+				cleaned++;
+
+			pthread_mutex_lock(&state->lock);
+			continue;
+		}
+
+		ckpt = cleaned ||
+			state->written_since_ckpt >= state->ckpt_interval;
+		if (ckpt) {
+			pthread_mutex_unlock(&state->lock);
+			if (!lsf_checkpoint(dev) && cleaned) {
+				tcmu_dev_dbg(dev, "Cleaned %u segments, write amplification %.2f\n",
+					     cleaned,
+					     (double)(state->user_blocks +
+						      state->gc_blocks) /
+					     max(state->user_blocks,
+						 (uint64_t)1));
+				cleaned = 0;
+			}
+			pthread_mutex_lock(&state->lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&state->gc_cond, &state->lock, &ts);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+static int lsf_load_checkpoint(struct tcmu_device *dev)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	struct lsf_ckpt_run *runs = NULL;
+	struct lsf_ckpt_hdr hdr;
+	uint64_t i, j;
+	int fd, ret;
+
+	fd = openat(state->dir_fd, LSF_CKPT_NAME, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		return -errno;
+	}
+
+	ret = lsf_pread(fd, &hdr, sizeof(hdr), 0);
+	if (ret)
+		goto close_fd;
+
+	if (hdr.magic != LSF_CKPT_MAGIC || hdr.version != LSF_VERSION ||
+	    hdr.block_size != state->block_size ||
+	    hdr.seg_size != state->seg_size) {
+		tcmu_dev_err(dev, "Checkpoint does not match the device (block size %u, segment size %"PRIu64")\n",
+			     hdr.block_size, hdr.seg_size);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	runs = malloc(max(hdr.nr_runs, (uint64_t)1) * sizeof(*runs));
+	if (!runs) {
+		ret = -ENOMEM;
+		goto close_fd;
+	}
+
+	ret = lsf_pread(fd, runs, hdr.nr_runs * sizeof(*runs), sizeof(hdr));
+	if (ret)
+		goto free_runs;
+
+	if (lsf_csum(runs, hdr.nr_runs * sizeof(*runs), hdr.seq) != hdr.csum) {
+		tcmu_dev_err(dev, "Checkpoint is corrupted\n");
+		ret = -EINVAL;
+		goto free_runs;
+	}
+
+	for (i = 0; i < hdr.nr_runs; i++) {
+		for (j = 0; j < runs[i].count; j++) {
+			ret = lsf_radix_set(&state->index, runs[i].lba + j,
+					    runs[i].loc + j);
+			if (ret)
+				goto free_runs;
+		}
+	}
+	state->ckpt_seq = hdr.seq;
+	state->seq = hdr.seq + 1;
+
+free_runs:
+	free(runs);
+close_fd:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Apply the summary entries of a segment that are newer than the
+ * checkpoint. seqs holds the sequence number each LBA was last
+ * replayed from.
+ */
+static int lsf_replay_segment(struct tcmu_device *dev, uint32_t slot,
+			      struct lsf_radix *seqs)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	struct lsf_seg *seg = &state->segs[slot];
+	uint32_t bs = state->block_size, i;
+	struct lsf_summary *sums, *s;
+	uint64_t lba, replayed = 0;
+	void *buf;
+	int ret;
+
+	sums = malloc(state->seg_blocks * sizeof(*sums));
+	buf = malloc(bs);
+	if (!sums || !buf) {
+		ret = -ENOMEM;
+		goto free_bufs;
+	}
+
+	ret = lsf_pread(seg->fd, sums, state->seg_blocks * sizeof(*sums),
+			lsf_summary_off(0));
+	if (ret)
+		goto free_bufs;
+
+	for (i = 0; i < state->seg_blocks; i++) {
+		s = &sums[i];
+		if (!s->seq)
+			continue;
+		/* the segment is never handed out again below this */
+		seg->next_blk = i + 1;
+
+		if (s->seq <= state->ckpt_seq)
+			continue;
+		if (s->seq >= state->seq)
+			state->seq = s->seq + 1;
+
+		if (s->flags & LSF_SUMMARY_TRIM) {
+			if (lsf_csum(NULL, 0, s->lba ^ s->seq) != s->csum)
+				continue;
+
+			for (lba = s->lba; lba < s->lba + s->nr_blocks; lba++) {
+				if (lsf_radix_get(seqs, lba) >= s->seq)
+					continue;
+				if (lsf_radix_set(seqs, lba, s->seq) ||
+				    lsf_radix_set(&state->index, lba, 0)) {
+					ret = -ENOMEM;
+					goto free_bufs;
+				}
+			}
+			replayed++;
+			continue;
+		}
+
+		if (lsf_radix_get(seqs, s->lba) >= s->seq)
+			continue;
+
+		/* blocks whose write did not complete are dropped */
+		ret = lsf_pread(seg->fd, buf, bs, lsf_data_off(state, i));
+		if (ret)
+			goto free_bufs;
+		if (lsf_csum(buf, bs, s->lba ^ s->seq) != s->csum)
+			continue;
+
+		if (lsf_radix_set(seqs, s->lba, s->seq) ||
+		    lsf_radix_set(&state->index, s->lba, LSF_LOC(slot, i))) {
+			ret = -ENOMEM;
+			goto free_bufs;
+		}
+		replayed++;
+	}
+
+	if (replayed)
+		tcmu_dev_dbg(dev, "Replayed %"PRIu64" entries from segment %u\n",
+			     replayed, slot);
+free_bufs:
+	free(buf);
+	free(sums);
+	return ret;
+}
+
+static int lsf_count_live(uint64_t lba, uint64_t loc, void *data)
+{
+	struct lsf_state *state = data;
+	uint32_t slot = LSF_LOC_SLOT(loc);
+
+	if (slot >= state->nr_segs || state->segs[slot].state == LSF_SEG_FREE)
+		return -ENOENT;
+	state->segs[slot].live++;
+	return 0;
+}
+
+static int lsf_recover(struct tcmu_device *dev)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	struct lsf_radix seqs = { 0 };
+	struct lsf_seg_hdr hdr;
+	struct dirent *dent;
+	unsigned int slot;
+	uint32_t i, nr_segs = 0;
+	DIR *dir;
+	int fd, ret;
+
+	ret = lsf_load_checkpoint(dev);
+	if (ret)
+		return ret;
+
+	ret = lsf_radix_grow(&seqs, tcmu_dev_get_num_lbas(dev));
+	if (ret)
+		return ret;
+
+	fd = dup(state->dir_fd);
+	dir = fd == -1 ? NULL : fdopendir(fd);
+	if (!dir) {
+		ret = -errno;
+		if (fd != -1)
+			close(fd);
+		return ret;
+	}
+
+	while ((dent = readdir(dir))) {
+		if (sscanf(dent->d_name, "seg-%u", &slot) != 1)
+			continue;
+
+		ret = lsf_grow_segs(state, slot + 1);
+		if (ret)
+			goto close_dir;
+
+		fd = openat(state->dir_fd, dent->d_name, O_RDWR);
+		if (fd == -1) {
+			ret = -errno;
+			goto close_dir;
+		}
+
+		if (lsf_pread(fd, &hdr, sizeof(hdr), 0) ||
+		    hdr.magic != LSF_SEG_MAGIC || hdr.slot != slot ||
+		    hdr.block_size != state->block_size ||
+		    hdr.seg_size != state->seg_size) {
+			tcmu_dev_err(dev, "%s is not a valid segment\n",
+				     dent->d_name);
+			close(fd);
+			ret = -EINVAL;
+			goto close_dir;
+		}
+
+		state->segs[slot].fd = fd;
+		state->segs[slot].state = LSF_SEG_FULL;
+		state->segs[slot].mtime = time(NULL);
+		state->nr_free--;
+		nr_segs++;
+
+		ret = lsf_replay_segment(dev, slot, &seqs);
+		if (ret)
+			goto close_dir;
+	}
+
+	ret = lsf_radix_walk(&state->index, lsf_count_live, state);
+	if (ret) {
+		tcmu_dev_err(dev, "Index references a missing segment\n");
+		goto close_dir;
+	}
+
+	/*
+	 * Checkpoint what was replayed so empty segments can be freed
+	 * and the partly written ones are never appended to again.
+	 */
+	state->written_since_ckpt = 0;
+	for (i = 0; i < state->nr_segs; i++) {
+		if (state->segs[i].state != LSF_SEG_FULL)
+			continue;
+		state->segs[i].ckpt_dirty = true;
+		if (!state->segs[i].live)
+			state->segs[i].state = LSF_SEG_CLEANED;
+	}
+
+	ret = lsf_checkpoint(dev);
+	if (ret)
+		goto close_dir;
+
+	tcmu_dev_info(dev, "Recovered %u segments, %u free, log at seq %"PRIu64"\n",
+		      nr_segs, state->nr_free, state->seq);
+close_dir:
+	closedir(dir);
+	lsf_radix_free(&seqs);
+	return ret;
+}
+
+static int lsf_parse_config(struct tcmu_device *dev, struct lsf_state *state)
+{
+	char *config, *opt;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	state->seg_size = LSF_DEF_SEG_SIZE;
+	state->overprov = LSF_DEF_OVERPROV;
+	state->ckpt_interval = LSF_DEF_CKPT_INTERVAL;
+
+	state->dir = strdup(strtok(config, ";") ? : "");
+	if (!state->dir || !strlen(state->dir)) {
+		tcmu_dev_err(dev, "Could not get directory\n");
+		free(config);
+		return -EINVAL;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "seg_size=", 9))
+			state->seg_size = strtoull(opt + 9, NULL, 0);
+		else if (!strncmp(opt, "overprov=", 9))
+			state->overprov = strtoul(opt + 9, NULL, 0);
+		else if (!strncmp(opt, "ckpt_interval=", 14))
+			state->ckpt_interval = strtoull(opt + 14, NULL, 0);
+		else
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+	}
+	free(config);
+
+	if (state->seg_size < LSF_MIN_SEG_SIZE ||
+	    state->seg_size % LSF_SEG_HDR_LEN) {
+		tcmu_dev_err(dev, "seg_size must be a multiple of %u and at least %llu\n",
+			     LSF_SEG_HDR_LEN, LSF_MIN_SEG_SIZE);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int lsf_open(struct tcmu_device *dev, bool reopen)
+{
+	struct lsf_state *state;
+	uint64_t summary_len;
+	int ret;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	state->dir_fd = -1;
+	state->hot = state->cold = -1;
+	state->seq = 1;
+	tcmur_dev_set_private(dev, state);
+
+	ret = lsf_parse_config(dev, state);
+	if (ret)
+		goto free_state;
+
+	state->block_size = tcmu_dev_get_block_size(dev);
+	if (state->block_size % sizeof(uint64_t)) {
+		ret = -EINVAL;
+		goto free_state;
+	}
+
+	/* fit the summary and the data blocks it describes */
+	state->seg_blocks = (state->seg_size - LSF_SEG_HDR_LEN) /
+				(state->block_size + sizeof(struct lsf_summary));
+	for (;;) {
+		summary_len = round_up(state->seg_blocks *
+					sizeof(struct lsf_summary),
+				       state->block_size);
+		if (LSF_SEG_HDR_LEN + summary_len +
+		    (uint64_t)state->seg_blocks * state->block_size <=
+		    state->seg_size)
+			break;
+		state->seg_blocks--;
+	}
+	state->data_off = LSF_SEG_HDR_LEN + summary_len;
+
+	if (mkdir(state->dir, 0700) && errno != EEXIST) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not create %s: %m\n", state->dir);
+		goto free_state;
+	}
+
+	state->dir_fd = open(state->dir, O_RDONLY | O_DIRECTORY);
+	if (state->dir_fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s: %m\n", state->dir);
+		goto free_state;
+	}
+
+	ret = pthread_rwlock_init(&state->io_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto close_dir;
+	}
+
+	ret = pthread_mutex_init(&state->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_io_lock;
+	}
+
+	ret = pthread_cond_init(&state->gc_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_cond_init(&state->space_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_gc_cond;
+	}
+
+	ret = lsf_radix_grow(&state->index, tcmu_dev_get_num_lbas(dev));
+	if (ret)
+		goto free_segs;
+
+	ret = lsf_grow_segs(state, lsf_nr_segs(state,
+					       tcmu_dev_get_num_lbas(dev)));
+	if (ret)
+		goto free_segs;
+
+	ret = lsf_recover(dev);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not recover log in %s: %d\n",
+			     state->dir, ret);
+		goto free_segs;
+	}
+
+	ret = pthread_create(&state->gc_thread, NULL, lsf_gc_thread, dev);
+	if (ret) {
+		ret = -ret;
+		goto free_segs;
+	}
+
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+	tcmu_dev_dbg(dev, "config %s, %u segments of %u blocks\n",
+		     tcmu_dev_get_cfgstring(dev), state->nr_segs,
+		     state->seg_blocks);
+	return 0;
+
+free_segs:
+	while (state->nr_segs--) {
+		if (state->segs[state->nr_segs].fd != -1)
+			close(state->segs[state->nr_segs].fd);
+	}
+	free(state->segs);
+	lsf_radix_free(&state->index);
+	pthread_cond_destroy(&state->space_cond);
+destroy_gc_cond:
+	pthread_cond_destroy(&state->gc_cond);
+destroy_lock:
+	pthread_mutex_destroy(&state->lock);
+destroy_io_lock:
+	pthread_rwlock_destroy(&state->io_lock);
+close_dir:
+	close(state->dir_fd);
+free_state:
+	free(state->dir);
+	free(state);
+	return ret;
+}
+
+static void lsf_close(struct tcmu_device *dev)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	uint32_t i;
+
+	pthread_mutex_lock(&state->lock);
+	state->stop = true;
+	pthread_cond_signal(&state->gc_cond);
+	pthread_mutex_unlock(&state->lock);
+	pthread_join(state->gc_thread, NULL);
+
+	/* saves replaying on the next open */
+	if (lsf_checkpoint(dev))
+		tcmu_dev_warn(dev, "Log will be replayed on the next open\n");
+
+	for (i = 0; i < state->nr_segs; i++) {
+		if (state->segs[i].fd != -1)
+			close(state->segs[i].fd);
+	}
+	free(state->segs);
+	lsf_radix_free(&state->index);
+	pthread_cond_destroy(&state->space_cond);
+	pthread_cond_destroy(&state->gc_cond);
+	pthread_mutex_destroy(&state->lock);
+	pthread_rwlock_destroy(&state->io_lock);
+	close(state->dir_fd);
+	free(state->dir);
+	free(state);
+}
+
+static int lsf_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
+{
+	struct lsf_state *state = tcmur_dev_get_private(dev);
+	uint64_t num_lbas;
+	int ret;
+
+	switch (cfg->type) {
+	case TCMULIB_CFG_DEV_SIZE:
+		num_lbas = cfg->data.dev_size / state->block_size;
+
+		pthread_rwlock_wrlock(&state->io_lock);
+		pthread_mutex_lock(&state->lock);
+		ret = lsf_radix_grow(&state->index, num_lbas);
+		if (!ret)
+			ret = lsf_grow_segs(state,
+					    lsf_nr_segs(state, num_lbas));
+		pthread_mutex_unlock(&state->lock);
+		pthread_rwlock_unlock(&state->io_lock);
+		return ret;
+	case TCMULIB_CFG_DEV_CFGSTR:
+	case TCMULIB_CFG_WRITE_CACHE:
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char lsf_cfg_desc[] =
+	"Directory for the log segments, with optional ;seg_size=bytes, "
+	";overprov=percent and ;ckpt_interval=bytes settings.";
+
+static struct tcmur_handler lsf_handler = {
+	.cfg_desc = lsf_cfg_desc,
+
+	.reconfig = lsf_reconfig,
+
+	.open = lsf_open,
+	.close = lsf_close,
+	.read = lsf_read,
+	.write = lsf_write,
+	.flush = lsf_flush,
+	.unmap = lsf_unmap,
+	.name = "Log-structured File Handler",
+	.subtype = "lsf",
+	.nr_threads = 4,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&lsf_handler);
+}
@@ -43,6 +43,13 @@
 #include "tcmur_aio.h"
 #include "tcmur_device.h"
 #include "tcmur_cmd_handler.h"
+#include "tcmur_cbt.h"
+#include "tcmur_repl.h"
+#include "tcmur_affinity.h"
+#include "tcmur_resp_cache.h"
+#include "tcmur_cc.h"
+#include "tcmur_hedge.h"
+#include "tcmur_co.h"
 #include "libtcmu.h"
 #include "tcmuhandler-generated.h"
 #include "version.h"
@@ -243,6 +250,289 @@ on_check_config(TCMUService1 *interface,
 	return TRUE;
 }
 
+static gboolean
+on_export_changed_blocks(TCMUService1 *interface,
+			 GDBusMethodInvocation *invocation,
+			 gchar *dev_name,
+			 gchar *path,
+			 gboolean reset,
+			 gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmu_device *dev;
+	uint64_t generation = 0;
+	char *reason = NULL;
+	int ret;
+
+	dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (!dev || tcmu_get_runner_handler(dev) != handler) {
+		reason = g_strdup_printf("No %s device named %s",
+					 handler->subtype, dev_name);
+		goto done;
+	}
+
+	ret = tcmur_cbt_export(dev, path, reset, &generation);
+	if (ret == -ENOENT)
+		reason = g_strdup_printf("Changed block tracking is not enabled on %s",
+					 dev_name);
+	else if (ret)
+		reason = g_strdup_printf("Could not export changed blocks: %s",
+					 strerror(-ret));
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bts)", reason ? FALSE : TRUE, generation,
+				  reason ? : "success"));
+	g_free(reason);
+	return TRUE;
+}
+
+static gboolean
+on_get_replication_stats(TCMUService1 *interface,
+			 GDBusMethodInvocation *invocation,
+			 gchar *dev_name,
+			 gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmu_device *dev;
+	char *stats = NULL;
+	char *reason = NULL;
+	int ret;
+
+	dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (!dev || tcmu_get_runner_handler(dev) != handler) {
+		reason = g_strdup_printf("No %s device named %s",
+					 handler->subtype, dev_name);
+		goto done;
+	}
+
+	ret = tcmur_repl_get_stats(dev, &stats);
+	if (ret == -ENOENT)
+		reason = g_strdup_printf("Replication is not enabled on %s",
+					 dev_name);
+	else if (ret)
+		reason = g_strdup_printf("Could not get replication stats: %s",
+					 strerror(-ret));
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bs)", reason ? FALSE : TRUE,
+				  reason ? : stats));
+	g_free(reason);
+	free(stats);
+	return TRUE;
+}
+
+static gboolean
+on_get_resp_cache_stats(TCMUService1 *interface,
+			GDBusMethodInvocation *invocation,
+			gchar *dev_name,
+			gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmu_device *dev;
+	char *stats = NULL;
+	char *reason = NULL;
+	int ret;
+
+	dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (!dev || tcmu_get_runner_handler(dev) != handler) {
+		reason = g_strdup_printf("No %s device named %s",
+					 handler->subtype, dev_name);
+		goto done;
+	}
+
+	ret = tcmur_resp_cache_get_stats(dev, &stats);
+	if (ret)
+		reason = g_strdup_printf("Could not get response cache stats: %s",
+					 strerror(-ret));
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bs)", reason ? FALSE : TRUE,
+				  reason ? : stats));
+	g_free(reason);
+	free(stats);
+	return TRUE;
+}
+
+static gboolean
+on_get_cc_stats(TCMUService1 *interface,
+		GDBusMethodInvocation *invocation,
+		gchar *dev_name,
+		gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmu_device *dev;
+	char *stats = NULL;
+	char *reason = NULL;
+	int ret;
+
+	dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (!dev || tcmu_get_runner_handler(dev) != handler) {
+		reason = g_strdup_printf("No %s device named %s",
+					 handler->subtype, dev_name);
+		goto done;
+	}
+
+	ret = tcmur_cc_get_stats(dev, &stats);
+	if (ret)
+		reason = g_strdup_printf("Could not get congestion control stats: %s",
+					 strerror(-ret));
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bs)", reason ? FALSE : TRUE,
+				  reason ? : stats));
+	g_free(reason);
+	free(stats);
+	return TRUE;
+}
+
+static gboolean
+on_get_hedge_stats(TCMUService1 *interface,
+		   GDBusMethodInvocation *invocation,
+		   gchar *dev_name,
+		   gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmu_device *dev;
+	char *stats = NULL;
+	char *reason = NULL;
+	int ret;
+
+	dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+	if (!dev || tcmu_get_runner_handler(dev) != handler) {
+		reason = g_strdup_printf("No %s device named %s",
+					 handler->subtype, dev_name);
+		goto done;
+	}
+
+	ret = tcmur_hedge_get_stats(dev, &stats);
+	if (ret)
+		reason = g_strdup_printf("Could not get hedged read stats: %s",
+					 strerror(-ret));
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bs)", reason ? FALSE : TRUE,
+				  reason ? : stats));
+	g_free(reason);
+	free(stats);
+	return TRUE;
+}
+
+static gboolean
+on_set_tunable(TCMUService1 *interface,
+	       GDBusMethodInvocation *invocation,
+	       gchar *dev_name,
+	       gchar *name,
+	       gchar *value,
+	       gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tcmu_device *dev = NULL;
+	struct tcmu_tunable *tun;
+	char *reason = NULL;
+	int64_t val;
+	int ret;
+
+	tun = tcmu_find_tunable(name);
+	if (!tun) {
+		reason = g_strdup_printf("No tunable named %s", name);
+		goto done;
+	}
+
+	/* an empty device name changes the global value */
+	if (dev_name[0]) {
+		dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+		if (!dev || tcmu_get_runner_handler(dev) != handler) {
+			reason = g_strdup_printf("No %s device named %s",
+						 handler->subtype, dev_name);
+			goto done;
+		}
+	}
+
+	if (!strcmp(value, "default")) {
+		if (dev)
+			tcmur_dev_clear_tunable(dev, tun);
+		else
+			tcmu_set_tunable(tun, tun->def);
+		goto done;
+	}
+
+	ret = tcmu_parse_tunable(tun, value, &val);
+	if (ret) {
+		reason = g_strdup_printf("Invalid value %s for %s, valid range [%"PRId64", %"PRId64"]",
+					 value, name, tun->min, tun->max);
+		goto done;
+	}
+
+	if (dev)
+		tcmur_dev_set_tunable(dev, tun, val);
+	else
+		tcmu_set_tunable(tun, val);
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bs)", reason ? FALSE : TRUE,
+				  reason ? : "success"));
+	g_free(reason);
+	return TRUE;
+}
+
+struct tunables_dump {
+	struct tcmu_device *dev;
+	GString *str;
+};
+
+static void dump_tunable(struct tcmu_tunable *tun, void *data)
+{
+	struct tunables_dump *dump = data;
+	int64_t val;
+
+	if (dump->dev)
+		val = tcmur_dev_get_tunable(dump->dev, tun);
+	else
+		val = tcmu_get_tunable(tun);
+
+	g_string_append_printf(dump->str, "%s %"PRId64" (default %"PRId64", range [%"PRId64", %"PRId64"]) %s\n",
+			       tun->name, val, tun->def, tun->min, tun->max,
+			       tun->desc ? : "");
+}
+
+static gboolean
+on_get_tunables(TCMUService1 *interface,
+		GDBusMethodInvocation *invocation,
+		gchar *dev_name,
+		gpointer user_data)
+{
+	struct tcmur_handler *handler = user_data;
+	struct tunables_dump dump = { NULL, NULL };
+	char *reason = NULL;
+
+	if (dev_name[0]) {
+		dump.dev = tcmur_lookup_dev(tcmu_cfg->ctx, dev_name);
+		if (!dump.dev || tcmu_get_runner_handler(dump.dev) != handler) {
+			reason = g_strdup_printf("No %s device named %s",
+						 handler->subtype, dev_name);
+			goto done;
+		}
+	}
+
+	dump.str = g_string_new(NULL);
+	tcmu_for_each_tunable(dump_tunable, &dump);
+
+done:
+	g_dbus_method_invocation_return_value(invocation,
+		    g_variant_new("(bs)", reason ? FALSE : TRUE,
+				  reason ? : dump.str->str));
+	g_free(reason);
+	if (dump.str)
+		g_string_free(dump.str, TRUE);
+	return TRUE;
+}
+
 static void
 dbus_export_handler(struct tcmur_handler *handler, GCallback check_config)
 {
@@ -259,6 +549,34 @@ dbus_export_handler(struct tcmur_handler *handler, GCallback check_config)
 			 "handle-check-config",
 			 check_config,
 			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-export-changed-blocks",
+			 G_CALLBACK(on_export_changed_blocks),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-replication-stats",
+			 G_CALLBACK(on_get_replication_stats),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-resp-cache-stats",
+			 G_CALLBACK(on_get_resp_cache_stats),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-congestion-stats",
+			 G_CALLBACK(on_get_cc_stats),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-hedge-stats",
+			 G_CALLBACK(on_get_hedge_stats),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-set-tunable",
+			 G_CALLBACK(on_set_tunable),
+			 handler); /* user_data */
+	g_signal_connect(interface,
+			 "handle-get-tunables",
+			 G_CALLBACK(on_get_tunables),
+			 handler); /* user_data */
 	tcmuservice1_set_config_desc(interface, handler->cfg_desc);
 	g_dbus_object_manager_server_export(manager, G_DBUS_OBJECT_SKELETON(object));
 	g_object_unref(object);
@@ -612,8 +930,10 @@ static void tcmur_stop_device(void *arg)
 	}
 	pthread_mutex_unlock(&rdev->state_lock);
 
-	if (is_open)
+	if (is_open) {
+		tcmur_dev_set_polling(dev, false);
 		rhandler->close(dev);
+	}
 
 	pthread_mutex_lock(&rdev->state_lock);
 	rdev->flags |= TCMUR_DEV_FLAG_STOPPED;
@@ -624,7 +944,6 @@ static void tcmur_stop_device(void *arg)
 
 int tcmur_get_time(struct tcmu_device *dev, struct timespec *time)
 {
-	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
 	ret = clock_gettime(CLOCK_MONOTONIC_COARSE, time);
@@ -635,7 +954,7 @@ int tcmur_get_time(struct tcmu_device *dev, struct timespec *time)
 
 	tcmu_dev_err(dev, "Could not get time. Error %d. Command timeout feature disabled.\n",
 		     ret);
-	rdev->cmd_time_out = 0;
+	tcmur_dev_set_tunable(dev, &tcmur_cmd_time_out_tunable, 0);
 	return ret;
 }
 
@@ -644,10 +963,12 @@ static bool get_next_cmd_timeout(struct tcmu_device *dev,
 				 struct timespec *tmo)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int run_time, cmd_tmo = rdev->cmd_time_out;
+	int run_time, cmd_tmo;
 	struct tcmur_cmd *tcmur_cmd;
 	bool has_timeout = false;
 
+	cmd_tmo = tcmur_dev_get_tunable(dev, &tcmur_cmd_time_out_tunable);
+
 	if (!cmd_tmo)
 		return false;
 
@@ -682,16 +1003,20 @@ static bool get_next_cmd_timeout(struct tcmu_device *dev,
 	return has_timeout;
 }
 
+/* commands cancelled per check, the next check runs right away */
+#define TCMUR_MAX_CANCEL 32
+
 static void check_for_timed_out_cmds(struct tcmu_device *dev)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	int cmd_tmo = rdev->cmd_time_out;
 	struct tcmur_cmd *tcmur_cmd;
+	struct tcmur_cmd *cancel[TCMUR_MAX_CANCEL];
 	struct timespec curr_time;
 	struct tcmulib_cmd *cmd;
-	int run_time;
-	uint8_t *cdb;
+	int run_time, cmd_tmo, i, nr_cancel = 0;
+	bool completed = false;
 
+	cmd_tmo = tcmur_dev_get_tunable(dev, &tcmur_cmd_time_out_tunable);
 	if (!cmd_tmo)
 		return;
 
@@ -710,26 +1035,56 @@ static void check_for_timed_out_cmds(struct tcmu_device *dev)
 		if (run_time < cmd_tmo)
 			continue;
 
+		if (nr_cancel == TCMUR_MAX_CANCEL)
+			break;
+
 		cmd = tcmur_cmd->lib_cmd;
 
 		if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD) {
 			tcmu_cdb_print_info(dev, cmd, "timed out.");
 		} else {
-			cdb = cmd->cdb;
 			tcmu_dev_info(dev, "Command %hu SCSI CDB 0x%x at LBA %"PRIu64" for %u blocks timed out.\n",
-				      cmd->cmd_id, cdb[0],
-				      tcmu_cdb_get_lba(cdb),
-				      tcmu_cdb_get_xfer_length(cdb));
+				      cmd->cmd_id, cmd->cdb[0], cmd->lba,
+				      cmd->xfer_len);
 		}
 
 		tcmur_cmd->timed_out = true;
+		tcmur_cmd->cancelling = true;
+		cancel[nr_cancel++] = tcmur_cmd;
 	}
 	pthread_spin_unlock(&rdev->lock);
+
+	if (!nr_cancel)
+		return;
+
+	/*
+	 * Drop work the io work queue has not started and let the handler
+	 * abort the rest, so it does not compete with new commands once
+	 * the backend recovers. Commands completing meanwhile are only
+	 * returned to the kernel below, so they stay valid.
+	 */
+	for (i = 0; i < nr_cancel; i++)
+		tcmur_cmd_cancel(dev, cancel[i]);
+
+	pthread_spin_lock(&rdev->lock);
+	for (i = 0; i < nr_cancel; i++) {
+		tcmur_cmd = cancel[i];
+		tcmur_cmd->cancelling = false;
+		if (tcmur_cmd->cancel_done) {
+			tcmulib_command_complete(dev, tcmur_cmd->lib_cmd,
+						 tcmur_cmd->cancel_ret);
+			completed = true;
+		}
+	}
+	pthread_spin_unlock(&rdev->lock);
+
+	if (completed)
+		tcmulib_processing_complete(dev);
 }
 
 static void tcmur_tcmulib_cmd_start(struct tcmu_device *dev,
 				    struct tcmulib_cmd *cmd,
-				    struct timespec *curr_time)
+				    struct timespec *curr_time, int cmd_tmo)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
@@ -738,7 +1093,7 @@ static void tcmur_tcmulib_cmd_start(struct tcmu_device *dev,
 	tcmur_cmd->lib_cmd = cmd;
 	list_node_init(&tcmur_cmd->cmds_list_entry);
 
-	if (rdev->cmd_time_out) {
+	if (cmd_tmo) {
 		tcmur_cmd->start_time.tv_sec = curr_time->tv_sec;
 
 		pthread_spin_lock(&rdev->lock);
@@ -747,33 +1102,72 @@ static void tcmur_tcmulib_cmd_start(struct tcmu_device *dev,
 	}
 }
 
+/*
+ * With poll_spin_us set, keep reaping completions for up to that long
+ * while commands are in flight before sleeping, so ones completing soon
+ * are returned without a wakeup. Returns true if any were.
+ */
+static bool poll_completions_spin(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct timespec start, now;
+	int64_t spin_us;
+
+	spin_us = tcmur_dev_get_tunable(dev, &tcmur_poll_spin_us_tunable);
+	if (!spin_us ||
+	    !__atomic_load_n(&rdev->track_queue.tracked_aio_ops,
+			     __ATOMIC_RELAXED))
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (tcmur_dev_poll_completions(dev) > 0)
+			return true;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000 +
+		 (now.tv_nsec - start.tv_nsec) / 1000 < spin_us);
+
+	return false;
+}
+
 static void *tcmur_cmdproc_thread(void *arg)
 {
 	struct tcmu_device *dev = arg;
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
-	struct pollfd pfd;
+	struct timespec no_wait = { 0, 0 };
+	struct pollfd pfd[3];
 	int ret;
 	bool dev_stopping = false;
 
 	pthread_cleanup_push(tcmur_stop_device, dev);
 
+	tcmur_affinity_bind_thread(dev);
+
 	while (1) {
 		int completed = 0;
 		struct tcmulib_cmd *cmd;
 		struct timespec tmo, curr_time;
-		bool set_tmo;
+		bool set_tmo, reaped = false;
+		int cmd_tmo, comp_fd;
 
 		tcmulib_processing_start(dev);
 
-		if (rdev->cmd_time_out)
-			tcmur_get_time(dev, &curr_time);
+		/* the time out can be changed at runtime, sample it once */
+		cmd_tmo = tcmur_dev_get_tunable(dev,
+						&tcmur_cmd_time_out_tunable);
+		if (cmd_tmo && tcmur_get_time(dev, &curr_time))
+			cmd_tmo = 0;
 
-		while (!dev_stopping &&
+		/*
+		 * Over the congestion control limit commands are left in the
+		 * ring, a completion wakes us through the cc fd.
+		 */
+		while (!dev_stopping && tcmur_cc_may_fetch(dev) &&
 		       (cmd = tcmulib_get_next_command(dev,
 					sizeof(struct tcmur_cmd))) != NULL) {
 
-			tcmur_tcmulib_cmd_start(dev, cmd, &curr_time);
+			tcmur_tcmulib_cmd_start(dev, cmd, &curr_time, cmd_tmo);
 
 			if (tcmu_get_log_level() == TCMU_LOG_DEBUG_SCSI_CMD)
 				tcmu_cdb_print_info(dev, cmd, NULL);
@@ -799,23 +1193,40 @@ static void *tcmur_cmdproc_thread(void *arg)
 			}
 		}
 
+		/* the ring is drained, send what was held for submit_batch */
+		tcmur_cmd_submit_batch(dev);
+
 		if (completed)
 			tcmulib_processing_complete(dev);
 
 		set_tmo = get_next_cmd_timeout(dev, &curr_time, &tmo);
 
-		pfd.fd = tcmu_dev_get_fd(dev);
-		pfd.events = POLLIN;
-		pfd.revents = 0;
+		pfd[0].fd = tcmu_dev_get_fd(dev);
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = tcmur_cc_get_fd(dev);
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		/* -1 unless the handler's completions are polled */
+		comp_fd = tcmur_dev_get_completion_fd(dev);
+		pfd[2].fd = comp_fd;
+		pfd[2].events = POLLIN;
+		pfd[2].revents = 0;
+
+		if (comp_fd >= 0)
+			reaped = poll_completions_spin(dev);
 
 		/* Use ppoll instead poll to avoid poll call reschedules during signal
 		 * handling. If we were removing a device, then the uio device's memory
 		 * could be freed, but the poll would be rescheduled and end up accessing
 		 * the released device. */
-		if (set_tmo) {
-			ret = ppoll(&pfd, 1, &tmo, NULL);
+		if (reaped) {
+			/* new commands may be waiting already, do not sleep */
+			ret = ppoll(pfd, 3, &no_wait, NULL);
+		} else if (set_tmo) {
+			ret = ppoll(pfd, 3, &tmo, NULL);
 		} else {
-			ret = ppoll(&pfd, 1, NULL, NULL);
+			ret = ppoll(pfd, 3, NULL, NULL);
 		}
 		if (ret == -1) {
 			tcmu_err("ppoll() returned %d\n", ret);
@@ -823,10 +1234,22 @@ static void *tcmur_cmdproc_thread(void *arg)
 		}
 
 		if (!ret) {
-			check_for_timed_out_cmds(dev);
-		} else if (pfd.revents != POLLIN) {
-			tcmu_err("ppoll received unexpected revent: 0x%x\n", pfd.revents);
+			if (!reaped)
+				check_for_timed_out_cmds(dev);
+		} else if ((pfd[0].revents && pfd[0].revents != POLLIN) ||
+			   (pfd[1].revents && pfd[1].revents != POLLIN)) {
+			tcmu_err("ppoll received unexpected revent: 0x%x 0x%x\n",
+				 pfd[0].revents, pfd[1].revents);
 			break;
+		} else {
+			if (pfd[1].revents)
+				tcmur_cc_clear_wakeup(dev);
+			/*
+			 * A reopen may have closed the completion fd since it
+			 * was looked up, only POLLIN means anything.
+			 */
+			if (pfd[2].revents & POLLIN)
+				tcmur_dev_poll_completions(dev);
 		}
 
 		/*
@@ -865,6 +1288,10 @@ static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 		return ret;
 
 	tcmu_dev_set_num_lbas(dev, new_lbas);
+	if (tcmur_cbt_resize(dev))
+		tcmu_dev_err(dev, "Could not resize changed block tracking bitmap.\n");
+	if (tcmur_repl_resize(dev))
+		tcmu_dev_err(dev, "Could not resize replication dirty bitmap.\n");
 	tcmur_set_pending_ua(dev, TCMUR_UA_DEV_SIZE_CHANGED);
 	return 0;
 }
@@ -872,16 +1299,55 @@ static int dev_resize(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 static int dev_reconfig(struct tcmu_device *dev, struct tcmulib_cfg_info *cfg)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	int ret;
 
 	if (!rhandler->reconfig)
 		return -EOPNOTSUPP;
 
 	switch (cfg->type) {
 	case TCMULIB_CFG_DEV_SIZE:
-		return dev_resize(dev, cfg);
+		ret = dev_resize(dev, cfg);
+		break;
 	default:
-		return rhandler->reconfig(dev, cfg);
+		ret = rhandler->reconfig(dev, cfg);
 	}
+
+	if (!ret)
+		tcmur_resp_cache_invalidate(dev);
+	return ret;
+}
+
+/*
+ * tcmur_<name>=<value> sets a registered tunable for this device only,
+ * for example tcmur_cmd_time_out=30.
+ */
+static bool parse_tunable_arg(struct tcmu_device *dev, char *arg)
+{
+	struct tcmu_tunable *tun;
+	size_t len = strcspn(arg, "=;");
+	char name[64], *val;
+	int64_t v;
+
+	if (arg[len] != '=' || len >= sizeof(name))
+		return false;
+
+	memcpy(name, arg, len);
+	name[len] = '\0';
+	tun = tcmu_find_tunable(name);
+	if (!tun)
+		return false;
+
+	val = strndup(arg + len + 1, strcspn(arg + len + 1, ";"));
+	if (!val)
+		return false;
+
+	if (tcmu_parse_tunable(tun, val, &v))
+		tcmu_dev_err(dev, "Invalid value %s for tcmur_%s, valid range [%"PRId64", %"PRId64"]\n",
+			     val, name, tun->min, tun->max);
+	else
+		tcmur_dev_set_tunable(dev, tun, v);
+	free(val);
+	return true;
 }
 
 static void parse_tcmu_runner_args(struct tcmu_device *dev)
@@ -898,12 +1364,57 @@ static void parse_tcmu_runner_args(struct tcmu_device *dev)
 		found = false;
 		arg++;
 
-		if (!strncmp(arg, "tcmur_cmd_time_out=", 19)) {
-			rdev->cmd_time_out = atoi(arg + 19);
+		if (!strncmp(arg, "tcmur_cbt=", 10)) {
+			free(rdev->cbt_path);
+			rdev->cbt_path = strndup(arg + 10, strcspn(arg + 10, ";"));
+
+			tcmu_dev_dbg(dev, "Using tcmur_cbt %s\n",
+				     rdev->cbt_path);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_cbt_gran=", 15)) {
+			rdev->cbt_granularity = strtoul(arg + 15, NULL, 0);
+
+			tcmu_dev_dbg(dev, "Using tcmur_cbt_gran %u\n",
+				     rdev->cbt_granularity);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_repl_target=", 18)) {
+			free(rdev->repl_target);
+			rdev->repl_target = strndup(arg + 18,
+						    strcspn(arg + 18, ";"));
 
-			tcmu_dev_dbg(dev, "Using tcmur_cmd_timeout %d\n",
-				     rdev->cmd_time_out);
+			tcmu_dev_dbg(dev, "Using tcmur_repl_target %s\n",
+				     rdev->repl_target);
 			found = true;
+		} else if (!strncmp(arg, "tcmur_repl_journal=", 19)) {
+			free(rdev->repl_journal);
+			rdev->repl_journal = strndup(arg + 19,
+						     strcspn(arg + 19, ";"));
+
+			tcmu_dev_dbg(dev, "Using tcmur_repl_journal %s\n",
+				     rdev->repl_journal);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_repl_journal_size=", 24)) {
+			rdev->repl_journal_size = strtoull(arg + 24, NULL, 0);
+
+			tcmu_dev_dbg(dev, "Using tcmur_repl_journal_size %"PRIu64"\n",
+				     rdev->repl_journal_size);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_repl_max_lag=", 19)) {
+			rdev->repl_max_lag = strtoul(arg + 19, NULL, 0);
+
+			tcmu_dev_dbg(dev, "Using tcmur_repl_max_lag %u\n",
+				     rdev->repl_max_lag);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_cpus=", 11)) {
+			free(rdev->affinity_cpus);
+			rdev->affinity_cpus = strndup(arg + 11,
+						      strcspn(arg + 11, ";"));
+
+			tcmu_dev_dbg(dev, "Using tcmur_cpus %s\n",
+				     rdev->affinity_cpus);
+			found = true;
+		} else if (!strncmp(arg, "tcmur_", 6)) {
+			found = parse_tunable_arg(dev, arg + 6);
 		}
 
 		arg_end = strstr(arg, ";");
@@ -929,6 +1440,7 @@ static int dev_added(struct tcmu_device *dev)
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct list_head group_list;
 	struct tcmur_device *rdev;
+	struct tcmur_affinity_saved saved_affinity;
 	int32_t block_size, max_sectors;
 	int64_t dev_size;
 	int ret;
@@ -944,24 +1456,40 @@ static int dev_added(struct tcmu_device *dev)
 
 	parse_tcmu_runner_args(dev);
 
+	ret = tcmur_affinity_dev_init(dev);
+	if (ret)
+		goto free_rdev;
+
+	ret = tcmur_resp_cache_init(dev);
+	if (ret)
+		goto free_affinity;
+
+	ret = tcmur_cc_init(dev);
+	if (ret)
+		goto free_resp_cache;
+
+	ret = tcmur_hedge_init(dev);
+	if (ret)
+		goto free_cc;
+
 	ret = -EINVAL;
 	block_size = tcmu_cfgfs_dev_get_attr_int(dev, "hw_block_size");
 	if (block_size <= 0) {
 		tcmu_dev_err(dev, "Could not get hw_block_size\n");
-		goto free_rdev;
+		goto free_hedge;
 	}
 	tcmu_dev_set_block_size(dev, block_size);
 
 	dev_size = tcmu_cfgfs_dev_get_info_u64(dev, "Size", &ret);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not get device size\n");
-		goto free_rdev;
+		goto free_hedge;
 	}
 	tcmu_dev_set_num_lbas(dev, tcmu_byte_to_lba(dev, dev_size));
 
 	max_sectors = tcmu_cfgfs_dev_get_attr_int(dev, "hw_max_sectors");
 	if (max_sectors < 0)
-		goto free_rdev;
+		goto free_hedge;
 	tcmu_dev_set_max_xfer_len(dev, max_sectors);
 
 	/*
@@ -987,7 +1515,7 @@ static int dev_added(struct tcmu_device *dev)
 	ret = pthread_spin_init(&rdev->lock, 0);
 	if (ret) {
 		ret = -ret;
-		goto free_rdev;
+		goto free_hedge;
 	}
 
 	ret = pthread_mutex_init(&rdev->caw_lock, NULL);
@@ -1008,15 +1536,27 @@ static int dev_added(struct tcmu_device *dev)
 		goto cleanup_format_lock;
 	}
 
+	ret = pthread_mutex_init(&rdev->poll_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto cleanup_state_lock;
+	}
+
+	ret = tcmur_co_init(dev);
+	if (ret < 0)
+		goto cleanup_poll_lock;
+
 	ret = setup_io_work_queue(dev);
 	if (ret < 0)
-		goto cleanup_state_lock;
+		goto free_co;
 
 	ret = setup_aio_tracking(rdev);
 	if (ret < 0)
 		goto cleanup_io_work_queue;
 
+	tcmur_affinity_enter(dev, &saved_affinity);
 	ret = rhandler->open(dev, false);
+	tcmur_affinity_leave(&saved_affinity);
 	if (ret)
 		goto cleanup_aio_tracking;
 	/*
@@ -1028,11 +1568,24 @@ static int dev_added(struct tcmu_device *dev)
 	tcmu_release_alua_grps(&group_list);
 
 	rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
+	tcmur_dev_set_polling(dev, true);
+
+	if (rdev->cbt_path) {
+		ret = tcmur_cbt_open(dev);
+		if (ret)
+			goto close_dev;
+	}
+
+	if (rdev->repl_target || rdev->repl_journal) {
+		ret = tcmur_repl_open(dev);
+		if (ret)
+			goto close_cbt;
+	}
 
 	ret = pthread_cond_init(&rdev->lock_cond, NULL);
 	if (ret) {
 		ret = -ret;
-		goto close_dev;
+		goto close_repl;
 	}
 
 	ret = pthread_create(&rdev->cmdproc_thread, NULL, tcmur_cmdproc_thread,
@@ -1046,12 +1599,21 @@ static int dev_added(struct tcmu_device *dev)
 
 cleanup_lock_cond:
 	pthread_cond_destroy(&rdev->lock_cond);
+close_repl:
+	tcmur_repl_close(dev);
+close_cbt:
+	tcmur_cbt_close(dev);
 close_dev:
+	tcmur_dev_set_polling(dev, false);
 	rhandler->close(dev);
 cleanup_aio_tracking:
 	cleanup_aio_tracking(rdev);
 cleanup_io_work_queue:
 	cleanup_io_work_queue(dev, true);
+free_co:
+	tcmur_co_free(dev);
+cleanup_poll_lock:
+	pthread_mutex_destroy(&rdev->poll_lock);
 cleanup_state_lock:
 	pthread_mutex_destroy(&rdev->state_lock);
 cleanup_format_lock:
@@ -1060,7 +1622,19 @@ cleanup_caw_lock:
 	pthread_mutex_destroy(&rdev->caw_lock);
 cleanup_dev_lock:
 	pthread_spin_destroy(&rdev->lock);
+free_hedge:
+	tcmur_hedge_free(dev);
+free_cc:
+	tcmur_cc_free(dev);
+free_resp_cache:
+	tcmur_resp_cache_free(dev);
+free_affinity:
+	tcmur_affinity_dev_free(dev);
 free_rdev:
+	free(rdev->affinity_cpus);
+	free(rdev->repl_journal);
+	free(rdev->repl_target);
+	free(rdev->cbt_path);
 	free(rdev);
 	return ret;
 }
@@ -1080,14 +1654,30 @@ static void dev_removed(struct tcmu_device *dev)
 	 * terminated before removing the handler (i.e., calling handlers
 	 * ->close() callout) in order to ensure that no handler callouts
 	 * are getting invoked when shutting down the handler.
+	 *
+	 * Replication resyncs through the work queue, so it is stopped
+	 * first.
 	 */
+	tcmur_repl_stop(dev);
 	cleanup_io_work_queue_threads(dev);
 
 	if (aio_wait_for_empty_queue(rdev))
 		tcmu_dev_err(dev, "could not flush queue.\n");
 
 	tcmu_thread_cancel(rdev->cmdproc_thread);
+
+	/*
+	 * The coroutine scheduler can only go once the cmdproc thread can
+	 * no longer hand it commands, and those it was handed after the
+	 * flush above have completed.
+	 */
+	if (rdev->co && aio_wait_for_empty_queue(rdev))
+		tcmu_dev_err(dev, "could not flush coroutine queue.\n");
+	tcmur_co_free(dev);
+
 	tcmur_stop_device(dev);
+	tcmur_repl_close(dev);
+	tcmur_cbt_close(dev);
 
 	cleanup_io_work_queue(dev, false);
 	cleanup_aio_tracking(rdev);
@@ -1100,6 +1690,10 @@ static void dev_removed(struct tcmu_device *dev)
 	if (ret != 0)
 		tcmu_err("could not cleanup state lock %d\n", ret);
 
+	ret = pthread_mutex_destroy(&rdev->poll_lock);
+	if (ret != 0)
+		tcmu_err("could not cleanup poll lock %d\n", ret);
+
 	ret = pthread_mutex_destroy(&rdev->format_lock);
 	if (ret != 0)
 		tcmu_err("could not cleanup format lock %d\n", ret);
@@ -1112,6 +1706,14 @@ static void dev_removed(struct tcmu_device *dev)
 	if (ret != 0)
 		tcmu_err("could not cleanup mailbox lock %d\n", ret);
 
+	tcmur_hedge_free(dev);
+	tcmur_cc_free(dev);
+	tcmur_resp_cache_free(dev);
+	tcmur_affinity_dev_free(dev);
+	free(rdev->affinity_cpus);
+	free(rdev->repl_journal);
+	free(rdev->repl_target);
+	free(rdev->cbt_path);
 	free(rdev);
 
 	tcmu_dev_dbg(dev, "removed from tcmu-runner\n");
@@ -1251,6 +1853,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* tunables found in the config file are applied on load */
+	if (tcmur_register_core_tunables() || tcmur_affinity_init()) {
+		tcmu_err("Registering tunables failed!\n");
+		goto free_config;
+	}
+
 	/*
 	 * The order of setting up config and logger is important, because
 	 * the log directory may be configured via the system config file
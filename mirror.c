@@ -0,0 +1,1293 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Mirroring (RAID-1) handler
+ *
+ * Every write goes to all legs (backing files or block devices) in
+ * parallel, reads go to the leg with the fewest reads and writes in
+ * flight, with ties going to the leg with the lowest latency:
+ *
+ *   mirror//path1,/path2[,...][;drl=path][;drl_gran=N][;rebuild_rate=N][;threads=N]
+ *
+ * A dirty region log (DRL) records the regions that may differ
+ * between legs. It is a runner bitmap (see tcmur_cbt.h) stored in the
+ * drl file, "<path1>.drl" by default, with drl_gran bytes per bit. A
+ * region is set and synced before a write to it is sent to the legs.
+ * A cleaner clears regions once the writes to them are stable on all
+ * legs. After a crash the regions still set are copied from the first
+ * leg to the others and everything else is known to be in sync.
+ *
+ * A leg that fails an IO is taken out of service and the writes it
+ * misses stay in the DRL, which is not cleaned while a leg is out. It
+ * is reopened every LEG_RETRY_SECS, then rebuilt by copying the dirty
+ * regions to it while it already receives new writes. Rebuilds are
+ * limited to rebuild_rate MB/s and slow down further while there is
+ * foreground IO. The state of each leg is kept in "<drl>.legs", so a
+ * failed leg is not trusted after a restart. A leg that is not listed
+ * there is new and gets a full copy.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/fs.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_cbt.h"
+
+#define MIRROR_MAX_LEGS		8
+#define MIRROR_DEF_THREADS	2
+#define MIRROR_DEF_REBUILD_RATE	64	/* MB/s */
+/* how often a failed leg is reopened and the DRL is cleaned */
+#define LEG_RETRY_SECS		10
+#define DRL_CLEAN_SECS		5
+/* dirty regions handled per DRL clean or rebuild batch */
+#define DRL_BATCH		64
+
+enum {
+	LEG_OK,
+	LEG_FAILED,
+	/* receives writes, but is only read from once rebuilt */
+	LEG_REBUILDING,
+};
+
+enum {
+	MIRROR_OP_READ,
+	MIRROR_OP_WRITE,
+	MIRROR_OP_FLUSH,
+	MIRROR_OP_UNMAP,
+};
+
+struct mirror_cmd {
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+	int op;
+	int remaining;
+	/* completions on legs that were in sync when the cmd was sent */
+	int nr_ok;
+	int epoch;
+
+	/* reads are retried on the other legs */
+	struct iovec *iov;
+	size_t iov_cnt;
+	unsigned int tried;
+};
+
+struct mirror_io {
+	struct mirror_cmd *mcmd;
+	struct list_node entry;
+	int leg;
+	bool leg_was_ok;
+	struct timespec start;
+
+	struct iovec *iov;
+	size_t iov_cnt;
+	uint64_t off;
+	uint64_t len;
+};
+
+struct mirror_leg {
+	char *path;
+	int fd;
+	bool is_blk;
+	uint64_t size;
+	int state;
+	time_t failed_at;
+
+	/* for read balancing */
+	int inflight;
+	uint64_t lat_us;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head queue;
+	pthread_t *threads;
+	int nr_threads;
+	bool stop;
+
+	struct mirror_state *state_ptr;
+	int idx;
+};
+
+struct mirror_state {
+	struct tcmu_device *dev;
+	struct mirror_leg legs[MIRROR_MAX_LEGS];
+	int nr_legs;
+	int threads_per_leg;
+
+	struct tcmur_cbt *drl;
+	char *drl_path;
+	uint32_t drl_gran;
+	char *legs_path;
+	uint64_t rebuild_rate;
+
+	/*
+	 * Protects the leg states and the write epochs. The DRL cleaner
+	 * flips the epoch and waits for the writes of the old one, so
+	 * it knows every write started before it looked is complete.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int epoch;
+	int epoch_inflight[2];
+	/* dirty regions from before a crash are still being copied */
+	bool resyncing;
+
+	pthread_t resync_thread;
+	bool stop;
+};
+
+static int mirror_rw(int fd, int op, struct iovec *iov, size_t iov_cnt,
+		     uint64_t off, uint64_t len)
+{
+	size_t cnt, consumed;
+	ssize_t ret;
+
+	while (len) {
+		cnt = min(iov_cnt, (size_t)IOV_MAX);
+		if (op == MIRROR_OP_READ)
+			ret = preadv(fd, iov, cnt, off);
+		else
+			ret = pwritev(fd, iov, cnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret) {
+			if (op == MIRROR_OP_WRITE)
+				return -EIO;
+			/* EOF of a sparse file, then zeros the iovecs left */
+			tcmu_iovec_zero(iov, iov_cnt);
+			break;
+		}
+
+		consumed = tcmu_iovec_seek(iov, ret);
+		iov += consumed;
+		iov_cnt -= consumed;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int mirror_discard(struct mirror_leg *leg, uint64_t off, uint64_t len)
+{
+	uint64_t range[2] = { off, len };
+
+	if (leg->is_blk) {
+		if (ioctl(leg->fd, BLKDISCARD, range))
+			return -errno;
+		return 0;
+	}
+
+	if (fallocate(leg->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len))
+		return -errno;
+	return 0;
+}
+
+/* Write the leg states, caller holds state->lock */
+static int mirror_save_legs(struct mirror_state *state)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int i, ret = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", state->legs_path);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		goto fail;
+
+	for (i = 0; i < state->nr_legs; i++)
+		fprintf(fp, "%s %s\n", state->legs[i].path,
+			state->legs[i].state == LEG_OK ? "ok" : "failed");
+
+	if (fflush(fp) || fdatasync(fileno(fp))) {
+		fclose(fp);
+		goto fail;
+	}
+	fclose(fp);
+
+	if (rename(tmp, state->legs_path))
+		goto fail;
+	return 0;
+
+fail:
+	ret = -errno;
+	tcmu_dev_err(state->dev, "Could not save leg states to %s: %m\n",
+		     state->legs_path);
+	return ret;
+}
+
+/*
+ * Take a leg out of service after an IO error. The last leg in sync
+ * is kept, there would be nothing left to read from.
+ */
+static void mirror_fail_leg(struct mirror_state *state, int idx, int err)
+{
+	struct mirror_leg *leg = &state->legs[idx];
+	int i, nr_ok = 0;
+
+	pthread_mutex_lock(&state->lock);
+	if (leg->state == LEG_FAILED)
+		goto unlock;
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state == LEG_OK)
+			nr_ok++;
+	}
+	if (leg->state == LEG_OK && nr_ok == 1) {
+		tcmu_dev_err(state->dev, "IO error %d on %s, the last leg in sync\n",
+			     err, leg->path);
+		goto unlock;
+	}
+
+	tcmu_dev_err(state->dev, "IO error %d on %s. Taking the leg out of service.\n",
+		     err, leg->path);
+	leg->state = LEG_FAILED;
+	leg->failed_at = time(NULL);
+	mirror_save_legs(state);
+unlock:
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void mirror_epoch_exit(struct mirror_state *state, int epoch)
+{
+	pthread_mutex_lock(&state->lock);
+	if (!--state->epoch_inflight[epoch])
+		pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/* Wait for the writes started before this call to complete */
+static void mirror_epoch_drain(struct mirror_state *state)
+{
+	int old;
+
+	pthread_mutex_lock(&state->lock);
+	old = state->epoch;
+	state->epoch ^= 1;
+	while (state->epoch_inflight[old])
+		pthread_cond_wait(&state->cond, &state->lock);
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void mirror_queue_io(struct mirror_state *state, struct mirror_io *io)
+{
+	struct mirror_leg *leg = &state->legs[io->leg];
+
+	__atomic_add_fetch(&leg->inflight, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&leg->lock);
+	list_add_tail(&leg->queue, &io->entry);
+	pthread_cond_signal(&leg->cond);
+	pthread_mutex_unlock(&leg->lock);
+}
+
+/*
+ * Pick the leg to read from: an in sync leg not tried yet with the
+ * fewest IOs in flight, then the lowest latency. While regions from
+ * before a crash are being copied only the first in sync leg has the
+ * right data. Caller holds state->lock.
+ */
+static int mirror_pick_read_leg(struct mirror_state *state,
+				unsigned int tried)
+{
+	int i, best = -1, inflight, best_inflight = INT_MAX;
+	uint64_t lat, best_lat = UINT64_MAX;
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state != LEG_OK)
+			continue;
+		if (state->resyncing)
+			return (tried & (1 << i)) ? -1 : i;
+		if (tried & (1 << i))
+			continue;
+
+		inflight = __atomic_load_n(&state->legs[i].inflight,
+					   __ATOMIC_RELAXED);
+		lat = __atomic_load_n(&state->legs[i].lat_us,
+				      __ATOMIC_RELAXED);
+		if (inflight < best_inflight ||
+		    (inflight == best_inflight && lat < best_lat)) {
+			best = i;
+			best_inflight = inflight;
+			best_lat = lat;
+		}
+	}
+
+	return best;
+}
+
+static void mirror_complete(struct mirror_cmd *mcmd, int ret)
+{
+	tcmur_cmd_complete(mcmd->dev, mcmd->tcmur_cmd, ret);
+	free(mcmd);
+}
+
+static void mirror_io_done(struct mirror_state *state, struct mirror_io *io,
+			   int ret)
+{
+	struct mirror_cmd *mcmd = io->mcmd;
+	int leg;
+
+	if (mcmd->op == MIRROR_OP_UNMAP && ret == -EOPNOTSUPP)
+		/* UNMAP is a hint, ignore legs that cannot punch */
+		ret = 0;
+
+	if (ret)
+		mirror_fail_leg(state, io->leg, ret);
+
+	if (mcmd->op == MIRROR_OP_READ) {
+		if (!ret) {
+			free(io);
+			mirror_complete(mcmd, TCMU_STS_OK);
+			return;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		leg = mirror_pick_read_leg(state, mcmd->tried);
+		pthread_mutex_unlock(&state->lock);
+		if (leg < 0) {
+			free(io);
+			mirror_complete(mcmd, TCMU_STS_RD_ERR);
+			return;
+		}
+
+		tcmu_dev_warn(mcmd->dev, "Retrying read on %s\n",
+			      state->legs[leg].path);
+		mcmd->tried |= 1 << leg;
+		io->leg = leg;
+		memcpy(io->iov, mcmd->iov, mcmd->iov_cnt * sizeof(*io->iov));
+		io->iov_cnt = mcmd->iov_cnt;
+		mirror_queue_io(state, io);
+		return;
+	}
+
+	if (!ret && io->leg_was_ok)
+		__atomic_add_fetch(&mcmd->nr_ok, 1, __ATOMIC_RELAXED);
+	free(io);
+
+	if (__atomic_sub_fetch(&mcmd->remaining, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (mcmd->op != MIRROR_OP_FLUSH)
+		mirror_epoch_exit(state, mcmd->epoch);
+	mirror_complete(mcmd, __atomic_load_n(&mcmd->nr_ok, __ATOMIC_RELAXED) ?
+			TCMU_STS_OK : TCMU_STS_WR_ERR);
+}
+
+static void *mirror_worker(void *arg)
+{
+	struct mirror_leg *leg = arg;
+	struct mirror_state *state = leg->state_ptr;
+	struct timespec end;
+	struct mirror_io *io;
+	uint64_t us;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&leg->lock);
+		while (!leg->stop && list_empty(&leg->queue))
+			pthread_cond_wait(&leg->cond, &leg->lock);
+		io = list_pop(&leg->queue, struct mirror_io, entry);
+		pthread_mutex_unlock(&leg->lock);
+		if (!io)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &io->start);
+		switch (io->mcmd->op) {
+		case MIRROR_OP_READ:
+		case MIRROR_OP_WRITE:
+			ret = mirror_rw(leg->fd, io->mcmd->op, io->iov,
+					io->iov_cnt, io->off, io->len);
+			break;
+		case MIRROR_OP_FLUSH:
+			ret = fdatasync(leg->fd) ? -errno : 0;
+			break;
+		case MIRROR_OP_UNMAP:
+			ret = mirror_discard(leg, io->off, io->len);
+			break;
+		default:
+			ret = -EINVAL;
+		}
+
+		if (io->mcmd->op == MIRROR_OP_READ && !ret) {
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &end);
+			us = (end.tv_sec - io->start.tv_sec) * 1000000 +
+				(end.tv_nsec - io->start.tv_nsec) / 1000;
+			/* moving average over the last 8 or so reads */
+			__atomic_store_n(&leg->lat_us,
+					 (leg->lat_us * 7 + us) / 8,
+					 __ATOMIC_RELAXED);
+		}
+		__atomic_sub_fetch(&leg->inflight, 1, __ATOMIC_RELAXED);
+
+		mirror_io_done(state, io, ret);
+	}
+
+	return NULL;
+}
+
+static struct mirror_io *mirror_alloc_io(struct mirror_cmd *mcmd, int leg,
+					 struct iovec *iov, size_t iov_cnt,
+					 uint64_t off, uint64_t len)
+{
+	struct mirror_io *io;
+
+	io = calloc(1, sizeof(*io) + iov_cnt * sizeof(*iov));
+	if (!io)
+		return NULL;
+	io->mcmd = mcmd;
+	io->leg = leg;
+	io->off = off;
+	io->len = len;
+	/* the iovec is advanced as it is consumed, each leg needs a copy */
+	io->iov = (struct iovec *)(io + 1);
+	io->iov_cnt = iov_cnt;
+	if (iov_cnt)
+		memcpy(io->iov, iov, iov_cnt * sizeof(*iov));
+	return io;
+}
+
+static struct mirror_cmd *mirror_alloc_cmd(struct tcmu_device *dev,
+					   struct tcmur_cmd *tcmur_cmd, int op)
+{
+	struct mirror_cmd *mcmd;
+
+	mcmd = calloc(1, sizeof(*mcmd));
+	if (!mcmd)
+		return NULL;
+	mcmd->dev = dev;
+	mcmd->tcmur_cmd = tcmur_cmd;
+	mcmd->op = op;
+	return mcmd;
+}
+
+static int mirror_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		       struct iovec *iov, size_t iov_cnt, size_t length,
+		       off_t offset)
+{
+	struct mirror_state *state = tcmur_dev_get_private(dev);
+	struct mirror_cmd *mcmd;
+	struct mirror_io *io;
+	int leg;
+
+	mcmd = mirror_alloc_cmd(dev, tcmur_cmd, MIRROR_OP_READ);
+	if (!mcmd)
+		return TCMU_STS_NO_RESOURCE;
+	mcmd->iov = iov;
+	mcmd->iov_cnt = iov_cnt;
+
+	pthread_mutex_lock(&state->lock);
+	leg = mirror_pick_read_leg(state, 0);
+	pthread_mutex_unlock(&state->lock);
+	if (leg < 0) {
+		free(mcmd);
+		return TCMU_STS_RD_ERR;
+	}
+	mcmd->tried = 1 << leg;
+
+	io = mirror_alloc_io(mcmd, leg, iov, iov_cnt, offset, length);
+	if (!io) {
+		free(mcmd);
+		return TCMU_STS_NO_RESOURCE;
+	}
+
+	mirror_queue_io(state, io);
+	return TCMU_STS_OK;
+}
+
+/*
+ * Drop a read that is still queued for a leg. Writes are left alone,
+ * stopping them on some legs would need their regions resynced.
+ */
+static void mirror_cancel(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct mirror_state *state = tcmur_dev_get_private(dev);
+	struct mirror_leg *leg;
+	struct mirror_io *io, *found = NULL;
+	int i;
+
+	for (i = 0; i < state->nr_legs && !found; i++) {
+		leg = &state->legs[i];
+
+		pthread_mutex_lock(&leg->lock);
+		list_for_each(&leg->queue, io, entry) {
+			if (io->mcmd->tcmur_cmd == tcmur_cmd &&
+			    io->mcmd->op == MIRROR_OP_READ) {
+				list_del(&io->entry);
+				found = io;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&leg->lock);
+	}
+
+	if (!found)
+		return;
+
+	__atomic_sub_fetch(&state->legs[found->leg].inflight, 1,
+			   __ATOMIC_RELAXED);
+	tcmu_dev_dbg(dev, "Cancelled read queued on %s\n",
+		     state->legs[found->leg].path);
+	mirror_complete(found->mcmd, TCMU_STS_TIMEOUT);
+	free(found);
+}
+
+/* Send a write, unmap or flush to every leg that is not failed */
+static int mirror_fanout(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int op, struct iovec *iov, size_t iov_cnt,
+			 uint64_t off, uint64_t len)
+{
+	struct mirror_state *state = tcmur_dev_get_private(dev);
+	struct mirror_io *ios[MIRROR_MAX_LEGS] = { NULL };
+	struct mirror_cmd *mcmd;
+	int i, nr = 0;
+
+	mcmd = mirror_alloc_cmd(dev, tcmur_cmd, op);
+	if (!mcmd)
+		return TCMU_STS_NO_RESOURCE;
+
+	for (i = 0; i < state->nr_legs; i++) {
+		ios[i] = mirror_alloc_io(mcmd, i, iov, iov_cnt, off, len);
+		if (!ios[i])
+			goto free_ios;
+	}
+
+	if (op != MIRROR_OP_FLUSH)
+		tcmur_cbt_set(dev, state->drl, off, len);
+
+	pthread_mutex_lock(&state->lock);
+	if (op != MIRROR_OP_FLUSH) {
+		mcmd->epoch = state->epoch;
+		state->epoch_inflight[mcmd->epoch]++;
+	}
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state == LEG_FAILED) {
+			free(ios[i]);
+			ios[i] = NULL;
+			continue;
+		}
+		ios[i]->leg_was_ok = state->legs[i].state == LEG_OK;
+		nr++;
+	}
+	mcmd->remaining = nr;
+	pthread_mutex_unlock(&state->lock);
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (ios[i])
+			mirror_queue_io(state, ios[i]);
+	}
+	return TCMU_STS_OK;
+
+free_ios:
+	for (i = 0; i < state->nr_legs; i++)
+		free(ios[i]);
+	free(mcmd);
+	return TCMU_STS_NO_RESOURCE;
+}
+
+static int mirror_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			struct iovec *iov, size_t iov_cnt, size_t length,
+			off_t offset)
+{
+	return mirror_fanout(dev, tcmur_cmd, MIRROR_OP_WRITE, iov, iov_cnt,
+			     offset, length);
+}
+
+static int mirror_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	return mirror_fanout(dev, tcmur_cmd, MIRROR_OP_FLUSH, NULL, 0, 0, 0);
+}
+
+static int mirror_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			uint64_t off, uint64_t len)
+{
+	return mirror_fanout(dev, tcmur_cmd, MIRROR_OP_UNMAP, NULL, 0, off,
+			     len);
+}
+
+static bool mirror_fg_busy(struct mirror_state *state)
+{
+	int i;
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (__atomic_load_n(&state->legs[i].inflight, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/* Sleep long enough to keep copying len bytes to rebuild_rate. */
+static void mirror_rebuild_throttle(struct mirror_state *state, uint64_t len)
+{
+	uint64_t ns = len * 1000 / state->rebuild_rate;
+	struct timespec ts;
+
+	/* back off while the initiator is using the device */
+	if (mirror_fg_busy(state))
+		ns *= 4;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+/* Copy a region from the source leg to the legs in targets. */
+static int mirror_copy_region(struct mirror_state *state, int src,
+			      unsigned int targets, void *buf, uint64_t off,
+			      uint64_t len)
+{
+	struct iovec iov;
+	int i, ret;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	ret = mirror_rw(state->legs[src].fd, MIRROR_OP_READ, &iov, 1, off, len);
+	if (ret) {
+		mirror_fail_leg(state, src, ret);
+		return ret;
+	}
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (!(targets & (1 << i)))
+			continue;
+
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ret = mirror_rw(state->legs[i].fd, MIRROR_OP_WRITE, &iov, 1,
+				off, len);
+		if (ret) {
+			mirror_fail_leg(state, i, ret);
+			return ret;
+		}
+	}
+
+	mirror_rebuild_throttle(state, len);
+	return 0;
+}
+
+/*
+ * Handle the next batch of dirty regions from *cursor on: copy them
+ * from the source leg to the target legs if any, make the legs stable
+ * and clear the regions in the DRL. Returns 1 when the end of the DRL
+ * is reached, 0 if there is more to do, or -errno.
+ */
+static int mirror_drl_batch(struct mirror_state *state, int src,
+			    unsigned int targets, void *buf, uint64_t *cursor)
+{
+	uint64_t offs[DRL_BATCH], lens[DRL_BATCH], off = *cursor, len;
+	int i, nr = 0, ret = 0;
+
+	while (nr < DRL_BATCH && tcmur_cbt_find_next(state->drl, &off, &len)) {
+		tcmur_cbt_clear_begin(state->drl, off, len);
+		offs[nr] = off;
+		lens[nr++] = len;
+		off += len;
+	}
+	*cursor = off;
+	if (!nr)
+		return 1;
+
+	/*
+	 * Writes sent from now on set the regions again. Wait out the
+	 * ones sent before, they might have missed a leg or might be
+	 * overwritten by the copy.
+	 */
+	mirror_epoch_drain(state);
+
+	if (targets) {
+		for (i = 0; i < nr; i++) {
+			if (state->stop)
+				return -EINTR;
+			ret = mirror_copy_region(state, src, targets, buf,
+						 offs[i], lens[i]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state == LEG_FAILED)
+			continue;
+		if (fdatasync(state->legs[i].fd)) {
+			ret = -errno;
+			mirror_fail_leg(state, i, ret);
+			return ret;
+		}
+	}
+
+	/* a leg that failed meanwhile still needs the regions */
+	pthread_mutex_lock(&state->lock);
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state == LEG_FAILED)
+			ret = -EIO;
+	}
+	pthread_mutex_unlock(&state->lock);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++)
+		tcmur_cbt_clear_end(state->drl, offs[i], lens[i]);
+	return 0;
+}
+
+static int mirror_reopen_leg(struct mirror_state *state, int idx)
+{
+	struct mirror_leg *leg = &state->legs[idx];
+	int fd;
+
+	fd = open(leg->path, O_RDWR);
+	if (fd == -1)
+		return -errno;
+
+	/* workers may still use the old fd, keep it valid until swapped */
+	dup2(fd, leg->fd);
+	close(fd);
+
+	pthread_mutex_lock(&state->lock);
+	leg->state = LEG_REBUILDING;
+	pthread_mutex_unlock(&state->lock);
+
+	tcmu_dev_info(state->dev, "Reopened %s, rebuilding it\n", leg->path);
+	return 0;
+}
+
+/*
+ * Runs the leg rebuilds, the resync after a crash and the DRL
+ * cleaning.
+ */
+static void *mirror_resync_thread(void *arg)
+{
+	struct mirror_state *state = arg;
+	unsigned int targets;
+	uint64_t cursor;
+	bool failed;
+	void *buf;
+	int i, src, ret;
+
+	buf = malloc(tcmur_cbt_get_granularity(state->drl));
+	if (!buf) {
+		tcmu_dev_err(state->dev, "Could not allocate rebuild buffer\n");
+		return NULL;
+	}
+
+	while (!state->stop) {
+		failed = false;
+		targets = 0;
+		src = -1;
+
+		pthread_mutex_lock(&state->lock);
+		for (i = 0; i < state->nr_legs; i++) {
+			struct mirror_leg *leg = &state->legs[i];
+
+			if (leg->state == LEG_FAILED &&
+			    time(NULL) - leg->failed_at >= LEG_RETRY_SECS) {
+				pthread_mutex_unlock(&state->lock);
+				if (mirror_reopen_leg(state, i))
+					leg->failed_at = time(NULL);
+				pthread_mutex_lock(&state->lock);
+			}
+
+			if (leg->state == LEG_FAILED)
+				failed = true;
+			else if (leg->state == LEG_REBUILDING)
+				targets |= 1 << i;
+			else if (src < 0)
+				src = i;
+		}
+		if (state->resyncing) {
+			for (i = src + 1; i < state->nr_legs; i++) {
+				if (state->legs[i].state == LEG_OK)
+					targets |= 1 << i;
+			}
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		/* the DRL is all a failed leg will have to catch up */
+		if (failed || src < 0) {
+			sleep(1);
+			continue;
+		}
+
+		/*
+		 * Legs in the rebuilding state get every new write, so one
+		 * pass over what was dirty when they came back is enough.
+		 */
+		cursor = 0;
+		do {
+			ret = mirror_drl_batch(state, src, targets, buf,
+					       &cursor);
+		} while (!ret && !state->stop);
+
+		if (ret < 0) {
+			sleep(1);
+			continue;
+		}
+
+		if (targets) {
+			pthread_mutex_lock(&state->lock);
+			for (i = 0; i < state->nr_legs; i++) {
+				if ((targets & (1 << i)) &&
+				    state->legs[i].state == LEG_REBUILDING) {
+					state->legs[i].state = LEG_OK;
+					tcmu_dev_info(state->dev, "%s is in sync\n",
+						      state->legs[i].path);
+				}
+			}
+			if (state->resyncing)
+				tcmu_dev_info(state->dev, "Resync after crash is complete\n");
+			state->resyncing = false;
+			mirror_save_legs(state);
+			pthread_mutex_unlock(&state->lock);
+			continue;
+		}
+
+		sleep(DRL_CLEAN_SECS);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void mirror_stop_leg(struct mirror_leg *leg)
+{
+	int i;
+
+	pthread_mutex_lock(&leg->lock);
+	leg->stop = true;
+	pthread_cond_broadcast(&leg->cond);
+	pthread_mutex_unlock(&leg->lock);
+
+	for (i = 0; i < leg->nr_threads; i++)
+		pthread_join(leg->threads[i], NULL);
+	free(leg->threads);
+	leg->threads = NULL;
+	leg->nr_threads = 0;
+}
+
+static void mirror_close_legs(struct mirror_state *state)
+{
+	struct mirror_leg *leg;
+	int i;
+
+	for (i = 0; i < state->nr_legs; i++) {
+		leg = &state->legs[i];
+
+		mirror_stop_leg(leg);
+		pthread_cond_destroy(&leg->cond);
+		pthread_mutex_destroy(&leg->lock);
+		if (leg->fd != -1)
+			close(leg->fd);
+		free(leg->path);
+	}
+	state->nr_legs = 0;
+}
+
+static int mirror_set_size(struct tcmu_device *dev, uint64_t dev_size)
+{
+	struct mirror_state *state = tcmur_dev_get_private(dev);
+	struct mirror_leg *leg;
+	int i;
+
+	for (i = 0; i < state->nr_legs; i++) {
+		leg = &state->legs[i];
+
+		if (leg->size >= dev_size)
+			continue;
+
+		if (leg->is_blk) {
+			tcmu_dev_err(dev, "%s is %"PRIu64" bytes, %"PRIu64" are needed\n",
+				     leg->path, leg->size, dev_size);
+			return -ENOSPC;
+		}
+
+		if (ftruncate(leg->fd, dev_size)) {
+			tcmu_dev_err(dev, "Could not resize %s: %m\n",
+				     leg->path);
+			return -errno;
+		}
+		leg->size = dev_size;
+	}
+	return 0;
+}
+
+static int mirror_open_leg(struct tcmu_device *dev, struct mirror_state *state,
+			   int idx, const char *path, bool *created)
+{
+	struct mirror_leg *leg = &state->legs[idx];
+	struct stat st;
+	int i, ret;
+
+	leg->state_ptr = state;
+	leg->idx = idx;
+	leg->fd = -1;
+	list_head_init(&leg->queue);
+	pthread_mutex_init(&leg->lock, NULL);
+	pthread_cond_init(&leg->cond, NULL);
+
+	leg->path = strdup(path);
+	if (!leg->path)
+		return -ENOMEM;
+
+	*created = access(path, F_OK) != 0;
+	leg->fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (leg->fd == -1) {
+		tcmu_dev_err(dev, "Could not open %s: %m\n", path);
+		return -errno;
+	}
+
+	if (fstat(leg->fd, &st)) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not stat %s: %m\n", path);
+		return ret;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		leg->is_blk = true;
+		if (ioctl(leg->fd, BLKGETSIZE64, &leg->size)) {
+			ret = -errno;
+			tcmu_dev_err(dev, "Could not get size of %s: %m\n",
+				     path);
+			return ret;
+		}
+	} else {
+		leg->size = st.st_size;
+	}
+
+	leg->threads = calloc(state->threads_per_leg, sizeof(pthread_t));
+	if (!leg->threads)
+		return -ENOMEM;
+
+	for (i = 0; i < state->threads_per_leg; i++) {
+		ret = pthread_create(&leg->threads[i], NULL, mirror_worker,
+				     leg);
+		if (ret)
+			return -ret;
+		leg->nr_threads++;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the leg states from the legs file. Returns true if there is
+ * one, false if the mirror is new.
+ */
+static bool mirror_load_legs(struct mirror_state *state, bool *listed)
+{
+	char path[PATH_MAX], leg_state[16];
+	FILE *fp;
+	int i;
+
+	fp = fopen(state->legs_path, "r");
+	if (!fp)
+		return false;
+
+	while (fscanf(fp, "%4095s %15s", path, leg_state) == 2) {
+		for (i = 0; i < state->nr_legs; i++) {
+			if (strcmp(state->legs[i].path, path))
+				continue;
+
+			listed[i] = true;
+			if (strcmp(leg_state, "ok"))
+				state->legs[i].state = LEG_REBUILDING;
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+static int mirror_parse_config(struct tcmu_device *dev,
+			       struct mirror_state *state, char **paths)
+{
+	char *config, *opt;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	state->threads_per_leg = MIRROR_DEF_THREADS;
+	state->rebuild_rate = MIRROR_DEF_REBUILD_RATE;
+
+	*paths = strdup(strtok(config, ";") ? : "");
+	if (!*paths) {
+		free(config);
+		return -ENOMEM;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "drl=", 4)) {
+			free(state->drl_path);
+			state->drl_path = strdup(opt + 4);
+		} else if (!strncmp(opt, "drl_gran=", 9)) {
+			state->drl_gran = strtoul(opt + 9, NULL, 0);
+		} else if (!strncmp(opt, "rebuild_rate=", 13)) {
+			state->rebuild_rate = strtoull(opt + 13, NULL, 0);
+		} else if (!strncmp(opt, "threads=", 8)) {
+			state->threads_per_leg = atoi(opt + 8);
+		} else {
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+		}
+	}
+	free(config);
+
+	if (state->threads_per_leg < 1 || !state->rebuild_rate) {
+		tcmu_dev_err(dev, "threads and rebuild_rate must be at least 1\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int mirror_open(struct tcmu_device *dev, bool reopen)
+{
+	bool created[MIRROR_MAX_LEGS] = { false };
+	bool listed[MIRROR_MAX_LEGS] = { false };
+	struct mirror_state *state;
+	char *paths = NULL, *path, *saveptr;
+	int i, ret, nr;
+	bool have_legs;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	state->dev = dev;
+	tcmur_dev_set_private(dev, state);
+
+	ret = mirror_parse_config(dev, state, &paths);
+	if (ret)
+		goto free_state;
+
+	for (nr = 1, path = paths; (path = strchr(path, ',')); path++)
+		nr++;
+	if (!strlen(paths) || nr < 2 || nr > MIRROR_MAX_LEGS) {
+		tcmu_dev_err(dev, "Between 2 and %d comma separated paths are needed\n",
+			     MIRROR_MAX_LEGS);
+		ret = -EINVAL;
+		goto free_state;
+	}
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->cond, NULL);
+
+	for (path = strtok_r(paths, ",", &saveptr); path;
+	     path = strtok_r(NULL, ",", &saveptr)) {
+		i = state->nr_legs++;
+		ret = mirror_open_leg(dev, state, i, path, &created[i]);
+		if (ret)
+			goto close_legs;
+	}
+
+	if (!state->drl_path) {
+		if (state->legs[0].is_blk) {
+			tcmu_dev_err(dev, "drl=path is needed when the first leg is a block device\n");
+			ret = -EINVAL;
+			goto close_legs;
+		}
+		ret = asprintf(&state->drl_path, "%s.drl", state->legs[0].path);
+		if (ret < 0) {
+			state->drl_path = NULL;
+			ret = -ENOMEM;
+			goto close_legs;
+		}
+	}
+
+	if (asprintf(&state->legs_path, "%s.legs", state->drl_path) < 0) {
+		state->legs_path = NULL;
+		ret = -ENOMEM;
+		goto close_legs;
+	}
+
+	ret = mirror_set_size(dev, tcmu_dev_get_num_lbas(dev) *
+				   tcmu_dev_get_block_size(dev));
+	if (ret)
+		goto close_legs;
+
+	ret = tcmur_cbt_create(dev, state->drl_path, state->drl_gran,
+			       &state->drl);
+	if (ret)
+		goto close_legs;
+
+	have_legs = mirror_load_legs(state, listed);
+	for (i = 0, nr = 0; i < state->nr_legs; i++) {
+		if (created[i])
+			nr++;
+	}
+	for (i = 0; i < state->nr_legs; i++) {
+		/* a leg that was replaced or added needs a full copy */
+		if (have_legs ? (!listed[i] || created[i]) :
+				(created[i] && nr < state->nr_legs)) {
+			tcmu_dev_info(dev, "%s is new, copying all data to it\n",
+				      state->legs[i].path);
+			state->legs[i].state = LEG_REBUILDING;
+			tcmur_cbt_set(dev, state->drl, 0,
+				      tcmu_dev_get_num_lbas(dev) *
+				      tcmu_dev_get_block_size(dev));
+		}
+	}
+
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state == LEG_OK)
+			break;
+	}
+	if (i == state->nr_legs) {
+		tcmu_dev_err(dev, "No leg is in sync\n");
+		ret = -EIO;
+		goto destroy_drl;
+	}
+
+	/* regions left dirty by a crash may differ between the legs */
+	if (tcmur_cbt_count(state->drl)) {
+		tcmu_dev_warn(dev, "Resyncing dirty regions from %s\n",
+			      state->legs[i].path);
+		state->resyncing = true;
+	}
+	mirror_save_legs(state);
+
+	ret = pthread_create(&state->resync_thread, NULL, mirror_resync_thread,
+			     state);
+	if (ret) {
+		ret = -ret;
+		goto destroy_drl;
+	}
+
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+	tcmu_dev_dbg(dev, "config %s, %d legs\n", tcmu_dev_get_cfgstring(dev),
+		     state->nr_legs);
+	free(paths);
+	return 0;
+
+destroy_drl:
+	tcmur_cbt_destroy(dev, state->drl);
+close_legs:
+	mirror_close_legs(state);
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+free_state:
+	free(state->legs_path);
+	free(state->drl_path);
+	free(paths);
+	free(state);
+	return ret;
+}
+
+static void mirror_close(struct tcmu_device *dev)
+{
+	struct mirror_state *state = tcmur_dev_get_private(dev);
+
+	uint64_t cursor = 0;
+	int i;
+
+	state->stop = true;
+	pthread_join(state->resync_thread, NULL);
+
+	/* clean the DRL so the next open does not resync */
+	for (i = 0; i < state->nr_legs; i++) {
+		if (state->legs[i].state != LEG_OK)
+			break;
+	}
+	if (i == state->nr_legs && !state->resyncing) {
+		while (!mirror_drl_batch(state, 0, 0, NULL, &cursor))
+			;
+	}
+
+	mirror_close_legs(state);
+	tcmur_cbt_destroy(dev, state->drl);
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	free(state->legs_path);
+	free(state->drl_path);
+	free(state);
+}
+
+static int mirror_reconfig(struct tcmu_device *dev,
+			   struct tcmulib_cfg_info *cfg)
+{
+	struct mirror_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	switch (cfg->type) {
+	case TCMULIB_CFG_DEV_SIZE:
+		ret = mirror_set_size(dev, cfg->data.dev_size);
+		if (ret)
+			return ret;
+		/* the DRL is sized from the device */
+		tcmu_dev_set_num_lbas(dev, cfg->data.dev_size /
+					   tcmu_dev_get_block_size(dev));
+		return tcmur_cbt_set_size(dev, state->drl);
+	case TCMULIB_CFG_DEV_CFGSTR:
+	case TCMULIB_CFG_WRITE_CACHE:
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char mirror_cfg_desc[] =
+	"Comma separated list of 2 or more backing files or block devices, "
+	"with optional ;drl=path, ;drl_gran=bytes, ;rebuild_rate=MB/s and "
+	";threads=per leg settings.";
+
+static struct tcmur_handler mirror_handler = {
+	.cfg_desc = mirror_cfg_desc,
+
+	.reconfig = mirror_reconfig,
+
+	.open = mirror_open,
+	.close = mirror_close,
+	.read = mirror_read,
+	/*
+	 * A leg that is stuck keeps its reads in flight, so picking the
+	 * leg with the fewest sends the hedged copy to another one.
+	 */
+	.hedge_read = mirror_read,
+	.cancel = mirror_cancel,
+	.write = mirror_write,
+	.flush = mirror_flush,
+	.unmap = mirror_unmap,
+	.name = "Mirroring Handler",
+	.subtype = "mirror",
+	.nr_threads = 0, /* IOs run on the per leg threads */
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&mirror_handler);
+}
@@ -0,0 +1,710 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Persistent memory handler
+ *
+ * Maps a file on a DAX filesystem with MAP_SYNC, so stores reach
+ * persistent memory without going through the page cache:
+ *
+ *   pmem//path/to/file
+ *
+ * Writes are copied with non-temporal stores and made durable with
+ * CLWB (or CLFLUSHOPT/CLFLUSH on older CPUs) and SFENCE before the
+ * command completes, so the write cache is reported as disabled and
+ * SYNCHRONIZE CACHE is only a store barrier. Commands are executed
+ * and completed inline from the device's command thread.
+ *
+ * Blocks are never updated in place. As in the BTT of the nvdimm
+ * driver, the file has a map from LBA to data block, and a write goes
+ * to a free block that is published by an atomic 8 byte update of the
+ * map entry once the data is durable. A crash leaves either the old
+ * or the new block mapped, never a torn one. The blocks not in the
+ * map are the free ones, so they are found by a scan on open and no
+ * free list or log is kept in the file. Map entries carry a
+ * generation that readers use to detect a block being reused under
+ * them.
+ *
+ * If the file cannot be mapped with MAP_SYNC, e.g. on tmpfs for
+ * testing, or the CPU is not x86-64, it is mapped normally, the write
+ * cache is reported as enabled and SYNCHRONIZE CACHE does msync(2).
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE	0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC		0x80000
+#endif
+
+#define PMEM_MAGIC		0x4d454d50	/* "PMEM" */
+#define PMEM_VERSION		1
+#define PMEM_HDR_LEN		4096
+#define PMEM_CACHELINE		64
+/* blocks beyond the LBA count, so writes always find a free one */
+#define PMEM_NR_SPARE		256
+
+/* A map entry is generation << 40 | (block + 1), block 0 is unmapped */
+#define PMEM_BLK_BITS		40
+#define PMEM_BLK_MASK		((1ULL << PMEM_BLK_BITS) - 1)
+#define PMEM_ENTRY(gen, blk)	(((uint64_t)(gen) << PMEM_BLK_BITS) | \
+				 ((blk) & PMEM_BLK_MASK))
+#define PMEM_ENTRY_GEN(e)	((e) >> PMEM_BLK_BITS)
+#define PMEM_ENTRY_BLK(e)	((e) & PMEM_BLK_MASK)
+
+struct pmem_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t reserved;
+	uint64_t nr_lbas;
+	uint64_t nr_blocks;
+	uint64_t map_off;
+	uint64_t data_off;
+};
+
+enum {
+	PMEM_FLUSH_NONE,	/* msync mode */
+	PMEM_FLUSH_CLFLUSH,
+	PMEM_FLUSH_CLFLUSHOPT,
+	PMEM_FLUSH_CLWB,
+};
+
+struct pmem_state {
+	int fd;
+	void *base;
+	size_t len;
+	int flush_type;
+
+	uint32_t block_size;
+	uint64_t nr_lbas;
+	uint64_t nr_blocks;
+	uint64_t *map;
+	void *data;
+
+	/* free data blocks, guarded by free_lock */
+	pthread_mutex_t free_lock;
+	pthread_cond_t free_cond;
+	uint64_t *free_map;
+	uint64_t nr_free;
+	uint64_t free_hint;
+};
+
+/* Position in an iovec that is not modified while copying */
+struct pmem_iter {
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t idx;
+	size_t pos;
+};
+
+#if defined(__x86_64__)
+static int pmem_detect_flush(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (ebx & (1 << 24))
+			return PMEM_FLUSH_CLWB;
+		if (ebx & (1 << 23))
+			return PMEM_FLUSH_CLFLUSHOPT;
+	}
+	return PMEM_FLUSH_CLFLUSH;
+}
+
+/* Write back the cache lines covering [addr, addr + len) */
+static void pmem_flush(struct pmem_state *state, const void *addr, size_t len)
+{
+	uintptr_t p = (uintptr_t)addr & ~(uintptr_t)(PMEM_CACHELINE - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+
+	switch (state->flush_type) {
+	case PMEM_FLUSH_CLWB:
+		for (; p < end; p += PMEM_CACHELINE)
+			__asm__ __volatile__(".byte 0x66; xsaveopt %0"
+					     : "+m" (*(volatile char *)p));
+		break;
+	case PMEM_FLUSH_CLFLUSHOPT:
+		for (; p < end; p += PMEM_CACHELINE)
+			__asm__ __volatile__(".byte 0x66; clflush %0"
+					     : "+m" (*(volatile char *)p));
+		break;
+	case PMEM_FLUSH_CLFLUSH:
+		for (; p < end; p += PMEM_CACHELINE)
+			_mm_clflush((const void *)p);
+		break;
+	}
+}
+
+/* Order the flushes and non-temporal stores before what follows */
+static void pmem_drain(struct pmem_state *state)
+{
+	if (state->flush_type != PMEM_FLUSH_NONE)
+		_mm_sfence();
+}
+
+/*
+ * Copy to persistent memory. The cache line aligned middle is written
+ * with non-temporal stores that bypass the cache, the head and tail
+ * are copied normally and flushed. pmem_drain() makes it durable.
+ */
+static void pmem_memcpy(struct pmem_state *state, void *dst, const void *src,
+			size_t len)
+{
+	size_t head, n;
+
+	if (state->flush_type == PMEM_FLUSH_NONE) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	head = -(uintptr_t)dst & (PMEM_CACHELINE - 1);
+	if (head) {
+		head = min(head, len);
+		memcpy(dst, src, head);
+		pmem_flush(state, dst, head);
+		dst += head;
+		src += head;
+		len -= head;
+	}
+
+	for (n = len / PMEM_CACHELINE; n; n--) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)src + 1);
+		__m128i c = _mm_loadu_si128((const __m128i *)src + 2);
+		__m128i d = _mm_loadu_si128((const __m128i *)src + 3);
+
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)dst + 1, b);
+		_mm_stream_si128((__m128i *)dst + 2, c);
+		_mm_stream_si128((__m128i *)dst + 3, d);
+		dst += PMEM_CACHELINE;
+		src += PMEM_CACHELINE;
+	}
+
+	len %= PMEM_CACHELINE;
+	if (len) {
+		memcpy(dst, src, len);
+		pmem_flush(state, dst, len);
+	}
+}
+#else
+static int pmem_detect_flush(void)
+{
+	return PMEM_FLUSH_NONE;
+}
+
+static void pmem_flush(struct pmem_state *state, const void *addr, size_t len)
+{
+}
+
+static void pmem_drain(struct pmem_state *state)
+{
+}
+
+static void pmem_memcpy(struct pmem_state *state, void *dst, const void *src,
+			size_t len)
+{
+	memcpy(dst, src, len);
+}
+#endif
+
+static void pmem_iter_init(struct pmem_iter *it, struct iovec *iov,
+			   size_t iov_cnt)
+{
+	it->iov = iov;
+	it->iov_cnt = iov_cnt;
+	it->idx = 0;
+	it->pos = 0;
+}
+
+/* Copy len bytes out of the iovec to persistent memory */
+static void pmem_iter_to_pmem(struct pmem_state *state, struct pmem_iter *it,
+			      void *dst, size_t len)
+{
+	size_t n;
+
+	while (len && it->idx < it->iov_cnt) {
+		n = min(len, it->iov[it->idx].iov_len - it->pos);
+		pmem_memcpy(state, dst, it->iov[it->idx].iov_base + it->pos, n);
+		dst += n;
+		len -= n;
+		it->pos += n;
+		if (it->pos == it->iov[it->idx].iov_len) {
+			it->idx++;
+			it->pos = 0;
+		}
+	}
+}
+
+/* Copy len bytes into the iovec, zeros if src is NULL */
+static void pmem_iter_from(struct pmem_iter *it, const void *src, size_t len)
+{
+	size_t n;
+
+	while (len && it->idx < it->iov_cnt) {
+		n = min(len, it->iov[it->idx].iov_len - it->pos);
+		if (src) {
+			memcpy(it->iov[it->idx].iov_base + it->pos, src, n);
+			src += n;
+		} else {
+			memset(it->iov[it->idx].iov_base + it->pos, 0, n);
+		}
+		len -= n;
+		it->pos += n;
+		if (it->pos == it->iov[it->idx].iov_len) {
+			it->idx++;
+			it->pos = 0;
+		}
+	}
+}
+
+static inline void *pmem_block(struct pmem_state *state, uint64_t blk)
+{
+	return state->data + blk * state->block_size;
+}
+
+/* Allocate a free data block. Caller holds free_lock. */
+static uint64_t pmem_alloc_block(struct pmem_state *state)
+{
+	uint64_t w = state->free_hint, nr_words = (state->nr_blocks + 63) / 64;
+	uint64_t blk;
+
+	while (!state->free_map[w])
+		w = (w + 1) % nr_words;
+
+	blk = w * 64 + __builtin_ctzll(state->free_map[w]);
+	state->free_map[w] &= ~(1ULL << (blk % 64));
+	state->free_hint = w;
+	state->nr_free--;
+	return blk;
+}
+
+static void pmem_free_blocks(struct pmem_state *state, uint64_t *blks, int nr)
+{
+	int i;
+
+	if (!nr)
+		return;
+
+	pthread_mutex_lock(&state->free_lock);
+	for (i = 0; i < nr; i++)
+		state->free_map[blks[i] / 64] |= 1ULL << (blks[i] % 64);
+	state->nr_free += nr;
+	pthread_cond_broadcast(&state->free_cond);
+	pthread_mutex_unlock(&state->free_lock);
+}
+
+/*
+ * Point the LBA at a new entry and return the block it replaced, or
+ * 0 if it was unmapped. The generation is bumped so readers of the
+ * old block notice.
+ */
+static uint64_t pmem_publish(struct pmem_state *state, uint64_t lba,
+			     uint64_t blk)
+{
+	uint64_t old, new;
+
+	old = __atomic_load_n(&state->map[lba], __ATOMIC_ACQUIRE);
+	do {
+		new = PMEM_ENTRY(PMEM_ENTRY_GEN(old) + 1, blk);
+	} while (!__atomic_compare_exchange_n(&state->map[lba], &old, new,
+					      false, __ATOMIC_RELEASE,
+					      __ATOMIC_ACQUIRE));
+	pmem_flush(state, &state->map[lba], sizeof(uint64_t));
+
+	return PMEM_ENTRY_BLK(old);
+}
+
+#define PMEM_BATCH	64
+
+static int pmem_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	struct pmem_state *state = tcmur_dev_get_private(dev);
+	uint64_t lba = offset / state->block_size;
+	uint64_t nr = length / state->block_size, done = 0;
+	uint64_t blks[PMEM_BATCH], old[PMEM_BATCH];
+	struct pmem_iter it;
+	int i, n, nr_old;
+
+	if (lba + nr > state->nr_lbas)
+		return TCMU_STS_RANGE;
+
+	pmem_iter_init(&it, iov, iov_cnt);
+	while (done < nr) {
+		n = min(nr - done, (uint64_t)PMEM_BATCH);
+
+		pthread_mutex_lock(&state->free_lock);
+		while (state->nr_free < n)
+			pthread_cond_wait(&state->free_cond, &state->free_lock);
+		for (i = 0; i < n; i++)
+			blks[i] = pmem_alloc_block(state);
+		pthread_mutex_unlock(&state->free_lock);
+
+		for (i = 0; i < n; i++)
+			pmem_iter_to_pmem(state, &it, pmem_block(state, blks[i]),
+					  state->block_size);
+		/* the data must be durable before it is mapped */
+		pmem_drain(state);
+
+		nr_old = 0;
+		for (i = 0; i < n; i++) {
+			old[nr_old] = pmem_publish(state, lba + done + i,
+						   blks[i] + 1);
+			if (old[nr_old])
+				old[nr_old++]--;
+		}
+		/* and the map before the old blocks can be reused */
+		pmem_drain(state);
+		pmem_free_blocks(state, old, nr_old);
+
+		done += n;
+	}
+
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int pmem_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	struct pmem_state *state = tcmur_dev_get_private(dev);
+	uint64_t lba = offset / state->block_size;
+	uint64_t nr = length / state->block_size, i, entry, blk;
+	struct pmem_iter it, start;
+
+	if (lba + nr > state->nr_lbas)
+		return TCMU_STS_RANGE;
+
+	pmem_iter_init(&it, iov, iov_cnt);
+	for (i = 0; i < nr; i++) {
+		start = it;
+		do {
+			it = start;
+			entry = __atomic_load_n(&state->map[lba + i],
+						__ATOMIC_ACQUIRE);
+			blk = PMEM_ENTRY_BLK(entry);
+			pmem_iter_from(&it, blk ? pmem_block(state, blk - 1) :
+				       NULL, state->block_size);
+			/* retry if the block was rewritten while copying */
+		} while (__atomic_load_n(&state->map[lba + i],
+					 __ATOMIC_ACQUIRE) != entry);
+	}
+
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int pmem_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      uint64_t off, uint64_t len)
+{
+	struct pmem_state *state = tcmur_dev_get_private(dev);
+	uint64_t lba = off / state->block_size;
+	uint64_t nr = len / state->block_size, i, old[PMEM_BATCH];
+	int nr_old = 0;
+
+	if (lba + nr > state->nr_lbas)
+		return TCMU_STS_RANGE;
+
+	for (i = 0; i < nr; i++) {
+		old[nr_old] = pmem_publish(state, lba + i, 0);
+		if (old[nr_old])
+			old[nr_old++]--;
+
+		if (nr_old == PMEM_BATCH || i == nr - 1) {
+			pmem_drain(state);
+			pmem_free_blocks(state, old, nr_old);
+			nr_old = 0;
+		}
+	}
+
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static int pmem_flush_cmd(struct tcmu_device *dev, struct tcmur_cmd *cmd)
+{
+	struct pmem_state *state = tcmur_dev_get_private(dev);
+
+	if (state->flush_type == PMEM_FLUSH_NONE) {
+		if (msync(state->base, state->len, MS_SYNC)) {
+			tcmu_dev_err(dev, "msync failed: %m\n");
+			return TCMU_STS_WR_ERR;
+		}
+	} else {
+		/* writes are durable on completion, this is only a barrier */
+		pmem_drain(state);
+	}
+
+	tcmur_cmd_complete(dev, cmd, TCMU_STS_OK);
+	return TCMU_STS_OK;
+}
+
+static void pmem_persist(struct pmem_state *state, void *addr, size_t len)
+{
+	if (state->flush_type == PMEM_FLUSH_NONE) {
+		msync(state->base, state->len, MS_SYNC);
+		return;
+	}
+	pmem_flush(state, addr, len);
+	pmem_drain(state);
+}
+
+/* Build the free block map from the blocks not referenced by the map */
+static int pmem_scan(struct tcmu_device *dev, struct pmem_state *state)
+{
+	uint64_t lba, blk, nr_words = (state->nr_blocks + 63) / 64;
+
+	state->free_map = malloc(nr_words * sizeof(uint64_t));
+	if (!state->free_map)
+		return -ENOMEM;
+	memset(state->free_map, 0xff, nr_words * sizeof(uint64_t));
+	if (state->nr_blocks % 64)
+		state->free_map[nr_words - 1] =
+			(1ULL << (state->nr_blocks % 64)) - 1;
+	state->nr_free = state->nr_blocks;
+
+	for (lba = 0; lba < state->nr_lbas; lba++) {
+		blk = PMEM_ENTRY_BLK(state->map[lba]);
+		if (!blk)
+			continue;
+		blk--;
+
+		if (blk >= state->nr_blocks ||
+		    !(state->free_map[blk / 64] & (1ULL << (blk % 64)))) {
+			tcmu_dev_err(dev, "LBA %"PRIu64" maps invalid or shared block %"PRIu64"\n",
+				     lba, blk);
+			return -EINVAL;
+		}
+		state->free_map[blk / 64] &= ~(1ULL << (blk % 64));
+		state->nr_free--;
+	}
+
+	return 0;
+}
+
+static int pmem_map_file(struct tcmu_device *dev, struct pmem_state *state,
+			 const char *path)
+{
+	state->flush_type = pmem_detect_flush();
+	if (state->flush_type != PMEM_FLUSH_NONE) {
+		state->base = mmap(NULL, state->len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED_VALIDATE | MAP_SYNC, state->fd, 0);
+		if (state->base != MAP_FAILED)
+			return 0;
+
+		if (errno != EOPNOTSUPP && errno != EINVAL) {
+			tcmu_dev_err(dev, "Could not map %s: %m\n", path);
+			return -errno;
+		}
+		tcmu_dev_warn(dev, "%s is not on a DAX filesystem, falling back to msync\n",
+			      path);
+		state->flush_type = PMEM_FLUSH_NONE;
+	}
+
+	state->base = mmap(NULL, state->len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, state->fd, 0);
+	if (state->base == MAP_FAILED) {
+		tcmu_dev_err(dev, "Could not map %s: %m\n", path);
+		return -errno;
+	}
+	return 0;
+}
+
+static int pmem_open(struct tcmu_device *dev, bool reopen)
+{
+	struct pmem_state *state;
+	struct pmem_hdr *hdr;
+	uint64_t map_len;
+	struct stat st;
+	char *config;
+	bool new_file;
+	int ret;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	tcmur_dev_set_private(dev, state);
+
+	state->block_size = tcmu_dev_get_block_size(dev);
+	state->nr_lbas = tcmu_dev_get_num_lbas(dev);
+	state->nr_blocks = state->nr_lbas + PMEM_NR_SPARE;
+	if (state->nr_blocks >= PMEM_BLK_MASK) {
+		ret = -EINVAL;
+		goto free_state;
+	}
+
+	map_len = round_up(state->nr_lbas * sizeof(uint64_t),
+			   (uint64_t)PMEM_HDR_LEN);
+	state->len = PMEM_HDR_LEN + map_len +
+			state->nr_blocks * state->block_size;
+
+	state->fd = open(config, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (state->fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open %s: %m\n", config);
+		goto free_state;
+	}
+
+	if (fstat(state->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+	new_file = st.st_size < PMEM_HDR_LEN;
+
+	if (new_file || st.st_size < state->len) {
+		/* DAX needs the blocks allocated, not just a sparse file */
+		ret = posix_fallocate(state->fd, 0, state->len);
+		if (ret) {
+			tcmu_dev_err(dev, "Could not allocate %zu bytes for %s: %d\n",
+				     state->len, config, ret);
+			ret = -ret;
+			goto close_fd;
+		}
+	}
+
+	ret = pthread_mutex_init(&state->free_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto close_fd;
+	}
+	ret = pthread_cond_init(&state->free_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pmem_map_file(dev, state, config);
+	if (ret)
+		goto destroy_cond;
+
+	hdr = state->base;
+	if (new_file) {
+		memset(hdr, 0, PMEM_HDR_LEN);
+		hdr->magic = PMEM_MAGIC;
+		hdr->version = PMEM_VERSION;
+		hdr->block_size = state->block_size;
+		hdr->nr_lbas = state->nr_lbas;
+		hdr->nr_blocks = state->nr_blocks;
+		hdr->map_off = PMEM_HDR_LEN;
+		hdr->data_off = PMEM_HDR_LEN + map_len;
+		pmem_persist(state, hdr, sizeof(*hdr));
+	} else if (hdr->magic != PMEM_MAGIC || hdr->version != PMEM_VERSION ||
+		   hdr->block_size != state->block_size ||
+		   hdr->nr_lbas != state->nr_lbas ||
+		   hdr->nr_blocks != state->nr_blocks) {
+		tcmu_dev_err(dev, "%s does not match the device (block size %u, %"PRIu64" LBAs)\n",
+			     config, hdr->block_size, hdr->nr_lbas);
+		ret = -EINVAL;
+		goto unmap;
+	}
+	state->map = state->base + hdr->map_off;
+	state->data = state->base + hdr->data_off;
+
+	ret = pmem_scan(dev, state);
+	if (ret)
+		goto unmap;
+
+	/* with MAP_SYNC a completed write is already durable */
+	tcmu_dev_set_write_cache_enabled(dev,
+				state->flush_type == PMEM_FLUSH_NONE);
+	tcmu_dev_dbg(dev, "config %s, %s, %"PRIu64" free blocks\n",
+		     tcmu_dev_get_cfgstring(dev),
+		     state->flush_type == PMEM_FLUSH_NONE ? "msync" : "DAX",
+		     state->nr_free);
+	return 0;
+
+unmap:
+	free(state->free_map);
+	munmap(state->base, state->len);
+destroy_cond:
+	pthread_cond_destroy(&state->free_cond);
+destroy_lock:
+	pthread_mutex_destroy(&state->free_lock);
+close_fd:
+	close(state->fd);
+free_state:
+	free(state);
+	return ret;
+}
+
+static void pmem_close(struct tcmu_device *dev)
+{
+	struct pmem_state *state = tcmur_dev_get_private(dev);
+
+	if (state->flush_type == PMEM_FLUSH_NONE &&
+	    msync(state->base, state->len, MS_SYNC))
+		tcmu_dev_warn(dev, "msync failed on close: %m\n");
+
+	munmap(state->base, state->len);
+	free(state->free_map);
+	pthread_cond_destroy(&state->free_cond);
+	pthread_mutex_destroy(&state->free_lock);
+	close(state->fd);
+	free(state);
+}
+
+static const char pmem_cfg_desc[] =
+	"Path to a file on a DAX filesystem. Other filesystems are "
+	"supported with msync for persistence.";
+
+static struct tcmur_handler pmem_handler = {
+	.cfg_desc = pmem_cfg_desc,
+
+	.open = pmem_open,
+	.close = pmem_close,
+	.read = pmem_read,
+	.write = pmem_write,
+	.flush = pmem_flush_cmd,
+	.unmap = pmem_unmap,
+	.name = "Persistent Memory Handler",
+	.subtype = "pmem",
+	.nr_threads = 0, /* commands complete inline */
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&pmem_handler);
+}
@@ -74,6 +74,15 @@ static struct bdev_ops qcow_ops;
 static struct bdev_ops qcow2_ops;
 static struct bdev_ops raw_ops;
 
+static struct tcmu_tunable qcow_l2_cache_tunable = {
+	.name = "qcow_l2_cache_size",
+	.desc = "L2 and refcount table clusters cached per image (applied at open)",
+	.type = TCMU_TUNABLE_INT,
+	.def = L2_CACHE_SIZE,
+	.min = 1,
+	.max = 4096,
+};
+
 struct bdev {
 	char *config;
 	void *private;
@@ -82,6 +91,8 @@ struct bdev {
 	/* from TCMU configfs configuration */
 	int64_t size;
 	uint32_t block_size;
+	/* L2 and refcount cache entries, see qcow_l2_cache_tunable */
+	unsigned int cache_size;
 
 	int fd;		/* image file descriptor */
 };
@@ -189,8 +200,6 @@ static void qcow2_header_bswap(struct qcow2_header *be, struct qcow2_header *dst
 	}
 }
 
-#define RC_CACHE_SIZE L2_CACHE_SIZE
-
 struct qcow_state
 {
 	int fd;
@@ -208,9 +217,10 @@ struct qcow_state
 	uint64_t *l1_table;
 
 	/* L2 cache */
+	unsigned int cache_size;
 	uint64_t *l2_cache;
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-	int l2_cache_counts[L2_CACHE_SIZE];
+	uint64_t *l2_cache_offsets;
+	int *l2_cache_counts;
 
 	/* cluster decompression cache */
 	uint8_t *cluster_cache;
@@ -230,8 +240,8 @@ struct qcow_state
 	/* refcount block cache */
 	unsigned int refcount_order;
 	void *rc_cache;
-	uint64_t rc_cache_offsets[RC_CACHE_SIZE];
-	int rc_cache_counts[RC_CACHE_SIZE];
+	uint64_t *rc_cache_offsets;
+	int *rc_cache_counts;
 
 	uint64_t (*block_alloc) (struct qcow_state *s, size_t size);
 	int (*set_refcount) (struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
@@ -410,6 +420,7 @@ static int qcow_setup_backing_file(struct bdev *bdev, struct qcow_header *header
 	/* backing file settings copied from overlay */
 	s->backing_image->size = bdev->size;
 	s->backing_image->block_size = bdev->block_size;
+	s->backing_image->cache_size = bdev->cache_size;
 
 	/* backing file pathname may be relative to the overlay image */
 	dirfd = get_dirfd(bdev->fd);
@@ -513,8 +524,11 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	s->cache_size = bdev->cache_size;
+	s->l2_cache = calloc(s->cache_size, s->l2_size * sizeof(uint64_t));
+	s->l2_cache_offsets = calloc(s->cache_size, sizeof(uint64_t));
+	s->l2_cache_counts = calloc(s->cache_size, sizeof(int));
+	if (!s->l2_cache || !s->l2_cache_offsets || !s->l2_cache_counts) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
@@ -542,6 +556,8 @@ fail:
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
+	free(s->l2_cache_counts);
+	free(s->l2_cache_offsets);
 	free(s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
@@ -634,8 +650,11 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	s->cache_size = bdev->cache_size;
+	s->l2_cache = calloc(s->cache_size, s->l2_size * sizeof(uint64_t));
+	s->l2_cache_offsets = calloc(s->cache_size, sizeof(uint64_t));
+	s->l2_cache_counts = calloc(s->cache_size, sizeof(int));
+	if (!s->l2_cache || !s->l2_cache_offsets || !s->l2_cache_counts) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
@@ -667,8 +686,10 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	}
 
 	s->refcount_order = header.refcount_order;
-	s->rc_cache = calloc(RC_CACHE_SIZE, s->cluster_size);
-	if (s->rc_cache == NULL) {
+	s->rc_cache = calloc(s->cache_size, s->cluster_size);
+	s->rc_cache_offsets = calloc(s->cache_size, sizeof(uint64_t));
+	s->rc_cache_counts = calloc(s->cache_size, sizeof(int));
+	if (!s->rc_cache || !s->rc_cache_offsets || !s->rc_cache_counts) {
 		tcmu_err("Failed to allocate refcount cache\n");
 		goto fail;
 	}
@@ -689,8 +710,12 @@ fail:
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
+	free(s->rc_cache_counts);
+	free(s->rc_cache_offsets);
 	free(s->rc_cache);
 	free(s->refcount_table);
+	free(s->l2_cache_counts);
+	free(s->l2_cache_offsets);
 	free(s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
@@ -710,8 +735,12 @@ static void qcow_image_close(struct bdev *bdev)
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	free(s->l1_table);
+	free(s->l2_cache_counts);
+	free(s->l2_cache_offsets);
 	free(s->l2_cache);
 	free(s->refcount_table);
+	free(s->rc_cache_counts);
+	free(s->rc_cache_offsets);
 	free(s->rc_cache);
 	free(s);
 }
@@ -725,10 +754,10 @@ static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
 	ssize_t read;
 
 	/* l2 cache lookup */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
+	for (i = 0; i < s->cache_size; i++) {
 		if (l2_offset == s->l2_cache_offsets[i]) {
 			if (++s->l2_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < L2_CACHE_SIZE; j++) {
+				for (j = 0; j < s->cache_size; j++) {
 					s->l2_cache_counts[j] >>= 1;
 				}
 			}
@@ -738,7 +767,7 @@ static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
 		}
 	}
 	/* not found, evict least used entry */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
+	for (i = 0; i < s->cache_size; i++) {
 		if (s->l2_cache_counts[i] < min_count) {
 			min_count = s->l2_cache_counts[i];
 			min_index = i;
@@ -869,10 +898,10 @@ static void *rc_cache_lookup(struct qcow_state *s, uint64_t rc_offset)
 	ssize_t read;
 
 	/* rc cache lookup */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
+	for (i = 0; i < s->cache_size; i++) {
 		if (rc_offset == s->rc_cache_offsets[i]) {
 			if (++s->rc_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < RC_CACHE_SIZE; j++) {
+				for (j = 0; j < s->cache_size; j++) {
 					s->rc_cache_counts[j] >>= 1;
 				}
 			}
@@ -881,7 +910,7 @@ static void *rc_cache_lookup(struct qcow_state *s, uint64_t rc_offset)
 		}
 	}
 	/* not found, evict least used entry */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
+	for (i = 0; i < s->cache_size; i++) {
 		if (s->rc_cache_counts[i] < min_count) {
 			min_count = s->rc_cache_counts[i];
 			min_index = i;
@@ -1398,6 +1427,7 @@ static int qcow_open(struct tcmu_device *dev, bool reopen)
 	tcmur_dev_set_private(dev, bdev);
 
 	bdev->block_size = tcmu_dev_get_block_size(dev);
+	bdev->cache_size = tcmur_dev_get_tunable(dev, &qcow_l2_cache_tunable);
 	bdev->size = tcmu_cfgfs_dev_get_info_u64(dev, "Size", &ret);
 	if (ret < 0) {
 		tcmu_err("Could not get device size\n");
@@ -1516,5 +1546,11 @@ static struct tcmur_handler qcow_handler = {
 /* Entry point must be named "handler_init". */
 int handler_init(void)
 {
+	int ret;
+
+	ret = tcmu_register_tunable(&qcow_l2_cache_tunable);
+	if (ret)
+		return ret;
+
 	return tcmur_register_handler(&qcow_handler);
 }
@@ -54,14 +54,29 @@ static inline bool do_mlock(struct tcmu_device *td)
 	return false;	    //XXX Needs a config switch
 }
 
+static struct tcmu_tunable ram_nt_copy_tunable = {
+	.name = "ram_nt_copy_min",
+	.desc = "READs this large or larger bypass the CPU cache when copied to the data area, 0 disables",
+	.type = TCMU_TUNABLE_SIZE,
+	.def = 256 * 1024,
+	.min = 0,
+	.max = INT32_MAX,
+};
+
 static int tcmu_ram_read(struct tcmu_device *td, struct tcmur_cmd *cmd,
 	      struct iovec *iov, size_t niov, size_t size, off_t seekpos)
 {
 	state_t s = tcmur_dev_get_private(td);
+	int64_t nt_min;
+
 	if (seekpos >= s->size || seekpos + size > s->size)
 		return TCMU_STS_RANGE;
 
-	tcmu_memcpy_into_iovec(iov, niov, s->ram + seekpos, size);
+	nt_min = tcmur_dev_get_tunable(td, &ram_nt_copy_tunable);
+	if (nt_min && size >= nt_min)
+		tcmu_memcpy_into_iovec_nt(iov, niov, s->ram + seekpos, size);
+	else
+		tcmu_memcpy_into_iovec(iov, niov, s->ram + seekpos, size);
 	return TCMU_STS_OK;
 }
 
@@ -225,6 +240,12 @@ struct tcmur_handler tcmu_ram_handler = {
 
 int handler_init(void)
 {
+	int ret;
+
+	ret = tcmu_register_tunable(&ram_nt_copy_tunable);
+	if (ret)
+		return ret;
+
 	return tcmur_register_handler(&tcmu_ram_handler);
 }
 
@@ -19,6 +19,7 @@
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <endian.h>
 #include <errno.h>
 #include <pthread.h>
@@ -66,6 +67,11 @@
 #endif
 #endif
 
+/* rbd_set_image_notification and rbd_poll_io_events, in luminous librbd */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(1, 12, 0)
+#define RBD_POLL_SUPPORT
+#endif
+
 #define TCMU_RBD_LOCKER_TAG_KEY "tcmu_rbd_locker_tag"
 #define TCMU_RBD_LOCKER_TAG_FMT "tcmu_tag=%hu,rbd_client=%s"
 #define TCMU_RBD_LOCKER_BUF_LEN 256
@@ -80,6 +86,54 @@ struct tcmu_rbd_state {
 	char *osd_op_timeout;
 	char *conf_path;
 	char *id;
+
+	/* set if cluster and io_ctx are shared, see tcmu_rbd_cluster_get */
+	struct tcmu_rbd_cluster *shared;
+	struct tcmu_rbd_pool *pool;
+
+	/* completions are reaped by tcmu_rbd_poll_completions if >= 0 */
+	int event_fd;
+};
+
+/*
+ * With rbd_share_cluster set, devices using the same id, conf file and
+ * osd_op_timeout share one cluster connection, and one ioctx per pool,
+ * instead of each having its own messenger threads and monitor session.
+ */
+struct tcmu_rbd_cluster {
+	struct list_node entry;
+
+	char *id;
+	char *conf_path;
+	char *osd_op_timeout;	/* as passed in, before timer_check_and_set_def */
+
+	rados_t cluster;
+	int refcnt;
+	/* blacklisted or timed out, new devices get a new connection */
+	bool stale;
+	struct list_head pools;
+};
+
+struct tcmu_rbd_pool {
+	struct list_node entry;
+
+	char *name;
+	rados_ioctx_t io_ctx;
+	int refcnt;
+};
+
+static LIST_HEAD(rbd_clusters);
+static pthread_mutex_t rbd_clusters_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rbd_nr_clusters;
+static int rbd_nr_shared_devs;
+
+static struct tcmu_tunable rbd_share_cluster_tunable = {
+	.name = "rbd_share_cluster",
+	.desc = "Share RADOS cluster connections between rbd devices with the same id, conf and osd_op_timeout (applied at open)",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 0,
+	.min = 0,
+	.max = 1,
 };
 
 enum rbd_aio_type {
@@ -117,6 +171,10 @@ static void tcmu_rbd_service_status_update(struct tcmu_device *dev,
 	char *status_buf = NULL;
 	int ret;
 
+	/* not registered, see tcmu_rbd_service_register */
+	if (state->shared)
+		return;
+
 	ret = asprintf(&status_buf, "%s%c%s%c", "lock_owner", '\0',
 		       has_lock ? "true" : "false", '\0');
 	if (ret < 0) {
@@ -143,6 +201,15 @@ static int tcmu_rbd_service_register(struct tcmu_device *dev)
 	char *image_id_buf = NULL;
 	int ret;
 
+	/*
+	 * A cluster handle can only register one daemon in the service
+	 * map, and the map describes one image per daemon.
+	 */
+	if (state->shared) {
+		tcmu_dev_dbg(dev, "Not registering shared cluster connection to the service map.\n");
+		return 0;
+	}
+
 	ret = uname(&u);
 	if (ret < 0) {
 		ret = -errno;
@@ -343,19 +410,6 @@ static void tcmu_rbd_detect_device_class(struct tcmu_device *dev)
 	free(crush_rule);
 }
 
-static void tcmu_rbd_image_close(struct tcmu_device *dev)
-{
-	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
-
-	rbd_close(state->image);
-	rados_ioctx_destroy(state->io_ctx);
-	rados_shutdown(state->cluster);
-
-	state->cluster = NULL;
-	state->io_ctx = NULL;
-	state->image = NULL;
-}
-
 static int timer_check_and_set_def(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
@@ -427,7 +481,7 @@ set:
 			      state->osd_op_timeout);
 }
 
-static int tcmu_rbd_image_open(struct tcmu_device *dev)
+static int tcmu_rbd_cluster_connect(struct tcmu_device *dev)
 {
 	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
 	int ret;
@@ -461,13 +515,226 @@ static int tcmu_rbd_image_open(struct tcmu_device *dev)
 		goto rados_shutdown;
 	}
 
-	tcmu_rbd_detect_device_class(dev);
-	ret = rados_ioctx_create(state->cluster, state->pool_name,
-				 &state->io_ctx);
+	return 0;
+
+rados_shutdown:
+	rados_shutdown(state->cluster);
+	state->cluster = NULL;
+	return ret;
+}
+
+static bool tcmu_rbd_str_eq(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static void tcmu_rbd_cluster_free(struct tcmu_rbd_cluster *c)
+{
+	free(c->id);
+	free(c->conf_path);
+	free(c->osd_op_timeout);
+	free(c);
+}
+
+/* Called with rbd_clusters_lock held */
+static struct tcmu_rbd_cluster *tcmu_rbd_cluster_find(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_cluster *c;
+	int ret;
+
+	list_for_each(&rbd_clusters, c, entry) {
+		if (!c->stale && tcmu_rbd_str_eq(c->id, state->id) &&
+		    tcmu_rbd_str_eq(c->conf_path, state->conf_path) &&
+		    tcmu_rbd_str_eq(c->osd_op_timeout, state->osd_op_timeout)) {
+			state->cluster = c->cluster;
+			return c;
+		}
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	list_head_init(&c->pools);
+
+	if ((state->id && !(c->id = strdup(state->id))) ||
+	    (state->conf_path && !(c->conf_path = strdup(state->conf_path))) ||
+	    (state->osd_op_timeout &&
+	     !(c->osd_op_timeout = strdup(state->osd_op_timeout))))
+		goto free_cluster;
+
+	ret = tcmu_rbd_cluster_connect(dev);
+	if (ret < 0)
+		goto free_cluster;
+
+	c->cluster = state->cluster;
+	list_add_tail(&rbd_clusters, &c->entry);
+	rbd_nr_clusters++;
+	return c;
+
+free_cluster:
+	tcmu_rbd_cluster_free(c);
+	return NULL;
+}
+
+static int tcmu_rbd_cluster_get(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_cluster *c;
+	struct tcmu_rbd_pool *pool;
+	int ret = 0;
+
+	pthread_mutex_lock(&rbd_clusters_lock);
+	c = tcmu_rbd_cluster_find(dev);
+	if (!c) {
+		ret = -EIO;
+		goto unlock;
+	}
+
+	list_for_each(&c->pools, pool, entry) {
+		if (!strcmp(pool->name, state->pool_name))
+			goto found_pool;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		ret = -ENOMEM;
+		goto put_cluster;
+	}
+
+	pool->name = strdup(state->pool_name);
+	if (!pool->name) {
+		ret = -ENOMEM;
+		goto free_pool;
+	}
+
+	ret = rados_ioctx_create(c->cluster, state->pool_name, &pool->io_ctx);
 	if (ret < 0) {
 		tcmu_dev_err(dev, "Could not create ioctx for pool %s. (Err %d)\n",
 			     state->pool_name, ret);
-		goto rados_shutdown;
+		goto free_pool;
+	}
+	list_add_tail(&c->pools, &pool->entry);
+
+found_pool:
+	pool->refcnt++;
+	c->refcnt++;
+	rbd_nr_shared_devs++;
+
+	state->shared = c;
+	state->pool = pool;
+	state->io_ctx = pool->io_ctx;
+
+	tcmu_dev_info(dev, "Using shared cluster connection, %d rbd devices on %d connections\n",
+		      rbd_nr_shared_devs, rbd_nr_clusters);
+	goto unlock;
+
+free_pool:
+	free(pool->name);
+	free(pool);
+put_cluster:
+	if (!c->refcnt) {
+		list_del(&c->entry);
+		rbd_nr_clusters--;
+		rados_shutdown(c->cluster);
+		tcmu_rbd_cluster_free(c);
+	}
+unlock:
+	pthread_mutex_unlock(&rbd_clusters_lock);
+	if (ret)
+		state->cluster = NULL;
+	return ret;
+}
+
+static void tcmu_rbd_cluster_put(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	struct tcmu_rbd_cluster *c = state->shared;
+	struct tcmu_rbd_pool *pool = state->pool;
+
+	pthread_mutex_lock(&rbd_clusters_lock);
+	if (!--pool->refcnt) {
+		list_del(&pool->entry);
+		rados_ioctx_destroy(pool->io_ctx);
+		free(pool->name);
+		free(pool);
+	}
+
+	rbd_nr_shared_devs--;
+	if (!--c->refcnt) {
+		list_del(&c->entry);
+		rbd_nr_clusters--;
+		rados_shutdown(c->cluster);
+		tcmu_rbd_cluster_free(c);
+	}
+
+	tcmu_dev_dbg(dev, "Released shared cluster connection, %d rbd devices on %d connections\n",
+		     rbd_nr_shared_devs, rbd_nr_clusters);
+	pthread_mutex_unlock(&rbd_clusters_lock);
+
+	state->shared = NULL;
+	state->pool = NULL;
+}
+
+/*
+ * A blacklisted or hung client must not be handed to new devices, so
+ * devices reopened to recover get a fresh connection. The old one is
+ * shut down when its last device is closed.
+ */
+static void tcmu_rbd_cluster_set_stale(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	if (!state->shared)
+		return;
+
+	pthread_mutex_lock(&rbd_clusters_lock);
+	state->shared->stale = true;
+	pthread_mutex_unlock(&rbd_clusters_lock);
+}
+
+static void tcmu_rbd_image_close(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	rbd_close(state->image);
+	if (state->shared) {
+		tcmu_rbd_cluster_put(dev);
+	} else {
+		rados_ioctx_destroy(state->io_ctx);
+		rados_shutdown(state->cluster);
+	}
+
+	state->cluster = NULL;
+	state->io_ctx = NULL;
+	state->image = NULL;
+}
+
+static int tcmu_rbd_image_open(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	if (tcmur_dev_get_tunable(dev, &rbd_share_cluster_tunable)) {
+		ret = tcmu_rbd_cluster_get(dev);
+		if (ret < 0)
+			return ret;
+		tcmu_rbd_detect_device_class(dev);
+	} else {
+		ret = tcmu_rbd_cluster_connect(dev);
+		if (ret < 0)
+			return ret;
+
+		tcmu_rbd_detect_device_class(dev);
+		ret = rados_ioctx_create(state->cluster, state->pool_name,
+					 &state->io_ctx);
+		if (ret < 0) {
+			tcmu_dev_err(dev, "Could not create ioctx for pool %s. (Err %d)\n",
+				     state->pool_name, ret);
+			goto rados_shutdown;
+		}
 	}
 
 	ret = rbd_open(state->io_ctx, state->image_name, &state->image, NULL);
@@ -487,6 +754,12 @@ rbd_close:
 	rbd_close(state->image);
 	state->image = NULL;
 rados_destroy:
+	if (state->shared) {
+		tcmu_rbd_cluster_put(dev);
+		state->cluster = NULL;
+		state->io_ctx = NULL;
+		return ret;
+	}
 	rados_ioctx_destroy(state->io_ctx);
 	state->io_ctx = NULL;
 rados_shutdown:
@@ -796,6 +1069,8 @@ static void tcmu_rbd_check_excl_lock_enabled(struct tcmu_device *dev)
 
 static void tcmu_rbd_state_free(struct tcmu_rbd_state *state)
 {
+	if (state->event_fd >= 0)
+		close(state->event_fd);
 	if (state->conf_path)
 		free(state->conf_path);
 	if (state->osd_op_timeout)
@@ -831,6 +1106,34 @@ static int tcmu_rbd_check_image_size(struct tcmu_device *dev, uint64_t new_size)
 	return 0;
 }
 
+/*
+ * Have librbd queue completions on the image and signal an eventfd,
+ * instead of calling rbd_finish_aio_generic from its finisher thread.
+ * The device keeps using callbacks if this fails.
+ */
+static void tcmu_rbd_poll_setup(struct tcmu_device *dev)
+{
+#ifdef RBD_POLL_SUPPORT
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	int fd, ret;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		tcmu_dev_warn(dev, "Could not create completion eventfd: %m\n");
+		return;
+	}
+
+	ret = rbd_set_image_notification(state->image, fd, EVENT_TYPE_EVENTFD);
+	if (ret < 0) {
+		tcmu_dev_warn(dev, "Could not set image notification. (Err %d)\n",
+			      ret);
+		close(fd);
+		return;
+	}
+	state->event_fd = fd;
+#endif
+}
+
 static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 {
 	rbd_image_info_t image_info;
@@ -843,6 +1146,7 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 	state = calloc(1, sizeof(*state));
 	if (!state)
 		return -ENOMEM;
+	state->event_fd = -1;
 	tcmur_dev_set_private(dev, state);
 
 	dev_cfg_dup = strdup(tcmu_dev_get_cfgstring(dev));
@@ -952,6 +1256,9 @@ static int tcmu_rbd_open(struct tcmu_device *dev, bool reopen)
 				    tcmu_dev_get_block_size(dev), false);
 	tcmu_dev_set_write_cache_enabled(dev, 0);
 
+	if (tcmur_dev_polls_completions(dev))
+		tcmu_rbd_poll_setup(dev);
+
 	free(dev_cfg_dup);
 	return 0;
 
@@ -974,6 +1281,7 @@ static void tcmu_rbd_close(struct tcmu_device *dev)
 
 static int tcmu_rbd_handle_blacklisted_cmd(struct tcmu_device *dev)
 		{
+	tcmu_rbd_cluster_set_stale(dev);
 	tcmu_notify_lock_lost(dev);
 	/*
 	 * This will happen during failback normally, because
@@ -993,6 +1301,7 @@ static int tcmu_rbd_handle_blacklisted_cmd(struct tcmu_device *dev)
 static int tcmu_rbd_handle_timedout_cmd(struct tcmu_device *dev)
 		{
 	tcmu_dev_err(dev, "Timing out cmd.\n");
+	tcmu_rbd_cluster_set_stale(dev);
 	tcmu_notify_conn_lost(dev);
 
 	/*
@@ -1125,6 +1434,62 @@ static void rbd_finish_aio_generic(rbd_completion_t completion,
 	free(aio_cb);
 }
 
+static int tcmu_rbd_aio_create_completion(struct tcmu_device *dev,
+					  struct rbd_aio_cb *aio_cb,
+					  rbd_completion_t *completion)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	/* polled completions are finished by tcmu_rbd_poll_completions */
+	if (state->event_fd >= 0)
+		return rbd_aio_create_completion(aio_cb, NULL, completion);
+
+	return rbd_aio_create_completion(aio_cb,
+					 (rbd_callback_t) rbd_finish_aio_generic,
+					 completion);
+}
+
+#ifdef RBD_POLL_SUPPORT
+
+#define TCMU_RBD_POLL_BATCH 32
+
+static int tcmu_rbd_get_completion_fd(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+
+	return state->event_fd;
+}
+
+static int tcmu_rbd_poll_completions(struct tcmu_device *dev)
+{
+	struct tcmu_rbd_state *state = tcmur_dev_get_private(dev);
+	rbd_completion_t comps[TCMU_RBD_POLL_BATCH];
+	int i, n, total = 0;
+	uint64_t val;
+
+	/* clear the eventfd first, so later completions set it again */
+	if (read(state->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		tcmu_dev_err(dev, "Could not read completion eventfd: %m\n");
+
+	do {
+		n = rbd_poll_io_events(state->image, comps, TCMU_RBD_POLL_BATCH);
+		if (n < 0) {
+			tcmu_dev_err(dev, "Could not poll io events. (Err %d)\n",
+				     n);
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			rbd_finish_aio_generic(comps[i],
+					       rbd_aio_get_arg(comps[i]));
+		total += n;
+	} while (n == TCMU_RBD_POLL_BATCH);
+
+	return total;
+}
+
+#endif /* RBD_POLL_SUPPORT */
+
 static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 			     struct iovec *iov, size_t iov_cnt, size_t length,
 			     off_t offset)
@@ -1146,8 +1511,7 @@ static int tcmu_rbd_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 	aio_cb->iov = iov;
 	aio_cb->iov_cnt = iov_cnt;
 
-	ret = rbd_aio_create_completion
-		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	ret = tcmu_rbd_aio_create_completion(dev, aio_cb, &completion);
 	if (ret < 0) {
 		goto out_free_aio_cb;
 	}
@@ -1185,8 +1549,7 @@ static int tcmu_rbd_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
 	aio_cb->tcmur_cmd = tcmur_cmd;
 
-	ret = rbd_aio_create_completion
-		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	ret = tcmu_rbd_aio_create_completion(dev, aio_cb, &completion);
 	if (ret < 0) {
 		goto out_free_aio_cb;
 	}
@@ -1227,8 +1590,7 @@ static int tcmu_rbd_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
 	aio_cb->bounce_buffer = NULL;
 
-	ret = rbd_aio_create_completion
-		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	ret = tcmu_rbd_aio_create_completion(dev, aio_cb, &completion);
 	if (ret < 0)
 		goto out_free_aio_cb;
 
@@ -1267,8 +1629,7 @@ static int tcmu_rbd_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 	aio_cb->type = RBD_AIO_TYPE_WRITE;
 	aio_cb->bounce_buffer = NULL;
 
-	ret = rbd_aio_create_completion
-		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	ret = tcmu_rbd_aio_create_completion(dev, aio_cb, &completion);
 	if (ret < 0) {
 		goto out_free_aio_cb;
 	}
@@ -1320,8 +1681,7 @@ static int tcmu_rbd_aio_writesame(struct tcmu_device *dev,
 
 	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, length, iov, iov_cnt);
 
-	ret = rbd_aio_create_completion
-		(aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	ret = tcmu_rbd_aio_create_completion(dev, aio_cb, &completion);
 	if (ret < 0)
 		goto out_free_bounce_buffer;
 
@@ -1377,8 +1737,7 @@ static int tcmu_rbd_aio_caw(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd
 	tcmu_memcpy_from_iovec(aio_cb->bounce_buffer, buffer_length, iov,
 			       iov_cnt);
 
-	ret = rbd_aio_create_completion(
-		aio_cb, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+	ret = tcmu_rbd_aio_create_completion(dev, aio_cb, &completion);
 	if (ret < 0) {
 		goto out_free_bounce_buffer;
 	}
@@ -1490,6 +1849,10 @@ struct tcmur_handler tcmu_rbd_handler = {
 	.unmap         = tcmu_rbd_unmap,
 #endif
 	.handle_cmd    = tcmu_rbd_handle_cmd,
+#ifdef RBD_POLL_SUPPORT
+	.get_completion_fd = tcmu_rbd_get_completion_fd,
+	.poll_completions = tcmu_rbd_poll_completions,
+#endif
 #ifdef RBD_LOCK_ACQUIRE_SUPPORT
 	.lock          = tcmu_rbd_lock,
 	.unlock        = tcmu_rbd_unlock,
@@ -1500,5 +1863,11 @@ struct tcmur_handler tcmu_rbd_handler = {
 
 int handler_init(void)
 {
+	int ret;
+
+	ret = tcmu_register_tunable(&rbd_share_cluster_tunable);
+	if (ret)
+		return ret;
+
 	return tcmur_register_handler(&tcmu_rbd_handler);
 }
@@ -0,0 +1,752 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Striping (RAID-0) handler
+ *
+ * The device is spread over several backing files or block devices in
+ * stripe_size chunks, so one LUN can use the bandwidth of all of them:
+ *
+ *   stripe//path1,/path2[,...][;stripe_size=N][;threads=N]
+ *
+ * A command is split into at most one sub-I/O per backing device. The
+ * chunks of a command that land on the same device are contiguous on
+ * it, so each sub-I/O is a single preadv/pwritev on an iovec built from
+ * slices of the command's iovec; no data is copied. Every backing
+ * device has its own pool of threads (2 by default), the sub-I/Os run
+ * concurrently and the command is completed when the last one ends.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/fs.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+
+#define STRIPE_MAX_DEVS		64
+#define STRIPE_DEF_SIZE		(128 * 1024)
+#define STRIPE_DEF_THREADS	2
+
+enum {
+	STRIPE_OP_READ,
+	STRIPE_OP_WRITE,
+	STRIPE_OP_FLUSH,
+	STRIPE_OP_UNMAP,
+};
+
+/* State of a command that has been split across devices */
+struct stripe_cmd {
+	struct tcmu_device *dev;
+	struct tcmur_cmd *tcmur_cmd;
+	int op;
+	int remaining;
+	int ret;
+};
+
+struct stripe_io {
+	struct stripe_cmd *scmd;
+	struct list_node entry;
+
+	struct iovec *iov;
+	size_t iov_cnt;
+	uint64_t off;
+	uint64_t len;
+};
+
+struct stripe_dev {
+	char *path;
+	int fd;
+	bool is_blk;
+	uint64_t size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head queue;
+	pthread_t *threads;
+	int nr_threads;
+	bool stop;
+
+	struct tcmu_device *dev;
+};
+
+struct stripe_state {
+	struct stripe_dev *devs;
+	int nr_devs;
+	uint64_t stripe_size;
+	int threads_per_dev;
+};
+
+static int stripe_rw(struct stripe_dev *sdev, int op, struct iovec *iov,
+		     size_t iov_cnt, uint64_t off, uint64_t len)
+{
+	size_t cnt, consumed;
+	ssize_t ret;
+
+	while (len) {
+		cnt = min(iov_cnt, (size_t)IOV_MAX);
+		if (op == STRIPE_OP_READ)
+			ret = preadv(sdev->fd, iov, cnt, off);
+		else
+			ret = pwritev(sdev->fd, iov, cnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret) {
+			if (op == STRIPE_OP_WRITE)
+				return -EIO;
+			/* EOF of a sparse file, then zeros the iovecs left */
+			tcmu_iovec_zero(iov, iov_cnt);
+			break;
+		}
+
+		consumed = tcmu_iovec_seek(iov, ret);
+		iov += consumed;
+		iov_cnt -= consumed;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int stripe_discard(struct stripe_dev *sdev, uint64_t off,
+			  uint64_t len)
+{
+	uint64_t range[2] = { off, len };
+
+	if (sdev->is_blk) {
+		if (ioctl(sdev->fd, BLKDISCARD, range))
+			return -errno;
+		return 0;
+	}
+
+	if (fallocate(sdev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len))
+		return -errno;
+	return 0;
+}
+
+static void stripe_io_done(struct stripe_io *io, int ret)
+{
+	struct stripe_cmd *scmd = io->scmd;
+	int sts;
+
+	if (ret) {
+		switch (scmd->op) {
+		case STRIPE_OP_READ:
+			sts = TCMU_STS_RD_ERR;
+			break;
+		case STRIPE_OP_UNMAP:
+			/* UNMAP is a hint, ignore devices that cannot punch */
+			sts = ret == -EOPNOTSUPP ? TCMU_STS_OK :
+						   TCMU_STS_WR_ERR;
+			break;
+		default:
+			sts = TCMU_STS_WR_ERR;
+		}
+		if (sts != TCMU_STS_OK)
+			__atomic_store_n(&scmd->ret, sts, __ATOMIC_RELAXED);
+	}
+	free(io);
+
+	if (__atomic_sub_fetch(&scmd->remaining, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	tcmur_cmd_complete(scmd->dev, scmd->tcmur_cmd,
+			   __atomic_load_n(&scmd->ret, __ATOMIC_RELAXED));
+	free(scmd);
+}
+
+static void *stripe_worker(void *arg)
+{
+	struct stripe_dev *sdev = arg;
+	struct stripe_io *io;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&sdev->lock);
+		while (!sdev->stop && list_empty(&sdev->queue))
+			pthread_cond_wait(&sdev->cond, &sdev->lock);
+		io = list_pop(&sdev->queue, struct stripe_io, entry);
+		pthread_mutex_unlock(&sdev->lock);
+		if (!io)
+			break;
+
+		switch (io->scmd->op) {
+		case STRIPE_OP_READ:
+		case STRIPE_OP_WRITE:
+			ret = stripe_rw(sdev, io->scmd->op, io->iov, io->iov_cnt,
+					io->off, io->len);
+			break;
+		case STRIPE_OP_FLUSH:
+			ret = fdatasync(sdev->fd) ? -errno : 0;
+			break;
+		case STRIPE_OP_UNMAP:
+			ret = stripe_discard(sdev, io->off, io->len);
+			break;
+		default:
+			ret = -EINVAL;
+		}
+
+		if (ret && ret != -EOPNOTSUPP)
+			tcmu_dev_err(sdev->dev, "IO to %s at %"PRIu64" failed: %d\n",
+				     sdev->path, io->off, ret);
+		stripe_io_done(io, ret);
+	}
+
+	return NULL;
+}
+
+static void stripe_queue_io(struct stripe_dev *sdev, struct stripe_io *io)
+{
+	pthread_mutex_lock(&sdev->lock);
+	list_add_tail(&sdev->queue, &io->entry);
+	pthread_cond_signal(&sdev->cond);
+	pthread_mutex_unlock(&sdev->lock);
+}
+
+/*
+ * Byte range [off, off + len) of the device that lands on device idx,
+ * as an offset and length on that device. Returns false if no chunk
+ * of the range is on it.
+ */
+static bool stripe_map_range(struct stripe_state *state, int idx,
+			     uint64_t off, uint64_t len,
+			     uint64_t *dev_off, uint64_t *dev_len)
+{
+	uint64_t ss = state->stripe_size, n = state->nr_devs;
+	uint64_t first = off / ss, last = (off + len - 1) / ss;
+	uint64_t start, end, chunk;
+
+	/* first and last chunk of the range on device idx */
+	chunk = first + (idx + n - first % n) % n;
+	if (chunk > last)
+		return false;
+	start = chunk == first ? off : chunk * ss;
+	start = (chunk / n) * ss + start % ss;
+
+	chunk = last - (last % n + n - idx) % n;
+	end = chunk == last ? off + len : (chunk + 1) * ss;
+	end = (chunk / n) * ss + (end - 1) % ss + 1;
+
+	*dev_off = start;
+	*dev_len = end - start;
+	return true;
+}
+
+static struct stripe_cmd *stripe_alloc_cmd(struct tcmu_device *dev,
+					   struct tcmur_cmd *tcmur_cmd, int op)
+{
+	struct stripe_cmd *scmd;
+
+	scmd = calloc(1, sizeof(*scmd));
+	if (!scmd)
+		return NULL;
+	scmd->dev = dev;
+	scmd->tcmur_cmd = tcmur_cmd;
+	scmd->op = op;
+	scmd->ret = TCMU_STS_OK;
+	/* held by the submitter until every sub-I/O is queued */
+	scmd->remaining = 1;
+	return scmd;
+}
+
+/* Queue the sub-I/Os, ios[i] goes to device i and may be NULL. */
+static void stripe_submit(struct stripe_state *state, struct stripe_cmd *scmd,
+			  struct stripe_io **ios)
+{
+	int i;
+
+	for (i = 0; i < state->nr_devs; i++) {
+		if (ios[i])
+			__atomic_add_fetch(&scmd->remaining, 1,
+					   __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < state->nr_devs; i++) {
+		if (ios[i])
+			stripe_queue_io(&state->devs[i], ios[i]);
+	}
+
+	/* drop the submitter's reference, completing the cmd if all done */
+	if (!__atomic_sub_fetch(&scmd->remaining, 1, __ATOMIC_ACQ_REL)) {
+		tcmur_cmd_complete(scmd->dev, scmd->tcmur_cmd, scmd->ret);
+		free(scmd);
+	}
+}
+
+static int stripe_rw_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int op, struct iovec *iov, size_t iov_cnt,
+			 size_t length, off_t offset)
+{
+	struct stripe_state *state = tcmur_dev_get_private(dev);
+	uint64_t ss = state->stripe_size, off, chunk_len, left, take;
+	struct stripe_io *ios[STRIPE_MAX_DEVS] = { NULL };
+	size_t counts[STRIPE_MAX_DEVS] = { 0 };
+	struct stripe_cmd *scmd;
+	size_t i, pos;
+	int idx;
+
+	/*
+	 * First pass counts the iovec slices each device gets, the second
+	 * fills them in.
+	 */
+	left = length;
+	off = offset;
+	i = 0;
+	pos = 0;
+	while (left) {
+		idx = (off / ss) % state->nr_devs;
+		chunk_len = min(left, ss - off % ss);
+		left -= chunk_len;
+		off += chunk_len;
+
+		while (chunk_len) {
+			take = min(chunk_len, (uint64_t)(iov[i].iov_len - pos));
+			counts[idx]++;
+			chunk_len -= take;
+			pos += take;
+			if (pos == iov[i].iov_len) {
+				i++;
+				pos = 0;
+			}
+		}
+	}
+
+	scmd = stripe_alloc_cmd(dev, tcmur_cmd, op);
+	if (!scmd)
+		return TCMU_STS_NO_RESOURCE;
+
+	for (idx = 0; idx < state->nr_devs; idx++) {
+		if (!counts[idx])
+			continue;
+
+		ios[idx] = calloc(1, sizeof(struct stripe_io) +
+				  counts[idx] * sizeof(struct iovec));
+		if (!ios[idx])
+			goto free_ios;
+		ios[idx]->scmd = scmd;
+		ios[idx]->iov = (struct iovec *)(ios[idx] + 1);
+		stripe_map_range(state, idx, offset, length, &ios[idx]->off,
+				 &ios[idx]->len);
+	}
+
+	left = length;
+	off = offset;
+	i = 0;
+	pos = 0;
+	while (left) {
+		idx = (off / ss) % state->nr_devs;
+		chunk_len = min(left, ss - off % ss);
+		left -= chunk_len;
+		off += chunk_len;
+
+		while (chunk_len) {
+			struct stripe_io *io = ios[idx];
+
+			take = min(chunk_len, (uint64_t)(iov[i].iov_len - pos));
+			io->iov[io->iov_cnt].iov_base = iov[i].iov_base + pos;
+			io->iov[io->iov_cnt].iov_len = take;
+			io->iov_cnt++;
+			chunk_len -= take;
+			pos += take;
+			if (pos == iov[i].iov_len) {
+				i++;
+				pos = 0;
+			}
+		}
+	}
+
+	stripe_submit(state, scmd, ios);
+	return TCMU_STS_OK;
+
+free_ios:
+	for (idx = 0; idx < state->nr_devs; idx++)
+		free(ios[idx]);
+	free(scmd);
+	return TCMU_STS_NO_RESOURCE;
+}
+
+static int stripe_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+		       struct iovec *iov, size_t iov_cnt, size_t length,
+		       off_t offset)
+{
+	return stripe_rw_cmd(dev, tcmur_cmd, STRIPE_OP_READ, iov, iov_cnt,
+			     length, offset);
+}
+
+static int stripe_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			struct iovec *iov, size_t iov_cnt, size_t length,
+			off_t offset)
+{
+	return stripe_rw_cmd(dev, tcmur_cmd, STRIPE_OP_WRITE, iov, iov_cnt,
+			     length, offset);
+}
+
+static int stripe_fanout(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int op, uint64_t off, uint64_t len)
+{
+	struct stripe_state *state = tcmur_dev_get_private(dev);
+	struct stripe_io *ios[STRIPE_MAX_DEVS] = { NULL };
+	struct stripe_cmd *scmd;
+	uint64_t dev_off, dev_len;
+	int idx;
+
+	scmd = stripe_alloc_cmd(dev, tcmur_cmd, op);
+	if (!scmd)
+		return TCMU_STS_NO_RESOURCE;
+
+	for (idx = 0; idx < state->nr_devs; idx++) {
+		if (op == STRIPE_OP_UNMAP &&
+		    !stripe_map_range(state, idx, off, len, &dev_off, &dev_len))
+			continue;
+
+		ios[idx] = calloc(1, sizeof(struct stripe_io));
+		if (!ios[idx])
+			goto free_ios;
+		ios[idx]->scmd = scmd;
+		if (op == STRIPE_OP_UNMAP) {
+			ios[idx]->off = dev_off;
+			ios[idx]->len = dev_len;
+		}
+	}
+
+	stripe_submit(state, scmd, ios);
+	return TCMU_STS_OK;
+
+free_ios:
+	for (idx = 0; idx < state->nr_devs; idx++)
+		free(ios[idx]);
+	free(scmd);
+	return TCMU_STS_NO_RESOURCE;
+}
+
+static int stripe_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	return stripe_fanout(dev, tcmur_cmd, STRIPE_OP_FLUSH, 0, 0);
+}
+
+static int stripe_unmap(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			uint64_t off, uint64_t len)
+{
+	return stripe_fanout(dev, tcmur_cmd, STRIPE_OP_UNMAP, off, len);
+}
+
+static void stripe_stop_dev(struct stripe_dev *sdev)
+{
+	int i;
+
+	pthread_mutex_lock(&sdev->lock);
+	sdev->stop = true;
+	pthread_cond_broadcast(&sdev->cond);
+	pthread_mutex_unlock(&sdev->lock);
+
+	for (i = 0; i < sdev->nr_threads; i++)
+		pthread_join(sdev->threads[i], NULL);
+	free(sdev->threads);
+	sdev->threads = NULL;
+	sdev->nr_threads = 0;
+}
+
+static void stripe_close_devs(struct stripe_state *state)
+{
+	struct stripe_dev *sdev;
+	int i;
+
+	for (i = 0; i < state->nr_devs; i++) {
+		sdev = &state->devs[i];
+
+		stripe_stop_dev(sdev);
+		pthread_cond_destroy(&sdev->cond);
+		pthread_mutex_destroy(&sdev->lock);
+		if (sdev->fd != -1)
+			close(sdev->fd);
+		free(sdev->path);
+	}
+	free(state->devs);
+	state->devs = NULL;
+	state->nr_devs = 0;
+}
+
+/* Size each device needs to hold its share of dev_size bytes */
+static uint64_t stripe_dev_size(struct stripe_state *state, uint64_t dev_size)
+{
+	uint64_t rows;
+
+	rows = (dev_size + state->stripe_size * state->nr_devs - 1) /
+		(state->stripe_size * state->nr_devs);
+	return rows * state->stripe_size;
+}
+
+static int stripe_set_size(struct tcmu_device *dev, uint64_t dev_size)
+{
+	struct stripe_state *state = tcmur_dev_get_private(dev);
+	uint64_t need = stripe_dev_size(state, dev_size);
+	struct stripe_dev *sdev;
+	int i;
+
+	for (i = 0; i < state->nr_devs; i++) {
+		sdev = &state->devs[i];
+
+		if (sdev->size >= need)
+			continue;
+
+		if (sdev->is_blk) {
+			tcmu_dev_err(dev, "%s is %"PRIu64" bytes, %"PRIu64" are needed\n",
+				     sdev->path, sdev->size, need);
+			return -ENOSPC;
+		}
+
+		if (ftruncate(sdev->fd, need)) {
+			tcmu_dev_err(dev, "Could not resize %s: %m\n",
+				     sdev->path);
+			return -errno;
+		}
+		sdev->size = need;
+	}
+	return 0;
+}
+
+static int stripe_open_dev(struct tcmu_device *dev, struct stripe_state *state,
+			   struct stripe_dev *sdev, const char *path)
+{
+	struct stat st;
+	int i, ret;
+
+	sdev->dev = dev;
+	sdev->fd = -1;
+	list_head_init(&sdev->queue);
+
+	ret = pthread_mutex_init(&sdev->lock, NULL);
+	if (ret)
+		return -ret;
+	ret = pthread_cond_init(&sdev->cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&sdev->lock);
+		return -ret;
+	}
+
+	sdev->path = strdup(path);
+	if (!sdev->path)
+		return -ENOMEM;
+
+	sdev->fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (sdev->fd == -1) {
+		tcmu_dev_err(dev, "Could not open %s: %m\n", path);
+		return -errno;
+	}
+
+	if (fstat(sdev->fd, &st)) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not stat %s: %m\n", path);
+		return ret;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		sdev->is_blk = true;
+		if (ioctl(sdev->fd, BLKGETSIZE64, &sdev->size)) {
+			ret = -errno;
+			tcmu_dev_err(dev, "Could not get size of %s: %m\n",
+				     path);
+			return ret;
+		}
+	} else {
+		sdev->size = st.st_size;
+	}
+
+	sdev->threads = calloc(state->threads_per_dev, sizeof(pthread_t));
+	if (!sdev->threads)
+		return -ENOMEM;
+
+	for (i = 0; i < state->threads_per_dev; i++) {
+		ret = pthread_create(&sdev->threads[i], NULL, stripe_worker,
+				     sdev);
+		if (ret)
+			return -ret;
+		sdev->nr_threads++;
+	}
+
+	return 0;
+}
+
+static int stripe_parse_config(struct tcmu_device *dev,
+			       struct stripe_state *state, char **paths)
+{
+	char *config, *opt;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	state->stripe_size = STRIPE_DEF_SIZE;
+	state->threads_per_dev = STRIPE_DEF_THREADS;
+
+	*paths = strdup(strtok(config, ";") ? : "");
+	if (!*paths) {
+		free(config);
+		return -ENOMEM;
+	}
+
+	/* The next options are optional */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "stripe_size=", 12))
+			state->stripe_size = strtoull(opt + 12, NULL, 0);
+		else if (!strncmp(opt, "threads=", 8))
+			state->threads_per_dev = atoi(opt + 8);
+		else
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+	}
+	free(config);
+
+	if (!state->stripe_size ||
+	    state->stripe_size % tcmu_dev_get_block_size(dev)) {
+		tcmu_dev_err(dev, "stripe_size must be a multiple of the block size %u\n",
+			     tcmu_dev_get_block_size(dev));
+		return -EINVAL;
+	}
+
+	if (state->threads_per_dev < 1) {
+		tcmu_dev_err(dev, "threads must be at least 1\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int stripe_open(struct tcmu_device *dev, bool reopen)
+{
+	struct stripe_state *state;
+	char *paths = NULL, *path, *saveptr;
+	int ret, nr;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	tcmur_dev_set_private(dev, state);
+
+	ret = stripe_parse_config(dev, state, &paths);
+	if (ret)
+		goto free_state;
+
+	for (nr = 1, path = paths; (path = strchr(path, ',')); path++)
+		nr++;
+	if (!strlen(paths) || nr > STRIPE_MAX_DEVS) {
+		tcmu_dev_err(dev, "Between 1 and %d comma separated paths are needed\n",
+			     STRIPE_MAX_DEVS);
+		ret = -EINVAL;
+		goto free_state;
+	}
+
+	state->devs = calloc(nr, sizeof(*state->devs));
+	if (!state->devs) {
+		ret = -ENOMEM;
+		goto free_state;
+	}
+
+	for (path = strtok_r(paths, ",", &saveptr); path;
+	     path = strtok_r(NULL, ",", &saveptr)) {
+		ret = stripe_open_dev(dev, state,
+				      &state->devs[state->nr_devs++], path);
+		if (ret)
+			goto close_devs;
+	}
+
+	ret = stripe_set_size(dev, tcmu_dev_get_num_lbas(dev) *
+				   tcmu_dev_get_block_size(dev));
+	if (ret)
+		goto close_devs;
+
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+	tcmu_dev_dbg(dev, "config %s, %d devices, stripe size %"PRIu64"\n",
+		     tcmu_dev_get_cfgstring(dev), state->nr_devs,
+		     state->stripe_size);
+	free(paths);
+	return 0;
+
+close_devs:
+	stripe_close_devs(state);
+free_state:
+	free(paths);
+	free(state);
+	return ret;
+}
+
+static void stripe_close(struct tcmu_device *dev)
+{
+	struct stripe_state *state = tcmur_dev_get_private(dev);
+
+	stripe_close_devs(state);
+	free(state);
+}
+
+static int stripe_reconfig(struct tcmu_device *dev,
+			   struct tcmulib_cfg_info *cfg)
+{
+	switch (cfg->type) {
+	case TCMULIB_CFG_DEV_SIZE:
+		return stripe_set_size(dev, cfg->data.dev_size);
+	case TCMULIB_CFG_DEV_CFGSTR:
+	case TCMULIB_CFG_WRITE_CACHE:
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static const char stripe_cfg_desc[] =
+	"Comma separated list of backing files or block devices, with "
+	"optional ;stripe_size=bytes and ;threads=per device settings.";
+
+static struct tcmur_handler stripe_handler = {
+	.cfg_desc = stripe_cfg_desc,
+
+	.reconfig = stripe_reconfig,
+
+	.open = stripe_open,
+	.close = stripe_close,
+	.read = stripe_read,
+	.write = stripe_write,
+	.flush = stripe_flush,
+	.unmap = stripe_unmap,
+	.name = "Striping Handler",
+	.subtype = "stripe",
+	.nr_threads = 0, /* sub-I/Os run on the per device threads */
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&stripe_handler);
+}
@@ -56,6 +56,27 @@ struct tcmur_cmd {
 
 	/* callback to finish/continue command processing */
 	void (*done)(struct tcmu_device *dev, struct tcmur_cmd *cmd, int ret);
+
+	/* Range marked in the CBT bitmap, see tcmur_cbt_cmd_done */
+	uint64_t cbt_off;
+	uint64_t cbt_len;
+	uint64_t cbt_reset;
+
+	/* Range modified by the cmd, used by replication (tcmur_repl.c) */
+	uint64_t repl_off;
+	uint64_t repl_len;
+	bool repl_journaled;
+
+	/* Time the handler got the cmd, used by tcmur_cc.c, 0 if not counted */
+	uint64_t cc_start;
+
+	/* Time the READ was sent, used by tcmur_hedge.c, 0 if not timed */
+	uint64_t hedge_start;
+
+	/* Completion is held back while cancelling, see tcmur_cmd_cancel */
+	bool cancelling;
+	bool cancel_done;
+	int cancel_ret;
 };
 
 struct tcmulib_cfg_info;
@@ -181,6 +202,92 @@ struct tcmur_handler {
 	 * Update the logdir called by dynamic config thread.
 	 */
 	bool (*update_logdir)(void);
+
+	/*
+	 * Optional: write the data and confirm it reached the medium
+	 * intact, without the runner reading it back. Handlers whose
+	 * backend keeps end-to-end checksums can implement WRITE AND
+	 * VERIFY this way at the cost of a single write.
+	 *
+	 * Return codes are the same as for write. If the data does not
+	 * verify return TCMU_STS_MISCOMPARE and set the offset of the
+	 * first mismatch with tcmu_sense_set_info(). Returning
+	 * TCMU_STS_NOT_HANDLED makes the runner fall back to writing the
+	 * data and reading it back for comparison, which is also what is
+	 * done if this callout is not set.
+	 */
+	int (*write_verify)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			    struct iovec *iovec, size_t iov_cnt, size_t len,
+			    off_t off);
+
+	/*
+	 * Optional: read the same data as read, but through another path
+	 * than the one a read in flight is likely stuck on, like another
+	 * replica, mirror leg or connection. With the hedge_reads tunable
+	 * set the runner calls it for READs that are slower than most
+	 * recent ones and returns whichever copy completes first.
+	 *
+	 * It is called like read. For hedged READs both read and
+	 * hedge_read get a cmd that is not the command's own tcmur_cmd
+	 * and whose lib_cmd is NULL, so it must only be used to complete
+	 * the read. For handlers with nr_threads 0 it is called from a
+	 * runner thread and must not block.
+	 */
+	int (*hedge_read)(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+			  struct iovec *iovec, size_t iov_cnt, size_t len,
+			  off_t off);
+
+	/*
+	 * Optional: abort a command passed to an IO callout, because it
+	 * timed out (see cmd_time_out) or is the losing copy of a hedged
+	 * read. It is best effort and the command must still be completed
+	 * exactly once with tcmur_cmd_complete, for example with
+	 * TCMU_STS_TIMEOUT if it was aborted, which may be done from the
+	 * callout.
+	 *
+	 * The command may have completed already, so cmd must only be
+	 * compared against the handler's own in flight IO and not be
+	 * dereferenced unless it is found there.
+	 */
+	void (*cancel)(struct tcmu_device *dev, struct tcmur_cmd *cmd);
+
+	/*
+	 * If set for a handler with nr_threads > 0 that does its I/O with
+	 * tcmur_co_preadv, tcmur_co_pwritev and tcmur_co_fdatasync, IO
+	 * callouts are run in coroutines, see tcmur_co.c, so more than
+	 * nr_threads I/Os can be in flight per device.
+	 */
+	bool coroutines;
+
+	/*
+	 * Optional, for handlers with nr_threads 0: submit the READs,
+	 * WRITEs and flushes the runner took from the ring in one pass
+	 * together, for example with a single io_uring_enter or by merging
+	 * adjacent writes. The op_class, iovec, iov_cnt and off of
+	 * cmds[i]->lib_cmd describe each one, the length is that of the
+	 * iovec.
+	 *
+	 * Returns how many commands from the start of cmds the handler
+	 * took. Those are completed like commands passed to read, write and
+	 * flush, the rest are passed to those callouts one at a time.
+	 */
+	int (*submit_batch)(struct tcmu_device *dev, struct tcmur_cmd **cmds,
+			    int nr_cmds);
+
+	/*
+	 * Optional, for handlers with nr_threads 0 whose backend can queue
+	 * completions for the caller to reap, like librbd's image
+	 * notification or an io_uring CQ. If tcmur_dev_polls_completions
+	 * returns true at open, the handler may set that up, and
+	 * get_completion_fd then returns an fd that is readable while
+	 * completions are waiting, else -1.
+	 *
+	 * poll_completions completes the waiting commands with
+	 * tcmur_cmd_complete and returns how many it did. It is called
+	 * from the cmdproc thread and must not block.
+	 */
+	int (*get_completion_fd)(struct tcmu_device *dev);
+	int (*poll_completions)(struct tcmu_device *dev);
 };
 
 void tcmur_cmd_complete(struct tcmu_device *dev, void *data, int rc);
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * CPU and NUMA placement of devices
+ *
+ * At startup the CPUs of each NUMA node are read from sysfs, limited to
+ * the CPUs tcmu-runner itself may run on. Each new device is assigned
+ * the next node round-robin, unless the numa_node tunable or the
+ * ";tcmur_cpus=<cpulist>" cfgstring argument picks its CPUs.
+ *
+ * The device's cmdproc and work queue threads pin themselves to those
+ * CPUs and prefer the node's memory, so buffers they allocate and touch
+ * stay local. The handler's open callout runs with the same placement,
+ * so handler state and threads it creates (librbd, gfapi, handler
+ * workers) inherit it.
+ *
+ * On single node systems nothing is pinned unless asked for.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "libtcmu_log.h"
+#include "libtcmu_config.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_affinity.h"
+
+#define TCMUR_MAX_NUMA_NODES 1024
+#define NODE_MASK_LONGS (TCMUR_MAX_NUMA_NODES / (8 * sizeof(unsigned long)))
+
+struct tcmur_numa_node {
+	int id;
+	cpu_set_t cpus;
+};
+
+struct tcmur_affinity {
+	cpu_set_t cpus;
+	int node;	/* -1 if the CPUs span nodes */
+};
+
+static struct tcmur_numa_node *numa_nodes;
+static int nr_numa_nodes;
+static unsigned int next_node;
+
+static struct tcmu_tunable affinity_tunable = {
+	.name = "affinity",
+	.desc = "Pin device threads to a NUMA node's CPUs, round-robin across nodes (applied at open)",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 1,
+	.min = 0,
+	.max = 1,
+};
+
+static struct tcmu_tunable numa_node_tunable = {
+	.name = "numa_node",
+	.desc = "NUMA node to place devices on, -1 for round-robin (applied at open)",
+	.type = TCMU_TUNABLE_INT,
+	.def = -1,
+	.min = -1,
+	.max = TCMUR_MAX_NUMA_NODES - 1,
+};
+
+/* Parse a kernel style cpulist like "0-3,8,10-11" */
+static int parse_cpulist(const char *str, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		first = strtoul(str, &end, 10);
+		if (end == str)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if (end == str || last < first)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -ERANGE;
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		str = end;
+		if (*str == ',')
+			str++;
+		else if (*str && *str != '\n')
+			return -EINVAL;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+static int read_node_cpus(int id, cpu_set_t *set)
+{
+	char path[64], buf[4096];
+	FILE *fp;
+	int ret = -ENOENT;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 id);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	if (fgets(buf, sizeof(buf), fp))
+		ret = parse_cpulist(buf, set);
+	fclose(fp);
+	return ret;
+}
+
+int tcmur_affinity_init(void)
+{
+	cpu_set_t allowed, cpus;
+	int i, ret;
+
+	ret = tcmu_register_tunable(&affinity_tunable);
+	if (ret)
+		return ret;
+	ret = tcmu_register_tunable(&numa_node_tunable);
+	if (ret)
+		return ret;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		tcmu_warn("Could not get CPU affinity, %m. Device placement disabled.\n");
+		return 0;
+	}
+
+	numa_nodes = calloc(TCMUR_MAX_NUMA_NODES, sizeof(*numa_nodes));
+	if (!numa_nodes)
+		return -ENOMEM;
+
+	/* node ids can have holes, memory only nodes have no CPUs */
+	for (i = 0; i < TCMUR_MAX_NUMA_NODES; i++) {
+		if (read_node_cpus(i, &cpus))
+			continue;
+
+		CPU_AND(&cpus, &cpus, &allowed);
+		if (!CPU_COUNT(&cpus))
+			continue;
+
+		numa_nodes[nr_numa_nodes].id = i;
+		numa_nodes[nr_numa_nodes].cpus = cpus;
+		nr_numa_nodes++;
+	}
+
+	if (!nr_numa_nodes) {
+		/* no NUMA support in the kernel, treat it as one node */
+		numa_nodes[0].id = -1;
+		numa_nodes[0].cpus = allowed;
+		nr_numa_nodes = 1;
+	}
+
+	tcmu_info("Found %d NUMA node(s) with usable CPUs\n", nr_numa_nodes);
+	return 0;
+}
+
+static struct tcmur_numa_node *find_node(int id)
+{
+	int i;
+
+	for (i = 0; i < nr_numa_nodes; i++) {
+		if (numa_nodes[i].id == id)
+			return &numa_nodes[i];
+	}
+
+	return NULL;
+}
+
+int tcmur_affinity_dev_init(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_affinity *aff;
+	struct tcmur_numa_node *node = NULL;
+	cpu_set_t cpus, tmp;
+	int64_t node_id;
+	int i, ret;
+
+	if (!nr_numa_nodes ||
+	    !tcmur_dev_get_tunable(dev, &affinity_tunable))
+		return 0;
+
+	node_id = tcmur_dev_get_tunable(dev, &numa_node_tunable);
+
+	if (rdev->affinity_cpus) {
+		ret = parse_cpulist(rdev->affinity_cpus, &cpus);
+		if (ret) {
+			tcmu_dev_err(dev, "Invalid tcmur_cpus %s\n",
+				     rdev->affinity_cpus);
+			return ret;
+		}
+
+		/* use the node's memory if all the CPUs are on one */
+		for (i = 0; i < nr_numa_nodes; i++) {
+			CPU_AND(&tmp, &cpus, &numa_nodes[i].cpus);
+			if (CPU_EQUAL(&tmp, &cpus)) {
+				node = &numa_nodes[i];
+				break;
+			}
+		}
+	} else if (node_id >= 0) {
+		node = find_node(node_id);
+		if (!node) {
+			tcmu_dev_err(dev, "NUMA node %"PRId64" has no usable CPUs\n",
+				     node_id);
+			return -EINVAL;
+		}
+		cpus = node->cpus;
+	} else {
+		if (nr_numa_nodes == 1)
+			return 0;
+
+		node = &numa_nodes[__atomic_fetch_add(&next_node, 1,
+					__ATOMIC_RELAXED) % nr_numa_nodes];
+		cpus = node->cpus;
+	}
+
+	aff = calloc(1, sizeof(*aff));
+	if (!aff)
+		return -ENOMEM;
+	aff->cpus = cpus;
+	aff->node = node ? node->id : -1;
+	rdev->affinity = aff;
+
+	tcmu_dev_dbg(dev, "Placed on NUMA node %d, %d CPUs\n", aff->node,
+		     CPU_COUNT(&aff->cpus));
+	return 0;
+}
+
+void tcmur_affinity_dev_free(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	free(rdev->affinity);
+	rdev->affinity = NULL;
+}
+
+static void set_mem_node(int node)
+{
+	unsigned long mask[NODE_MASK_LONGS];
+	long ret;
+
+	if (node < 0) {
+		ret = syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+	} else {
+		memset(mask, 0, sizeof(mask));
+		mask[node / (8 * sizeof(unsigned long))] |=
+				1UL << (node % (8 * sizeof(unsigned long)));
+		ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			      TCMUR_MAX_NUMA_NODES + 1);
+	}
+
+	if (ret)
+		tcmu_dbg("set_mempolicy failed: %m\n");
+}
+
+/* Pin the calling thread to the device's CPUs and memory node */
+void tcmur_affinity_bind_thread(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_affinity *aff = rdev->affinity;
+	int ret;
+
+	if (!aff)
+		return;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(aff->cpus),
+				     &aff->cpus);
+	if (ret)
+		tcmu_dev_warn(dev, "Could not set thread affinity %d\n", ret);
+
+	if (aff->node >= 0)
+		set_mem_node(aff->node);
+}
+
+/*
+ * Run the calling thread with the device's placement until
+ * tcmur_affinity_leave, so allocations and threads made by the
+ * handler in between are local to it.
+ */
+void tcmur_affinity_enter(struct tcmu_device *dev,
+			  struct tcmur_affinity_saved *saved)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	cpu_set_t cpus;
+
+	saved->valid = false;
+	if (!rdev->affinity)
+		return;
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		return;
+
+	/* both are CPU_SETSIZE bits */
+	memcpy(saved->cpus, &cpus, sizeof(saved->cpus));
+	saved->valid = true;
+	tcmur_affinity_bind_thread(dev);
+}
+
+void tcmur_affinity_leave(struct tcmur_affinity_saved *saved)
+{
+	cpu_set_t cpus;
+
+	if (!saved->valid)
+		return;
+
+	memcpy(&cpus, saved->cpus, sizeof(saved->cpus));
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	set_mem_node(-1);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_AFFINITY_H
+#define __TCMUR_AFFINITY_H
+
+#include <stdbool.h>
+
+struct tcmu_device;
+struct tcmur_affinity;
+
+struct tcmur_affinity_saved {
+	bool valid;
+	unsigned long cpus[1024 / (8 * sizeof(unsigned long))];
+};
+
+int tcmur_affinity_init(void);
+
+/* Placement of a LIO device using rdev->affinity */
+int tcmur_affinity_dev_init(struct tcmu_device *dev);
+void tcmur_affinity_dev_free(struct tcmu_device *dev);
+
+void tcmur_affinity_bind_thread(struct tcmu_device *dev);
+void tcmur_affinity_enter(struct tcmu_device *dev,
+			  struct tcmur_affinity_saved *saved);
+void tcmur_affinity_leave(struct tcmur_affinity_saved *saved);
+
+#endif
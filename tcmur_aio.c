@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "ccan/list/list.h"
 
@@ -18,6 +19,8 @@
 #include "libtcmu_priv.h"
 #include "tcmur_device.h"
 #include "tcmur_aio.h"
+#include "tcmur_affinity.h"
+#include "tcmur_co.h"
 #include "tcmu_runner_priv.h"
 #include "tcmu-runner.h"
 
@@ -102,11 +105,43 @@ static void cleanup_empty_queue_wait(void *arg)
 	pthread_mutex_unlock(&aio_track->track_lock);
 }
 
+/*
+ * The cmdproc thread reaps polled completions itself, so it has to keep
+ * doing that while it waits.
+ */
+static int aio_poll_for_empty_queue(struct tcmur_device *rdev, int fd)
+{
+	struct tcmu_track_aio *aio_track = &rdev->track_queue;
+	struct pollfd pfd;
+	bool empty;
+
+	while (1) {
+		pthread_mutex_lock(&aio_track->track_lock);
+		empty = !aio_track->tracked_aio_ops;
+		pthread_mutex_unlock(&aio_track->track_lock);
+		if (empty)
+			return 0;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+			return errno;
+		tcmur_dev_poll_completions(rdev->dev);
+	}
+}
+
 int aio_wait_for_empty_queue(struct tcmur_device *rdev)
 {
 	struct tcmu_track_aio *aio_track = &rdev->track_queue;
 	pthread_cond_t cond;
-	int ret;
+	int ret, fd;
+
+	if (pthread_equal(pthread_self(), rdev->cmdproc_thread)) {
+		fd = tcmur_dev_get_completion_fd(rdev->dev);
+		if (fd >= 0)
+			return aio_poll_for_empty_queue(rdev, fd);
+	}
 
 	ret = pthread_cond_init(&cond, NULL);
 	if (ret)
@@ -145,6 +180,8 @@ static void *io_work_queue(void *arg)
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
 	int ret;
 
+	tcmur_affinity_bind_thread(dev);
+
 	while (1) {
 		struct tcmu_work *work;
 		void *data;
@@ -211,9 +248,12 @@ int aio_request_schedule(struct tcmu_device *dev, void *data,
 			 tcmu_work_fn_t work_fn, tcmu_done_fn_t done_fn)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
-	if (!rhandler->nr_threads) {
+	if (rdev->co) {
+		ret = tcmur_co_schedule(dev, data, work_fn, done_fn);
+	} else if (!rhandler->nr_threads) {
 		ret = work_fn(dev, data);
 		if (!ret)
 			ret = TCMU_STS_ASYNC_HANDLED;
@@ -224,6 +264,43 @@ int aio_request_schedule(struct tcmu_device *dev, void *data,
 	return ret;
 }
 
+/*
+ * Remove data's work item from the queue if no thread has picked it up
+ * yet and complete it with sts. Returns false if it was not queued.
+ */
+bool aio_request_cancel(struct tcmu_device *dev, void *data, int sts)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmu_io_queue *io_wq = &rdev->work_queue;
+	struct tcmu_work *work, *found = NULL;
+
+	if (rdev->co)
+		return tcmur_co_cancel(dev, data, sts);
+	if (!io_wq->io_wq_threads)
+		return false;
+
+	pthread_cleanup_push(_cleanup_mutex_lock, &io_wq->io_lock);
+	pthread_mutex_lock(&io_wq->io_lock);
+
+	list_for_each(&io_wq->io_queue, work, entry) {
+		if (work->data == data) {
+			list_del(&work->entry);
+			found = work;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&io_wq->io_lock);
+	pthread_cleanup_pop(0);
+
+	if (!found)
+		return false;
+
+	found->done_fn(dev, data, sts);
+	free(found);
+	return true;
+}
+
 int setup_aio_tracking(struct tcmur_device *rdev)
 {
 	int ret;
@@ -254,10 +331,9 @@ void cleanup_aio_tracking(struct tcmur_device *rdev)
 
 void cleanup_io_work_queue_threads(struct tcmu_device *dev)
 {
-	struct tcmur_handler *r_handler = tcmu_get_runner_handler(dev);
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
-	int i, nr_threads = r_handler->nr_threads;
+	int i, nr_threads = io_wq->nr_threads;
 
 	if (!io_wq->io_wq_threads) {
 		return;
@@ -276,9 +352,16 @@ int setup_io_work_queue(struct tcmu_device *dev)
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmu_io_queue *io_wq = &rdev->work_queue;
 	int ret, i, nr_threads = r_handler->nr_threads;
+	int64_t tun_threads;
 
-	if (!nr_threads)
+	/* run in coroutines instead, see tcmur_co.c */
+	if (!nr_threads || rdev->co)
 		return 0;
+	/* async handlers stay async, threaded ones may use more threads */
+	tun_threads = tcmur_dev_get_tunable(dev, &tcmur_nr_threads_tunable);
+	if (tun_threads > 0)
+		nr_threads = tun_threads;
+	io_wq->nr_threads = nr_threads;
 
 	list_head_init(&io_wq->io_queue);
 
@@ -9,6 +9,7 @@
 #ifndef __TCMUR_AIO_H
 #define __TCMUR_AIO_H
 
+#include <stdbool.h>
 #include <pthread.h>
 
 #include "ccan/list/list.h"
@@ -29,6 +30,7 @@ struct tcmu_io_queue {
 	pthread_cond_t io_cond;
 
 	pthread_t *io_wq_threads;
+	int nr_threads;
 	struct list_head io_queue;
 };
 
@@ -44,6 +46,7 @@ typedef void (*tcmu_done_fn_t)(struct tcmu_device *dev, void *data, int rc);
 
 int aio_request_schedule(struct tcmu_device *, void *, tcmu_work_fn_t,
 			 tcmu_done_fn_t);
+bool aio_request_cancel(struct tcmu_device *, void *, int);
 
 /* aio request tracking */
 void track_aio_request_start(struct tcmur_device *);
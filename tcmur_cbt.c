@@ -0,0 +1,821 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Changed block tracking (CBT)
+ *
+ * When a device is created with ";tcmur_cbt=/path/to/bitmap" in its
+ * cfgstring the runner records every range that is written, unmapped
+ * or formatted in a bitmap file, one bit per tcmur_cbt_gran bytes
+ * (64K by default). Incremental backup tools fetch the changed ranges
+ * through the ExportChangedBlocks D-Bus method and only read those.
+ *
+ * The bitmap file is a TCMUR_CBT_HDR_LEN byte header followed by the
+ * bitmap as an array of 64 bit words, all in host byte order. It is
+ * mmapped, and a bit is synced to disk before the write it covers is
+ * sent to the handler, so after a crash the bitmap is still a
+ * superset of what changed.
+ *
+ * Every reset of the bitmap starts a new generation. While a reset is
+ * in progress TCMUR_CBT_FLAG_DIRTY is set in the header. If it is
+ * found set on open the bitmap cannot be trusted, so every block is
+ * marked changed and the generation is bumped.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <scsi/scsi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "scsi_defs.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_cbt.h"
+
+#define TCMUR_CBT_MAGIC		0x54424354	/* "TCBT" */
+#define TCMUR_CBT_VERSION	1
+#define TCMUR_CBT_HDR_LEN	4096
+
+#define TCMUR_CBT_FLAG_DIRTY	(1 << 0)
+
+struct tcmur_cbt_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t granularity;
+	uint32_t flags;
+	uint64_t size;		/* bytes of the device covered */
+	uint64_t generation;
+};
+
+struct tcmur_cbt {
+	int fd;
+	char *path;
+
+	/*
+	 * Taken for read when marking and for write when the mapping
+	 * changes or the bitmap is reset.
+	 */
+	pthread_rwlock_t lock;
+	/* serializes exports */
+	pthread_mutex_t export_lock;
+
+	void *map;
+	size_t map_len;
+	struct tcmur_cbt_hdr *hdr;
+	uint64_t *bitmap;
+
+	/* bits known to be on disk, so marking them again needs no sync */
+	uint64_t *synced;
+
+	/* bumped by every reset, see tcmur_cbt_cmd_done() */
+	uint64_t nr_resets;
+
+	uint64_t nr_bits;
+	uint32_t gran_shift;
+	size_t page_size;
+};
+
+static inline uint64_t cbt_nr_words(uint64_t nr_bits)
+{
+	return (nr_bits + 63) / 64;
+}
+
+static size_t cbt_map_len(struct tcmur_cbt *cbt, uint64_t nr_bits)
+{
+	return TCMUR_CBT_HDR_LEN +
+		round_up(cbt_nr_words(nr_bits) * sizeof(uint64_t),
+			 cbt->page_size);
+}
+
+static int cbt_sync_hdr(struct tcmur_cbt *cbt)
+{
+	if (msync(cbt->hdr, TCMUR_CBT_HDR_LEN, MS_SYNC))
+		return -errno;
+	return 0;
+}
+
+static int cbt_sync_words(struct tcmur_cbt *cbt, uint64_t first,
+			  uint64_t last)
+{
+	uintptr_t start = (uintptr_t)&cbt->bitmap[first];
+	uintptr_t end = (uintptr_t)&cbt->bitmap[last + 1];
+
+	start = round_down(start, cbt->page_size);
+	if (msync((void *)start, end - start, MS_SYNC))
+		return -errno;
+	return 0;
+}
+
+/* Set bits [first, last]. Caller holds cbt->lock. */
+static void cbt_set_bits(struct tcmur_cbt *cbt, uint64_t first, uint64_t last)
+{
+	uint64_t w, first_w = first / 64, last_w = last / 64;
+
+	for (w = first_w; w <= last_w; w++) {
+		uint64_t mask = ~0ULL;
+
+		if (w == first_w)
+			mask &= ~0ULL << (first % 64);
+		if (w == last_w && (last % 64) != 63)
+			mask &= (1ULL << ((last % 64) + 1)) - 1;
+
+		__atomic_fetch_or(&cbt->bitmap[w], mask, __ATOMIC_RELAXED);
+	}
+}
+
+static void cbt_mark_all(struct tcmur_cbt *cbt)
+{
+	if (cbt->nr_bits)
+		cbt_set_bits(cbt, 0, cbt->nr_bits - 1);
+}
+
+static int cbt_map(struct tcmu_device *dev, struct tcmur_cbt *cbt,
+		   uint64_t nr_bits)
+{
+	size_t map_len = cbt_map_len(cbt, nr_bits);
+	uint64_t *synced;
+	void *map;
+
+	if (ftruncate(cbt->fd, map_len)) {
+		tcmu_dev_err(dev, "Could not size CBT bitmap %s to %zu: %m\n",
+			     cbt->path, map_len);
+		return -errno;
+	}
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   cbt->fd, 0);
+	if (map == MAP_FAILED) {
+		tcmu_dev_err(dev, "Could not map CBT bitmap %s: %m\n",
+			     cbt->path);
+		return -errno;
+	}
+
+	synced = calloc(cbt_nr_words(nr_bits), sizeof(uint64_t));
+	if (!synced) {
+		munmap(map, map_len);
+		return -ENOMEM;
+	}
+
+	if (cbt->map)
+		munmap(cbt->map, cbt->map_len);
+	free(cbt->synced);
+
+	cbt->map = map;
+	cbt->map_len = map_len;
+	cbt->hdr = map;
+	cbt->bitmap = map + TCMUR_CBT_HDR_LEN;
+	cbt->synced = synced;
+	cbt->nr_bits = nr_bits;
+	return 0;
+}
+
+static uint64_t cbt_dev_size(struct tcmu_device *dev)
+{
+	return tcmu_lba_to_byte(dev, tcmu_dev_get_num_lbas(dev));
+}
+
+static uint64_t cbt_size_to_bits(struct tcmur_cbt *cbt, uint64_t size)
+{
+	return (size + (1ULL << cbt->gran_shift) - 1) >> cbt->gran_shift;
+}
+
+/**
+ * tcmur_cbt_create - open or create a bitmap file covering dev
+ * @dev: device whose size the bitmap tracks
+ * @path: bitmap file
+ * @gran: bytes per bit, 0 for TCMUR_CBT_DEF_GRANULARITY. The
+ *	  granularity of an existing file takes precedence.
+ * @cbt_ret: returns the bitmap
+ */
+int tcmur_cbt_create(struct tcmu_device *dev, const char *path, uint32_t gran,
+		     struct tcmur_cbt **cbt_ret)
+{
+	uint64_t dev_size = cbt_dev_size(dev);
+	struct tcmur_cbt_hdr hdr;
+	struct tcmur_cbt *cbt;
+	struct stat st;
+	bool new_map;
+	ssize_t rd;
+	int ret;
+
+	if (!gran)
+		gran = TCMUR_CBT_DEF_GRANULARITY;
+
+	cbt = calloc(1, sizeof(*cbt));
+	if (!cbt)
+		return -ENOMEM;
+	cbt->page_size = sysconf(_SC_PAGESIZE);
+
+	cbt->path = strdup(path);
+	if (!cbt->path) {
+		ret = -ENOMEM;
+		goto free_cbt;
+	}
+
+	cbt->fd = open(cbt->path, O_RDWR | O_CREAT, 0600);
+	if (cbt->fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open CBT bitmap %s: %m\n",
+			     cbt->path);
+		goto free_path;
+	}
+
+	if (fstat(cbt->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	new_map = st.st_size < sizeof(hdr);
+	if (!new_map) {
+		rd = pread(cbt->fd, &hdr, sizeof(hdr), 0);
+		if (rd != sizeof(hdr)) {
+			ret = rd < 0 ? -errno : -EIO;
+			goto close_fd;
+		}
+
+		if (hdr.magic != TCMUR_CBT_MAGIC ||
+		    hdr.version != TCMUR_CBT_VERSION) {
+			tcmu_dev_err(dev, "%s is not a CBT bitmap (magic 0x%x version %u)\n",
+				     cbt->path, hdr.magic, hdr.version);
+			ret = -EINVAL;
+			goto close_fd;
+		}
+
+		if (hdr.granularity != gran) {
+			tcmu_dev_warn(dev, "Using CBT granularity %u from %s instead of %u\n",
+				      hdr.granularity, cbt->path, gran);
+			gran = hdr.granularity;
+		}
+	}
+
+	if (gran < tcmu_dev_get_block_size(dev) || (gran & (gran - 1))) {
+		tcmu_dev_err(dev, "Invalid CBT granularity %u. Must be a power of 2 and at least the block size.\n",
+			     gran);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+	cbt->gran_shift = ffs(gran) - 1;
+
+	ret = cbt_map(dev, cbt, cbt_size_to_bits(cbt, dev_size));
+	if (ret)
+		goto close_fd;
+
+	if (new_map) {
+		memset(cbt->hdr, 0, TCMUR_CBT_HDR_LEN);
+		cbt->hdr->magic = TCMUR_CBT_MAGIC;
+		cbt->hdr->version = TCMUR_CBT_VERSION;
+		cbt->hdr->granularity = gran;
+		cbt->hdr->size = dev_size;
+		cbt->hdr->generation = 1;
+	} else if (cbt->hdr->flags & TCMUR_CBT_FLAG_DIRTY) {
+		tcmu_dev_warn(dev, "CBT bitmap %s was not reset cleanly. Marking all blocks changed.\n",
+			      cbt->path);
+		cbt_mark_all(cbt);
+		cbt->hdr->generation++;
+		cbt->hdr->flags &= ~TCMUR_CBT_FLAG_DIRTY;
+	} else if (cbt->hdr->size < dev_size) {
+		/* device grew while we were not tracking it */
+		cbt_set_bits(cbt, cbt->hdr->size >> cbt->gran_shift,
+			     cbt->nr_bits - 1);
+	}
+	cbt->hdr->size = dev_size;
+
+	if (msync(cbt->map, cbt->map_len, MS_SYNC)) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not sync CBT bitmap %s: %m\n",
+			     cbt->path);
+		goto unmap;
+	}
+	memcpy(cbt->synced, cbt->bitmap,
+	       cbt_nr_words(cbt->nr_bits) * sizeof(uint64_t));
+
+	ret = pthread_rwlock_init(&cbt->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto unmap;
+	}
+
+	ret = pthread_mutex_init(&cbt->export_lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	tcmu_dev_info(dev, "Tracking changed blocks in %s, granularity %u, generation %"PRIu64"\n",
+		      cbt->path, gran, cbt->hdr->generation);
+	*cbt_ret = cbt;
+	return 0;
+
+destroy_lock:
+	pthread_rwlock_destroy(&cbt->lock);
+unmap:
+	munmap(cbt->map, cbt->map_len);
+	free(cbt->synced);
+close_fd:
+	close(cbt->fd);
+free_path:
+	free(cbt->path);
+free_cbt:
+	free(cbt);
+	return ret;
+}
+
+int tcmur_cbt_open(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	return tcmur_cbt_create(dev, rdev->cbt_path, rdev->cbt_granularity,
+				&rdev->cbt);
+}
+
+void tcmur_cbt_destroy(struct tcmu_device *dev, struct tcmur_cbt *cbt)
+{
+	if (msync(cbt->map, cbt->map_len, MS_SYNC))
+		tcmu_dev_err(dev, "Could not sync CBT bitmap %s: %m\n",
+			     cbt->path);
+
+	pthread_mutex_destroy(&cbt->export_lock);
+	pthread_rwlock_destroy(&cbt->lock);
+	munmap(cbt->map, cbt->map_len);
+	free(cbt->synced);
+	close(cbt->fd);
+	free(cbt->path);
+	free(cbt);
+}
+
+void tcmur_cbt_close(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cbt *cbt = rdev->cbt;
+
+	if (!cbt)
+		return;
+	rdev->cbt = NULL;
+	tcmur_cbt_destroy(dev, cbt);
+}
+
+/*
+ * Called after the device size has changed. Growing marks the new
+ * area as changed since a backup has never seen it.
+ */
+int tcmur_cbt_set_size(struct tcmu_device *dev, struct tcmur_cbt *cbt)
+{
+	uint64_t new_size = cbt_dev_size(dev);
+	uint64_t old_size, nr_bits;
+	int ret;
+
+	pthread_rwlock_wrlock(&cbt->lock);
+	old_size = cbt->hdr->size;
+	nr_bits = cbt_size_to_bits(cbt, new_size);
+
+	ret = cbt_map(dev, cbt, nr_bits);
+	if (ret)
+		goto unlock;
+
+	if (new_size > old_size)
+		cbt_set_bits(cbt, old_size >> cbt->gran_shift, nr_bits - 1);
+	cbt->hdr->size = new_size;
+
+	if (msync(cbt->map, cbt->map_len, MS_SYNC)) {
+		ret = -errno;
+		goto unlock;
+	}
+	memcpy(cbt->synced, cbt->bitmap,
+	       cbt_nr_words(cbt->nr_bits) * sizeof(uint64_t));
+
+	tcmu_dev_dbg(dev, "CBT bitmap resized from %"PRIu64" to %"PRIu64" bytes\n",
+		     old_size, new_size);
+unlock:
+	pthread_rwlock_unlock(&cbt->lock);
+	return ret;
+}
+
+int tcmur_cbt_resize(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (!rdev->cbt)
+		return 0;
+	return tcmur_cbt_set_size(dev, rdev->cbt);
+}
+
+/* Bits of word w that fall in [first, last] */
+static uint64_t cbt_word_mask(uint64_t w, uint64_t first, uint64_t last)
+{
+	uint64_t mask = ~0ULL;
+
+	if (w == first / 64)
+		mask &= ~0ULL << (first % 64);
+	if (w == last / 64 && (last % 64) != 63)
+		mask &= (1ULL << ((last % 64) + 1)) - 1;
+	return mask;
+}
+
+/*
+ * Set the bits covering [off, off + len) and sync them to disk. Caller
+ * holds cbt->lock for reading.
+ */
+static void cbt_set_range(struct tcmu_device *dev, struct tcmur_cbt *cbt,
+			  uint64_t off, uint64_t len)
+{
+	uint64_t first, last, w, first_w, last_w;
+	bool need_sync = false;
+
+	if (!cbt->nr_bits)
+		return;
+
+	first = off >> cbt->gran_shift;
+	last = (off + len - 1) >> cbt->gran_shift;
+	if (first >= cbt->nr_bits)
+		return;
+	last = min(last, cbt->nr_bits - 1);
+
+	first_w = first / 64;
+	last_w = last / 64;
+	for (w = first_w; w <= last_w; w++) {
+		uint64_t mask = cbt_word_mask(w, first, last);
+
+		if ((__atomic_load_n(&cbt->synced[w], __ATOMIC_ACQUIRE) &
+		     mask) == mask)
+			continue;
+
+		__atomic_fetch_or(&cbt->bitmap[w], mask, __ATOMIC_RELAXED);
+		need_sync = true;
+	}
+
+	if (!need_sync)
+		return;
+
+	/*
+	 * The bit must be on disk before the data it covers is written,
+	 * else a crash could lose the record of the change.
+	 */
+	if (cbt_sync_words(cbt, first_w, last_w)) {
+		tcmu_dev_err(dev, "Could not sync CBT bitmap %s: %m\n",
+			     cbt->path);
+		return;
+	}
+
+	/*
+	 * Only our own bits are known to be on disk. Other bits of these
+	 * words may have been set after the msync started and stay
+	 * unsynced until whoever set them syncs them.
+	 */
+	for (w = first_w; w <= last_w; w++)
+		__atomic_fetch_or(&cbt->synced[w],
+				  cbt_word_mask(w, first, last),
+				  __ATOMIC_RELEASE);
+}
+
+void tcmur_cbt_set(struct tcmu_device *dev, struct tcmur_cbt *cbt,
+		   uint64_t off, uint64_t len)
+{
+	if (!len)
+		return;
+
+	pthread_rwlock_rdlock(&cbt->lock);
+	cbt_set_range(dev, cbt, off, len);
+	pthread_rwlock_unlock(&cbt->lock);
+}
+
+void tcmur_cbt_mark(struct tcmu_device *dev, uint64_t off, uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (rdev->cbt)
+		tcmur_cbt_set(dev, rdev->cbt, off, len);
+}
+
+/*
+ * Mark the range of a command and remember which reset it was marked
+ * after, see tcmur_cbt_cmd_done().
+ */
+static void cbt_mark_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 uint64_t off, uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct tcmur_cbt *cbt = rdev->cbt;
+
+	if (!len)
+		return;
+
+	pthread_rwlock_rdlock(&cbt->lock);
+	cbt_set_range(dev, cbt, off, len);
+	tcmur_cmd->cbt_off = off;
+	tcmur_cmd->cbt_len = len;
+	tcmur_cmd->cbt_reset = cbt->nr_resets;
+	pthread_rwlock_unlock(&cbt->lock);
+}
+
+/*
+ * A reset while the command was in flight cleared its bits, but the
+ * data may only have reached the handler after the export was taken.
+ * Mark the range again so the next export reports it.
+ */
+void tcmur_cbt_cmd_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cbt *cbt = rdev->cbt;
+
+	if (!cbt || !tcmur_cmd->cbt_len)
+		return;
+
+	if (__atomic_load_n(&cbt->nr_resets, __ATOMIC_ACQUIRE) ==
+	    tcmur_cmd->cbt_reset)
+		return;
+
+	tcmur_cbt_set(dev, cbt, tcmur_cmd->cbt_off, tcmur_cmd->cbt_len);
+}
+
+/*
+ * Clearing a range is done in two steps so a bit never reaches the
+ * disk cleared before the copy it stands for is stable:
+ *
+ * tcmur_cbt_clear_begin() forgets that the bits are synced, so a
+ * tcmur_cbt_set() racing with the copy syncs them again. Once the copy
+ * is stable tcmur_cbt_clear_end() clears the bits that were not set
+ * again in between.
+ */
+void tcmur_cbt_clear_begin(struct tcmur_cbt *cbt, uint64_t off, uint64_t len)
+{
+	uint64_t bit, last;
+
+	if (!len)
+		return;
+
+	pthread_rwlock_rdlock(&cbt->lock);
+	last = (off + len - 1) >> cbt->gran_shift;
+	for (bit = off >> cbt->gran_shift;
+	     bit < cbt->nr_bits && bit <= last; bit++)
+		__atomic_fetch_and(&cbt->synced[bit / 64],
+				   ~(1ULL << (bit % 64)), __ATOMIC_SEQ_CST);
+	pthread_rwlock_unlock(&cbt->lock);
+}
+
+void tcmur_cbt_clear_end(struct tcmur_cbt *cbt, uint64_t off, uint64_t len)
+{
+	uint64_t bit, last;
+
+	if (!len)
+		return;
+
+	/* excludes tcmur_cbt_set() so a bit set again cannot be lost */
+	pthread_rwlock_wrlock(&cbt->lock);
+	last = (off + len - 1) >> cbt->gran_shift;
+	for (bit = off >> cbt->gran_shift;
+	     bit < cbt->nr_bits && bit <= last; bit++) {
+		uint64_t mask = 1ULL << (bit % 64);
+
+		if (!(cbt->synced[bit / 64] & mask))
+			cbt->bitmap[bit / 64] &= ~mask;
+	}
+	pthread_rwlock_unlock(&cbt->lock);
+}
+
+/*
+ * Find the first set bit at or after *off. On success the granule it
+ * covers is returned in *off and *len.
+ */
+bool tcmur_cbt_find_next(struct tcmur_cbt *cbt, uint64_t *off, uint64_t *len)
+{
+	uint64_t bit, w, word;
+	bool found = false;
+
+	pthread_rwlock_rdlock(&cbt->lock);
+	bit = *off >> cbt->gran_shift;
+	while (bit < cbt->nr_bits) {
+		w = bit / 64;
+		word = __atomic_load_n(&cbt->bitmap[w], __ATOMIC_SEQ_CST) &
+			(~0ULL << (bit % 64));
+		if (!word) {
+			bit = (w + 1) * 64;
+			continue;
+		}
+
+		bit = w * 64 + __builtin_ctzll(word);
+		if (bit >= cbt->nr_bits)
+			break;
+
+		*off = bit << cbt->gran_shift;
+		*len = min((uint64_t)1 << cbt->gran_shift,
+			   cbt->hdr->size - *off);
+		found = true;
+		break;
+	}
+	pthread_rwlock_unlock(&cbt->lock);
+	return found;
+}
+
+/* Number of bits set */
+uint64_t tcmur_cbt_count(struct tcmur_cbt *cbt)
+{
+	uint64_t w, count = 0;
+
+	pthread_rwlock_rdlock(&cbt->lock);
+	for (w = 0; w < cbt_nr_words(cbt->nr_bits); w++)
+		count += __builtin_popcountll(__atomic_load_n(&cbt->bitmap[w],
+							      __ATOMIC_RELAXED));
+	pthread_rwlock_unlock(&cbt->lock);
+	return count;
+}
+
+uint32_t tcmur_cbt_get_granularity(struct tcmur_cbt *cbt)
+{
+	return 1U << cbt->gran_shift;
+}
+
+/*
+ * Record the range a command is going to modify. UNMAP and EXTENDED
+ * COPY carry their ranges in the parameter list and are marked where
+ * that is parsed.
+ */
+void tcmur_cbt_track_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	uint8_t *cdb = cmd->cdb;
+	uint32_t nlbas;
+
+	if (!rdev->cbt)
+		return;
+
+	switch (cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case COMPARE_AND_WRITE:
+		nlbas = cmd->xfer_len;
+		if (cdb[0] == WRITE_6 && !nlbas)
+			nlbas = 256;
+		cbt_mark_cmd(dev, cmd, cmd->off, tcmu_lba_to_byte(dev, nlbas));
+		break;
+	case FORMAT_UNIT:
+		cbt_mark_cmd(dev, cmd, 0, cbt_dev_size(dev));
+		break;
+	}
+}
+
+static int cbt_write_export(struct tcmu_device *dev, struct tcmur_cbt *cbt,
+			    const char *path, uint64_t *snap, uint64_t nr_bits,
+			    uint64_t dev_size, uint64_t generation)
+{
+	uint64_t gran = 1ULL << cbt->gran_shift;
+	uint64_t bit, start = 0;
+	bool in_range = false;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		tcmu_dev_err(dev, "Could not create CBT export %s: %m\n", path);
+		return -errno;
+	}
+
+	fprintf(fp, "generation %"PRIu64"\n", generation);
+	fprintf(fp, "granularity %"PRIu64"\n", gran);
+	fprintf(fp, "size %"PRIu64"\n", dev_size);
+
+	for (bit = 0; bit <= nr_bits; bit++) {
+		bool set = bit < nr_bits &&
+			   (snap[bit / 64] & (1ULL << (bit % 64)));
+
+		if (set && !in_range) {
+			start = bit;
+			in_range = true;
+		} else if (!set && in_range) {
+			uint64_t off = start * gran;
+			uint64_t end = min(bit * gran, dev_size);
+
+			fprintf(fp, "%"PRIu64" %"PRIu64"\n", off, end - off);
+			in_range = false;
+		}
+	}
+
+	if (fflush(fp) || fsync(fileno(fp))) {
+		tcmu_dev_err(dev, "Could not write CBT export %s: %m\n", path);
+		ret = -errno;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Write the ranges changed in the current generation to path, one
+ * "offset length" pair in bytes per line after a small header. If
+ * reset is true the bitmap is cleared and a new generation started.
+ * The exported generation is returned in *generation.
+ */
+int tcmur_cbt_export(struct tcmu_device *dev, const char *path, bool reset,
+		     uint64_t *generation)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cbt *cbt = rdev->cbt;
+	uint64_t nr_bits, nr_words, dev_size, w;
+	uint64_t *snap;
+	int ret;
+
+	if (!cbt)
+		return -ENOENT;
+
+	pthread_mutex_lock(&cbt->export_lock);
+
+	pthread_rwlock_wrlock(&cbt->lock);
+	nr_bits = cbt->nr_bits;
+	nr_words = cbt_nr_words(nr_bits);
+	dev_size = cbt->hdr->size;
+	*generation = cbt->hdr->generation;
+
+	snap = malloc(max(nr_words, (uint64_t)1) * sizeof(uint64_t));
+	if (!snap) {
+		pthread_rwlock_unlock(&cbt->lock);
+		ret = -ENOMEM;
+		goto unlock_export;
+	}
+	memcpy(snap, cbt->bitmap, nr_words * sizeof(uint64_t));
+
+	if (reset) {
+		cbt->hdr->flags |= TCMUR_CBT_FLAG_DIRTY;
+		ret = cbt_sync_hdr(cbt);
+		if (ret) {
+			cbt->hdr->flags &= ~TCMUR_CBT_FLAG_DIRTY;
+			pthread_rwlock_unlock(&cbt->lock);
+			goto free_snap;
+		}
+		memset(cbt->bitmap, 0, nr_words * sizeof(uint64_t));
+		memset(cbt->synced, 0, nr_words * sizeof(uint64_t));
+		/* in flight commands mark their range again on completion */
+		__atomic_add_fetch(&cbt->nr_resets, 1, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&cbt->lock);
+
+	ret = cbt_write_export(dev, cbt, path, snap, nr_bits, dev_size,
+			       *generation);
+	if (!reset)
+		goto done;
+
+	/*
+	 * The device may have been resized while we were writing the
+	 * export, so only touch the words both bitmaps have.
+	 */
+	pthread_rwlock_rdlock(&cbt->lock);
+	if (ret) {
+		/* put the ranges back so they are not lost */
+		nr_words = min(nr_words, cbt_nr_words(cbt->nr_bits));
+		for (w = 0; w < nr_words; w++)
+			__atomic_fetch_or(&cbt->bitmap[w], snap[w],
+					  __ATOMIC_RELAXED);
+	}
+
+	if (msync(cbt->map, cbt->map_len, MS_SYNC)) {
+		/* leave the DIRTY flag set, the next open marks everything */
+		tcmu_dev_err(dev, "Could not sync CBT bitmap %s: %m\n",
+			     cbt->path);
+		if (!ret)
+			ret = -errno;
+		pthread_rwlock_unlock(&cbt->lock);
+		goto free_snap;
+	}
+
+	if (!ret)
+		cbt->hdr->generation++;
+	cbt->hdr->flags &= ~TCMUR_CBT_FLAG_DIRTY;
+	if (cbt_sync_hdr(cbt))
+		tcmu_dev_err(dev, "Could not sync CBT header %s: %m\n",
+			     cbt->path);
+	pthread_rwlock_unlock(&cbt->lock);
+
+done:
+	if (ret)
+		goto free_snap;
+
+	tcmu_dev_info(dev, "Exported CBT generation %"PRIu64" to %s%s\n",
+		      *generation, path, reset ? " and reset bitmap" : "");
+free_snap:
+	free(snap);
+unlock_export:
+	pthread_mutex_unlock(&cbt->export_lock);
+	return ret;
+}
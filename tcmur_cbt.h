@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_CBT_H
+#define __TCMUR_CBT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct tcmu_device;
+struct tcmulib_cmd;
+struct tcmur_cmd;
+struct tcmur_cbt;
+
+#define TCMUR_CBT_DEF_GRANULARITY	(64 * 1024)
+
+/* Bitmap instances, also used by other runner features */
+int tcmur_cbt_create(struct tcmu_device *dev, const char *path, uint32_t gran,
+		     struct tcmur_cbt **cbt_ret);
+void tcmur_cbt_destroy(struct tcmu_device *dev, struct tcmur_cbt *cbt);
+int tcmur_cbt_set_size(struct tcmu_device *dev, struct tcmur_cbt *cbt);
+void tcmur_cbt_set(struct tcmu_device *dev, struct tcmur_cbt *cbt,
+		   uint64_t off, uint64_t len);
+void tcmur_cbt_clear_begin(struct tcmur_cbt *cbt, uint64_t off, uint64_t len);
+void tcmur_cbt_clear_end(struct tcmur_cbt *cbt, uint64_t off, uint64_t len);
+bool tcmur_cbt_find_next(struct tcmur_cbt *cbt, uint64_t *off, uint64_t *len);
+uint64_t tcmur_cbt_count(struct tcmur_cbt *cbt);
+uint32_t tcmur_cbt_get_granularity(struct tcmur_cbt *cbt);
+
+/* Changed block tracking of a LIO device using rdev->cbt */
+int tcmur_cbt_open(struct tcmu_device *dev);
+void tcmur_cbt_close(struct tcmu_device *dev);
+int tcmur_cbt_resize(struct tcmu_device *dev);
+
+void tcmur_cbt_mark(struct tcmu_device *dev, uint64_t off, uint64_t len);
+void tcmur_cbt_track_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_cbt_cmd_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd);
+
+int tcmur_cbt_export(struct tcmu_device *dev, const char *path, bool reset,
+		     uint64_t *generation);
+
+#endif /* __TCMUR_CBT_H */
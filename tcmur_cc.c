@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Latency based limit on the commands a device has in flight to its handler
+ *
+ * When a backend slows down the runner would otherwise keep passing it
+ * everything LIO sends, until commands hit cmd_time_out and initiators
+ * start aborting and dropping sessions. With cc_target_latency set, the
+ * time each I/O spends in the handler is measured and the number of
+ * commands in flight is limited AIMD style: the limit grows by one for
+ * each limit commands completing within the target and is cut by a
+ * quarter, at most once per target interval, when they take longer.
+ *
+ * Over the limit the cmdproc thread stops taking commands from the ring
+ * and the kernel queues them, until a completion brings the device back
+ * under the limit. With cc_task_set_full set the commands are fetched and
+ * failed with TASK SET FULL instead, so initiators back off themselves.
+ *
+ * Only commands that go through the handler's I/O callouts count. Handlers
+ * with nr_threads 0 that take commands in handle_cmd are not limited.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "libtcmu_config.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_cc.h"
+
+struct tcmur_cc {
+	pthread_mutex_t lock;
+	/* written when a completion ends a throttled period */
+	int wake_fd;
+	bool throttled;
+
+	uint32_t inflight;
+	uint32_t limit;
+	/* completions within the target since the limit last grew */
+	uint32_t acks;
+	uint64_t last_cut;
+	/* moving average of the handler latency, in ns */
+	uint64_t avg_lat;
+
+	uint64_t nr_cmds;
+	uint64_t nr_over_target;
+	uint64_t nr_cuts;
+	uint64_t nr_throttled;
+	uint64_t nr_rejected;
+};
+
+struct tcmu_tunable tcmur_cc_target_latency_tunable = {
+	.name = "cc_target_latency",
+	.desc = "Handler latency in ms above which the commands in flight per device are reduced, 0 to not limit them",
+	.type = TCMU_TUNABLE_INT,
+	.def = 0,
+	.min = 0,
+	.max = 600000,
+};
+
+struct tcmu_tunable tcmur_cc_min_depth_tunable = {
+	.name = "cc_min_depth",
+	.desc = "Lowest limit of commands in flight per device set by cc_target_latency",
+	.type = TCMU_TUNABLE_INT,
+	.def = 4,
+	.min = 1,
+	.max = 65536,
+};
+
+struct tcmu_tunable tcmur_cc_max_depth_tunable = {
+	.name = "cc_max_depth",
+	.desc = "Highest limit of commands in flight per device set by cc_target_latency",
+	.type = TCMU_TUNABLE_INT,
+	.def = 256,
+	.min = 1,
+	.max = 65536,
+};
+
+struct tcmu_tunable tcmur_cc_task_set_full_tunable = {
+	.name = "cc_task_set_full",
+	.desc = "Fail commands over the cc_target_latency limit with TASK SET FULL instead of leaving them in the ring",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 0,
+	.min = 0,
+	.max = 1,
+};
+
+static uint64_t cc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the bounds can be changed at runtime, keep the limit between them */
+static uint32_t cc_clamp(struct tcmu_device *dev, uint32_t limit)
+{
+	uint32_t min_depth, max_depth;
+
+	min_depth = tcmur_dev_get_tunable(dev, &tcmur_cc_min_depth_tunable);
+	max_depth = tcmur_dev_get_tunable(dev, &tcmur_cc_max_depth_tunable);
+	if (max_depth < min_depth)
+		max_depth = min_depth;
+
+	if (limit < min_depth)
+		return min_depth;
+	if (limit > max_depth)
+		return max_depth;
+	return limit;
+}
+
+int tcmur_cc_init(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cc *cc;
+	int ret;
+
+	cc = calloc(1, sizeof(*cc));
+	if (!cc)
+		return -ENOMEM;
+
+	cc->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cc->wake_fd < 0) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not create congestion control eventfd: %m\n");
+		free(cc);
+		return ret;
+	}
+
+	pthread_mutex_init(&cc->lock, NULL);
+	/* start unlimited, the first slow completions bring it down */
+	cc->limit = cc_clamp(dev, UINT32_MAX);
+	rdev->cc = cc;
+	return 0;
+}
+
+void tcmur_cc_free(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cc *cc = rdev->cc;
+
+	if (!cc)
+		return;
+
+	close(cc->wake_fd);
+	pthread_mutex_destroy(&cc->lock);
+	free(cc);
+	rdev->cc = NULL;
+}
+
+static bool cc_enabled(struct tcmu_device *dev)
+{
+	return tcmur_dev_get_tunable(dev, &tcmur_cc_target_latency_tunable) != 0;
+}
+
+bool tcmur_cc_may_fetch(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cc *cc = rdev->cc;
+	bool ok;
+
+	if (!cc || !cc_enabled(dev) ||
+	    tcmur_dev_get_tunable(dev, &tcmur_cc_task_set_full_tunable))
+		return true;
+
+	pthread_mutex_lock(&cc->lock);
+	ok = cc->inflight < cc->limit;
+	if (!ok && !cc->throttled) {
+		cc->throttled = true;
+		cc->nr_throttled++;
+	}
+	pthread_mutex_unlock(&cc->lock);
+	return ok;
+}
+
+int tcmur_cc_get_fd(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	return rdev->cc ? rdev->cc->wake_fd : -1;
+}
+
+void tcmur_cc_clear_wakeup(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	uint64_t val;
+
+	if (rdev->cc && read(rdev->cc->wake_fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN)
+		tcmu_dev_err(dev, "Could not read congestion control eventfd: %m\n");
+}
+
+int tcmur_cc_start(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cc *cc = rdev->cc;
+
+	if (!cc || !cc_enabled(dev))
+		return TCMU_STS_OK;
+
+	pthread_mutex_lock(&cc->lock);
+	if (cc->inflight >= cc->limit &&
+	    tcmur_dev_get_tunable(dev, &tcmur_cc_task_set_full_tunable)) {
+		cc->nr_rejected++;
+		pthread_mutex_unlock(&cc->lock);
+		return TCMU_STS_NO_RESOURCE;
+	}
+	cc->inflight++;
+	pthread_mutex_unlock(&cc->lock);
+
+	tcmur_cmd->cc_start = cc_now();
+	return TCMU_STS_OK;
+}
+
+void tcmur_cc_end(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cc *cc = rdev->cc;
+	uint64_t now, lat, target;
+	bool wake = false;
+
+	if (!cc || !tcmur_cmd->cc_start)
+		return;
+
+	now = cc_now();
+	lat = now - tcmur_cmd->cc_start;
+	tcmur_cmd->cc_start = 0;
+	target = tcmur_dev_get_tunable(dev, &tcmur_cc_target_latency_tunable) *
+								1000000ULL;
+
+	pthread_mutex_lock(&cc->lock);
+	cc->inflight--;
+	cc->nr_cmds++;
+	cc->avg_lat = cc->avg_lat ? cc->avg_lat - cc->avg_lat / 16 + lat / 16 : lat;
+
+	if (!target) {
+		/* disabled while the command was in flight */
+	} else if (lat <= target) {
+		if (++cc->acks >= cc->limit) {
+			cc->acks = 0;
+			cc->limit++;
+		}
+	} else {
+		cc->nr_over_target++;
+		/* one cut per round of commands sent over the old limit */
+		if (now - cc->last_cut >= target) {
+			cc->limit -= cc->limit / 4;
+			cc->acks = 0;
+			cc->last_cut = now;
+			cc->nr_cuts++;
+			tcmu_dev_dbg(dev, "Handler latency %"PRIu64" us, limiting to %u commands\n",
+				     lat / 1000, cc_clamp(dev, cc->limit));
+		}
+	}
+	cc->limit = cc_clamp(dev, cc->limit);
+
+	if (cc->throttled && (cc->inflight < cc->limit || !target)) {
+		cc->throttled = false;
+		wake = true;
+	}
+	pthread_mutex_unlock(&cc->lock);
+
+	if (wake && eventfd_write(cc->wake_fd, 1))
+		tcmu_dev_err(dev, "Could not wake up cmdproc thread: %m\n");
+}
+
+int tcmur_cc_get_stats(struct tcmu_device *dev, char **stats)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_cc *cc = rdev->cc;
+	int ret;
+
+	if (!cc)
+		return -ENOENT;
+
+	pthread_mutex_lock(&cc->lock);
+	ret = asprintf(stats,
+		       "target_latency_ms %"PRId64"\n"
+		       "limit %u\n"
+		       "inflight %u\n"
+		       "avg_latency_us %"PRIu64"\n"
+		       "commands %"PRIu64"\n"
+		       "over_target %"PRIu64"\n"
+		       "limit_cuts %"PRIu64"\n"
+		       "throttled %"PRIu64"\n"
+		       "task_set_full %"PRIu64"\n",
+		       tcmur_dev_get_tunable(dev, &tcmur_cc_target_latency_tunable),
+		       cc->limit, cc->inflight, cc->avg_lat / 1000, cc->nr_cmds,
+		       cc->nr_over_target, cc->nr_cuts, cc->nr_throttled,
+		       cc->nr_rejected);
+	pthread_mutex_unlock(&cc->lock);
+
+	if (ret < 0) {
+		*stats = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
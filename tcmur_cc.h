@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_CC_H
+#define __TCMUR_CC_H
+
+#include <stdbool.h>
+
+struct tcmu_device;
+struct tcmur_cmd;
+struct tcmur_cc;
+struct tcmu_tunable;
+
+extern struct tcmu_tunable tcmur_cc_target_latency_tunable;
+extern struct tcmu_tunable tcmur_cc_min_depth_tunable;
+extern struct tcmu_tunable tcmur_cc_max_depth_tunable;
+extern struct tcmu_tunable tcmur_cc_task_set_full_tunable;
+
+int tcmur_cc_init(struct tcmu_device *dev);
+void tcmur_cc_free(struct tcmu_device *dev);
+
+/*
+ * Called by the cmdproc thread before fetching a command. Returns false
+ * if commands should be left in the ring until tcmur_cc_get_fd is
+ * readable.
+ */
+bool tcmur_cc_may_fetch(struct tcmu_device *dev);
+int tcmur_cc_get_fd(struct tcmu_device *dev);
+void tcmur_cc_clear_wakeup(struct tcmu_device *dev);
+
+/*
+ * Count a command as in flight to the handler. Returns TCMU_STS_OK, or
+ * TCMU_STS_NO_RESOURCE if the device is over its limit and
+ * cc_task_set_full is set.
+ */
+int tcmur_cc_start(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd);
+/* Called once the handler is done with a command tcmur_cc_start counted */
+void tcmur_cc_end(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd);
+
+int tcmur_cc_get_stats(struct tcmu_device *dev, char **stats);
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+
+#include "darray.h"
+#include "libtcmu.h"
+#include "libtcmu_log.h"
+#include "libtcmu_priv.h"
+#include "libtcmu_common.h"
+#include "string_priv.h"
+#include "tcmu-runner.h"
+#include "tcmu_runner_priv.h"
+#include "tcmur_aio.h"
+#include "tcmur_device.h"
+#include "tcmur_child.h"
+#include "tcmur_co.h"
+
+struct tcmur_child {
+	struct tcmu_device dev;
+	struct tcmulib_handler handler;
+	struct tcmur_device rdev;
+};
+
+static struct tcmulib_handler *find_handler(struct tcmulib_context *ctx,
+					    const char *subtype, size_t len)
+{
+	struct tcmulib_handler *handler;
+
+	darray_foreach(handler, ctx->handlers) {
+		if (strlen(handler->subtype) == len &&
+		    !strncmp(handler->subtype, subtype, len))
+			return handler;
+	}
+
+	return NULL;
+}
+
+/**
+ * tcmur_child_dev_open - open a handler instance not backed by LIO
+ * @parent: device the child stores data for
+ * @label: appended to the parent's name in log messages
+ * @cfgstring: "subtype/handler config" string passed to the handler
+ *
+ * The child inherits the parent's size and block limits. Handler
+ * callouts on it may be run with the tcmur_dev_sync_* helpers.
+ * Returns NULL on failure.
+ */
+struct tcmu_device *tcmur_child_dev_open(struct tcmu_device *parent,
+					 const char *label,
+					 const char *cfgstring)
+{
+	struct tcmulib_handler *handler;
+	struct tcmur_handler *rhandler;
+	struct tcmur_child *child;
+	struct tcmu_device *dev;
+	struct tcmur_device *rdev;
+	const char *sep;
+	int ret;
+
+	sep = strchr(cfgstring, '/');
+	if (!sep) {
+		tcmu_dev_err(parent, "Invalid child cfgstring %s. Must be subtype/config.\n",
+			     cfgstring);
+		return NULL;
+	}
+
+	handler = find_handler(parent->ctx, cfgstring, sep - cfgstring);
+	if (!handler) {
+		tcmu_dev_err(parent, "No handler for child cfgstring %s\n",
+			     cfgstring);
+		return NULL;
+	}
+
+	rhandler = handler->hm_private;
+	if (rhandler->_is_dbus_handler || !rhandler->read || !rhandler->write) {
+		tcmu_dev_err(parent, "Handler %s does not support read/write callouts\n",
+			     rhandler->subtype);
+		return NULL;
+	}
+
+	child = calloc(1, sizeof(*child));
+	if (!child)
+		return NULL;
+	child->handler = *handler;
+
+	dev = &child->dev;
+	dev->fd = -1;
+	dev->handler = &child->handler;
+	dev->ctx = parent->ctx;
+	tcmu_dev_set_num_lbas(dev, tcmu_dev_get_num_lbas(parent));
+	tcmu_dev_set_block_size(dev, tcmu_dev_get_block_size(parent));
+	tcmu_dev_set_max_xfer_len(dev, tcmu_dev_get_max_xfer_len(parent));
+	tcmu_dev_set_opt_xcopy_rw_len(dev,
+				      tcmu_dev_get_opt_xcopy_rw_len(parent));
+	tcmu_dev_set_max_unmap_len(dev, tcmu_dev_get_max_unmap_len(parent));
+	tcmu_dev_set_opt_unmap_gran(dev, tcmu_dev_get_opt_unmap_gran(parent),
+				    parent->split_unmaps);
+	tcmu_dev_set_unmap_gran_align(dev,
+				      tcmu_dev_get_unmap_gran_align(parent));
+	strlcpy(dev->dev_name, parent->dev_name, sizeof(dev->dev_name));
+	strlcpy(dev->tcm_hba_name, parent->tcm_hba_name,
+		sizeof(dev->tcm_hba_name));
+	snprintf(dev->tcm_dev_name, sizeof(dev->tcm_dev_name), "%s-%s",
+		 parent->tcm_dev_name, label);
+	strlcpy(dev->cfgstring, cfgstring, sizeof(dev->cfgstring));
+
+	rdev = &child->rdev;
+	rdev->dev = dev;
+	rdev->flags = TCMUR_DEV_FLAG_CHILD;
+	list_node_init(&rdev->recovery_entry);
+	list_head_init(&rdev->cmds_list);
+	tcmu_dev_set_private(dev, rdev);
+
+	ret = pthread_spin_init(&rdev->lock, 0);
+	if (ret)
+		goto free_child;
+
+	ret = pthread_mutex_init(&rdev->caw_lock, NULL);
+	if (ret)
+		goto cleanup_dev_lock;
+
+	ret = pthread_mutex_init(&rdev->format_lock, NULL);
+	if (ret)
+		goto cleanup_caw_lock;
+
+	ret = pthread_mutex_init(&rdev->state_lock, NULL);
+	if (ret)
+		goto cleanup_format_lock;
+
+	ret = pthread_mutex_init(&rdev->poll_lock, NULL);
+	if (ret)
+		goto cleanup_state_lock;
+
+	ret = pthread_cond_init(&rdev->lock_cond, NULL);
+	if (ret)
+		goto cleanup_poll_lock;
+
+	ret = tcmur_co_init(dev);
+	if (ret < 0)
+		goto cleanup_lock_cond;
+
+	ret = setup_io_work_queue(dev);
+	if (ret < 0)
+		goto free_co;
+
+	ret = setup_aio_tracking(rdev);
+	if (ret < 0)
+		goto cleanup_io_work_queue;
+
+	ret = rhandler->open(dev, false);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not open child device %s: %d\n",
+			     cfgstring, ret);
+		goto cleanup_aio_tracking;
+	}
+	rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
+
+	tcmu_dev_dbg(dev, "Opened child device %s\n", cfgstring);
+	return dev;
+
+cleanup_aio_tracking:
+	cleanup_aio_tracking(rdev);
+cleanup_io_work_queue:
+	cleanup_io_work_queue(dev, true);
+free_co:
+	tcmur_co_free(dev);
+cleanup_lock_cond:
+	pthread_cond_destroy(&rdev->lock_cond);
+cleanup_poll_lock:
+	pthread_mutex_destroy(&rdev->poll_lock);
+cleanup_state_lock:
+	pthread_mutex_destroy(&rdev->state_lock);
+cleanup_format_lock:
+	pthread_mutex_destroy(&rdev->format_lock);
+cleanup_caw_lock:
+	pthread_mutex_destroy(&rdev->caw_lock);
+cleanup_dev_lock:
+	pthread_spin_destroy(&rdev->lock);
+free_child:
+	free(child);
+	return NULL;
+}
+
+/*
+ * The caller must make sure no I/O is running on the child.
+ */
+void tcmur_child_dev_close(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler;
+	struct tcmur_child *child;
+	struct tcmur_device *rdev;
+
+	if (!dev)
+		return;
+
+	child = container_of(dev, struct tcmur_child, dev);
+	rhandler = tcmu_get_runner_handler(dev);
+	rdev = &child->rdev;
+
+	cleanup_io_work_queue_threads(dev);
+	tcmur_co_free(dev);
+
+	if (rdev->flags & TCMUR_DEV_FLAG_IS_OPEN)
+		rhandler->close(dev);
+	rdev->flags = TCMUR_DEV_FLAG_CHILD | TCMUR_DEV_FLAG_STOPPED;
+
+	cleanup_io_work_queue(dev, false);
+	cleanup_aio_tracking(rdev);
+	pthread_cond_destroy(&rdev->lock_cond);
+	pthread_mutex_destroy(&rdev->poll_lock);
+	pthread_mutex_destroy(&rdev->state_lock);
+	pthread_mutex_destroy(&rdev->format_lock);
+	pthread_mutex_destroy(&rdev->caw_lock);
+	pthread_spin_destroy(&rdev->lock);
+
+	tcmu_dev_dbg(dev, "Closed child device\n");
+	free(child);
+}
+
+void tcmur_child_dev_set_num_lbas(struct tcmu_device *dev, uint64_t num_lbas)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmulib_cfg_info cfg;
+
+	if (tcmu_dev_get_num_lbas(dev) == num_lbas)
+		return;
+
+	if (rhandler->reconfig) {
+		cfg.type = TCMULIB_CFG_DEV_SIZE;
+		cfg.data.dev_size = tcmu_lba_to_byte(dev, num_lbas);
+		if (rhandler->reconfig(dev, &cfg))
+			tcmu_dev_warn(dev, "Handler could not resize child to %"PRIu64" bytes\n",
+				      cfg.data.dev_size);
+	}
+	tcmu_dev_set_num_lbas(dev, num_lbas);
+}
+
+enum {
+	SYNC_IO_READ,
+	SYNC_IO_WRITE,
+	SYNC_IO_FLUSH,
+	SYNC_IO_UNMAP,
+};
+
+struct sync_io {
+	struct tcmur_cmd tcmur_cmd;
+	struct tcmulib_cmd lib_cmd;
+	uint8_t cdb[16];
+
+	int op;
+	struct iovec *iov;
+	size_t iov_cnt;
+	size_t len;
+	uint64_t off;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+	int status;
+};
+
+static int sync_io_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct sync_io *io = container_of(tcmur_cmd, struct sync_io, tcmur_cmd);
+
+	switch (io->op) {
+	case SYNC_IO_READ:
+		return rhandler->read(dev, tcmur_cmd, io->iov, io->iov_cnt,
+				      io->len, io->off);
+	case SYNC_IO_WRITE:
+		return rhandler->write(dev, tcmur_cmd, io->iov, io->iov_cnt,
+				       io->len, io->off);
+	case SYNC_IO_FLUSH:
+		if (!rhandler->flush)
+			return TCMU_STS_OK;
+		return rhandler->flush(dev, tcmur_cmd);
+	case SYNC_IO_UNMAP:
+		if (!rhandler->unmap)
+			return TCMU_STS_OK;
+		return rhandler->unmap(dev, tcmur_cmd, io->off, io->len);
+	}
+
+	return TCMU_STS_NOT_HANDLED;
+}
+
+static void sync_io_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int ret)
+{
+	struct sync_io *io = container_of(tcmur_cmd, struct sync_io, tcmur_cmd);
+
+	pthread_mutex_lock(&io->lock);
+	io->status = ret;
+	io->done = true;
+	pthread_cond_signal(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+}
+
+static int sync_io_submit(struct tcmu_device *dev, int op, struct iovec *iov,
+			  size_t iov_cnt, size_t len, uint64_t off)
+{
+	struct iovec *iov_copy = NULL;
+	struct sync_io *io;
+	int ret;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return TCMU_STS_NO_RESOURCE;
+
+	/* handlers may advance the iovec they are given */
+	if (iov_cnt) {
+		iov_copy = malloc(iov_cnt * sizeof(*iov));
+		if (!iov_copy) {
+			free(io);
+			return TCMU_STS_NO_RESOURCE;
+		}
+		memcpy(iov_copy, iov, iov_cnt * sizeof(*iov));
+	}
+
+	io->lib_cmd.cdb = io->cdb;
+	tcmu_cdb_decode(dev, &io->lib_cmd);
+	io->lib_cmd.iovec = iov_copy;
+	io->lib_cmd.iov_cnt = iov_cnt;
+	io->lib_cmd.hm_private = &io->tcmur_cmd;
+	io->tcmur_cmd.lib_cmd = &io->lib_cmd;
+	io->tcmur_cmd.done = sync_io_done;
+	list_node_init(&io->tcmur_cmd.cmds_list_entry);
+	io->op = op;
+	io->iov = iov_copy;
+	io->iov_cnt = iov_cnt;
+	io->len = len;
+	io->off = off;
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->cond, NULL);
+
+	ret = aio_request_schedule(dev, &io->tcmur_cmd, sync_io_work_fn,
+				   tcmur_cmd_complete);
+	if (ret == TCMU_STS_ASYNC_HANDLED) {
+		pthread_mutex_lock(&io->lock);
+		while (!io->done)
+			pthread_cond_wait(&io->cond, &io->lock);
+		ret = io->status;
+		pthread_mutex_unlock(&io->lock);
+	}
+
+	pthread_cond_destroy(&io->cond);
+	pthread_mutex_destroy(&io->lock);
+	free(iov_copy);
+	free(io);
+	return ret;
+}
+
+int tcmur_dev_sync_read(struct tcmu_device *dev, struct iovec *iov,
+			size_t iov_cnt, size_t len, off_t off)
+{
+	return sync_io_submit(dev, SYNC_IO_READ, iov, iov_cnt, len, off);
+}
+
+int tcmur_dev_sync_write(struct tcmu_device *dev, struct iovec *iov,
+			 size_t iov_cnt, size_t len, off_t off)
+{
+	return sync_io_submit(dev, SYNC_IO_WRITE, iov, iov_cnt, len, off);
+}
+
+int tcmur_dev_sync_flush(struct tcmu_device *dev)
+{
+	return sync_io_submit(dev, SYNC_IO_FLUSH, NULL, 0, 0, 0);
+}
+
+int tcmur_dev_sync_unmap(struct tcmu_device *dev, uint64_t off, uint64_t len)
+{
+	return sync_io_submit(dev, SYNC_IO_UNMAP, NULL, 0, len, off);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Child devices are extra instances of a tcmur handler that are not
+ * backed by a LIO device. Runner features and stacking handlers use
+ * them to store data on a second backend described by a cfgstring of
+ * the form "subtype/handler config", e.g. "file//var/lib/replica.img".
+ */
+
+#ifndef __TCMUR_CHILD_H
+#define __TCMUR_CHILD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct tcmu_device;
+
+struct tcmu_device *tcmur_child_dev_open(struct tcmu_device *parent,
+					 const char *label,
+					 const char *cfgstring);
+void tcmur_child_dev_close(struct tcmu_device *child);
+void tcmur_child_dev_set_num_lbas(struct tcmu_device *child,
+				  uint64_t num_lbas);
+
+/*
+ * Execute a handler callout on a tcmur device (child or not) and wait
+ * for it to complete. Sync handlers are run from the device's work
+ * queue so the nr_threads limit is honored. Returns a TCMU_STS code.
+ */
+int tcmur_dev_sync_read(struct tcmu_device *dev, struct iovec *iov,
+			size_t iov_cnt, size_t len, off_t off);
+int tcmur_dev_sync_write(struct tcmu_device *dev, struct iovec *iov,
+			 size_t iov_cnt, size_t len, off_t off);
+int tcmur_dev_sync_flush(struct tcmu_device *dev);
+int tcmur_dev_sync_unmap(struct tcmu_device *dev, uint64_t off, uint64_t len);
+
+#endif /* __TCMUR_CHILD_H */
@@ -26,6 +26,11 @@
 #include "tcmu-runner.h"
 #include "tcmu_runner_priv.h"
 #include "tcmur_cmd_handler.h"
+#include "tcmur_cbt.h"
+#include "tcmur_repl.h"
+#include "tcmur_resp_cache.h"
+#include "tcmur_cc.h"
+#include "tcmur_hedge.h"
 #include "alua.h"
 
 static void _cleanup_spin_lock(void *arg)
@@ -40,6 +45,10 @@ void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	struct timespec curr_time;
 
+	tcmur_cbt_cmd_done(dev, tcmur_cmd);
+	tcmur_hedge_cmd_done(dev, tcmur_cmd, rc);
+	tcmur_repl_cmd_done(dev, tcmur_cmd, rc);
+
 	pthread_cleanup_push(_cleanup_spin_lock, (void *)&rdev->lock);
 	pthread_spin_lock(&rdev->lock);
 
@@ -58,7 +67,13 @@ void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
 
 	list_del(&tcmur_cmd->cmds_list_entry);
 
-	tcmulib_command_complete(dev, cmd, rc);
+	if (tcmur_cmd->cancelling) {
+		/* the cancelling thread completes it once the cancel returns */
+		tcmur_cmd->cancel_done = true;
+		tcmur_cmd->cancel_ret = rc;
+	} else {
+		tcmulib_command_complete(dev, cmd, rc);
+	}
 
 	pthread_spin_unlock(&rdev->lock);
 	pthread_cleanup_pop(0);
@@ -70,6 +85,7 @@ static void aio_command_finish(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int wake_up;
 
+	tcmur_cc_end(dev, cmd->hm_private);
 	tcmur_tcmulib_cmd_complete(dev, cmd, rc);
 	track_aio_request_finish(rdev, &wake_up);
 	while (wake_up) {
@@ -85,6 +101,24 @@ void tcmur_cmd_complete(struct tcmu_device *dev, void *data, int rc)
 	tcmur_cmd->done(dev, tcmur_cmd, rc);
 }
 
+/*
+ * Stop work on a command that is no longer wanted. If it is still
+ * queued for the io work queue it is completed with TCMU_STS_TIMEOUT
+ * here, else the handler is asked to abort it. The caller must keep
+ * tcmur_cmd from being freed while this runs, by setting cancelling or
+ * by other means, since it may complete at any time.
+ */
+void tcmur_cmd_cancel(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	if (aio_request_cancel(dev, tcmur_cmd, TCMU_STS_TIMEOUT))
+		return;
+
+	if (rhandler->cancel)
+		rhandler->cancel(dev, tcmur_cmd);
+}
+
 static void tcmur_cmd_iovec_reset(struct tcmur_cmd *tcmur_cmd,
 				  size_t data_length)
 {
@@ -157,15 +191,13 @@ static inline int check_lbas(struct tcmu_device *dev,
 static int check_lba_and_length(struct tcmu_device *dev,
 				struct tcmulib_cmd *cmd, uint32_t sectors)
 {
-	uint8_t *cdb = cmd->cdb;
-	uint64_t start_lba = tcmu_cdb_get_lba(cdb);
 	int ret;
 
 	ret = check_iovec_length(dev, cmd, sectors);
 	if (ret)
 		return ret;
 
-	ret = check_lbas(dev, start_lba, sectors);
+	ret = check_lbas(dev, cmd->lba, sectors);
 	if (ret)
 		return ret;
 
@@ -186,7 +218,7 @@ static int read_work_fn(struct tcmu_device *dev, void *data)
 
 	return rhandler->read(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
 			      tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
-			      tcmu_cdb_to_byte(dev, cmd->cdb));
+			      cmd->off);
 }
 
 static int write_work_fn(struct tcmu_device *dev, void *data)
@@ -194,10 +226,14 @@ static int write_work_fn(struct tcmu_device *dev, void *data)
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	size_t len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	off_t off = cmd->off;
+
+	tcmur_repl_journal_write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+				 len, off);
 
 	return rhandler->write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
-				tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
-				tcmu_cdb_to_byte(dev, cmd->cdb));
+				len, off);
 }
 
 struct unmap_state {
@@ -427,6 +463,11 @@ static int handle_unmap_internal(struct tcmu_device *dev, struct tcmulib_cmd *cm
 			goto done;
 
 		if (nlbas) {
+			tcmur_cbt_mark(dev, tcmu_lba_to_byte(dev, lba),
+				       tcmu_lba_to_byte(dev, nlbas));
+			tcmur_repl_mark_cmd(dev, tcmur_cmd,
+					    tcmu_lba_to_byte(dev, lba),
+					    tcmu_lba_to_byte(dev, nlbas));
 			ret = align_and_split_unmap(dev, tcmur_cmd, lba, nlbas);
 			if (ret != TCMU_STS_ASYNC_HANDLED)
 				goto done;
@@ -458,7 +499,7 @@ static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *origcmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	uint8_t *cdb = origcmd->cdb;
-	size_t copied, data_length = tcmu_cdb_get_xfer_length(cdb);
+	size_t copied, data_length = origcmd->xfer_len;
 	uint8_t *par;
 	uint16_t dl, bddl;
 	int ret;
@@ -628,10 +669,9 @@ finish_err:
 
 static int handle_writesame_check(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
-	uint8_t *cdb = cmd->cdb;
-	uint32_t lba_cnt = tcmu_cdb_get_xfer_length(cdb);
+	uint32_t lba_cnt = cmd->xfer_len;
 	uint32_t block_size = tcmu_dev_get_block_size(dev);
-	uint64_t start_lba = tcmu_cdb_get_lba(cdb);
+	uint64_t start_lba = cmd->lba;
 	int ret;
 
 	if (cmd->iov_cnt != 1 || cmd->iovec->iov_len != block_size) {
@@ -679,9 +719,8 @@ static int handle_unmap_in_writesame(struct tcmu_device *dev,
 				     struct tcmulib_cmd *cmd)
 {
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	uint8_t *cdb = cmd->cdb;
-	uint64_t lba = tcmu_cdb_get_lba(cdb);
-	uint64_t nlbas = tcmu_cdb_get_xfer_length(cdb);
+	uint64_t lba = cmd->lba;
+	uint64_t nlbas = cmd->xfer_len;
 	struct unmap_state *state;
 	int ret;
 
@@ -707,12 +746,11 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	uint8_t *cdb = cmd->cdb;
-	uint32_t lba_cnt = tcmu_cdb_get_xfer_length(cdb);
+	uint32_t lba_cnt = cmd->xfer_len;
 	uint32_t block_size = tcmu_dev_get_block_size(dev);
-	uint64_t start_lba = tcmu_cdb_get_lba(cdb);
+	uint64_t start_lba = cmd->lba;
 	uint64_t write_lbas;
-	size_t max_xfer_length, length = 1024 * 1024;
+	size_t max_xfer_length, length;
 	struct write_same *write_same;
 	int i, ret;
 
@@ -723,6 +761,7 @@ static int handle_writesame(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	if (rhandler->unmap && (cmd->cdb[1] & 0x08))
 		return handle_unmap_in_writesame(dev, cmd);
 
+	length = tcmur_dev_get_tunable(dev, &tcmur_wsame_chunk_tunable);
 	max_xfer_length = tcmu_dev_get_max_xfer_len(dev) * block_size;
 	length = round_up(length, max_xfer_length);
 	length = min(length, tcmu_lba_to_byte(dev, lba_cnt));
@@ -754,9 +793,8 @@ static int tcmur_writesame_work_fn(struct tcmu_device *dev, void *data)
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 	tcmur_writesame_fn_t write_same_fn = tcmur_cmd->cmd_state;
-	uint8_t *cdb = cmd->cdb;
-	uint64_t off = tcmu_cdb_to_byte(dev, cdb);
-	uint64_t len = tcmu_lba_to_byte(dev, tcmu_cdb_get_xfer_length(cdb));
+	uint64_t off = cmd->off;
+	uint64_t len = cmd->len;
 
 	/*
 	 * Write contents of the logical block data(from the Data-Out Buffer)
@@ -795,89 +833,281 @@ int tcmur_handle_writesame(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
 }
 
 /* async write verify */
+#define WRITE_VERIFY_CHUNK_LEN	(1024 * 1024)
+/* chunk reads in flight per command */
+#define WRITE_VERIFY_DEPTH	4
+
 struct write_verify_state {
+	pthread_mutex_t lock;
+	/* chunk reads, plus one while they are started */
+	unsigned int refcount;
+	int status;
+	/* offset of the first mismatch if status is TCMU_STS_MISCOMPARE */
+	uint64_t miscompare;
+
+	/* next offset of the Data-Out buffer to read back */
+	uint64_t next;
+	uint64_t length;
+	size_t chunk_len;
+
 	struct iovec *w_iovec;
 	size_t w_iov_cnt;
 };
 
-static void handle_write_verify_read_cbk(struct tcmu_device *dev,
-					 struct tcmur_cmd *tcmur_cmd, int ret)
+struct write_verify_chunk {
+	/* offset of the chunk in the Data-Out buffer */
+	uint64_t off;
+};
+
+static void write_verify_set_status(struct write_verify_state *state,
+				    int ret, uint64_t miscompare)
 {
+	pthread_mutex_lock(&state->lock);
+	if (state->status == TCMU_STS_OK) {
+		state->status = ret;
+		state->miscompare = miscompare;
+	} else if (state->status == TCMU_STS_MISCOMPARE &&
+		   ret == TCMU_STS_MISCOMPARE) {
+		/* chunks complete out of order, report the first mismatch */
+		state->miscompare = min(state->miscompare, miscompare);
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void write_verify_put(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			     int ret)
+{
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	struct write_verify_state *state = tcmur_cmd->cmd_state;
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
-	uint32_t cmp_offset;
+	int status;
 
-	/* failed read - bail out */
 	if (ret != TCMU_STS_OK)
-		goto done;
+		write_verify_set_status(state, ret, 0);
 
-	ret = TCMU_STS_OK;
-	cmp_offset = tcmu_iovec_compare(tcmur_cmd->iov_base_copy,
-					state->w_iovec, tcmur_cmd->requested);
-	if (cmp_offset != -1) {
-		tcmu_dev_err(dev, "Verify failed at offset %u\n", cmp_offset);
-		ret =  TCMU_STS_MISCOMPARE;
-		tcmu_sense_set_info(cmd->sense_buf, cmp_offset);
+	pthread_mutex_lock(&state->lock);
+	if (--state->refcount > 0) {
+		pthread_mutex_unlock(&state->lock);
+		return;
+	}
+	status = state->status;
+	pthread_mutex_unlock(&state->lock);
+
+	if (status == TCMU_STS_MISCOMPARE) {
+		tcmu_dev_err(dev, "Verify failed at offset %"PRIu64"\n",
+			     state->miscompare);
+		tcmu_sense_set_info(cmd->sense_buf, state->miscompare);
 	}
 
-done:
+	pthread_mutex_destroy(&state->lock);
 	tcmur_cmd_state_free(tcmur_cmd);
-	aio_command_finish(dev, cmd, ret);
+	aio_command_finish(dev, cmd, status);
+}
+
+/*
+ * Compare len bytes read back into buf with the Data-Out buffer at off.
+ * Returns the offset of the first mismatch in buf or -1.
+ */
+static off_t write_verify_compare(struct write_verify_state *state,
+				  void *buf, uint64_t off, size_t len)
+{
+	struct iovec *iovec = state->w_iovec;
+	struct iovec part;
+	size_t done = 0;
+	off_t cmp_offset;
+
+	while (off >= iovec->iov_len) {
+		off -= iovec->iov_len;
+		iovec++;
+	}
+
+	while (done < len) {
+		part.iov_base = iovec->iov_base + off;
+		part.iov_len = min(len - done, iovec->iov_len - off);
+
+		cmp_offset = tcmu_iovec_compare(buf + done, &part,
+						part.iov_len);
+		if (cmp_offset != -1)
+			return done + cmp_offset;
+
+		done += part.iov_len;
+		off = 0;
+		iovec++;
+	}
+
+	return -1;
 }
 
 static int write_verify_read_work_fn(struct tcmu_device *dev, void *data)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
-	struct tcmur_cmd *tcmur_cmd = data;
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	struct tcmur_cmd *tcmur_ucmd = data;
+	struct write_verify_chunk *chunk = tcmur_ucmd->cmd_state;
+	struct tcmulib_cmd *cmd = tcmur_ucmd->lib_cmd;
 
-	return rhandler->read(dev, tcmur_cmd, tcmur_cmd->iovec,
-			      tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-			      tcmu_cdb_to_byte(dev, cmd->cdb));
+	tcmur_cmd_iovec_reset(tcmur_ucmd, tcmur_ucmd->requested);
+	return rhandler->read(dev, tcmur_ucmd, tcmur_ucmd->iovec,
+			      tcmur_ucmd->iov_cnt, tcmur_ucmd->requested,
+			      cmd->off + chunk->off);
+}
+
+/*
+ * Read back the next chunk nobody has taken yet into tcmur_ucmd's
+ * buffer. Returns TCMU_STS_OK if there is none left or the command
+ * already failed.
+ */
+static int write_verify_read_next(struct tcmu_device *dev,
+				  struct tcmur_cmd *tcmur_ucmd)
+{
+	struct tcmur_cmd *tcmur_cmd = tcmur_ucmd->lib_cmd->hm_private;
+	struct write_verify_state *state = tcmur_cmd->cmd_state;
+	struct write_verify_chunk *chunk = tcmur_ucmd->cmd_state;
+
+	pthread_mutex_lock(&state->lock);
+	if (state->status != TCMU_STS_OK || state->next == state->length) {
+		pthread_mutex_unlock(&state->lock);
+		return TCMU_STS_OK;
+	}
+	chunk->off = state->next;
+	tcmur_ucmd->requested = min(state->chunk_len,
+				    state->length - state->next);
+	state->next += tcmur_ucmd->requested;
+	pthread_mutex_unlock(&state->lock);
+
+	tcmu_dev_dbg(dev, "Verify offset: %"PRIu64", length: %zu\n",
+		     chunk->off, tcmur_ucmd->requested);
+
+	return aio_request_schedule(dev, tcmur_ucmd, write_verify_read_work_fn,
+				    tcmur_cmd_complete);
+}
+
+static void handle_write_verify_read_cbk(struct tcmu_device *dev,
+					 struct tcmur_cmd *tcmur_ucmd, int ret)
+{
+	struct tcmulib_cmd *cmd = tcmur_ucmd->lib_cmd;
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	struct write_verify_state *state = tcmur_cmd->cmd_state;
+	struct write_verify_chunk *chunk = tcmur_ucmd->cmd_state;
+	off_t cmp_offset;
+
+	/* failed read - bail out */
+	if (ret != TCMU_STS_OK)
+		goto put;
+
+	cmp_offset = write_verify_compare(state, tcmur_ucmd->iov_base_copy,
+					  chunk->off, tcmur_ucmd->requested);
+	if (cmp_offset != -1) {
+		write_verify_set_status(state, TCMU_STS_MISCOMPARE,
+					chunk->off + cmp_offset);
+		goto put;
+	}
+
+	ret = write_verify_read_next(dev, tcmur_ucmd);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
+
+put:
+	tcmur_cmd_state_free(tcmur_ucmd);
+	free(tcmur_ucmd);
+	write_verify_put(dev, cmd, ret);
+}
+
+/* Start a chunk read that reads back chunks until none are left */
+static void write_verify_start_read(struct tcmu_device *dev,
+				    struct tcmur_cmd *tcmur_cmd)
+{
+	struct write_verify_state *state = tcmur_cmd->cmd_state;
+	struct tcmur_cmd *tcmur_ucmd;
+	int ret;
+
+	tcmur_ucmd = calloc(1, sizeof(*tcmur_ucmd));
+	if (!tcmur_ucmd) {
+		write_verify_set_status(state, TCMU_STS_NO_RESOURCE, 0);
+		return;
+	}
+
+	if (tcmur_cmd_state_init(tcmur_ucmd, sizeof(struct write_verify_chunk),
+				 state->chunk_len)) {
+		write_verify_set_status(state, TCMU_STS_NO_RESOURCE, 0);
+		goto free_ucmd;
+	}
+	tcmur_ucmd->lib_cmd = tcmur_cmd->lib_cmd;
+	tcmur_ucmd->done = handle_write_verify_read_cbk;
+
+	pthread_mutex_lock(&state->lock);
+	state->refcount++;
+	pthread_mutex_unlock(&state->lock);
+
+	ret = write_verify_read_next(dev, tcmur_ucmd);
+	if (ret == TCMU_STS_ASYNC_HANDLED)
+		return;
+
+	tcmur_cmd_state_free(tcmur_ucmd);
+	free(tcmur_ucmd);
+	write_verify_put(dev, tcmur_cmd->lib_cmd, ret);
+	return;
+
+free_ucmd:
+	free(tcmur_ucmd);
 }
 
 static void handle_write_verify_write_cbk(struct tcmu_device *dev,
 					  struct tcmur_cmd *tcmur_cmd,
 					  int ret)
 {
-	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	struct write_verify_state *state = tcmur_cmd->cmd_state;
+	uint64_t nr_chunks;
+	int i;
 
 	/* write error - bail out */
 	if (ret != TCMU_STS_OK)
-		goto finish_err;
-
-	tcmur_cmd->done = handle_write_verify_read_cbk;
+		goto put;
 
-	ret = aio_request_schedule(dev, tcmur_cmd, write_verify_read_work_fn,
-				   tcmur_cmd_complete);
-	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto finish_err;
-	return;
+	nr_chunks = (state->length + state->chunk_len - 1) / state->chunk_len;
+	for (i = 0; i < WRITE_VERIFY_DEPTH && i < nr_chunks; i++)
+		write_verify_start_read(dev, tcmur_cmd);
 
-finish_err:
-	tcmur_cmd_state_free(tcmur_cmd);
-	aio_command_finish(dev, cmd, ret);
+put:
+	write_verify_put(dev, tcmur_cmd->lib_cmd, ret);
 }
 
-static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+/*
+ * Fallback for handlers without a write_verify callout: write the data,
+ * then read it back and compare it. The read back is done in chunks of
+ * at most WRITE_VERIFY_CHUNK_LEN, with up to WRITE_VERIFY_DEPTH of them
+ * in flight, so large transfers neither need a second buffer the size
+ * of the whole command nor wait for one chunk before reading the next.
+ */
+static int write_verify_read_back(struct tcmu_device *dev,
+				  struct tcmur_cmd *tcmur_cmd)
 {
-	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	uint8_t *cdb = cmd->cdb;
-	size_t length = tcmu_lba_to_byte(dev, tcmu_cdb_get_xfer_length(cdb));
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	uint32_t block_size = tcmu_dev_get_block_size(dev);
+	size_t max_xfer_length, chunk_len;
 	struct write_verify_state *state;
 	int i, ret, state_len;
 
-	ret = check_lba_and_length(dev, cmd, tcmu_cdb_get_xfer_length(cdb));
-	if (ret)
-		return ret;
+	max_xfer_length = tcmu_dev_get_max_xfer_len(dev) * block_size;
+	chunk_len = min((size_t)WRITE_VERIFY_CHUNK_LEN, max_xfer_length);
+	chunk_len = max(round_down(chunk_len, block_size), (size_t)block_size);
 
 	state_len = sizeof(*state) + (cmd->iov_cnt * sizeof(struct iovec));
 
-	if (tcmur_cmd_state_init(tcmur_cmd, state_len, length))
+	if (tcmur_cmd_state_init(tcmur_cmd, state_len, 0))
 		return TCMU_STS_NO_RESOURCE;
 	tcmur_cmd->done = handle_write_verify_write_cbk;
 
 	state = tcmur_cmd->cmd_state;
+	ret = pthread_mutex_init(&state->lock, NULL);
+	if (ret) {
+		tcmu_dev_err(dev, "Failed to init write verify lock: %d\n", ret);
+		ret = TCMU_STS_HW_ERR;
+		goto free_state;
+	}
+	/* released by handle_write_verify_write_cbk */
+	state->refcount = 1;
+	state->status = TCMU_STS_OK;
+	state->length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	state->chunk_len = chunk_len;
 	/*
 	 * Copy cmd iovec for later comparision in case handler modifies
 	 * pointers/lens.
@@ -892,15 +1122,66 @@ static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	ret = aio_request_schedule(dev, tcmur_cmd, write_work_fn,
 				   tcmur_cmd_complete);
 	if (ret != TCMU_STS_ASYNC_HANDLED)
-		goto free_state;
+		goto destroy_lock;
 
 	return TCMU_STS_ASYNC_HANDLED;
 
+destroy_lock:
+	pthread_mutex_destroy(&state->lock);
 free_state:
 	tcmur_cmd_state_free(tcmur_cmd);
 	return ret;
 }
 
+static void handle_write_verify_cbk(struct tcmu_device *dev,
+				    struct tcmur_cmd *tcmur_cmd, int ret)
+{
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	if (ret == TCMU_STS_NOT_HANDLED) {
+		tcmu_dev_dbg(dev, "write_verify not handled, falling back to read back.\n");
+		ret = write_verify_read_back(dev, tcmur_cmd);
+		if (ret == TCMU_STS_ASYNC_HANDLED)
+			return;
+	}
+
+	aio_command_finish(dev, cmd, ret);
+}
+
+static int write_verify_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	return rhandler->write_verify(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
+				      tcmu_iovec_length(cmd->iovec, cmd->iov_cnt),
+				      cmd->off);
+}
+
+static int handle_write_verify(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
+	int ret;
+
+	ret = check_lba_and_length(dev, cmd, cmd->xfer_len);
+	if (ret)
+		return ret;
+
+	if (!rhandler->write_verify)
+		return write_verify_read_back(dev, tcmur_cmd);
+
+	tcmur_cmd->done = handle_write_verify_cbk;
+
+	ret = aio_request_schedule(dev, tcmur_cmd, write_verify_work_fn,
+				   tcmur_cmd_complete);
+	if (ret == TCMU_STS_NOT_HANDLED)
+		ret = write_verify_read_back(dev, tcmur_cmd);
+
+	return ret;
+}
+
 #define XCOPY_HDR_LEN                   16
 #define XCOPY_TARGET_DESC_LEN           32
 #define XCOPY_SEGMENT_DESC_B2B_LEN      28
@@ -1216,8 +1497,7 @@ static int xcopy_parse_parameter_list(struct tcmu_device *dev,
 				      struct tcmulib_cmd *cmd,
 				      struct xcopy *xcopy)
 {
-	uint8_t *cdb = cmd->cdb;
-	size_t data_length = tcmu_cdb_get_xfer_length(cdb);
+	size_t data_length = cmd->xfer_len;
 	struct iovec *iovec = cmd->iovec;
 	size_t iov_cnt = cmd->iov_cnt;
 	uint32_t inline_dl;
@@ -1395,6 +1675,10 @@ static void handle_xcopy_write_cbk(struct tcmu_device *dst_dev,
 	struct xcopy *xcopy = tcmur_cmd->cmd_state;
 	struct tcmu_device *src_dev = xcopy->src_dev;
 
+	/* again, in case resync copied the range during the write */
+	tcmur_repl_mark(dst_dev, tcmu_lba_to_byte(dst_dev, xcopy->dst_lba),
+			tcmur_cmd->requested);
+
 	/* write failed - bail out */
 	if (ret != TCMU_STS_OK) {
 		tcmu_dev_err(src_dev, "Failed to write to dst device!\n");
@@ -1430,6 +1714,10 @@ static int xcopy_write_work_fn(struct tcmu_device *dst_dev, void *data)
 	struct xcopy *xcopy = tcmur_cmd->cmd_state;
 
 	tcmur_cmd_iovec_reset(tcmur_cmd, tcmur_cmd->requested);
+	tcmur_cbt_mark(dst_dev, tcmu_lba_to_byte(dst_dev, xcopy->dst_lba),
+		       tcmur_cmd->requested);
+	tcmur_repl_mark(dst_dev, tcmu_lba_to_byte(dst_dev, xcopy->dst_lba),
+			tcmur_cmd->requested);
 
 	return rhandler->write(dst_dev, tcmur_cmd, tcmur_cmd->iovec,
 			       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
@@ -1484,7 +1772,7 @@ static int handle_xcopy(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	uint8_t *cdb = cmd->cdb;
-	size_t data_length = tcmu_cdb_get_xfer_length(cdb);
+	size_t data_length = cmd->xfer_len;
 	uint32_t max_sectors, src_max_sectors, dst_max_sectors;
 	struct xcopy *xcopy, xcopy_parse;
 	int ret;
@@ -1573,12 +1861,12 @@ static int caw_work_fn(struct tcmu_device *dev, void *data)
 	if (tcmur_cmd->done == handle_caw_write_cbk) {
 		return rhandler->write(dev, tcmur_cmd, cmd->iovec, cmd->iov_cnt,
 				       tcmur_cmd->requested,
-				       tcmu_cdb_to_byte(dev, cmd->cdb));
+				       cmd->off);
 
 	} else {
 		return rhandler->read(dev, tcmur_cmd, tcmur_cmd->iovec,
 				       tcmur_cmd->iov_cnt, tcmur_cmd->requested,
-				       tcmu_cdb_to_byte(dev, cmd->cdb));
+				       cmd->off);
 	}
 }
 
@@ -1622,7 +1910,7 @@ finish_err:
 static int handle_caw_check(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	int ret;
-	uint64_t start_lba = tcmu_cdb_get_lba(cmd->cdb);
+	uint64_t start_lba = cmd->lba;
 	uint8_t sectors = cmd->cdb[13];
 
 	/* From sbc4r12a section 5.3 COMPARE AND WRITE command
@@ -1695,7 +1983,7 @@ static int tcmur_caw_fn(struct tcmu_device *dev, void *data)
 	struct tcmur_cmd *tcmur_cmd = data;
 	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
 	tcmur_caw_fn_t caw_fn = tcmur_cmd->cmd_state;
-	uint64_t off = tcmu_cdb_to_byte(dev, cmd->cdb);
+	uint64_t off = cmd->off;
 	size_t half = (tcmu_iovec_length(cmd->iovec, cmd->iov_cnt)) / 2;
 
 	return caw_fn(dev, tcmur_cmd, off, half, cmd->iovec, cmd->iov_cnt);
@@ -1746,6 +2034,91 @@ static int flush_work_fn(struct tcmu_device *dev, void *data)
 	return rhandler->flush(dev, data);
 }
 
+/*
+ * Batched submission: with a submit_batch callout, READs, WRITEs and
+ * flushes are collected while the cmdproc thread drains the ring and
+ * submitted together once it is empty, the batch is full or another
+ * command comes in, so they stay ordered against it.
+ */
+static bool batch_enabled(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+
+	return rhandler->submit_batch && !rhandler->nr_threads;
+}
+
+static bool batch_cmd(struct tcmulib_cmd *cmd)
+{
+	switch (cmd->cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int batch_add(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	rdev->batch[rdev->nr_batch++] = tcmur_cmd;
+	if (rdev->nr_batch == TCMUR_MAX_BATCH)
+		tcmur_cmd_submit_batch(dev);
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+/* submit a command the handler did not take in submit_batch */
+static int batch_submit_one(struct tcmu_device *dev,
+			    struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+
+	switch (cmd->op_class) {
+	case TCMU_OP_CLASS_READ:
+		return read_work_fn(dev, tcmur_cmd);
+	case TCMU_OP_CLASS_WRITE:
+		/* journaled when it was added */
+		return rhandler->write(dev, tcmur_cmd, cmd->iovec,
+				       cmd->iov_cnt,
+				       tcmu_iovec_length(cmd->iovec,
+							 cmd->iov_cnt),
+				       cmd->off);
+	default:
+		return flush_work_fn(dev, tcmur_cmd);
+	}
+}
+
+void tcmur_cmd_submit_batch(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int i, nr = rdev->nr_batch, taken, ret;
+
+	if (!nr)
+		return;
+	rdev->nr_batch = 0;
+
+	taken = rhandler->submit_batch(dev, rdev->batch, nr);
+	if (taken < 0)
+		taken = 0;
+
+	for (i = taken; i < nr; i++) {
+		ret = batch_submit_one(dev, rdev->batch[i]);
+		if (ret)
+			tcmur_cmd_complete(dev, rdev->batch[i], ret);
+	}
+}
+
 static int handle_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
@@ -1755,6 +2128,10 @@ static int handle_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		return TCMU_STS_INVALID_CMD;
 
 	tcmur_cmd->done = handle_generic_cbk;
+
+	if (batch_enabled(dev))
+		return batch_add(dev, tcmur_cmd);
+
 	return aio_request_schedule(dev, tcmur_cmd, flush_work_fn,
 				    tcmur_cmd_complete);
 }
@@ -1880,11 +2257,23 @@ static int handle_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	int ret;
 
-	ret = check_lba_and_length(dev, cmd, tcmu_cdb_get_xfer_length(cmd->cdb));
+	ret = check_lba_and_length(dev, cmd, cmd->xfer_len);
 	if (ret)
 		return ret;
 
+	tcmur_repl_throttle(dev);
+
 	tcmur_cmd->done = handle_generic_cbk;
+
+	if (batch_enabled(dev)) {
+		tcmur_repl_journal_write(dev, tcmur_cmd, cmd->iovec,
+					 cmd->iov_cnt,
+					 tcmu_iovec_length(cmd->iovec,
+							   cmd->iov_cnt),
+					 cmd->off);
+		return batch_add(dev, tcmur_cmd);
+	}
+
 	return aio_request_schedule(dev, tcmur_cmd, write_work_fn,
 				    tcmur_cmd_complete);
 }
@@ -1895,11 +2284,19 @@ static int handle_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
 	int ret;
 
-	ret = check_lba_and_length(dev, cmd, tcmu_cdb_get_xfer_length(cmd->cdb));
+	ret = check_lba_and_length(dev, cmd, cmd->xfer_len);
 	if (ret)
 		return ret;
 
 	tcmur_cmd->done = handle_generic_cbk;
+
+	ret = tcmur_hedge_read(dev, tcmur_cmd);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
+	if (batch_enabled(dev))
+		return batch_add(dev, tcmur_cmd);
+
 	return aio_request_schedule(dev, tcmur_cmd, read_work_fn,
 				    tcmur_cmd_complete);
 }
@@ -1979,7 +2376,7 @@ free_state:
 static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_cmd *tcmur_cmd = cmd->hm_private;
-	size_t max_xfer_length, length = 1024 * 1024;
+	size_t max_xfer_length, length;
 	uint32_t block_size = tcmu_dev_get_block_size(dev);
 	uint64_t num_lbas = tcmu_dev_get_num_lbas(dev);
 	int ret;
@@ -1995,9 +2392,10 @@ static int handle_format_unit(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	rdev->flags |= TCMUR_DEV_FLAG_FORMATTING;
 	pthread_mutex_unlock(&rdev->format_lock);
 
+	length = tcmur_dev_get_tunable(dev, &tcmur_wsame_chunk_tunable);
 	max_xfer_length = tcmu_dev_get_max_xfer_len(dev) * block_size;
 	length = round_up(length, max_xfer_length);
-	/* Check length on first write to make sure its not less than 1MB */
+	/* Check length on first write to make sure its not less than the chunk */
 	if (tcmu_lba_to_byte(dev, num_lbas) < length)
 		length = tcmu_lba_to_byte(dev, num_lbas);
 
@@ -2038,6 +2436,7 @@ static int handle_stpg(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 
 	ret = tcmu_emulate_set_tgt_port_grps(dev, &group_list, cmd);
 	tcmu_release_alua_grps(&group_list);
+	tcmur_resp_cache_invalidate(dev);
 	return ret;
 }
 
@@ -2147,6 +2546,9 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	case WRITE_SAME_16:
 	case FORMAT_UNIT:
 		ret = alua_check_state(dev, cmd);
+		if (ret)
+			goto untrack;
+		ret = tcmur_cc_start(dev, cmd->hm_private);
 		if (ret)
 			goto untrack;
 		break;
@@ -2197,8 +2599,10 @@ static int tcmur_cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	}
 
 untrack:
-	if (ret != TCMU_STS_ASYNC_HANDLED)
+	if (ret != TCMU_STS_ASYNC_HANDLED) {
+		tcmur_cc_end(dev, cmd->hm_private);
 		track_aio_request_finish(rdev, NULL);
+	}
 	return ret;
 }
 
@@ -2208,6 +2612,10 @@ static int handle_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tgt_port *port;
 	int ret;
 
+	ret = tcmur_resp_cache_get(dev, cmd);
+	if (ret != TCMU_STS_NOT_HANDLED)
+		return ret;
+
 	list_head_init(&group_list);
 
 	if (tcmu_get_alua_grps(dev, &group_list))
@@ -2220,12 +2628,25 @@ static int handle_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		tcmu_update_dev_lock_state(dev);
 	}
 
-	ret = tcmu_emulate_inquiry(dev, port, cmd->cdb, cmd->iovec,
-				   cmd->iov_cnt);
+	ret = tcmur_resp_cache_fill(dev, cmd, port);
+	if (ret == TCMU_STS_NOT_HANDLED)
+		ret = tcmu_emulate_inquiry(dev, port, cmd->cdb, cmd->iovec,
+					   cmd->iov_cnt);
 	tcmu_release_alua_grps(&group_list);
 	return ret;
 }
 
+/* Serve a command from the response cache, or emulate and cache it */
+static int handle_cached_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	int ret;
+
+	ret = tcmur_resp_cache_get(dev, cmd);
+	if (ret == TCMU_STS_NOT_HANDLED)
+		ret = tcmur_resp_cache_fill(dev, cmd, NULL);
+	return ret;
+}
+
 static int handle_sync_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 {
 	uint8_t *cdb = cmd->cdb;
@@ -2233,6 +2654,7 @@ static int handle_sync_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	size_t iov_cnt = cmd->iov_cnt;
 	uint32_t block_size = tcmu_dev_get_block_size(dev);
 	uint64_t num_lbas = tcmu_dev_get_num_lbas(dev);
+	int ret;
 
 	switch (cdb[0]) {
 	case INQUIRY:
@@ -2240,13 +2662,17 @@ static int handle_sync_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	case TEST_UNIT_READY:
 		return tcmu_emulate_test_unit_ready(cdb, iovec, iov_cnt);
 	case SERVICE_ACTION_IN_16:
-		if (cdb[1] == READ_CAPACITY_16)
+		if (cdb[1] == READ_CAPACITY_16) {
+			ret = handle_cached_cmd(dev, cmd);
+			if (ret != TCMU_STS_NOT_HANDLED)
+				return ret;
 			return tcmu_emulate_read_capacity_16(num_lbas,
 							     block_size,
 							     cdb, iovec,
 							     iov_cnt);
-		else
+		} else {
 			return TCMU_STS_NOT_HANDLED;
+		}
 	case READ_CAPACITY:
 		if ((cdb[1] & 0x01) || (cdb[8] & 0x01))
 			/* Reserved bits for MM logical units */
@@ -2258,6 +2684,9 @@ static int handle_sync_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 							     iov_cnt);
 	case MODE_SENSE:
 	case MODE_SENSE_10:
+		ret = handle_cached_cmd(dev, cmd);
+		if (ret != TCMU_STS_NOT_HANDLED)
+			return ret;
 		return tcmu_emulate_mode_sense(dev, cdb, iovec, iov_cnt);
 	case START_STOP:
 		return tcmu_emulate_start_stop(dev, cdb);
@@ -2368,6 +2797,10 @@ int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	int ret;
 
+	/* keep batched I/O ahead of commands that are not batched */
+	if (rdev->nr_batch && !batch_cmd(cmd))
+		tcmur_cmd_submit_batch(dev);
+
 	ret = handle_pending_ua(rdev, cmd);
 	if (ret != TCMU_STS_NOT_HANDLED)
 		return ret;
@@ -2378,6 +2811,9 @@ int tcmur_generic_handle_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
 		return TCMU_STS_FRMT_IN_PROGRESS;
 	}
 
+	tcmur_cbt_track_cmd(dev, cmd);
+	tcmur_repl_track_cmd(dev, cmd);
+
 	/*
 	 * The handler want to handle some commands by itself,
 	 * try to passthrough it first
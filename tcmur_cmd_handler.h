@@ -24,6 +24,8 @@ int tcmur_cmd_passthrough_handler(struct tcmu_device *dev, struct tcmulib_cmd *c
 bool tcmur_handler_is_passthrough_only(struct tcmur_handler *rhandler);
 void tcmur_tcmulib_cmd_complete(struct tcmu_device *dev,
 				struct tcmulib_cmd *cmd, int ret);
+void tcmur_cmd_cancel(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd);
+void tcmur_cmd_submit_batch(struct tcmu_device *dev);
 typedef int (*tcmur_writesame_fn_t)(struct tcmu_device *dev,
 				    struct tcmur_cmd *tcmur_cmd, uint64_t off,
 				    uint64_t len, struct iovec *iov,
@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Coroutine scheduler for handlers written with blocking I/O
+ *
+ * A handler with nr_threads set can have at most nr_threads I/Os in flight
+ * per device, because each IO callout blocks its thread until the I/O
+ * is done. Handlers that also set coroutines and do their I/O through
+ * tcmur_co_preadv, tcmur_co_pwritev and tcmur_co_fdatasync instead get
+ * one scheduler thread per device that runs each IO callout in a
+ * coroutine with its own stack. Those calls submit the I/O to an io_uring
+ * and switch back to the scheduler, which runs the next callout and
+ * resumes the coroutine once the I/O completes, so up to co_max I/Os can
+ * be in flight without a thread for each.
+ *
+ * Everything else a callout does, including other blocking syscalls, runs
+ * as before but holds up the other coroutines of the device while it
+ * blocks. Callouts must not hold a lock over one of the calls above
+ * that another callout of the device could wait for.
+ *
+ * If the kernel has no io_uring the device uses nr_threads threads.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "libtcmu_config.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_affinity.h"
+#include "tcmur_co.h"
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define TCMUR_HAVE_IO_URING
+#endif
+
+#define CO_STACK_SIZE		(64 * 1024)
+
+/* user_data of the poll on the wakeup eventfd, coroutines are never NULL */
+#define CO_WAKEUP_DATA		0
+
+struct tcmur_co_work {
+	void *data;
+	int (*work_fn)(struct tcmu_device *, void *);
+	void (*done_fn)(struct tcmu_device *, void *, int);
+	struct list_node entry;
+};
+
+struct co {
+	struct tcmur_co *sched;
+	ucontext_t ctx;
+	void *stack;
+
+	struct tcmur_co_work work;
+	int ret;
+	bool finished;
+	/* result of the I/O the coroutine waits for */
+	int res;
+
+	struct list_node entry;
+};
+
+struct co_ring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned to_submit;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+};
+
+struct tcmur_co {
+	struct tcmu_device *dev;
+	pthread_t thread;
+	struct co_ring ring;
+	int wake_fd;
+	ucontext_t ctx;
+
+	pthread_mutex_t lock;
+	/* callouts waiting for a coroutine */
+	struct list_head queue;
+	/* the scheduler is about to sleep in io_uring_enter */
+	bool waiting;
+	bool stop;
+
+	/* only touched by the scheduler thread */
+	struct list_head ready;
+	struct list_head idle;
+	unsigned nr_cos;
+	unsigned max_cos;
+};
+
+static __thread struct co *co_current;
+
+struct tcmu_tunable tcmur_coroutines_tunable = {
+	.name = "coroutines",
+	.desc = "Run the IO callouts of handlers that support it in coroutines instead of nr_threads threads, applied when the device is opened",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 1,
+	.min = 0,
+	.max = 1,
+};
+
+struct tcmu_tunable tcmur_co_max_tunable = {
+	.name = "co_max",
+	.desc = "Highest number of IO callouts per device run in coroutines at a time, applied when the device is opened",
+	.type = TCMU_TUNABLE_INT,
+	.def = 256,
+	.min = 1,
+	.max = 4096,
+};
+
+#ifdef TCMUR_HAVE_IO_URING
+
+static int co_ring_setup(struct co_ring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq_ptr, *cq_ptr = NULL, *sqes;
+	int fd, ret;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		goto close_fd;
+
+	cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq_ptr == MAP_FAILED)
+		goto unmap_sq;
+
+	sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	ring->fd = fd;
+	ring->sq_ptr = sq_ptr;
+	ring->sq_head = sq_ptr + p.sq_off.head;
+	ring->sq_tail = sq_ptr + p.sq_off.tail;
+	ring->sq_mask = sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = sq_ptr + p.sq_off.array;
+	ring->sq_entries = p.sq_entries;
+	ring->sqes = sqes;
+	ring->to_submit = 0;
+
+	ring->cq_ptr = cq_ptr;
+	ring->cq_head = cq_ptr + p.cq_off.head;
+	ring->cq_tail = cq_ptr + p.cq_off.tail;
+	ring->cq_mask = cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = cq_ptr + p.cq_off.cqes;
+	return 0;
+
+unmap_cq:
+	ret = -errno;
+	munmap(cq_ptr, ring->cq_len);
+	goto unmap_sq_ret;
+unmap_sq:
+	ret = -errno;
+unmap_sq_ret:
+	munmap(sq_ptr, ring->sq_len);
+	close(fd);
+	return ret;
+close_fd:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static void co_ring_free(struct co_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+/*
+ * Submit the queued SQEs and wait for wait_nr completions. The CQ ring
+ * is sized for every coroutine plus the wakeup poll, so it can not
+ * overflow.
+ */
+static int co_ring_enter(struct co_ring *ring, unsigned wait_nr)
+{
+	int ret;
+
+	if (!ring->to_submit && !wait_nr)
+		return 0;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+			      wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	ring->to_submit -= ret;
+	return 0;
+}
+
+static struct io_uring_sqe *co_ring_get_sqe(struct co_ring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	if (ring->to_submit == ring->sq_entries && co_ring_enter(ring, 0))
+		return NULL;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+static int co_arm_wakeup(struct tcmur_co *s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = co_ring_get_sqe(&s->ring);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = s->wake_fd;
+	sqe->poll_events = POLLIN;
+	sqe->user_data = CO_WAKEUP_DATA;
+	return 0;
+}
+
+/* Make the coroutines whose I/O completed ready */
+static void co_reap(struct tcmur_co *s)
+{
+	struct co_ring *ring = &s->ring;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t val;
+	struct co *co;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+
+		if (cqe->user_data == CO_WAKEUP_DATA) {
+			if (read(s->wake_fd, &val, sizeof(val)) < 0 &&
+			    errno != EAGAIN)
+				tcmu_dev_err(s->dev, "Could not read coroutine eventfd: %m\n");
+			if (co_arm_wakeup(s))
+				tcmu_dev_err(s->dev, "Could not rearm coroutine wakeup\n");
+			continue;
+		}
+
+		co = (struct co *)(uintptr_t)cqe->user_data;
+		co->res = cqe->res;
+		list_add_tail(&s->ready, &co->entry);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Queue an I/O for the running coroutine and switch to the scheduler */
+static int co_io(struct co *co, uint8_t opcode, int fd, const void *addr,
+		 unsigned len, off_t off, uint32_t fsync_flags)
+{
+	struct tcmur_co *s = co->sched;
+	struct io_uring_sqe *sqe;
+
+	sqe = co_ring_get_sqe(&s->ring);
+	if (!sqe) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->fsync_flags = fsync_flags;
+	sqe->user_data = (uintptr_t)co;
+
+	swapcontext(&co->ctx, &s->ctx);
+
+	if (co->res < 0) {
+		errno = -co->res;
+		return -1;
+	}
+	return co->res;
+}
+
+ssize_t tcmur_co_preadv(int fd, const struct iovec *iov, int iovcnt,
+			off_t offset)
+{
+	if (!co_current)
+		return preadv(fd, iov, iovcnt, offset);
+	return co_io(co_current, IORING_OP_READV, fd, iov, iovcnt, offset, 0);
+}
+
+ssize_t tcmur_co_pwritev(int fd, const struct iovec *iov, int iovcnt,
+			 off_t offset)
+{
+	if (!co_current)
+		return pwritev(fd, iov, iovcnt, offset);
+	return co_io(co_current, IORING_OP_WRITEV, fd, iov, iovcnt, offset, 0);
+}
+
+int tcmur_co_fdatasync(int fd)
+{
+	if (!co_current)
+		return fdatasync(fd);
+	return co_io(co_current, IORING_OP_FSYNC, fd, NULL, 0, 0,
+		     IORING_FSYNC_DATASYNC);
+}
+
+static void co_main(void)
+{
+	struct co *co;
+
+	while (1) {
+		co = co_current;
+		co->ret = co->work.work_fn(co->sched->dev, co->work.data);
+		co->finished = true;
+		swapcontext(&co->ctx, &co->sched->ctx);
+	}
+}
+
+static struct co *co_alloc(struct tcmur_co *s)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct co *co;
+
+	co = calloc(1, sizeof(*co));
+	if (!co)
+		return NULL;
+
+	/* the lowest page is left unmapped to catch overflows */
+	co->stack = mmap(NULL, CO_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (co->stack == MAP_FAILED)
+		goto free_co;
+	if (mprotect(co->stack, page, PROT_NONE))
+		goto unmap_stack;
+
+	if (getcontext(&co->ctx))
+		goto unmap_stack;
+	co->ctx.uc_stack.ss_sp = co->stack + page;
+	co->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+	co->ctx.uc_link = NULL;
+	makecontext(&co->ctx, co_main, 0);
+
+	co->sched = s;
+	list_node_init(&co->entry);
+	s->nr_cos++;
+	return co;
+
+unmap_stack:
+	munmap(co->stack, CO_STACK_SIZE + page);
+free_co:
+	free(co);
+	return NULL;
+}
+
+static void co_free(struct co *co)
+{
+	munmap(co->stack, CO_STACK_SIZE + sysconf(_SC_PAGESIZE));
+	free(co);
+}
+
+/* Give queued callouts a coroutine each, as far as there are any */
+static void co_start_queued(struct tcmur_co *s)
+{
+	struct tcmur_co_work *work;
+	struct co *co;
+
+	pthread_mutex_lock(&s->lock);
+	while (!list_empty(&s->queue)) {
+		co = list_pop(&s->idle, struct co, entry);
+		if (!co) {
+			if (s->nr_cos >= s->max_cos)
+				break;
+			co = co_alloc(s);
+			if (!co) {
+				if (!s->nr_cos)
+					tcmu_dev_err(s->dev, "Could not allocate coroutine\n");
+				break;
+			}
+		}
+
+		work = list_pop(&s->queue, struct tcmur_co_work, entry);
+		co->work = *work;
+		free(work);
+		list_add_tail(&s->ready, &co->entry);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void co_run_ready(struct tcmur_co *s)
+{
+	struct co *co;
+
+	while ((co = list_pop(&s->ready, struct co, entry))) {
+		co_current = co;
+		swapcontext(&s->ctx, &co->ctx);
+		co_current = NULL;
+
+		if (!co->finished)
+			continue;
+
+		co->finished = false;
+		co->work.done_fn(s->dev, co->work.data, co->ret);
+		list_add(&s->idle, &co->entry);
+	}
+}
+
+static void *co_sched_thread(void *arg)
+{
+	struct tcmur_co *s = arg;
+	bool stop;
+	int ret;
+
+	tcmur_affinity_bind_thread(s->dev);
+
+	while (1) {
+		co_start_queued(s);
+		co_run_ready(s);
+
+		pthread_mutex_lock(&s->lock);
+		stop = s->stop;
+		s->waiting = list_empty(&s->queue) ||
+			     (list_empty(&s->idle) && s->nr_cos >= s->max_cos);
+		pthread_mutex_unlock(&s->lock);
+		if (stop)
+			break;
+
+		ret = co_ring_enter(&s->ring, s->waiting ? 1 : 0);
+
+		pthread_mutex_lock(&s->lock);
+		s->waiting = false;
+		pthread_mutex_unlock(&s->lock);
+
+		if (ret) {
+			tcmu_dev_err(s->dev, "io_uring_enter failed: %d\n", ret);
+			/* let completions free up the ring */
+			co_ring_enter(&s->ring, 1);
+		}
+		co_reap(s);
+	}
+
+	return NULL;
+}
+
+int tcmur_co_init(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_co *s;
+	int ret;
+
+	if (!rhandler->coroutines || !rhandler->nr_threads ||
+	    !tcmur_dev_get_tunable(dev, &tcmur_coroutines_tunable))
+		return 0;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->dev = dev;
+	s->max_cos = tcmur_dev_get_tunable(dev, &tcmur_co_max_tunable);
+	list_head_init(&s->queue);
+	list_head_init(&s->ready);
+	list_head_init(&s->idle);
+
+	ret = co_ring_setup(&s->ring, s->max_cos + 1);
+	if (ret) {
+		tcmu_dev_info(dev, "Could not set up io_uring (%d), using %d IO threads instead of coroutines\n",
+			      ret, rhandler->nr_threads);
+		free(s);
+		return 0;
+	}
+
+	s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->wake_fd < 0) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not create coroutine eventfd: %m\n");
+		goto free_ring;
+	}
+
+	ret = co_arm_wakeup(s);
+	if (ret)
+		goto close_fd;
+
+	pthread_mutex_init(&s->lock, NULL);
+
+	ret = pthread_create(&s->thread, NULL, co_sched_thread, s);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	rdev->co = s;
+	return 0;
+
+destroy_lock:
+	pthread_mutex_destroy(&s->lock);
+close_fd:
+	close(s->wake_fd);
+free_ring:
+	co_ring_free(&s->ring);
+	free(s);
+	return ret;
+}
+
+/*
+ * Called once no commands are left, so all coroutines are idle when the
+ * scheduler stops.
+ */
+void tcmur_co_free(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_co *s = rdev->co;
+	struct co *co;
+
+	if (!s)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_mutex_unlock(&s->lock);
+
+	if (eventfd_write(s->wake_fd, 1))
+		tcmu_dev_err(dev, "Could not wake up coroutine scheduler: %m\n");
+	pthread_join(s->thread, NULL);
+
+	while ((co = list_pop(&s->idle, struct co, entry)))
+		co_free(co);
+	if (!list_empty(&s->ready))
+		tcmu_dev_err(dev, "Coroutines still running at shutdown\n");
+
+	pthread_mutex_destroy(&s->lock);
+	close(s->wake_fd);
+	co_ring_free(&s->ring);
+	free(s);
+	rdev->co = NULL;
+}
+
+int tcmur_co_schedule(struct tcmu_device *dev, void *data,
+		      int (*work_fn)(struct tcmu_device *, void *),
+		      void (*done_fn)(struct tcmu_device *, void *, int))
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_co *s = rdev->co;
+	struct tcmur_co_work *work;
+	bool wake;
+
+	work = malloc(sizeof(*work));
+	if (!work)
+		return TCMU_STS_NO_RESOURCE;
+
+	work->data = data;
+	work->work_fn = work_fn;
+	work->done_fn = done_fn;
+
+	pthread_mutex_lock(&s->lock);
+	list_add_tail(&s->queue, &work->entry);
+	wake = s->waiting;
+	s->waiting = false;
+	pthread_mutex_unlock(&s->lock);
+
+	if (wake && eventfd_write(s->wake_fd, 1))
+		tcmu_dev_err(dev, "Could not wake up coroutine scheduler: %m\n");
+
+	return TCMU_STS_ASYNC_HANDLED;
+}
+
+/*
+ * Complete data's callout with sts if it is still waiting for a
+ * coroutine. Returns false if it was not queued.
+ */
+bool tcmur_co_cancel(struct tcmu_device *dev, void *data, int sts)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_co *s = rdev->co;
+	struct tcmur_co_work *work, *found = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	list_for_each(&s->queue, work, entry) {
+		if (work->data == data) {
+			list_del(&work->entry);
+			found = work;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (!found)
+		return false;
+
+	found->done_fn(dev, data, sts);
+	free(found);
+	return true;
+}
+
+#else /* TCMUR_HAVE_IO_URING */
+
+ssize_t tcmur_co_preadv(int fd, const struct iovec *iov, int iovcnt,
+			off_t offset)
+{
+	return preadv(fd, iov, iovcnt, offset);
+}
+
+ssize_t tcmur_co_pwritev(int fd, const struct iovec *iov, int iovcnt,
+			 off_t offset)
+{
+	return pwritev(fd, iov, iovcnt, offset);
+}
+
+int tcmur_co_fdatasync(int fd)
+{
+	return fdatasync(fd);
+}
+
+int tcmur_co_init(struct tcmu_device *dev)
+{
+	return 0;
+}
+
+void tcmur_co_free(struct tcmu_device *dev)
+{
+}
+
+int tcmur_co_schedule(struct tcmu_device *dev, void *data,
+		      int (*work_fn)(struct tcmu_device *, void *),
+		      void (*done_fn)(struct tcmu_device *, void *, int))
+{
+	return TCMU_STS_NO_RESOURCE;
+}
+
+bool tcmur_co_cancel(struct tcmu_device *dev, void *data, int sts)
+{
+	return false;
+}
+
+#endif /* TCMUR_HAVE_IO_URING */
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_CO_H
+#define __TCMUR_CO_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct tcmu_device;
+struct tcmu_tunable;
+
+extern struct tcmu_tunable tcmur_coroutines_tunable;
+extern struct tcmu_tunable tcmur_co_max_tunable;
+
+int tcmur_co_init(struct tcmu_device *dev);
+void tcmur_co_free(struct tcmu_device *dev);
+
+/* Like aio_request_schedule, for devices with a coroutine scheduler */
+int tcmur_co_schedule(struct tcmu_device *dev, void *data,
+		      int (*work_fn)(struct tcmu_device *, void *),
+		      void (*done_fn)(struct tcmu_device *, void *, int));
+bool tcmur_co_cancel(struct tcmu_device *dev, void *data, int sts);
+
+/*
+ * For handlers with coroutines set: drop in replacements for preadv,
+ * pwritev and fdatasync that let other IO callouts of the device run
+ * while they wait. Outside of a coroutine they just make the call.
+ */
+ssize_t tcmur_co_preadv(int fd, const struct iovec *iov, int iovcnt,
+			off_t offset);
+ssize_t tcmur_co_pwritev(int fd, const struct iovec *iov, int iovcnt,
+			 off_t offset);
+int tcmur_co_fdatasync(int fd);
+
+#endif
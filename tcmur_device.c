@@ -14,12 +14,21 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <string.h>
 
+#include "darray.h"
 #include "libtcmu_log.h"
 #include "libtcmu_common.h"
+#include "libtcmu_priv.h"
 #include "tcmu-runner.h"
 #include "tcmur_device.h"
 #include "tcmur_cmd_handler.h"
+#include "tcmur_affinity.h"
+#include "tcmur_resp_cache.h"
+#include "tcmur_cc.h"
+#include "tcmur_hedge.h"
+#include "tcmur_co.h"
 #include "tcmu_runner_priv.h"
 #include "target.h"
 
@@ -42,6 +51,7 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 {
 	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
 	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_affinity_saved saved;
 	int ret, attempt = 0;
 	bool needs_close = false;
 	bool cancel_lock = false;
@@ -96,6 +106,7 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 
 	if (needs_close) {
 		tcmu_dev_dbg(dev, "Closing device.\n");
+		tcmur_dev_set_polling(dev, false);
 		rhandler->close(dev);
 	}
 
@@ -106,16 +117,22 @@ int __tcmu_reopen_dev(struct tcmu_device *dev, int retries)
 		pthread_mutex_unlock(&rdev->state_lock);
 
 		tcmu_dev_dbg(dev, "Opening device. Attempt %d\n", attempt);
+		tcmur_affinity_enter(dev, &saved);
 		ret = rhandler->open(dev, true);
+		tcmur_affinity_leave(&saved);
 		if (ret) {
 			/* Avoid busy loop ? */
 			sleep(1);
+		} else {
+			tcmur_dev_set_polling(dev, true);
 		}
 
 		pthread_mutex_lock(&rdev->state_lock);
 		if (!ret) {
 			rdev->flags |= TCMUR_DEV_FLAG_IS_OPEN;
 			rdev->lock_lost = false;
+			/* limits and size may have changed */
+			tcmur_resp_cache_invalidate(dev);
 		}
 		attempt++;
 	}
@@ -197,6 +214,15 @@ void tcmu_notify_conn_lost(struct tcmu_device *dev)
 		(rdev->flags & TCMUR_DEV_FLAG_IN_RECOVERY))
 		goto unlock;
 
+	/*
+	 * Child devices have no ring to block, their owner sees the
+	 * failed IO and decides how to recover.
+	 */
+	if (rdev->flags & TCMUR_DEV_FLAG_CHILD) {
+		tcmu_dev_err(dev, "Child handler connection lost\n");
+		goto unlock;
+	}
+
 	tcmu_dev_err(dev, "Handler connection lost (lock state %d)\n",
 		     rdev->lock_state);
 
@@ -488,3 +514,182 @@ void *tcmur_dev_get_private(struct tcmu_device *dev)
 
 	return rdev->hm_private;
 }
+
+struct tcmu_tunable tcmur_cmd_time_out_tunable = {
+	.name = "cmd_time_out",
+	.desc = "Seconds before a running command is reported as timed out, 0 disables",
+	.type = TCMU_TUNABLE_INT,
+	.def = 0,
+	.min = 0,
+	.max = INT_MAX,
+};
+
+struct tcmu_tunable tcmur_nr_threads_tunable = {
+	.name = "nr_threads",
+	.desc = "I/O threads for handlers that use the runner's work queue, 0 uses the handler's default (applied at open)",
+	.type = TCMU_TUNABLE_INT,
+	.def = 0,
+	.min = 0,
+	.max = 256,
+};
+
+struct tcmu_tunable tcmur_wsame_chunk_tunable = {
+	.name = "wsame_chunk_size",
+	.desc = "Buffer size used to emulate WRITE SAME and FORMAT UNIT",
+	.type = TCMU_TUNABLE_SIZE,
+	.def = 1024 * 1024,
+	.min = 4096,
+	.max = 64 * 1024 * 1024,
+};
+
+struct tcmu_tunable tcmur_poll_completions_tunable = {
+	.name = "poll_completions",
+	.desc = "Reap completions on the cmdproc thread instead of the backend's threads, for handlers that support it (applied at open)",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 0,
+	.min = 0,
+	.max = 1,
+};
+
+struct tcmu_tunable tcmur_poll_spin_us_tunable = {
+	.name = "poll_spin_us",
+	.desc = "Microseconds the cmdproc thread keeps polling for completions before it sleeps, with poll_completions",
+	.type = TCMU_TUNABLE_INT,
+	.def = 0,
+	.min = 0,
+	.max = 1000,
+};
+
+int tcmur_register_core_tunables(void)
+{
+	struct tcmu_tunable *tunables[] = {
+		&tcmur_cmd_time_out_tunable,
+		&tcmur_nr_threads_tunable,
+		&tcmur_wsame_chunk_tunable,
+		&tcmur_resp_cache_tunable,
+		&tcmur_cc_target_latency_tunable,
+		&tcmur_cc_min_depth_tunable,
+		&tcmur_cc_max_depth_tunable,
+		&tcmur_cc_task_set_full_tunable,
+		&tcmur_hedge_reads_tunable,
+		&tcmur_hedge_percentile_tunable,
+		&tcmur_hedge_budget_tunable,
+		&tcmur_coroutines_tunable,
+		&tcmur_co_max_tunable,
+		&tcmur_poll_completions_tunable,
+		&tcmur_poll_spin_us_tunable,
+	};
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(tunables); i++) {
+		ret = tcmu_register_tunable(tunables[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Returns the device's own value if one was set through the cfgstring or
+ * D-Bus, else the global one. This is lockless so it can be used in the
+ * I/O path and picks up changes for the next command.
+ */
+int64_t tcmur_dev_get_tunable(struct tcmu_device *dev, struct tcmu_tunable *tun)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (__atomic_load_n(&rdev->tunables_set, __ATOMIC_ACQUIRE) &
+	    (1U << tun->id))
+		return __atomic_load_n(&rdev->tunables[tun->id],
+				       __ATOMIC_RELAXED);
+	return tcmu_get_tunable(tun);
+}
+
+void tcmur_dev_set_tunable(struct tcmu_device *dev, struct tcmu_tunable *tun,
+			   int64_t val)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	__atomic_store_n(&rdev->tunables[tun->id], val, __ATOMIC_RELAXED);
+	__atomic_or_fetch(&rdev->tunables_set, 1U << tun->id, __ATOMIC_RELEASE);
+	tcmu_dev_dbg(dev, "Using %s %"PRId64"\n", tun->name, val);
+}
+
+void tcmur_dev_clear_tunable(struct tcmu_device *dev, struct tcmu_tunable *tun)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	__atomic_and_fetch(&rdev->tunables_set, ~(1U << tun->id),
+			   __ATOMIC_RELEASE);
+}
+
+/*
+ * Called by handlers from open: should completions be left for the
+ * cmdproc thread to reap through poll_completions. Child devices have
+ * no cmdproc thread.
+ */
+bool tcmur_dev_polls_completions(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (!rhandler->get_completion_fd || !rhandler->poll_completions ||
+	    rhandler->nr_threads || rdev->flags & TCMUR_DEV_FLAG_CHILD)
+		return false;
+
+	return tcmur_dev_get_tunable(dev, &tcmur_poll_completions_tunable);
+}
+
+/* Start reaping completions after open, or stop before close */
+void tcmur_dev_set_polling(struct tcmu_device *dev, bool on)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	pthread_mutex_lock(&rdev->poll_lock);
+	rdev->polling = on && rhandler->get_completion_fd &&
+			rhandler->poll_completions &&
+			rhandler->get_completion_fd(dev) >= 0;
+	pthread_mutex_unlock(&rdev->poll_lock);
+}
+
+int tcmur_dev_get_completion_fd(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int fd = -1;
+
+	pthread_mutex_lock(&rdev->poll_lock);
+	if (rdev->polling)
+		fd = rhandler->get_completion_fd(dev);
+	pthread_mutex_unlock(&rdev->poll_lock);
+	return fd;
+}
+
+int tcmur_dev_poll_completions(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	int ret = 0;
+
+	pthread_mutex_lock(&rdev->poll_lock);
+	if (rdev->polling)
+		ret = rhandler->poll_completions(dev);
+	pthread_mutex_unlock(&rdev->poll_lock);
+	return ret;
+}
+
+/* Find a device by its LIO name (e.g. "backup2") or uio name. */
+struct tcmu_device *tcmur_lookup_dev(struct tcmulib_context *ctx,
+				     const char *name)
+{
+	struct tcmu_device **dev_ptr;
+
+	darray_foreach(dev_ptr, ctx->devices) {
+		if (!strcmp((*dev_ptr)->tcm_dev_name, name) ||
+		    !strcmp((*dev_ptr)->dev_name, name))
+			return *dev_ptr;
+	}
+
+	return NULL;
+}
@@ -13,8 +13,18 @@
 
 #include "ccan/list/list.h"
 
+#include "libtcmu_config.h"
 #include "tcmur_aio.h"
 
+struct tcmulib_context;
+struct tcmur_cbt;
+struct tcmur_repl;
+struct tcmur_affinity;
+struct tcmur_resp_cache;
+struct tcmur_cc;
+struct tcmur_hedge;
+struct tcmur_co;
+
 #define TCMU_INVALID_LOCK_TAG USHRT_MAX
 
 #define TCMUR_DEV_FLAG_FORMATTING	(1 << 0)
@@ -22,9 +32,14 @@
 #define TCMUR_DEV_FLAG_IS_OPEN		(1 << 2)
 #define TCMUR_DEV_FLAG_STOPPING		(1 << 3)
 #define TCMUR_DEV_FLAG_STOPPED		(1 << 4)
+/* handler instance opened by the runner, see tcmur_child.c */
+#define TCMUR_DEV_FLAG_CHILD		(1 << 5)
 
 #define TCMUR_UA_DEV_SIZE_CHANGED	0
 
+/* commands passed to the handler's submit_batch at most at a time */
+#define TCMUR_MAX_BATCH			64
+
 enum {
 	TCMUR_DEV_FAILOVER_ALL_ACTIVE,
 	TCMUR_DEV_FAILOVER_IMPLICIT,
@@ -74,8 +89,50 @@ struct tcmur_device {
 	uint32_t format_progress;
 	pthread_mutex_t format_lock; /* for atomic format operations */
 
-	int cmd_time_out;
 	struct list_head cmds_list;
+
+	/* commands waiting for submit_batch, only used by cmdproc thread */
+	struct tcmur_cmd *batch[TCMUR_MAX_BATCH];
+	int nr_batch;
+
+	/* per device tunable values, bit N of tunables_set covers id N */
+	uint32_t tunables_set;
+	int64_t tunables[TCMU_MAX_TUNABLES];
+
+	/* changed block tracking, see tcmur_cbt.c */
+	char *cbt_path;
+	uint32_t cbt_granularity;
+	struct tcmur_cbt *cbt;
+
+	/* replication, see tcmur_repl.c */
+	char *repl_target;
+	char *repl_journal;
+	uint64_t repl_journal_size;
+	uint32_t repl_max_lag;
+	struct tcmur_repl *repl;
+
+	/* CPU and NUMA placement, see tcmur_affinity.c */
+	char *affinity_cpus;
+	struct tcmur_affinity *affinity;
+
+	/* prebuilt INQUIRY/MODE SENSE responses, see tcmur_resp_cache.c */
+	struct tcmur_resp_cache *resp_cache;
+
+	/* latency based limit on commands in flight, see tcmur_cc.c */
+	struct tcmur_cc *cc;
+
+	/* duplicate slow READs, see tcmur_hedge.c */
+	struct tcmur_hedge *hedge;
+
+	/* coroutine scheduler for IO callouts, see tcmur_co.c */
+	struct tcmur_co *co;
+
+	/*
+	 * Set while the cmdproc thread reaps the handler's completions,
+	 * poll_lock keeps poll_completions from running during close.
+	 */
+	pthread_mutex_t poll_lock;
+	bool polling;
 };
 
 bool tcmu_dev_in_recovery(struct tcmu_device *dev);
@@ -96,4 +153,24 @@ void tcmu_update_dev_lock_state(struct tcmu_device *dev);
 void tcmur_dev_set_private(struct tcmu_device *dev, void *private);
 void *tcmur_dev_get_private(struct tcmu_device *dev);
 
+extern struct tcmu_tunable tcmur_cmd_time_out_tunable;
+extern struct tcmu_tunable tcmur_nr_threads_tunable;
+extern struct tcmu_tunable tcmur_wsame_chunk_tunable;
+extern struct tcmu_tunable tcmur_poll_completions_tunable;
+extern struct tcmu_tunable tcmur_poll_spin_us_tunable;
+
+int tcmur_register_core_tunables(void);
+int64_t tcmur_dev_get_tunable(struct tcmu_device *dev, struct tcmu_tunable *tun);
+void tcmur_dev_set_tunable(struct tcmu_device *dev, struct tcmu_tunable *tun,
+			   int64_t val);
+void tcmur_dev_clear_tunable(struct tcmu_device *dev, struct tcmu_tunable *tun);
+
+bool tcmur_dev_polls_completions(struct tcmu_device *dev);
+void tcmur_dev_set_polling(struct tcmu_device *dev, bool on);
+int tcmur_dev_get_completion_fd(struct tcmu_device *dev);
+int tcmur_dev_poll_completions(struct tcmu_device *dev);
+
+struct tcmu_device *tcmur_lookup_dev(struct tcmulib_context *ctx,
+				     const char *name);
+
 #endif
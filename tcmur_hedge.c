@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Hedged reads
+ *
+ * On replicated backends the read latency tail comes from the one
+ * replica, mirror leg or connection that is slow at the moment. For
+ * handlers with a hedge_read callout, which reads the same data through
+ * another path, the hedge_reads tunable makes the runner send a second
+ * copy of a READ that has not completed within the hedge_percentile
+ * latency of the recent reads. Whichever copy completes first is
+ * returned and the other one is cancelled, or discarded when it
+ * completes if the handler cannot abort it.
+ *
+ * Both copies read into their own buffer, so a late one never writes
+ * into ring memory that is reused once the command completed, and the
+ * first good one is copied into the command's iovec. hedge_budget
+ * limits the copies to a percentage of the reads, with bursts of up to
+ * HEDGE_MAX_BURST. Reads that could not be hedged anyway, because
+ * there are too few samples yet or no budget left, skip the buffer and
+ * are only timed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "libtcmu_config.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_aio.h"
+#include "tcmur_affinity.h"
+#include "tcmur_cmd_handler.h"
+#include "tcmur_hedge.h"
+
+/* read latencies the percentile is taken from */
+#define HEDGE_SAMPLES		256
+/* reads needed before the first hedge */
+#define HEDGE_MIN_SAMPLES	32
+/* do not hedge reads that are only slow by noise */
+#define HEDGE_MIN_DELAY_US	100
+#define HEDGE_COST		100
+#define HEDGE_MAX_BURST		16
+
+struct hedge_read;
+
+struct hedge_leg {
+	/* passed to the handler, completed through hedge_leg_done */
+	struct tcmur_cmd tcmur_cmd;
+	struct iovec iov;
+	struct hedge_read *hr;
+	uint64_t start;
+	bool is_hedge;
+	/* handed to the handler, so the winner has to cancel it */
+	bool sent;
+};
+
+struct hedge_read {
+	/* on the pending list until hedged or completed */
+	struct list_node entry;
+	bool on_list;
+	uint64_t deadline;
+
+	struct tcmur_cmd *orig;
+	size_t len;
+	off_t off;
+
+	int legs_out;
+	bool finished;
+	/* the winner is cancelling the other copy, do not free */
+	bool cancelling;
+	struct hedge_leg legs[2];
+};
+
+struct tcmur_hedge {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool stop;
+	/* reads that may be hedged, oldest deadline first */
+	struct list_head pending;
+
+	uint32_t samples[HEDGE_SAMPLES];
+	unsigned int nr_samples;
+	unsigned int next_sample;
+	unsigned int new_samples;
+	/* ns before a read is hedged, 0 while there are too few samples */
+	uint64_t delay;
+	int64_t credits;
+
+	uint64_t nr_reads;
+	uint64_t nr_hedged;
+	uint64_t nr_hedge_wins;
+	uint64_t nr_no_budget;
+};
+
+struct tcmu_tunable tcmur_hedge_reads_tunable = {
+	.name = "hedge_reads",
+	.desc = "Send a second copy of slow READs through the handler's hedge_read callout",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 0,
+	.min = 0,
+	.max = 1,
+};
+
+struct tcmu_tunable tcmur_hedge_percentile_tunable = {
+	.name = "hedge_percentile",
+	.desc = "Percentile of recent READ latencies after which a READ is hedged",
+	.type = TCMU_TUNABLE_INT,
+	.def = 95,
+	.min = 50,
+	.max = 99,
+};
+
+struct tcmu_tunable tcmur_hedge_budget_tunable = {
+	.name = "hedge_budget",
+	.desc = "Maximum hedged READs, in percent of all READs",
+	.type = TCMU_TUNABLE_INT,
+	.def = 5,
+	.min = 1,
+	.max = 100,
+};
+
+static uint64_t hedge_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Called with hedge->lock held */
+static void hedge_add_sample(struct tcmu_device *dev, struct tcmur_hedge *hedge,
+			     uint64_t lat)
+{
+	uint32_t sorted[HEDGE_SAMPLES];
+	uint64_t pct;
+	unsigned int idx;
+
+	lat /= 1000;
+	hedge->samples[hedge->next_sample] = lat > UINT32_MAX ? UINT32_MAX : lat;
+	hedge->next_sample = (hedge->next_sample + 1) % HEDGE_SAMPLES;
+	if (hedge->nr_samples < HEDGE_SAMPLES)
+		hedge->nr_samples++;
+
+	/* the percentile moves slowly, recompute it every few reads */
+	if (hedge->nr_samples < HEDGE_MIN_SAMPLES ||
+	    ++hedge->new_samples < HEDGE_MIN_SAMPLES)
+		return;
+	hedge->new_samples = 0;
+
+	memcpy(sorted, hedge->samples, hedge->nr_samples * sizeof(*sorted));
+	qsort(sorted, hedge->nr_samples, sizeof(*sorted), cmp_u32);
+
+	pct = tcmur_dev_get_tunable(dev, &tcmur_hedge_percentile_tunable);
+	idx = hedge->nr_samples * pct / 100;
+	if (idx >= hedge->nr_samples)
+		idx = hedge->nr_samples - 1;
+
+	hedge->delay = sorted[idx] < HEDGE_MIN_DELAY_US ?
+			HEDGE_MIN_DELAY_US : sorted[idx];
+	hedge->delay *= 1000;
+}
+
+static int hedge_read_work_fn(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_cmd *tcmur_cmd = data;
+	struct hedge_leg *leg = container_of(tcmur_cmd, struct hedge_leg,
+					     tcmur_cmd);
+	struct hedge_read *hr = leg->hr;
+
+	if (leg->is_hedge)
+		return rhandler->hedge_read(dev, tcmur_cmd, &leg->iov, 1,
+					    hr->len, hr->off);
+	return rhandler->read(dev, tcmur_cmd, &leg->iov, 1, hr->len, hr->off);
+}
+
+static void hedge_leg_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			   int ret)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+	struct hedge_leg *leg = container_of(tcmur_cmd, struct hedge_leg,
+					     tcmur_cmd);
+	struct hedge_read *hr = leg->hr;
+	struct tcmur_cmd *orig = hr->orig;
+	struct tcmur_cmd *loser = NULL;
+	void *buf = leg->iov.iov_base;
+	size_t len = hr->len;
+	bool win, free_hr;
+
+	pthread_mutex_lock(&hedge->lock);
+	if (!leg->is_hedge && ret == TCMU_STS_OK)
+		hedge_add_sample(dev, hedge, hedge_now() - leg->start);
+
+	/* an error only counts if the other copy cannot do better */
+	hr->legs_out--;
+	win = !hr->finished && (ret == TCMU_STS_OK || !hr->legs_out);
+	if (win) {
+		hr->finished = true;
+		if (hr->on_list) {
+			list_del(&hr->entry);
+			hr->on_list = false;
+		}
+		if (leg->is_hedge && ret == TCMU_STS_OK)
+			hedge->nr_hedge_wins++;
+		/* a copy not sent yet is dropped by hedge_leg_send */
+		if (hr->legs_out && hr->legs[!leg->is_hedge].sent) {
+			hr->cancelling = true;
+			loser = &hr->legs[!leg->is_hedge].tcmur_cmd;
+		}
+	}
+	free_hr = !hr->legs_out && !hr->cancelling;
+	pthread_mutex_unlock(&hedge->lock);
+
+	/* unless cancelling, hr may be freed by the other copy from here on */
+	if (win) {
+		if (ret == TCMU_STS_OK)
+			tcmu_memcpy_into_iovec(orig->lib_cmd->iovec,
+					       orig->lib_cmd->iov_cnt, buf, len);
+		tcmur_cmd_complete(dev, orig, ret);
+	}
+
+	if (loser) {
+		tcmur_cmd_cancel(dev, loser);
+
+		pthread_mutex_lock(&hedge->lock);
+		hr->cancelling = false;
+		free_hr = !hr->legs_out;
+		pthread_mutex_unlock(&hedge->lock);
+	}
+
+	free(buf);
+	track_aio_request_finish(rdev, NULL);
+	if (free_hr)
+		free(hr);
+}
+
+static void hedge_leg_send(struct tcmu_device *dev, struct hedge_read *hr,
+			   int idx)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+	struct hedge_leg *leg = &hr->legs[idx];
+	bool finished;
+	int ret;
+
+	/* the copy may outlive the command, close has to wait for it */
+	track_aio_request_start(rdev);
+
+	leg->hr = hr;
+	leg->is_hedge = idx;
+	/* the command is completed and freed when either copy wins */
+	leg->tcmur_cmd.lib_cmd = NULL;
+	leg->tcmur_cmd.done = hedge_leg_done;
+	list_node_init(&leg->tcmur_cmd.cmds_list_entry);
+
+	/* the other copy may have completed the command in the meantime */
+	pthread_mutex_lock(&hedge->lock);
+	finished = hr->finished;
+	if (!finished) {
+		leg->sent = true;
+	} else if (idx) {
+		hedge->nr_hedged--;
+		hedge->credits += HEDGE_COST;
+	}
+	pthread_mutex_unlock(&hedge->lock);
+
+	if (finished) {
+		hedge_leg_done(dev, &leg->tcmur_cmd, TCMU_STS_NOT_HANDLED);
+		return;
+	}
+
+	leg->iov.iov_len = hr->len;
+	if (!leg->iov.iov_base)
+		leg->iov.iov_base = malloc(hr->len);
+	leg->start = hedge_now();
+
+	if (!leg->iov.iov_base)
+		ret = TCMU_STS_NO_RESOURCE;
+	else
+		ret = aio_request_schedule(dev, &leg->tcmur_cmd,
+					   hedge_read_work_fn,
+					   tcmur_cmd_complete);
+	if (ret != TCMU_STS_ASYNC_HANDLED)
+		hedge_leg_done(dev, &leg->tcmur_cmd, ret);
+}
+
+int tcmur_hedge_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+	struct tcmulib_cmd *cmd = tcmur_cmd->lib_cmd;
+	struct hedge_read *hr;
+	int64_t budget;
+	bool can_hedge;
+
+	if (!hedge || !tcmur_dev_get_tunable(dev, &tcmur_hedge_reads_tunable))
+		return TCMU_STS_NOT_HANDLED;
+
+	budget = tcmur_dev_get_tunable(dev, &tcmur_hedge_budget_tunable);
+
+	pthread_mutex_lock(&hedge->lock);
+	hedge->nr_reads++;
+	hedge->credits += budget;
+	if (hedge->credits > HEDGE_COST * HEDGE_MAX_BURST)
+		hedge->credits = HEDGE_COST * HEDGE_MAX_BURST;
+	can_hedge = hedge->delay && hedge->credits >= HEDGE_COST;
+	pthread_mutex_unlock(&hedge->lock);
+
+	/*
+	 * Only pay for the bounce buffer if a copy could be sent, else
+	 * the read goes the usual way and is just timed for the percentile.
+	 */
+	if (!can_hedge)
+		goto no_hedge;
+
+	hr = calloc(1, sizeof(*hr));
+	if (!hr)
+		goto no_hedge;
+	hr->orig = tcmur_cmd;
+	hr->len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+	hr->off = cmd->off;
+	hr->legs[0].iov.iov_base = malloc(hr->len);
+	if (!hr->legs[0].iov.iov_base) {
+		free(hr);
+		goto no_hedge;
+	}
+
+	pthread_mutex_lock(&hedge->lock);
+	hr->legs_out = 1;
+	hr->deadline = hedge_now() + hedge->delay;
+	hr->on_list = true;
+	if (list_empty(&hedge->pending))
+		pthread_cond_signal(&hedge->cond);
+	list_add_tail(&hedge->pending, &hr->entry);
+	pthread_mutex_unlock(&hedge->lock);
+
+	hedge_leg_send(dev, hr, 0);
+	return TCMU_STS_ASYNC_HANDLED;
+
+no_hedge:
+	tcmur_cmd->hedge_start = hedge_now();
+	return TCMU_STS_NOT_HANDLED;
+}
+
+/* Time a READ that tcmur_hedge_read() left to the usual path */
+void tcmur_hedge_cmd_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			  int rc)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+
+	if (!hedge || !tcmur_cmd->hedge_start || rc != TCMU_STS_OK)
+		return;
+
+	pthread_mutex_lock(&hedge->lock);
+	hedge_add_sample(dev, hedge, hedge_now() - tcmur_cmd->hedge_start);
+	pthread_mutex_unlock(&hedge->lock);
+}
+
+static void *hedge_thread(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+	struct hedge_read *hr;
+	struct timespec ts;
+	uint64_t now;
+
+	tcmur_affinity_bind_thread(dev);
+
+	pthread_mutex_lock(&hedge->lock);
+	while (!hedge->stop) {
+		hr = list_top(&hedge->pending, struct hedge_read, entry);
+		if (!hr) {
+			pthread_cond_wait(&hedge->cond, &hedge->lock);
+			continue;
+		}
+
+		now = hedge_now();
+		if (now < hr->deadline) {
+			ts.tv_sec = hr->deadline / 1000000000ULL;
+			ts.tv_nsec = hr->deadline % 1000000000ULL;
+			pthread_cond_timedwait(&hedge->cond, &hedge->lock, &ts);
+			continue;
+		}
+
+		list_del(&hr->entry);
+		hr->on_list = false;
+
+		if (hedge->credits < HEDGE_COST) {
+			hedge->nr_no_budget++;
+			continue;
+		}
+		hedge->credits -= HEDGE_COST;
+		hedge->nr_hedged++;
+		hr->legs_out++;
+		pthread_mutex_unlock(&hedge->lock);
+
+		tcmu_dev_dbg(dev, "Hedging READ of %zu bytes at %"PRIu64"\n",
+			     hr->len, (uint64_t)hr->off);
+		hedge_leg_send(dev, hr, 1);
+
+		pthread_mutex_lock(&hedge->lock);
+	}
+	pthread_mutex_unlock(&hedge->lock);
+
+	return NULL;
+}
+
+int tcmur_hedge_init(struct tcmu_device *dev)
+{
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge;
+	pthread_condattr_t attr;
+	int ret;
+
+	if (!rhandler->hedge_read)
+		return 0;
+
+	hedge = calloc(1, sizeof(*hedge));
+	if (!hedge)
+		return -ENOMEM;
+
+	pthread_mutex_init(&hedge->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&hedge->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	list_head_init(&hedge->pending);
+	rdev->hedge = hedge;
+
+	ret = pthread_create(&hedge->thread, NULL, hedge_thread, dev);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not start hedged read thread %d\n", ret);
+		pthread_cond_destroy(&hedge->cond);
+		pthread_mutex_destroy(&hedge->lock);
+		free(hedge);
+		rdev->hedge = NULL;
+		return -ret;
+	}
+
+	return 0;
+}
+
+void tcmur_hedge_free(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+
+	if (!hedge)
+		return;
+
+	pthread_mutex_lock(&hedge->lock);
+	hedge->stop = true;
+	pthread_cond_signal(&hedge->cond);
+	pthread_mutex_unlock(&hedge->lock);
+	pthread_join(hedge->thread, NULL);
+
+	pthread_cond_destroy(&hedge->cond);
+	pthread_mutex_destroy(&hedge->lock);
+	free(hedge);
+	rdev->hedge = NULL;
+}
+
+int tcmur_hedge_get_stats(struct tcmu_device *dev, char **stats)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_hedge *hedge = rdev->hedge;
+	int ret;
+
+	if (!hedge)
+		return -EOPNOTSUPP;
+
+	pthread_mutex_lock(&hedge->lock);
+	ret = asprintf(stats,
+		       "enabled %"PRId64"\n"
+		       "delay_us %"PRIu64"\n"
+		       "reads %"PRIu64"\n"
+		       "hedged %"PRIu64"\n"
+		       "hedge_wins %"PRIu64"\n"
+		       "over_budget %"PRIu64"\n",
+		       tcmur_dev_get_tunable(dev, &tcmur_hedge_reads_tunable),
+		       hedge->delay / 1000, hedge->nr_reads, hedge->nr_hedged,
+		       hedge->nr_hedge_wins, hedge->nr_no_budget);
+	pthread_mutex_unlock(&hedge->lock);
+
+	if (ret < 0) {
+		*stats = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
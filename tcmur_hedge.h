@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_HEDGE_H
+#define __TCMUR_HEDGE_H
+
+struct tcmu_device;
+struct tcmur_cmd;
+struct tcmur_hedge;
+struct tcmu_tunable;
+
+extern struct tcmu_tunable tcmur_hedge_reads_tunable;
+extern struct tcmu_tunable tcmur_hedge_percentile_tunable;
+extern struct tcmu_tunable tcmur_hedge_budget_tunable;
+
+int tcmur_hedge_init(struct tcmu_device *dev);
+void tcmur_hedge_free(struct tcmu_device *dev);
+
+/*
+ * Send a READ whose done callback is set to the handler, and a second
+ * copy through the handler's hedge_read callout if the first one is
+ * slow. Returns TCMU_STS_NOT_HANDLED if the caller has to send it the
+ * usual way.
+ */
+int tcmur_hedge_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd);
+void tcmur_hedge_cmd_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			  int rc);
+
+int tcmur_hedge_get_stats(struct tcmu_device *dev, char **stats);
+
+#endif
@@ -0,0 +1,1223 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Asynchronous replication
+ *
+ * A device created with ";tcmur_repl_target=subtype/config" and
+ * ";tcmur_repl_journal=/path" in its cfgstring keeps a copy of its
+ * data on a second handler instance (see tcmur_child.c).
+ *
+ * WRITEs are appended to the journal file and the append is made
+ * stable before the write is sent to the handler, so a write is
+ * acknowledged once it is on both the primary and the journal.
+ * Concurrent appends share one fdatasync. The journal is a ring of
+ * tcmur_repl_journal_size bytes. A thread ships its entries to the
+ * secondary in order and frees them once the secondary flushed them.
+ *
+ * Everything that is not journaled is recorded in a dirty bitmap
+ * (a tcmur_cbt kept in "<journal>.dirty") and copied from the
+ * primary once the journal has been shipped:
+ *
+ * - writes that do not fit in the journal,
+ * - other commands modifying data (WRITE SAME, COMPARE AND WRITE,
+ *   WRITE AND VERIFY, UNMAP, FORMAT UNIT, EXTENDED COPY),
+ * - journal entries that could not be shipped while the secondary
+ *   was unavailable, and
+ * - everything on the first start, or after an unclean shutdown the
+ *   ranges still in the journal since its tail may be torn.
+ *
+ * Those ranges are marked before and again after the command, so a
+ * resync racing with the command copies the region another time.
+ *
+ * If tcmur_repl_max_lag is set, new WRITEs are held back while the
+ * oldest unshipped entry is older than that many seconds. The bound
+ * is not enforced while the secondary is unavailable.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <scsi/scsi.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "libtcmu_priv.h"
+#include "scsi_defs.h"
+#include "tcmu-runner.h"
+#include "tcmu_runner_priv.h"
+#include "tcmur_device.h"
+#include "tcmur_cmd_handler.h"
+#include "tcmur_cbt.h"
+#include "tcmur_child.h"
+#include "tcmur_repl.h"
+
+#define REPL_JOURNAL_MAGIC	0x4c4a5254	/* "TRJL" */
+#define REPL_JOURNAL_VERSION	1
+#define REPL_JOURNAL_HDR_LEN	4096
+#define REPL_JOURNAL_MIN_SIZE	(4 * 1024 * 1024)
+
+#define REPL_JOURNAL_FLAG_OPEN	(1 << 0)
+
+#define REPL_ENTRY_MAGIC	0x45524a54	/* "TJRE" */
+#define REPL_ENTRY_HDR_LEN	512
+
+#define REPL_DIRTY_GRANULARITY	(1024 * 1024)
+
+/* bytes shipped or resynced between flushes of the secondary */
+#define REPL_BATCH_LEN		(16 * 1024 * 1024)
+
+#define REPL_RETRY_SECS		30
+#define REPL_STATS_SECS		60
+
+struct repl_journal_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t capacity;	/* bytes in the ring */
+	/* byte positions since the journal was created */
+	uint64_t head;
+	uint64_t tail;
+	uint64_t next_seq;
+};
+
+enum {
+	REPL_ENTRY_DATA = 1,
+	REPL_ENTRY_PAD,		/* skip to the start of the ring */
+};
+
+struct repl_entry {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t seq;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t timestamp;	/* ns, CLOCK_REALTIME */
+};
+
+enum {
+	REPL_STATE_REPLICATING,
+	REPL_STATE_DEGRADED,
+};
+
+static const char *repl_state_str[] = {
+	[REPL_STATE_REPLICATING] = "replicating",
+	[REPL_STATE_DEGRADED] = "degraded",
+};
+
+struct tcmur_repl {
+	struct tcmu_device *dev;
+	struct tcmu_device *secondary;
+	char *target;
+
+	int fd;
+	char *path;
+	struct tcmur_cbt *dirty;
+
+	pthread_mutex_t lock;
+	/* wakes up the shipping thread */
+	pthread_cond_t ship_cond;
+	/* journal synced, or tail moved forward */
+	pthread_cond_t space_cond;
+
+	uint64_t capacity;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t next_seq;
+	/* timestamp of the entry at tail, 0 if not known */
+	uint64_t tail_ts;
+	uint64_t synced_head;
+	bool syncing;
+
+	int state;
+	uint32_t max_lag;
+	bool stop;
+	bool thread_running;
+	pthread_t thread;
+	time_t retry_time;
+
+	/* only used by the shipping thread */
+	void *buf;
+	size_t buf_len;
+	uint64_t resync_cursor;
+
+	/* statistics, under lock */
+	uint64_t journaled_bytes;
+	uint64_t journaled_entries;
+	uint64_t shipped_bytes;
+	uint64_t shipped_entries;
+	uint64_t resynced_bytes;
+	uint64_t overflows;
+	uint64_t throttled;
+	uint64_t ship_errors;
+	time_t stats_time;
+	uint64_t stats_journaled;
+	uint64_t stats_shipped;
+	uint64_t journal_rate;
+	uint64_t ship_rate;
+};
+
+static uint64_t repl_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t repl_entry_len(uint64_t data_len)
+{
+	return REPL_ENTRY_HDR_LEN + round_up(data_len, REPL_ENTRY_HDR_LEN);
+}
+
+static inline off_t repl_pos(struct tcmur_repl *repl, uint64_t pos)
+{
+	return REPL_JOURNAL_HDR_LEN + pos % repl->capacity;
+}
+
+/* Caller holds repl->lock */
+static uint64_t repl_lag_secs(struct tcmur_repl *repl)
+{
+	uint64_t now;
+
+	if (repl->head == repl->tail || !repl->tail_ts)
+		return 0;
+
+	now = repl_now_ns();
+	if (now < repl->tail_ts)
+		return 0;
+	return (now - repl->tail_ts) / 1000000000ULL;
+}
+
+/* Caller holds repl->lock */
+static int repl_write_hdr(struct tcmur_repl *repl, bool open)
+{
+	struct repl_journal_hdr hdr;
+	ssize_t wr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = REPL_JOURNAL_MAGIC;
+	hdr.version = REPL_JOURNAL_VERSION;
+	hdr.flags = open ? REPL_JOURNAL_FLAG_OPEN : 0;
+	hdr.capacity = repl->capacity;
+	hdr.head = repl->head;
+	hdr.tail = repl->tail;
+	hdr.next_seq = repl->next_seq;
+
+	wr = pwrite(repl->fd, &hdr, sizeof(hdr), 0);
+	if (wr != sizeof(hdr))
+		return wr < 0 ? -errno : -EIO;
+	return 0;
+}
+
+static int repl_read_entry(struct tcmur_repl *repl, uint64_t pos,
+			   struct repl_entry *entry)
+{
+	ssize_t rd;
+
+	rd = pread(repl->fd, entry, sizeof(*entry), repl_pos(repl, pos));
+	if (rd != sizeof(*entry))
+		return rd < 0 ? -errno : -EIO;
+
+	if (entry->magic != REPL_ENTRY_MAGIC ||
+	    (entry->type != REPL_ENTRY_DATA && entry->type != REPL_ENTRY_PAD))
+		return -EINVAL;
+	if (entry->type == REPL_ENTRY_DATA &&
+	    repl_entry_len(entry->length) > repl->capacity - pos % repl->capacity)
+		return -EINVAL;
+	return 0;
+}
+
+static void repl_mark_all(struct tcmur_repl *repl)
+{
+	struct tcmu_device *dev = repl->dev;
+
+	tcmur_cbt_set(dev, repl->dirty, 0,
+		      tcmu_lba_to_byte(dev, tcmu_dev_get_num_lbas(dev)));
+}
+
+/*
+ * Walk the journal after an unclean shutdown. Entries whose append was
+ * not completed are dropped, the primary was not written for them.
+ * Since the data of the last synced entries may still be torn their
+ * ranges are also copied from the primary.
+ */
+static void repl_journal_recover(struct tcmur_repl *repl)
+{
+	struct tcmu_device *dev = repl->dev;
+	struct repl_entry entry;
+	uint64_t pos = repl->tail, seq = 0;
+
+	while (pos != repl->head) {
+		if (repl_read_entry(repl, pos, &entry))
+			break;
+
+		if (entry.type == REPL_ENTRY_PAD) {
+			pos += repl->capacity - pos % repl->capacity;
+			continue;
+		}
+
+		if (seq && entry.seq != seq)
+			break;
+		seq = entry.seq + 1;
+
+		tcmur_cbt_set(dev, repl->dirty, entry.offset, entry.length);
+		pos += repl_entry_len(entry.length);
+	}
+
+	if (pos != repl->head) {
+		tcmu_dev_warn(dev, "Dropping %"PRIu64" bytes of incomplete journal entries\n",
+			      repl->head - pos);
+		repl->head = pos;
+	}
+
+	if (seq > repl->next_seq)
+		repl->next_seq = seq;
+}
+
+static int repl_journal_open(struct tcmur_repl *repl, uint64_t size)
+{
+	struct tcmu_device *dev = repl->dev;
+	struct repl_journal_hdr hdr;
+	struct stat st;
+	ssize_t rd;
+	int ret;
+
+	repl->fd = open(repl->path, O_RDWR | O_CREAT, 0600);
+	if (repl->fd == -1) {
+		ret = -errno;
+		tcmu_dev_err(dev, "Could not open replication journal %s: %m\n",
+			     repl->path);
+		return ret;
+	}
+
+	if (fstat(repl->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	if (st.st_size < REPL_JOURNAL_HDR_LEN) {
+		if (size < REPL_JOURNAL_MIN_SIZE) {
+			tcmu_dev_err(dev, "Replication journal size %"PRIu64" is smaller than %u\n",
+				     size, REPL_JOURNAL_MIN_SIZE);
+			ret = -EINVAL;
+			goto close_fd;
+		}
+
+		repl->capacity = round_down(size - REPL_JOURNAL_HDR_LEN,
+					    REPL_ENTRY_HDR_LEN);
+		repl->next_seq = 1;
+		if (ftruncate(repl->fd, REPL_JOURNAL_HDR_LEN + repl->capacity)) {
+			ret = -errno;
+			tcmu_dev_err(dev, "Could not size replication journal %s: %m\n",
+				     repl->path);
+			goto close_fd;
+		}
+		goto write_hdr;
+	}
+
+	rd = pread(repl->fd, &hdr, sizeof(hdr), 0);
+	if (rd != sizeof(hdr)) {
+		ret = rd < 0 ? -errno : -EIO;
+		goto close_fd;
+	}
+
+	if (hdr.magic != REPL_JOURNAL_MAGIC ||
+	    hdr.version != REPL_JOURNAL_VERSION ||
+	    hdr.capacity % REPL_ENTRY_HDR_LEN ||
+	    hdr.tail > hdr.head || hdr.head - hdr.tail > hdr.capacity ||
+	    st.st_size < REPL_JOURNAL_HDR_LEN + hdr.capacity) {
+		tcmu_dev_err(dev, "%s is not a valid replication journal\n",
+			     repl->path);
+		ret = -EINVAL;
+		goto close_fd;
+	}
+
+	if (hdr.capacity != round_down(size - REPL_JOURNAL_HDR_LEN,
+				       REPL_ENTRY_HDR_LEN))
+		tcmu_dev_warn(dev, "Using journal size %"PRIu64" from %s\n",
+			      hdr.capacity + REPL_JOURNAL_HDR_LEN, repl->path);
+
+	repl->capacity = hdr.capacity;
+	repl->head = hdr.head;
+	repl->tail = hdr.tail;
+	repl->next_seq = hdr.next_seq;
+
+	if (hdr.flags & REPL_JOURNAL_FLAG_OPEN) {
+		tcmu_dev_warn(dev, "Replication journal %s was not closed cleanly\n",
+			      repl->path);
+		repl_journal_recover(repl);
+	}
+
+write_hdr:
+	repl->synced_head = repl->head;
+	ret = repl_write_hdr(repl, true);
+	if (!ret && fdatasync(repl->fd))
+		ret = -errno;
+	if (ret) {
+		tcmu_dev_err(dev, "Could not write replication journal %s: %d\n",
+			     repl->path, ret);
+		goto close_fd;
+	}
+	return 0;
+
+close_fd:
+	close(repl->fd);
+	repl->fd = -1;
+	return ret;
+}
+
+/*
+ * Make the journal stable up to target. Only one thread syncs at a
+ * time, the others wait and are usually covered by its sync.
+ *
+ * Caller holds repl->lock.
+ */
+static int repl_journal_sync(struct tcmur_repl *repl, uint64_t target)
+{
+	uint64_t sync_head;
+	int ret;
+
+	while (repl->synced_head < target) {
+		if (repl->syncing) {
+			pthread_cond_wait(&repl->space_cond, &repl->lock);
+			continue;
+		}
+
+		repl->syncing = true;
+		sync_head = repl->head;
+		ret = repl_write_hdr(repl, true);
+		pthread_mutex_unlock(&repl->lock);
+
+		if (!ret && fdatasync(repl->fd))
+			ret = -errno;
+
+		pthread_mutex_lock(&repl->lock);
+		repl->syncing = false;
+		if (!ret && sync_head > repl->synced_head)
+			repl->synced_head = sync_head;
+		pthread_cond_broadcast(&repl->space_cond);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int repl_journal_append(struct tcmur_repl *repl, struct iovec *iov,
+			       size_t iov_cnt, size_t len, uint64_t off)
+{
+	struct tcmu_device *dev = repl->dev;
+	char hdr_buf[REPL_ENTRY_HDR_LEN] = { 0 };
+	struct repl_entry *entry = (struct repl_entry *)hdr_buf;
+	uint64_t need = repl_entry_len(len);
+	uint64_t pos, contig, ts;
+	struct iovec *wr_iov;
+	bool was_empty;
+	ssize_t wr;
+	int ret;
+
+	if (len % REPL_ENTRY_HDR_LEN || iov_cnt + 1 > IOV_MAX)
+		return -EINVAL;
+
+	wr_iov = malloc((iov_cnt + 1) * sizeof(*wr_iov));
+	if (!wr_iov)
+		return -ENOMEM;
+	wr_iov[0].iov_base = hdr_buf;
+	wr_iov[0].iov_len = REPL_ENTRY_HDR_LEN;
+	memcpy(&wr_iov[1], iov, iov_cnt * sizeof(*iov));
+
+	ts = repl_now_ns();
+	entry->magic = REPL_ENTRY_MAGIC;
+	entry->type = REPL_ENTRY_DATA;
+	entry->offset = off;
+	entry->length = len;
+	entry->timestamp = ts;
+
+	pthread_mutex_lock(&repl->lock);
+	if (repl->state != REPL_STATE_REPLICATING) {
+		/* the entry would only be turned into a dirty region */
+		ret = -EAGAIN;
+		goto unlock;
+	}
+
+	was_empty = repl->head == repl->tail;
+	pos = repl->head % repl->capacity;
+	contig = repl->capacity - pos;
+	if (need > contig)
+		need += contig;
+
+	if (need > repl->capacity - (repl->head - repl->tail)) {
+		repl->overflows++;
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	if (need > repl_entry_len(len)) {
+		struct repl_entry pad = {
+			.magic = REPL_ENTRY_MAGIC,
+			.type = REPL_ENTRY_PAD,
+		};
+
+		wr = pwrite(repl->fd, &pad, sizeof(pad),
+			    repl_pos(repl, repl->head));
+		if (wr != sizeof(pad)) {
+			ret = wr < 0 ? -errno : -EIO;
+			goto write_err;
+		}
+		repl->head += contig;
+		need -= contig;
+	}
+
+	entry->seq = repl->next_seq;
+	wr = pwritev(repl->fd, wr_iov, iov_cnt + 1, repl_pos(repl, repl->head));
+	if (wr != REPL_ENTRY_HDR_LEN + len) {
+		ret = wr < 0 ? -errno : -EIO;
+		goto write_err;
+	}
+
+	repl->next_seq++;
+	repl->head += need;
+	if (was_empty)
+		repl->tail_ts = ts;
+	repl->journaled_bytes += len;
+	repl->journaled_entries++;
+
+	ret = repl_journal_sync(repl, repl->head);
+	if (ret)
+		goto write_err;
+
+	pthread_cond_signal(&repl->ship_cond);
+	goto unlock;
+
+write_err:
+	tcmu_dev_err(dev, "Could not write to replication journal %s: %d\n",
+		     repl->path, ret);
+unlock:
+	pthread_mutex_unlock(&repl->lock);
+	free(wr_iov);
+	return ret;
+}
+
+/*
+ * Called from the write path before the data is sent to the handler.
+ * If the data cannot be journaled its range is marked dirty instead.
+ */
+void tcmur_repl_journal_write(struct tcmu_device *dev,
+			      struct tcmur_cmd *tcmur_cmd, struct iovec *iov,
+			      size_t iov_cnt, size_t len, off_t off)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_repl *repl = rdev->repl;
+	int old_state;
+
+	/* Already marked dirty, e.g. by WRITE AND VERIFY */
+	if (!repl || tcmur_cmd->repl_len)
+		return;
+
+	tcmur_cmd->repl_off = off;
+	tcmur_cmd->repl_len = len;
+
+	/* a cancelled cmdproc thread must not leave repl->lock held */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+	if (!repl_journal_append(repl, iov, iov_cnt, len, off))
+		tcmur_cmd->repl_journaled = true;
+	else
+		tcmur_cbt_set(dev, repl->dirty, off, len);
+	pthread_setcancelstate(old_state, NULL);
+}
+
+void tcmur_repl_mark(struct tcmu_device *dev, uint64_t off, uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (rdev->repl)
+		tcmur_cbt_set(dev, rdev->repl->dirty, off, len);
+}
+
+/*
+ * Mark a range the command modifies without journaling it. The range
+ * is marked again when the command completes.
+ */
+void tcmur_repl_mark_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 uint64_t off, uint64_t len)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	uint64_t end;
+
+	if (!rdev->repl || !len)
+		return;
+
+	tcmur_cbt_set(dev, rdev->repl->dirty, off, len);
+
+	if (!tcmur_cmd->repl_len) {
+		tcmur_cmd->repl_off = off;
+		tcmur_cmd->repl_len = len;
+		return;
+	}
+
+	end = max(tcmur_cmd->repl_off + tcmur_cmd->repl_len, off + len);
+	tcmur_cmd->repl_off = min(tcmur_cmd->repl_off, off);
+	tcmur_cmd->repl_len = end - tcmur_cmd->repl_off;
+}
+
+/*
+ * WRITEs are journaled from the write path. Other commands modifying
+ * data are marked here. UNMAP and EXTENDED COPY carry their ranges in
+ * the parameter list and are marked where that is parsed.
+ */
+void tcmur_repl_track_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	uint8_t *cdb = cmd->cdb;
+
+	if (!rdev->repl)
+		return;
+
+	switch (cdb[0]) {
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case COMPARE_AND_WRITE:
+		tcmur_repl_mark_cmd(dev, cmd->hm_private, cmd->off, cmd->len);
+		break;
+	case FORMAT_UNIT:
+		tcmur_repl_mark_cmd(dev, cmd->hm_private, 0,
+				    tcmu_lba_to_byte(dev,
+						tcmu_dev_get_num_lbas(dev)));
+		break;
+	}
+}
+
+void tcmur_repl_cmd_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int rc)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (!rdev->repl || !tcmur_cmd->repl_len)
+		return;
+
+	/*
+	 * A failed write may have partly reached the primary, so let
+	 * resync decide what the secondary gets.
+	 */
+	if (tcmur_cmd->repl_journaled && rc == TCMU_STS_OK)
+		return;
+
+	tcmur_cbt_set(dev, rdev->repl->dirty, tcmur_cmd->repl_off,
+		      tcmur_cmd->repl_len);
+}
+
+/*
+ * Hold back new WRITEs while the secondary lags more than
+ * tcmur_repl_max_lag seconds behind.
+ */
+void tcmur_repl_throttle(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_repl *repl = rdev->repl;
+	struct timespec ts;
+	bool throttled = false;
+	int old_state;
+
+	if (!repl || !repl->max_lag)
+		return;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+	pthread_mutex_lock(&repl->lock);
+	while (!repl->stop && repl->state == REPL_STATE_REPLICATING &&
+	       repl_lag_secs(repl) > repl->max_lag) {
+		if (!throttled) {
+			tcmu_dev_dbg(dev, "Replication lag %"PRIu64" secs exceeds %u. Throttling writes.\n",
+				     repl_lag_secs(repl), repl->max_lag);
+			repl->throttled++;
+			throttled = true;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&repl->space_cond, &repl->lock, &ts);
+	}
+	pthread_mutex_unlock(&repl->lock);
+	pthread_setcancelstate(old_state, NULL);
+}
+
+static void *repl_get_buf(struct tcmur_repl *repl, size_t len)
+{
+	void *buf;
+
+	if (len <= repl->buf_len)
+		return repl->buf;
+
+	buf = realloc(repl->buf, len);
+	if (!buf)
+		return NULL;
+	repl->buf = buf;
+	repl->buf_len = len;
+	return buf;
+}
+
+/* Caller holds repl->lock */
+static void repl_set_degraded(struct tcmur_repl *repl, const char *why)
+{
+	if (repl->state == REPL_STATE_DEGRADED)
+		return;
+
+	tcmu_dev_err(repl->dev, "Replication to %s degraded: %s. Retrying in %d secs.\n",
+		     repl->target, why, REPL_RETRY_SECS);
+	repl->state = REPL_STATE_DEGRADED;
+	repl->retry_time = time(NULL) + REPL_RETRY_SECS;
+	repl->ship_errors++;
+	/* writers waiting for the lag to drop */
+	pthread_cond_broadcast(&repl->space_cond);
+}
+
+/* Caller holds repl->lock */
+static void repl_advance_tail(struct tcmur_repl *repl, uint64_t tail)
+{
+	int ret;
+
+	repl->tail = tail;
+	if (repl->tail == repl->head)
+		repl->tail_ts = 0;
+
+	/*
+	 * Not synced, after a crash entries are shipped again which
+	 * leaves the secondary in the same state.
+	 */
+	ret = repl_write_hdr(repl, true);
+	if (ret)
+		tcmu_dev_err(repl->dev, "Could not update replication journal %s: %d\n",
+			     repl->path, ret);
+	pthread_cond_broadcast(&repl->space_cond);
+}
+
+/*
+ * While degraded, entries are not shipped but turned into dirty
+ * regions so the journal does not fill up.
+ *
+ * Caller holds repl->lock.
+ */
+static void repl_journal_to_dirty(struct tcmur_repl *repl)
+{
+	struct repl_entry entry;
+	uint64_t pos = repl->tail;
+
+	if (pos == repl->head)
+		return;
+
+	while (pos != repl->head) {
+		if (repl_read_entry(repl, pos, &entry)) {
+			repl_mark_all(repl);
+			break;
+		}
+
+		if (entry.type == REPL_ENTRY_PAD) {
+			pos += repl->capacity - pos % repl->capacity;
+			continue;
+		}
+
+		tcmur_cbt_set(repl->dev, repl->dirty, entry.offset,
+			      entry.length);
+		pos += repl_entry_len(entry.length);
+	}
+
+	repl_advance_tail(repl, repl->head);
+}
+
+/* Ship up to REPL_BATCH_LEN bytes of journal entries. */
+static int repl_ship_batch(struct tcmur_repl *repl)
+{
+	struct tcmu_device *dev = repl->dev;
+	uint64_t tail, head, shipped = 0, entries = 0;
+	struct repl_entry entry;
+	struct iovec iov;
+	ssize_t rd;
+	int ret;
+
+	pthread_mutex_lock(&repl->lock);
+	tail = repl->tail;
+	head = repl->head;
+	pthread_mutex_unlock(&repl->lock);
+
+	while (tail != head && shipped < REPL_BATCH_LEN) {
+		ret = repl_read_entry(repl, tail, &entry);
+		if (ret) {
+			tcmu_dev_err(dev, "Replication journal %s is corrupted (%d). Resyncing the device.\n",
+				     repl->path, ret);
+			pthread_mutex_lock(&repl->lock);
+			repl_mark_all(repl);
+			repl_advance_tail(repl, head);
+			pthread_mutex_unlock(&repl->lock);
+			return 0;
+		}
+
+		if (entry.type == REPL_ENTRY_PAD) {
+			tail += repl->capacity - tail % repl->capacity;
+			continue;
+		}
+
+		pthread_mutex_lock(&repl->lock);
+		repl->tail_ts = entry.timestamp;
+		pthread_mutex_unlock(&repl->lock);
+
+		iov.iov_base = repl_get_buf(repl, entry.length);
+		iov.iov_len = entry.length;
+		if (!iov.iov_base)
+			return -ENOMEM;
+
+		rd = pread(repl->fd, iov.iov_base, entry.length,
+			   repl_pos(repl, tail) + REPL_ENTRY_HDR_LEN);
+		if (rd != entry.length) {
+			tcmu_dev_err(dev, "Could not read replication journal %s: %zd\n",
+				     repl->path, rd);
+			return -EIO;
+		}
+
+		ret = tcmur_dev_sync_write(repl->secondary, &iov, 1,
+					   entry.length, entry.offset);
+		if (ret != TCMU_STS_OK)
+			return -EIO;
+
+		tail += repl_entry_len(entry.length);
+		shipped += entry.length;
+		entries++;
+	}
+
+	if (tcmur_dev_sync_flush(repl->secondary) != TCMU_STS_OK)
+		return -EIO;
+
+	pthread_mutex_lock(&repl->lock);
+	repl->shipped_bytes += shipped;
+	repl->shipped_entries += entries;
+	repl_advance_tail(repl, tail);
+	pthread_mutex_unlock(&repl->lock);
+	return 0;
+}
+
+/*
+ * Copy up to REPL_BATCH_LEN bytes of dirty regions from the primary.
+ * Returns the number of bytes copied or -errno.
+ */
+static int64_t repl_resync_batch(struct tcmur_repl *repl)
+{
+	struct tcmu_device *dev = repl->dev;
+	uint64_t off, len, start, copied = 0;
+	struct iovec iov;
+	int ret;
+
+	off = repl->resync_cursor;
+	if (!tcmur_cbt_find_next(repl->dirty, &off, &len)) {
+		if (!repl->resync_cursor)
+			return 0;
+
+		repl->resync_cursor = off = 0;
+		if (!tcmur_cbt_find_next(repl->dirty, &off, &len))
+			return 0;
+	}
+	start = off;
+
+	do {
+		tcmur_cbt_clear_begin(repl->dirty, off, len);
+
+		iov.iov_base = repl_get_buf(repl, len);
+		iov.iov_len = len;
+		if (!iov.iov_base)
+			return -ENOMEM;
+
+		ret = tcmur_dev_sync_read(dev, &iov, 1, len, off);
+		if (ret != TCMU_STS_OK) {
+			tcmu_dev_err(dev, "Could not read %"PRIu64" bytes at %"PRIu64" to resync: %d\n",
+				     len, off, ret);
+			return -EIO;
+		}
+
+		ret = tcmur_dev_sync_write(repl->secondary, &iov, 1, len, off);
+		if (ret != TCMU_STS_OK)
+			return -EIO;
+
+		copied += len;
+		off += len;
+		repl->resync_cursor = off;
+	} while (copied < REPL_BATCH_LEN &&
+		 tcmur_cbt_find_next(repl->dirty, &off, &len));
+
+	if (tcmur_dev_sync_flush(repl->secondary) != TCMU_STS_OK)
+		return -EIO;
+
+	tcmur_cbt_clear_end(repl->dirty, start, repl->resync_cursor - start);
+
+	pthread_mutex_lock(&repl->lock);
+	repl->resynced_bytes += copied;
+	pthread_mutex_unlock(&repl->lock);
+	return copied;
+}
+
+/* Caller holds repl->lock */
+static void repl_reconnect(struct tcmur_repl *repl)
+{
+	struct tcmu_device *secondary;
+
+	pthread_mutex_unlock(&repl->lock);
+	tcmur_child_dev_close(repl->secondary);
+	secondary = tcmur_child_dev_open(repl->dev, "repl", repl->target);
+	pthread_mutex_lock(&repl->lock);
+
+	repl->secondary = secondary;
+	if (!secondary) {
+		repl->retry_time = time(NULL) + REPL_RETRY_SECS;
+		return;
+	}
+
+	tcmu_dev_info(repl->dev, "Replication to %s resumed\n", repl->target);
+	repl->state = REPL_STATE_REPLICATING;
+	repl->resync_cursor = 0;
+}
+
+/* Caller holds repl->lock */
+static void repl_update_stats(struct tcmur_repl *repl)
+{
+	time_t now = time(NULL);
+	time_t elapsed = now - repl->stats_time;
+
+	if (elapsed < REPL_STATS_SECS)
+		return;
+
+	repl->journal_rate = (repl->journaled_bytes - repl->stats_journaled) /
+				elapsed;
+	repl->ship_rate = (repl->shipped_bytes - repl->stats_shipped) / elapsed;
+	repl->stats_journaled = repl->journaled_bytes;
+	repl->stats_shipped = repl->shipped_bytes;
+	repl->stats_time = now;
+
+	tcmu_dev_info(repl->dev, "Replication %s: lag %"PRIu64" secs, journal %"PRIu64"/%"PRIu64" bytes, %"PRIu64" dirty regions, journaled %"PRIu64" B/s, shipped %"PRIu64" B/s\n",
+		      repl_state_str[repl->state], repl_lag_secs(repl),
+		      repl->head - repl->tail, repl->capacity,
+		      tcmur_cbt_count(repl->dirty), repl->journal_rate,
+		      repl->ship_rate);
+}
+
+static void *repl_ship_thread(void *arg)
+{
+	struct tcmur_repl *repl = arg;
+	struct timespec ts;
+	int64_t copied;
+	int ret;
+
+	pthread_mutex_lock(&repl->lock);
+	while (!repl->stop) {
+		repl_update_stats(repl);
+
+		if (repl->state == REPL_STATE_DEGRADED) {
+			repl_journal_to_dirty(repl);
+			if (time(NULL) >= repl->retry_time)
+				repl_reconnect(repl);
+			if (repl->state == REPL_STATE_DEGRADED)
+				goto wait;
+		}
+
+		/* the journal is shipped in order before any resync */
+		if (repl->tail != repl->head) {
+			pthread_mutex_unlock(&repl->lock);
+			ret = repl_ship_batch(repl);
+			pthread_mutex_lock(&repl->lock);
+			if (ret)
+				repl_set_degraded(repl, "could not ship journal");
+			continue;
+		}
+
+		pthread_mutex_unlock(&repl->lock);
+		copied = repl_resync_batch(repl);
+		pthread_mutex_lock(&repl->lock);
+		if (copied < 0)
+			repl_set_degraded(repl, "could not resync dirty regions");
+		if (copied)
+			continue;
+wait:
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&repl->ship_cond, &repl->lock, &ts);
+	}
+	pthread_mutex_unlock(&repl->lock);
+
+	return NULL;
+}
+
+static int repl_start_thread(struct tcmur_repl *repl)
+{
+	int ret;
+
+	repl->stop = false;
+	ret = pthread_create(&repl->thread, NULL, repl_ship_thread, repl);
+	if (ret)
+		return -ret;
+	repl->thread_running = true;
+	return 0;
+}
+
+static void repl_stop_thread(struct tcmur_repl *repl)
+{
+	if (!repl->thread_running)
+		return;
+
+	pthread_mutex_lock(&repl->lock);
+	repl->stop = true;
+	pthread_cond_broadcast(&repl->ship_cond);
+	pthread_cond_broadcast(&repl->space_cond);
+	pthread_mutex_unlock(&repl->lock);
+
+	pthread_join(repl->thread, NULL);
+	repl->thread_running = false;
+}
+
+int tcmur_repl_open(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_handler *rhandler = tcmu_get_runner_handler(dev);
+	struct tcmur_repl *repl;
+	char *dirty_path;
+	bool new_dirty;
+	int ret;
+
+	if (!rdev->repl_target || !rdev->repl_journal) {
+		tcmu_dev_err(dev, "Replication needs both tcmur_repl_target and tcmur_repl_journal\n");
+		return -EINVAL;
+	}
+
+	if (tcmur_handler_is_passthrough_only(rhandler)) {
+		tcmu_dev_err(dev, "Replication is not supported by handler %s\n",
+			     rhandler->subtype);
+		return -EOPNOTSUPP;
+	}
+
+	repl = calloc(1, sizeof(*repl));
+	if (!repl)
+		return -ENOMEM;
+	repl->dev = dev;
+	repl->fd = -1;
+	repl->max_lag = rdev->repl_max_lag;
+	repl->stats_time = time(NULL);
+
+	repl->target = strdup(rdev->repl_target);
+	if (!repl->target) {
+		ret = -ENOMEM;
+		goto free_repl;
+	}
+
+	repl->path = strdup(rdev->repl_journal);
+	if (!repl->path) {
+		ret = -ENOMEM;
+		goto free_target;
+	}
+
+	ret = pthread_mutex_init(&repl->lock, NULL);
+	if (ret) {
+		ret = -ret;
+		goto free_path;
+	}
+
+	ret = pthread_cond_init(&repl->ship_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_lock;
+	}
+
+	ret = pthread_cond_init(&repl->space_cond, NULL);
+	if (ret) {
+		ret = -ret;
+		goto destroy_ship_cond;
+	}
+
+	if (asprintf(&dirty_path, "%s.dirty", repl->path) == -1) {
+		ret = -ENOMEM;
+		goto destroy_space_cond;
+	}
+	new_dirty = access(dirty_path, F_OK) != 0;
+
+	ret = tcmur_cbt_create(dev, dirty_path, REPL_DIRTY_GRANULARITY,
+			       &repl->dirty);
+	free(dirty_path);
+	if (ret)
+		goto destroy_space_cond;
+
+	ret = repl_journal_open(repl, rdev->repl_journal_size ?
+					rdev->repl_journal_size :
+					TCMUR_REPL_DEF_JOURNAL_SIZE);
+	if (ret)
+		goto destroy_dirty;
+
+	if (new_dirty) {
+		tcmu_dev_info(dev, "Starting initial sync to %s\n",
+			      repl->target);
+		repl_mark_all(repl);
+	}
+
+	repl->secondary = tcmur_child_dev_open(dev, "repl", repl->target);
+	if (!repl->secondary) {
+		repl->state = REPL_STATE_DEGRADED;
+		repl->retry_time = time(NULL) + REPL_RETRY_SECS;
+		tcmu_dev_err(dev, "Could not open replication target %s. Retrying in %d secs.\n",
+			     repl->target, REPL_RETRY_SECS);
+	}
+
+	ret = repl_start_thread(repl);
+	if (ret)
+		goto close_secondary;
+
+	tcmu_dev_info(dev, "Replicating to %s using journal %s (%"PRIu64" bytes)\n",
+		      repl->target, repl->path, repl->capacity);
+	rdev->repl = repl;
+	return 0;
+
+close_secondary:
+	tcmur_child_dev_close(repl->secondary);
+	close(repl->fd);
+destroy_dirty:
+	tcmur_cbt_destroy(dev, repl->dirty);
+destroy_space_cond:
+	pthread_cond_destroy(&repl->space_cond);
+destroy_ship_cond:
+	pthread_cond_destroy(&repl->ship_cond);
+destroy_lock:
+	pthread_mutex_destroy(&repl->lock);
+free_path:
+	free(repl->path);
+free_target:
+	free(repl->target);
+free_repl:
+	free(repl);
+	return ret;
+}
+
+/*
+ * Stop shipping. Must be called before the device's work queue is
+ * torn down since resync reads from the primary through it.
+ */
+void tcmur_repl_stop(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+
+	if (rdev->repl)
+		repl_stop_thread(rdev->repl);
+}
+
+void tcmur_repl_close(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_repl *repl = rdev->repl;
+	int ret;
+
+	if (!repl)
+		return;
+
+	repl_stop_thread(repl);
+	rdev->repl = NULL;
+
+	ret = repl_write_hdr(repl, false);
+	if (!ret && fdatasync(repl->fd))
+		ret = -errno;
+	if (ret)
+		tcmu_dev_err(dev, "Could not close replication journal %s: %d\n",
+			     repl->path, ret);
+
+	tcmur_child_dev_close(repl->secondary);
+	tcmur_cbt_destroy(dev, repl->dirty);
+	close(repl->fd);
+	pthread_cond_destroy(&repl->space_cond);
+	pthread_cond_destroy(&repl->ship_cond);
+	pthread_mutex_destroy(&repl->lock);
+	free(repl->buf);
+	free(repl->path);
+	free(repl->target);
+	free(repl);
+}
+
+/*
+ * Called after the device size has changed. A grown area is copied to
+ * the secondary by resync.
+ */
+int tcmur_repl_resize(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_repl *repl = rdev->repl;
+	int ret;
+
+	if (!repl)
+		return 0;
+
+	repl_stop_thread(repl);
+
+	if (repl->secondary)
+		tcmur_child_dev_set_num_lbas(repl->secondary,
+					     tcmu_dev_get_num_lbas(dev));
+	ret = tcmur_cbt_set_size(dev, repl->dirty);
+	repl->resync_cursor = 0;
+
+	if (repl_start_thread(repl))
+		tcmu_dev_err(dev, "Could not restart replication thread\n");
+	return ret;
+}
+
+/* Returns replication statistics as "name value" lines. */
+int tcmur_repl_get_stats(struct tcmu_device *dev, char **stats)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_repl *repl = rdev->repl;
+	uint64_t dirty;
+	int ret;
+
+	if (!repl)
+		return -ENOENT;
+
+	dirty = tcmur_cbt_count(repl->dirty);
+
+	pthread_mutex_lock(&repl->lock);
+	ret = asprintf(stats,
+		       "state %s\n"
+		       "target %s\n"
+		       "lag_secs %"PRIu64"\n"
+		       "max_lag_secs %u\n"
+		       "journal_used_bytes %"PRIu64"\n"
+		       "journal_size_bytes %"PRIu64"\n"
+		       "journaled_bytes %"PRIu64"\n"
+		       "journaled_entries %"PRIu64"\n"
+		       "journal_rate_bps %"PRIu64"\n"
+		       "shipped_bytes %"PRIu64"\n"
+		       "shipped_entries %"PRIu64"\n"
+		       "ship_rate_bps %"PRIu64"\n"
+		       "journal_overflows %"PRIu64"\n"
+		       "dirty_bytes %"PRIu64"\n"
+		       "resynced_bytes %"PRIu64"\n"
+		       "throttled_writes %"PRIu64"\n"
+		       "ship_errors %"PRIu64"\n",
+		       repl_state_str[repl->state], repl->target,
+		       repl_lag_secs(repl), repl->max_lag,
+		       repl->head - repl->tail, repl->capacity,
+		       repl->journaled_bytes, repl->journaled_entries,
+		       repl->journal_rate, repl->shipped_bytes,
+		       repl->shipped_entries, repl->ship_rate, repl->overflows,
+		       dirty * tcmur_cbt_get_granularity(repl->dirty),
+		       repl->resynced_bytes, repl->throttled,
+		       repl->ship_errors);
+	pthread_mutex_unlock(&repl->lock);
+
+	return ret < 0 ? -ENOMEM : 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_REPL_H
+#define __TCMUR_REPL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct tcmu_device;
+struct tcmulib_cmd;
+struct tcmur_cmd;
+struct tcmur_repl;
+
+#define TCMUR_REPL_DEF_JOURNAL_SIZE	(256 * 1024 * 1024ULL)
+
+int tcmur_repl_open(struct tcmu_device *dev);
+void tcmur_repl_stop(struct tcmu_device *dev);
+void tcmur_repl_close(struct tcmu_device *dev);
+int tcmur_repl_resize(struct tcmu_device *dev);
+
+/* IO path hooks */
+void tcmur_repl_track_cmd(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+void tcmur_repl_mark(struct tcmu_device *dev, uint64_t off, uint64_t len);
+void tcmur_repl_mark_cmd(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 uint64_t off, uint64_t len);
+void tcmur_repl_journal_write(struct tcmu_device *dev,
+			      struct tcmur_cmd *tcmur_cmd, struct iovec *iov,
+			      size_t iov_cnt, size_t len, off_t off);
+void tcmur_repl_cmd_done(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+			 int rc);
+void tcmur_repl_throttle(struct tcmu_device *dev);
+
+int tcmur_repl_get_stats(struct tcmu_device *dev, char **stats);
+
+#endif /* __TCMUR_REPL_H */
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Response cache for INQUIRY, MODE SENSE and READ CAPACITY(16)
+ *
+ * Path checkers and hypervisors send these commands constantly, and
+ * emulating INQUIRY reads the ALUA groups and, for the serial number
+ * and device identification pages, the WWN from configfs each time.
+ * The response of each page is built once by the scsi.c emulation into
+ * a zero padded buffer and later commands for it get a single copy into
+ * their iovec.
+ *
+ * The responses only change when the device is reconfigured, resized or
+ * reopened, or when its ALUA configuration changes, and those paths call
+ * tcmur_resp_cache_invalidate. Ports or groups changed directly in
+ * configfs are not noticed, set the resp_cache tunable to 0 to always
+ * emulate.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <scsi/scsi.h>
+
+#include "ccan/list/list.h"
+
+#include "libtcmu_log.h"
+#include "libtcmu_common.h"
+#include "libtcmu_config.h"
+#include "scsi_defs.h"
+#include "scsi.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_resp_cache.h"
+
+/* largest page built by the scsi.c emulation */
+#define RESP_MAX_LEN	512
+/* MODE SENSE(6) allocation length is one byte */
+#define RESP_MS6_LEN	255
+/* pages per device, a few VPD and mode pages are valid */
+#define RESP_MAX_ENTRIES 64
+
+struct resp_entry {
+	struct list_node entry;
+	uint32_t key;
+	uint32_t len;
+	/* the INQUIRY was built with an enabled ALUA port */
+	bool has_port;
+	uint8_t data[RESP_MAX_LEN];
+};
+
+struct tcmur_resp_cache {
+	pthread_mutex_t lock;
+	struct list_head entries;
+	int nr_entries;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+struct tcmu_tunable tcmur_resp_cache_tunable = {
+	.name = "resp_cache",
+	.desc = "Serve INQUIRY, MODE SENSE and READ CAPACITY(16) from per device prebuilt responses",
+	.type = TCMU_TUNABLE_BOOL,
+	.def = 1,
+	.min = 0,
+	.max = 1,
+};
+
+int tcmur_resp_cache_init(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_resp_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -ENOMEM;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	list_head_init(&cache->entries);
+	rdev->resp_cache = cache;
+	return 0;
+}
+
+/* Called with cache->lock held */
+static void resp_cache_drop(struct tcmur_resp_cache *cache)
+{
+	struct resp_entry *ent;
+
+	while ((ent = list_pop(&cache->entries, struct resp_entry, entry)))
+		free(ent);
+	cache->nr_entries = 0;
+}
+
+void tcmur_resp_cache_free(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_resp_cache *cache = rdev->resp_cache;
+
+	if (!cache)
+		return;
+
+	resp_cache_drop(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	rdev->resp_cache = NULL;
+}
+
+void tcmur_resp_cache_invalidate(struct tcmu_device *dev)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_resp_cache *cache = rdev->resp_cache;
+
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->nr_entries) {
+		resp_cache_drop(cache);
+		cache->invalidations++;
+		tcmu_dev_dbg(dev, "Dropped cached INQUIRY/MODE SENSE responses\n");
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Returns the cache key of a cacheable command and the number of bytes
+ * to copy into its iovec, or 0 if it has to be emulated.
+ */
+static uint32_t resp_key(struct tcmulib_cmd *cmd, uint32_t *copy_len)
+{
+	uint8_t *cdb = cmd->cdb;
+
+	switch (cdb[0]) {
+	case INQUIRY:
+		*copy_len = RESP_MAX_LEN;
+		return INQUIRY << 24 | (cdb[1] & 0x01) << 16 | cdb[2] << 8;
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+		/*
+		 * The emulation copies exactly the allocation length, let
+		 * it handle 0, too short and larger than the built page.
+		 */
+		if (cmd->xfer_len < (cdb[0] == MODE_SENSE ? 4 : 8) ||
+		    cmd->xfer_len > RESP_MAX_LEN)
+			return 0;
+		*copy_len = cmd->xfer_len;
+		return cdb[0] << 24 | (cdb[2] & 0x3f) << 16 | cdb[3] << 8;
+	case SERVICE_ACTION_IN_16:
+		if (cdb[1] != READ_CAPACITY_16)
+			return 0;
+		*copy_len = 32;
+		return SERVICE_ACTION_IN_16 << 24 | READ_CAPACITY_16 << 16;
+	}
+
+	return 0;
+}
+
+int tcmur_resp_cache_get(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_resp_cache *cache = rdev->resp_cache;
+	struct resp_entry *ent;
+	uint32_t key, len;
+	bool has_port;
+
+	if (!cache)
+		return TCMU_STS_NOT_HANDLED;
+
+	if (!tcmur_dev_get_tunable(dev, &tcmur_resp_cache_tunable)) {
+		/* entries could go stale while disabled */
+		if (cache->nr_entries)
+			tcmur_resp_cache_invalidate(dev);
+		return TCMU_STS_NOT_HANDLED;
+	}
+
+	key = resp_key(cmd, &len);
+	if (!key)
+		return TCMU_STS_NOT_HANDLED;
+
+	pthread_mutex_lock(&cache->lock);
+	list_for_each(&cache->entries, ent, entry) {
+		if (ent->key == key)
+			goto found;
+	}
+	cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+	return TCMU_STS_NOT_HANDLED;
+
+found:
+	tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, ent->data,
+			       len < ent->len ? len : ent->len);
+	has_port = ent->has_port;
+	cache->hits++;
+	pthread_mutex_unlock(&cache->lock);
+
+	/* as handle_inquiry does for every INQUIRY with ALUA enabled */
+	if (has_port)
+		tcmu_update_dev_lock_state(dev);
+	return TCMU_STS_OK;
+}
+
+static int resp_build(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      struct tgt_port *port, struct resp_entry *ent)
+{
+	uint8_t cdb[16];
+	struct iovec iov = {
+		.iov_base = ent->data,
+		.iov_len = sizeof(ent->data),
+	};
+
+	memcpy(cdb, cmd->cdb, cmd->cdb_len < sizeof(cdb) ?
+				cmd->cdb_len : sizeof(cdb));
+
+	switch (cdb[0]) {
+	case INQUIRY:
+		ent->len = RESP_MAX_LEN;
+		ent->has_port = port != NULL;
+		return tcmu_emulate_inquiry(dev, port, cdb, &iov, 1);
+	case MODE_SENSE:
+		ent->len = RESP_MS6_LEN;
+		cdb[4] = RESP_MS6_LEN;
+		return tcmu_emulate_mode_sense(dev, cdb, &iov, 1);
+	case MODE_SENSE_10:
+		ent->len = RESP_MAX_LEN;
+		cdb[7] = RESP_MAX_LEN >> 8;
+		cdb[8] = RESP_MAX_LEN & 0xff;
+		return tcmu_emulate_mode_sense(dev, cdb, &iov, 1);
+	case SERVICE_ACTION_IN_16:
+		ent->len = 32;
+		return tcmu_emulate_read_capacity_16(tcmu_dev_get_num_lbas(dev),
+						     tcmu_dev_get_block_size(dev),
+						     cdb, &iov, 1);
+	}
+
+	return TCMU_STS_NOT_HANDLED;
+}
+
+/*
+ * Emulate a command that tcmur_resp_cache_get missed and cache the
+ * response. Returns TCMU_STS_NOT_HANDLED if the caller has to emulate
+ * it itself.
+ */
+int tcmur_resp_cache_fill(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  struct tgt_port *port)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_resp_cache *cache = rdev->resp_cache;
+	struct resp_entry *ent;
+	uint32_t key, len;
+	int ret;
+
+	if (!cache || !tcmur_dev_get_tunable(dev, &tcmur_resp_cache_tunable))
+		return TCMU_STS_NOT_HANDLED;
+
+	key = resp_key(cmd, &len);
+	if (!key)
+		return TCMU_STS_NOT_HANDLED;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		return TCMU_STS_NOT_HANDLED;
+	ent->key = key;
+
+	/* errors are returned as the emulation would, and not cached */
+	ret = resp_build(dev, cmd, port, ent);
+	if (ret != TCMU_STS_OK) {
+		free(ent);
+		return ret;
+	}
+
+	tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, ent->data,
+			       len < ent->len ? len : ent->len);
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->nr_entries < RESP_MAX_ENTRIES) {
+		list_add(&cache->entries, &ent->entry);
+		cache->nr_entries++;
+		ent = NULL;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	free(ent);
+	return TCMU_STS_OK;
+}
+
+int tcmur_resp_cache_get_stats(struct tcmu_device *dev, char **stats)
+{
+	struct tcmur_device *rdev = tcmu_dev_get_private(dev);
+	struct tcmur_resp_cache *cache = rdev->resp_cache;
+	int ret;
+
+	if (!cache)
+		return -ENOENT;
+
+	pthread_mutex_lock(&cache->lock);
+	ret = asprintf(stats,
+		       "enabled %"PRId64"\n"
+		       "entries %d\n"
+		       "hits %"PRIu64"\n"
+		       "misses %"PRIu64"\n"
+		       "invalidations %"PRIu64"\n",
+		       tcmur_dev_get_tunable(dev, &tcmur_resp_cache_tunable),
+		       cache->nr_entries, cache->hits, cache->misses,
+		       cache->invalidations);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (ret < 0) {
+		*stats = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+#ifndef __TCMUR_RESP_CACHE_H
+#define __TCMUR_RESP_CACHE_H
+
+struct tcmu_device;
+struct tcmulib_cmd;
+struct tgt_port;
+struct tcmur_resp_cache;
+struct tcmu_tunable;
+
+extern struct tcmu_tunable tcmur_resp_cache_tunable;
+
+int tcmur_resp_cache_init(struct tcmu_device *dev);
+void tcmur_resp_cache_free(struct tcmu_device *dev);
+void tcmur_resp_cache_invalidate(struct tcmu_device *dev);
+
+/*
+ * Serve INQUIRY, MODE SENSE and READ CAPACITY(16) from the cache.
+ * Returns TCMU_STS_NOT_HANDLED if the command has to be emulated.
+ */
+int tcmur_resp_cache_get(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+/* Build and store the response of a command tcmur_resp_cache_get missed */
+int tcmur_resp_cache_fill(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  struct tgt_port *port);
+int tcmur_resp_cache_get_stats(struct tcmu_device *dev, char **stats);
+
+#endif
@@ -0,0 +1,854 @@
+/*
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This file is licensed to you under your choice of the GNU Lesser
+ * General Public License, version 2.1 or any later version (LGPLv2.1 or
+ * later), or the Apache License 2.0.
+ */
+
+/*
+ * Two tier handler
+ *
+ * Keeps the hot extents of the device on a small fast handler and the
+ * rest on a large slow one. Both tiers are child handler instances
+ * (see tcmur_child.c) given as "subtype/config" strings, separated by
+ * '|' so their own configs may contain ';':
+ *
+ *   tier//path/to/map;fast_size=N[;extent_size=N][;interval=N]
+ *       [;migrate_max=N]|fast subtype/config|slow subtype/config
+ *
+ * e.g. "tier//var/lib/lun0.tier;fast_size=10G|file//nvme/lun0|
+ * rbd/pool/lun0".
+ *
+ * Every extent (1M by default) has its home on the slow tier, which is
+ * as large as the device. The fast tier has fast_size / extent_size
+ * slots, and an extent promoted to a slot is served from there until
+ * it is demoted again, at which point it is copied back if it was
+ * written. The extent map recording the slot of each extent is an
+ * mmapped file that is made stable before I/O is sent to a new
+ * location.
+ *
+ * Accesses bump a per extent heat counter, and every interval (30s by
+ * default) a thread promotes the hottest slow extents, demoting the
+ * coldest fast ones if there is no free slot and the new extent is
+ * clearly hotter, then halves every counter so old accesses fade out.
+ * At most migrate_max extents are moved per interval. The fraction of
+ * I/O served by each tier is logged every TIER_STATS_SECS and on close.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "darray.h"
+#include "libtcmu.h"
+#include "tcmu-runner.h"
+#include "tcmur_device.h"
+#include "tcmur_child.h"
+
+#define TIER_MAGIC		0x52454954	/* "TIER" */
+#define TIER_VERSION		1
+#define TIER_HDR_LEN		4096
+#define TIER_DEF_EXTENT		(1024 * 1024)
+#define TIER_MAX_EXTENT		(64 * 1024 * 1024)
+#define TIER_DEF_INTERVAL	30
+#define TIER_DEF_MIGRATE_MAX	64
+#define TIER_NR_EXTENT_LOCKS	1024
+#define TIER_STATS_SECS		60
+/* heat a slow extent needs before it is considered for promotion */
+#define TIER_PROMOTE_MIN	4
+
+/* map entries are the fast slot + 1, 0 is an extent on the slow tier */
+#define TIER_SLOT_MASK		0x7fffffffU
+#define TIER_DIRTY		0x80000000U
+
+struct tier_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t clean;
+	uint32_t extent_size;
+	uint64_t nr_extents;
+	uint64_t nr_slots;
+};
+
+struct tier_heat {
+	uint64_t extent;
+	uint32_t heat;
+};
+
+struct tier_state {
+	struct tcmu_device *dev;
+	char *map_path;
+	char *fast_cfg;
+	char *slow_cfg;
+	struct tcmu_device *fast;
+	struct tcmu_device *slow;
+
+	uint64_t fast_size;
+	uint32_t extent_size;
+	uint32_t extent_shift;
+	uint64_t dev_size;
+	int interval;
+	int migrate_max;
+
+	struct tier_hdr *hdr;
+	size_t map_len;
+	uint32_t *map;
+	uint32_t *heat;
+
+	/* I/O holds an extent's lock shared, migration exclusive */
+	pthread_rwlock_t extent_locks[TIER_NR_EXTENT_LOCKS];
+
+	/* free fast slots */
+	pthread_mutex_t lock;
+	darray(uint32_t) free_slots;
+
+	pthread_t thread;
+	pthread_mutex_t thread_lock;
+	pthread_cond_t thread_cond;
+	bool stop;
+
+	uint64_t fast_ios;
+	uint64_t slow_ios;
+	uint64_t promoted;
+	uint64_t demoted;
+	time_t stats_time;
+};
+
+static pthread_rwlock_t *tier_extent_lock(struct tier_state *state,
+					  uint64_t extent)
+{
+	return &state->extent_locks[extent % TIER_NR_EXTENT_LOCKS];
+}
+
+static uint64_t tier_extent_len(struct tier_state *state, uint64_t extent)
+{
+	return min((uint64_t)state->extent_size,
+		   state->dev_size - (extent << state->extent_shift));
+}
+
+/* Make the map entry of an extent stable */
+static int tier_sync_entry(struct tier_state *state, uint64_t extent)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t addr = (uintptr_t)&state->map[extent];
+
+	addr &= ~(page_size - 1);
+	if (msync((void *)addr, page_size, MS_SYNC))
+		return -errno;
+	return 0;
+}
+
+/*
+ * Build an iovec covering the first len bytes of iov into out, which
+ * has room for iov_cnt entries. Returns the number of entries used.
+ */
+static size_t tier_iov_slice(struct iovec *iov, size_t iov_cnt, size_t len,
+			     struct iovec *out)
+{
+	size_t i;
+
+	for (i = 0; i < iov_cnt && len; i++) {
+		out[i].iov_base = iov[i].iov_base;
+		out[i].iov_len = min(iov[i].iov_len, len);
+		len -= out[i].iov_len;
+	}
+	return i;
+}
+
+/* Copy an extent between tiers through buf */
+static int tier_copy(struct tier_state *state, uint64_t extent, void *buf,
+		     struct tcmu_device *from, uint64_t from_off,
+		     struct tcmu_device *to, uint64_t to_off)
+{
+	struct iovec iov;
+	int ret;
+
+	iov.iov_base = buf;
+	iov.iov_len = tier_extent_len(state, extent);
+
+	ret = tcmur_dev_sync_read(from, &iov, 1, iov.iov_len, from_off);
+	if (ret != TCMU_STS_OK)
+		return -EIO;
+	ret = tcmur_dev_sync_write(to, &iov, 1, iov.iov_len, to_off);
+	if (ret != TCMU_STS_OK)
+		return -EIO;
+	if (tcmur_dev_sync_flush(to) != TCMU_STS_OK)
+		return -EIO;
+	return 0;
+}
+
+/* Move a fast extent back to the slow tier and free its slot */
+static int tier_demote(struct tier_state *state, uint64_t extent, void *buf)
+{
+	pthread_rwlock_t *lock = tier_extent_lock(state, extent);
+	uint32_t entry, slot;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(lock);
+	entry = state->map[extent];
+	if (!entry)
+		goto unlock;
+	slot = (entry & TIER_SLOT_MASK) - 1;
+
+	if (entry & TIER_DIRTY) {
+		ret = tier_copy(state, extent, buf, state->fast,
+				(uint64_t)slot << state->extent_shift,
+				state->slow, extent << state->extent_shift);
+		if (ret)
+			goto unlock;
+	}
+
+	state->map[extent] = 0;
+	ret = tier_sync_entry(state, extent);
+	if (ret) {
+		state->map[extent] = entry;
+		goto unlock;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	darray_append(state->free_slots, slot);
+	pthread_mutex_unlock(&state->lock);
+	state->demoted++;
+unlock:
+	pthread_rwlock_unlock(lock);
+	return ret;
+}
+
+/* Copy a slow extent into a free slot and switch I/O to it */
+static int tier_promote(struct tier_state *state, uint64_t extent, void *buf)
+{
+	pthread_rwlock_t *lock = tier_extent_lock(state, extent);
+	uint32_t slot;
+	int ret = 0;
+
+	pthread_mutex_lock(&state->lock);
+	if (darray_empty(state->free_slots)) {
+		pthread_mutex_unlock(&state->lock);
+		return -ENOSPC;
+	}
+	slot = darray_pop(state->free_slots);
+	pthread_mutex_unlock(&state->lock);
+
+	pthread_rwlock_wrlock(lock);
+	if (state->map[extent])
+		goto free_slot;
+
+	ret = tier_copy(state, extent, buf, state->slow,
+			extent << state->extent_shift, state->fast,
+			(uint64_t)slot << state->extent_shift);
+	if (ret)
+		goto free_slot;
+
+	state->map[extent] = slot + 1;
+	ret = tier_sync_entry(state, extent);
+	if (ret) {
+		state->map[extent] = 0;
+		goto free_slot;
+	}
+	state->promoted++;
+	pthread_rwlock_unlock(lock);
+	return 0;
+
+free_slot:
+	pthread_rwlock_unlock(lock);
+	pthread_mutex_lock(&state->lock);
+	darray_append(state->free_slots, slot);
+	pthread_mutex_unlock(&state->lock);
+	return ret;
+}
+
+static int tier_heat_cmp_desc(const void *a, const void *b)
+{
+	const struct tier_heat *ha = a, *hb = b;
+
+	return (ha->heat < hb->heat) - (ha->heat > hb->heat);
+}
+
+static int tier_heat_cmp_asc(const void *a, const void *b)
+{
+	return tier_heat_cmp_desc(b, a);
+}
+
+/*
+ * Promote the hottest slow extents, making room by demoting fast ones
+ * that are less than half as hot, then decay every counter.
+ */
+static void tier_balance(struct tier_state *state, void *buf)
+{
+	darray(struct tier_heat) hot = darray_new();
+	darray(struct tier_heat) cold = darray_new();
+	struct tier_heat h;
+	uint64_t i;
+	size_t c = 0;
+	int moved = 0;
+
+	for (i = 0; i < state->hdr->nr_extents; i++) {
+		h.extent = i;
+		h.heat = __atomic_load_n(&state->heat[i], __ATOMIC_RELAXED);
+		if (__atomic_load_n(&state->map[i], __ATOMIC_RELAXED))
+			darray_append(cold, h);
+		else if (h.heat >= TIER_PROMOTE_MIN)
+			darray_append(hot, h);
+	}
+
+	qsort(hot.item, darray_size(hot), sizeof(h), tier_heat_cmp_desc);
+	qsort(cold.item, darray_size(cold), sizeof(h), tier_heat_cmp_asc);
+
+	for (i = 0; i < darray_size(hot) && moved < state->migrate_max; i++) {
+		if (tier_promote(state, hot.item[i].extent, buf) != -ENOSPC) {
+			moved++;
+			continue;
+		}
+
+		if (c == darray_size(cold) ||
+		    hot.item[i].heat <= 2 * cold.item[c].heat)
+			break;
+
+		if (tier_demote(state, cold.item[c++].extent, buf))
+			break;
+		tier_promote(state, hot.item[i].extent, buf);
+		moved += 2;
+	}
+
+	for (i = 0; i < state->hdr->nr_extents; i++)
+		__atomic_store_n(&state->heat[i],
+				 __atomic_load_n(&state->heat[i],
+						 __ATOMIC_RELAXED) >> 1,
+				 __ATOMIC_RELAXED);
+
+	darray_free(cold);
+	darray_free(hot);
+}
+
+static void tier_log_stats(struct tier_state *state)
+{
+	uint64_t fast = __atomic_load_n(&state->fast_ios, __ATOMIC_RELAXED);
+	uint64_t slow = __atomic_load_n(&state->slow_ios, __ATOMIC_RELAXED);
+	size_t nr_free;
+
+	pthread_mutex_lock(&state->lock);
+	nr_free = darray_size(state->free_slots);
+	pthread_mutex_unlock(&state->lock);
+
+	tcmu_dev_info(state->dev, "fast tier hit rate %.1f%% (%"PRIu64" fast, %"PRIu64" slow I/Os), %zu of %"PRIu64" slots free, %"PRIu64" promoted, %"PRIu64" demoted\n",
+		      fast + slow ? 100.0 * fast / (fast + slow) : 0.0,
+		      fast, slow, nr_free,
+		      state->hdr->nr_slots, state->promoted, state->demoted);
+}
+
+static void *tier_thread(void *arg)
+{
+	struct tier_state *state = arg;
+	struct timespec ts;
+	void *buf;
+
+	buf = malloc(state->extent_size);
+	if (!buf) {
+		tcmu_dev_err(state->dev, "Could not allocate migration buffer, tiering is disabled\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&state->thread_lock);
+	while (!state->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += state->interval;
+		pthread_cond_timedwait(&state->thread_cond,
+				       &state->thread_lock, &ts);
+		if (state->stop)
+			break;
+		pthread_mutex_unlock(&state->thread_lock);
+
+		tier_balance(state, buf);
+		if (time(NULL) - state->stats_time >= TIER_STATS_SECS) {
+			state->stats_time = time(NULL);
+			tier_log_stats(state);
+		}
+
+		pthread_mutex_lock(&state->thread_lock);
+	}
+	pthread_mutex_unlock(&state->thread_lock);
+
+	free(buf);
+	return NULL;
+}
+
+enum {
+	TIER_OP_READ,
+	TIER_OP_WRITE,
+	TIER_OP_UNMAP,
+};
+
+/* Run an operation extent by extent on the tier holding each extent */
+static int tier_io(struct tcmu_device *dev, int op, struct iovec *iov,
+		   size_t iov_cnt, uint64_t off, uint64_t len)
+{
+	struct tier_state *state = tcmur_dev_get_private(dev);
+	struct iovec *slice = NULL;
+	struct tcmu_device *child;
+	pthread_rwlock_t *lock;
+	uint64_t extent, eoff, n, child_off;
+	size_t slice_cnt = 0, consumed;
+	uint32_t entry;
+	int ret = TCMU_STS_OK;
+
+	if (iov_cnt) {
+		slice = malloc(iov_cnt * sizeof(*slice));
+		if (!slice)
+			return TCMU_STS_NO_RESOURCE;
+	}
+
+	while (len) {
+		extent = off >> state->extent_shift;
+		eoff = off & (state->extent_size - 1);
+		n = min(len, state->extent_size - eoff);
+		lock = tier_extent_lock(state, extent);
+
+		__atomic_add_fetch(&state->heat[extent], 1, __ATOMIC_RELAXED);
+
+		pthread_rwlock_rdlock(lock);
+		entry = state->map[extent];
+		if (entry) {
+			child = state->fast;
+			child_off = ((uint64_t)((entry & TIER_SLOT_MASK) - 1) <<
+				     state->extent_shift) + eoff;
+			if (op != TIER_OP_READ && !(entry & TIER_DIRTY))
+				__atomic_or_fetch(&state->map[extent],
+						  TIER_DIRTY, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&state->fast_ios, 1,
+					   __ATOMIC_RELAXED);
+		} else {
+			child = state->slow;
+			child_off = off;
+			__atomic_add_fetch(&state->slow_ios, 1,
+					   __ATOMIC_RELAXED);
+		}
+
+		if (iov_cnt)
+			slice_cnt = tier_iov_slice(iov, iov_cnt, n, slice);
+
+		switch (op) {
+		case TIER_OP_READ:
+			ret = tcmur_dev_sync_read(child, slice, slice_cnt, n,
+						  child_off);
+			break;
+		case TIER_OP_WRITE:
+			ret = tcmur_dev_sync_write(child, slice, slice_cnt, n,
+						   child_off);
+			break;
+		case TIER_OP_UNMAP:
+			ret = tcmur_dev_sync_unmap(child, child_off, n);
+			break;
+		}
+		pthread_rwlock_unlock(lock);
+		if (ret != TCMU_STS_OK)
+			break;
+
+		if (iov_cnt) {
+			consumed = tcmu_iovec_seek(iov, n);
+			iov += consumed;
+			iov_cnt -= consumed;
+		}
+		off += n;
+		len -= n;
+	}
+
+	free(slice);
+	return ret;
+}
+
+static int tier_read(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		     struct iovec *iov, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	return tier_io(dev, TIER_OP_READ, iov, iov_cnt, offset, length);
+}
+
+static int tier_write(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      struct iovec *iov, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	return tier_io(dev, TIER_OP_WRITE, iov, iov_cnt, offset, length);
+}
+
+static int tier_unmap(struct tcmu_device *dev, struct tcmur_cmd *cmd,
+		      uint64_t off, uint64_t len)
+{
+	return tier_io(dev, TIER_OP_UNMAP, NULL, 0, off, len);
+}
+
+static int tier_flush(struct tcmu_device *dev, struct tcmur_cmd *cmd)
+{
+	struct tier_state *state = tcmur_dev_get_private(dev);
+	int ret;
+
+	ret = tcmur_dev_sync_flush(state->fast);
+	if (ret != TCMU_STS_OK)
+		return ret;
+	return tcmur_dev_sync_flush(state->slow);
+}
+
+static int tier_parse_config(struct tcmu_device *dev,
+			     struct tier_state *state)
+{
+	char *config, *fast, *slow, *opt, *end;
+	int ret = -EINVAL;
+
+	config = strchr(tcmu_dev_get_cfgstring(dev), '/');
+	if (!config) {
+		tcmu_dev_err(dev, "no configuration found in cfgstring\n");
+		return -EINVAL;
+	}
+	config += 1; /* get past '/' */
+
+	config = strdup(config);
+	if (!config)
+		return -ENOMEM;
+
+	fast = strchr(config, '|');
+	slow = fast ? strchr(fast + 1, '|') : NULL;
+	if (!slow) {
+		tcmu_dev_err(dev, "cfgstring must be map|fast subtype/config|slow subtype/config\n");
+		goto free_config;
+	}
+	*fast++ = '\0';
+	*slow++ = '\0';
+
+	state->extent_size = TIER_DEF_EXTENT;
+	state->interval = TIER_DEF_INTERVAL;
+	state->migrate_max = TIER_DEF_MIGRATE_MAX;
+
+	state->map_path = strdup(strtok(config, ";") ? : "");
+	state->fast_cfg = strdup(fast);
+	state->slow_cfg = strdup(slow);
+	if (!state->map_path || !state->fast_cfg || !state->slow_cfg) {
+		ret = -ENOMEM;
+		goto free_config;
+	}
+	if (!strlen(state->map_path)) {
+		tcmu_dev_err(dev, "Could not get map path\n");
+		goto free_config;
+	}
+
+	/* The next options are optional, except fast_size */
+	while ((opt = strtok(NULL, ";"))) {
+		if (!strncmp(opt, "fast_size=", 10)) {
+			state->fast_size = strtoull(opt + 10, &end, 0);
+			switch (*end) {
+			case 'T': case 't':
+				state->fast_size <<= 10;
+				/* fall through */
+			case 'G': case 'g':
+				state->fast_size <<= 10;
+				/* fall through */
+			case 'M': case 'm':
+				state->fast_size <<= 10;
+				/* fall through */
+			case 'K': case 'k':
+				state->fast_size <<= 10;
+			}
+		} else if (!strncmp(opt, "extent_size=", 12)) {
+			state->extent_size = strtoul(opt + 12, NULL, 0);
+		} else if (!strncmp(opt, "interval=", 9)) {
+			state->interval = atoi(opt + 9);
+		} else if (!strncmp(opt, "migrate_max=", 12)) {
+			state->migrate_max = atoi(opt + 12);
+		} else {
+			tcmu_dev_warn(dev, "Ignoring unknown option %s\n", opt);
+		}
+	}
+
+	if (state->extent_size < tcmu_dev_get_block_size(dev) ||
+	    state->extent_size > TIER_MAX_EXTENT ||
+	    (state->extent_size & (state->extent_size - 1))) {
+		tcmu_dev_err(dev, "extent_size must be a power of 2 from the block size to %u\n",
+			     TIER_MAX_EXTENT);
+		goto free_config;
+	}
+	if (state->fast_size < state->extent_size) {
+		tcmu_dev_err(dev, "fast_size must be set to at least one extent\n");
+		goto free_config;
+	}
+	if (state->interval < 1 || state->migrate_max < 1) {
+		tcmu_dev_err(dev, "interval and migrate_max must be positive\n");
+		goto free_config;
+	}
+
+	state->extent_shift = __builtin_ctz(state->extent_size);
+	ret = 0;
+
+free_config:
+	free(config);
+	return ret;
+}
+
+static int tier_map_file(struct tier_state *state, uint64_t nr_extents)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	state->map_len = TIER_HDR_LEN + nr_extents * sizeof(uint32_t);
+
+	fd = open(state->map_path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st) ||
+	    (st.st_size < state->map_len && ftruncate(fd, state->map_len))) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	state->hdr = mmap(NULL, state->map_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (state->hdr == MAP_FAILED) {
+		ret = -errno;
+		state->hdr = NULL;
+		goto close_fd;
+	}
+	state->map = (void *)state->hdr + TIER_HDR_LEN;
+
+close_fd:
+	close(fd);
+	return ret;
+}
+
+/* Check the map and collect the free slots */
+static int tier_load_map(struct tier_state *state)
+{
+	uint64_t i, nr_slots = state->hdr->nr_slots;
+	uint32_t slot;
+	uint8_t *used;
+
+	used = calloc(nr_slots, 1);
+	if (!used)
+		return -ENOMEM;
+
+	for (i = 0; i < state->hdr->nr_extents; i++) {
+		if (!state->map[i])
+			continue;
+
+		slot = (state->map[i] & TIER_SLOT_MASK) - 1;
+		if (slot >= nr_slots || used[slot]) {
+			tcmu_dev_err(state->dev, "Extent %"PRIu64" has an invalid slot %u\n",
+				     i, slot);
+			free(used);
+			return -EINVAL;
+		}
+		used[slot] = 1;
+
+		/* writes may not have been recorded before a crash */
+		if (!state->hdr->clean)
+			state->map[i] |= TIER_DIRTY;
+	}
+
+	/* hand out low slots first */
+	for (i = nr_slots; i > 0; i--) {
+		if (!used[i - 1])
+			darray_append(state->free_slots, i - 1);
+	}
+	free(used);
+
+	state->hdr->clean = 0;
+	if (msync(state->hdr, state->map_len, MS_SYNC))
+		return -errno;
+	return 0;
+}
+
+static int tier_open(struct tcmu_device *dev, bool reopen)
+{
+	uint64_t nr_extents, nr_slots;
+	struct tier_state *state;
+	int i, ret;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+	state->dev = dev;
+	darray_init(state->free_slots);
+	tcmur_dev_set_private(dev, state);
+
+	ret = tier_parse_config(dev, state);
+	if (ret)
+		goto free_state;
+
+	state->dev_size = tcmu_dev_get_num_lbas(dev) *
+			  tcmu_dev_get_block_size(dev);
+	nr_extents = (state->dev_size + state->extent_size - 1) >>
+		     state->extent_shift;
+	nr_slots = min(state->fast_size >> state->extent_shift, nr_extents);
+	if (nr_slots > TIER_SLOT_MASK) {
+		tcmu_dev_err(dev, "fast_size is too large for extent_size\n");
+		ret = -EINVAL;
+		goto free_state;
+	}
+
+	ret = tier_map_file(state, nr_extents);
+	if (ret) {
+		tcmu_dev_err(dev, "Could not map %s: %d\n", state->map_path,
+			     ret);
+		goto free_state;
+	}
+
+	if (!state->hdr->magic) {
+		state->hdr->magic = TIER_MAGIC;
+		state->hdr->version = TIER_VERSION;
+		state->hdr->clean = 1;
+		state->hdr->extent_size = state->extent_size;
+		state->hdr->nr_extents = nr_extents;
+		state->hdr->nr_slots = nr_slots;
+	} else if (state->hdr->magic != TIER_MAGIC ||
+		   state->hdr->version != TIER_VERSION ||
+		   state->hdr->extent_size != state->extent_size ||
+		   state->hdr->nr_extents != nr_extents ||
+		   state->hdr->nr_slots != nr_slots) {
+		tcmu_dev_err(dev, "%s does not match the device (extent size %u, %"PRIu64" extents, %"PRIu64" slots)\n",
+			     state->map_path, state->hdr->extent_size,
+			     state->hdr->nr_extents, state->hdr->nr_slots);
+		ret = -EINVAL;
+		goto unmap_file;
+	}
+
+	state->heat = calloc(nr_extents, sizeof(uint32_t));
+	if (!state->heat) {
+		ret = -ENOMEM;
+		goto unmap_file;
+	}
+
+	ret = tier_load_map(state);
+	if (ret)
+		goto free_heat;
+
+	state->slow = tcmur_child_dev_open(dev, "slow", state->slow_cfg);
+	if (!state->slow) {
+		ret = -EIO;
+		goto free_heat;
+	}
+
+	state->fast = tcmur_child_dev_open(dev, "fast", state->fast_cfg);
+	if (!state->fast) {
+		ret = -EIO;
+		goto close_slow;
+	}
+	tcmur_child_dev_set_num_lbas(state->fast,
+				     (nr_slots << state->extent_shift) /
+				     tcmu_dev_get_block_size(dev));
+
+	for (i = 0; i < TIER_NR_EXTENT_LOCKS; i++)
+		pthread_rwlock_init(&state->extent_locks[i], NULL);
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_mutex_init(&state->thread_lock, NULL);
+	pthread_cond_init(&state->thread_cond, NULL);
+
+	state->stats_time = time(NULL);
+	ret = pthread_create(&state->thread, NULL, tier_thread, state);
+	if (ret) {
+		ret = -ret;
+		goto destroy_locks;
+	}
+
+	tcmu_dev_set_write_cache_enabled(dev, 1);
+	tcmu_dev_dbg(dev, "config %s, %"PRIu64" extents, %"PRIu64" fast slots\n",
+		     tcmu_dev_get_cfgstring(dev), nr_extents, nr_slots);
+	return 0;
+
+destroy_locks:
+	pthread_cond_destroy(&state->thread_cond);
+	pthread_mutex_destroy(&state->thread_lock);
+	pthread_mutex_destroy(&state->lock);
+	for (i = 0; i < TIER_NR_EXTENT_LOCKS; i++)
+		pthread_rwlock_destroy(&state->extent_locks[i]);
+	tcmur_child_dev_close(state->fast);
+close_slow:
+	tcmur_child_dev_close(state->slow);
+free_heat:
+	free(state->heat);
+unmap_file:
+	munmap(state->hdr, state->map_len);
+free_state:
+	darray_free(state->free_slots);
+	free(state->map_path);
+	free(state->fast_cfg);
+	free(state->slow_cfg);
+	free(state);
+	return ret;
+}
+
+static void tier_close(struct tcmu_device *dev)
+{
+	struct tier_state *state = tcmur_dev_get_private(dev);
+	int i;
+
+	pthread_mutex_lock(&state->thread_lock);
+	state->stop = true;
+	pthread_cond_signal(&state->thread_cond);
+	pthread_mutex_unlock(&state->thread_lock);
+	pthread_join(state->thread, NULL);
+
+	tier_log_stats(state);
+
+	/* dirty bits are only trusted if both tiers are stable */
+	if (tcmur_dev_sync_flush(state->fast) == TCMU_STS_OK &&
+	    tcmur_dev_sync_flush(state->slow) == TCMU_STS_OK &&
+	    !msync(state->hdr, state->map_len, MS_SYNC)) {
+		state->hdr->clean = 1;
+		if (msync(state->hdr, TIER_HDR_LEN, MS_SYNC))
+			tcmu_dev_warn(dev, "Could not mark %s clean: %m\n",
+				      state->map_path);
+	}
+
+	tcmur_child_dev_close(state->fast);
+	tcmur_child_dev_close(state->slow);
+
+	pthread_cond_destroy(&state->thread_cond);
+	pthread_mutex_destroy(&state->thread_lock);
+	pthread_mutex_destroy(&state->lock);
+	for (i = 0; i < TIER_NR_EXTENT_LOCKS; i++)
+		pthread_rwlock_destroy(&state->extent_locks[i]);
+	free(state->heat);
+	munmap(state->hdr, state->map_len);
+	darray_free(state->free_slots);
+	free(state->map_path);
+	free(state->fast_cfg);
+	free(state->slow_cfg);
+	free(state);
+}
+
+static const char tier_cfg_desc[] =
+	"Path of the extent map file with ;fast_size=bytes and optional "
+	";extent_size=bytes, ;interval=secs and ;migrate_max=N settings, "
+	"then |fast subtype/config|slow subtype/config.";
+
+static struct tcmur_handler tier_handler = {
+	.cfg_desc = tier_cfg_desc,
+
+	.open = tier_open,
+	.close = tier_close,
+	.read = tier_read,
+	.write = tier_write,
+	.flush = tier_flush,
+	.unmap = tier_unmap,
+	.name = "Two Tier Handler",
+	.subtype = "tier",
+	.nr_threads = 8,
+};
+
+/* Entry point must be named "handler_init". */
+int handler_init(void)
+{
+	return tcmur_register_handler(&tier_handler);
+}